@@ -46,6 +46,9 @@
 #define LIBFEEDBACK_USE_UNSTABLE_API
 #include <libfeedback.h>
 
+/* Time to wait for pending history writes on exit, in seconds */
+#define HISTORY_CLOSE_TIMEOUT 5
+
 /**
  * SECTION: chatty-application
  * @title: ChattyApplication
@@ -66,6 +69,7 @@ struct _ChattyApplication
 
   gboolean daemon;
   gboolean show_window;
+  gboolean history_closing;
 };
 
 G_DEFINE_TYPE (ChattyApplication, chatty_application, ADW_TYPE_APPLICATION)
@@ -393,6 +397,41 @@ static const GActionEntry app_entries[] = {
   { "show-window", chatty_application_show_window }
 };
 
+static void
+application_history_open_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!chatty_history_open_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error opening history: %s", error->message);
+}
+
+static void
+application_history_close_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  g_autoptr(ChattyApplication) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!chatty_history_close_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error closing history: %s", error->message);
+
+  self->history_closing = FALSE;
+}
+
+static gboolean
+application_history_close_timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 chatty_application_startup (GApplication *application)
 {
@@ -413,8 +452,10 @@ chatty_application_startup (GApplication *application)
 
   lfb_init (CHATTY_APP_ID, NULL);
   db_path =  g_build_filename (chatty_utils_get_purple_dir (), "chatty", "db", NULL);
-  chatty_history_open (chatty_manager_get_history (self->manager),
-                       db_path, "chatty-history.db");
+  /* Opening runs before any other history task, whenever queued */
+  chatty_history_open_async (chatty_manager_get_history (self->manager),
+                             g_steal_pointer (&db_path), "chatty-history.db",
+                             application_history_open_cb, NULL);
 
   self->settings = chatty_settings_get_default ();
   g_signal_connect_object (self->manager, "open-chat",
@@ -464,9 +505,33 @@ static void
 chatty_application_shutdown (GApplication *application)
 {
   ChattyApplication *self = (ChattyApplication *)application;
+  ChattyHistory *history;
 
   g_object_unref (chatty_settings_get_default ());
-  chatty_history_close (chatty_manager_get_history (self->manager));
+
+  history = chatty_manager_get_history (self->manager);
+  if (!chatty_history_is_closed (history)) {
+    gboolean timed_out = FALSE;
+    guint timeout_id;
+
+    /*
+     * The main loop has already quit, so this is the only place we
+     * wait for the worker: pending writes should hit the disk before exit.
+     * Don't hang forever if the worker is stuck though.
+     */
+    self->history_closing = TRUE;
+    chatty_history_close_async (history, application_history_close_cb, g_object_ref (self));
+    timeout_id = g_timeout_add_seconds (HISTORY_CLOSE_TIMEOUT,
+                                        application_history_close_timeout_cb,
+                                        &timed_out);
+    while (self->history_closing && !timed_out)
+      g_main_context_iteration (NULL, TRUE);
+
+    if (timed_out)
+      g_warning ("Timed out closing history, pending changes may be lost");
+    else
+      g_source_remove (timeout_id);
+  }
   lfb_uninit ();
 
   G_APPLICATION_CLASS (chatty_application_parent_class)->shutdown (application);
@@ -18,6 +18,7 @@
 
 #include "chatty-contact-private.h"
 #include "chatty-contact-provider.h"
+#include "chatty-settings.h"
 #include "chatty-log.h"
 
 /**
@@ -31,6 +32,12 @@
 #define IM_SEXP       "(contains 'im_jabber' '')"
 #define CHATTY_SEXP   "(or " PHONE_SEXP  IM_SEXP ")"
 
+/* Contacts of a uid are kept together in contacts_list */
+typedef struct {
+  guint position;
+  guint count;
+} UidRange;
+
 struct _ChattyEds
 {
   GObject           parent_instance;
@@ -45,6 +52,22 @@ struct _ChattyEds
   guint             providers_to_load;
   ChattyProtocol    protocols;
   gboolean          is_ready;
+
+  /* uid of contacts in contacts_list to their UidRange */
+  GHashTable       *uid_index;
+
+  /*
+   * Phone number contacts in contacts_list keyed by the
+   * ChattyPhoneKey of their number, as GPtrArrays in the
+   * order added, and by the key without the country code
+   * in national_index.  Numbers are parsed for the country
+   * index_country.  Values that can't be parsed are keyed
+   * by the value in value_index.
+   */
+  GHashTable       *number_index;
+  GHashTable       *national_index;
+  GHashTable       *value_index;
+  char             *index_country;
 };
 
 G_DEFINE_TYPE (ChattyEds, chatty_eds, G_TYPE_OBJECT)
@@ -115,64 +138,262 @@ chatty_eds_bus_got (GObject      *object,
                             g_steal_pointer (&task));
 }
 
+static gpointer
+eds_phone_key_copy (gpointer key)
+{
+  ChattyPhoneKey *copy;
+
+  copy = g_new (ChattyPhoneKey, 1);
+  *copy = *(ChattyPhoneKey *)key;
+
+  return copy;
+}
+
+/* The key of the national significant number of @key */
+static void
+eds_phone_key_get_national (const ChattyPhoneKey *key,
+                            ChattyPhoneKey       *national)
+{
+  *national = *key;
+  national->country_code = 0;
+  national->has_country_code = FALSE;
+}
+
+static void
+eds_index_insert (GHashTable     *index,
+                  gpointer        key,
+                  GBoxedCopyFunc  copy_key,
+                  ChattyContact  *contact)
+{
+  GPtrArray *contacts;
+
+  contacts = g_hash_table_lookup (index, key);
+
+  if (!contacts) {
+    contacts = g_ptr_array_new_with_free_func (g_object_unref);
+    g_hash_table_insert (index, copy_key (key), contacts);
+  }
+
+  g_ptr_array_add (contacts, g_object_ref (contact));
+}
+
+static void
+eds_index_remove (GHashTable    *index,
+                  gconstpointer  key,
+                  ChattyContact *contact)
+{
+  GPtrArray *contacts;
+
+  contacts = g_hash_table_lookup (index, key);
+
+  if (contacts && g_ptr_array_remove (contacts, contact) && !contacts->len)
+    g_hash_table_remove (index, key);
+}
+
+static void
+eds_index_update (ChattyEds     *self,
+                  ChattyContact *contact,
+                  gboolean       add)
+{
+  ChattyPhoneKey key, national;
+  const char *value;
+
+  /* Only these are matched, see chatty_contact_is_exact_match() */
+  if (!(chatty_item_get_protocols (CHATTY_ITEM (contact)) &
+        (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS)))
+    return;
+
+  value = chatty_item_get_username (CHATTY_ITEM (contact));
+
+  if (chatty_contact_get_phone_key (contact, &key)) {
+    eds_phone_key_get_national (&key, &national);
+
+    if (add) {
+      eds_index_insert (self->number_index, &key, eds_phone_key_copy, contact);
+      eds_index_insert (self->national_index, &national, eds_phone_key_copy, contact);
+    } else {
+      eds_index_remove (self->number_index, &key, contact);
+      eds_index_remove (self->national_index, &national, contact);
+    }
+  } else {
+    if (add)
+      eds_index_insert (self->value_index, (gpointer)value, (GBoxedCopyFunc)g_strdup, contact);
+    else
+      eds_index_remove (self->value_index, value, contact);
+  }
+}
+
+/*
+ * The keys depend on the country set, so rebuild the index
+ * from contacts_list if the country changed since it was built.
+ */
+static void
+eds_index_check_country (ChattyEds *self)
+{
+  const char *country;
+  guint n_items;
+
+  country = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+
+  if (g_strcmp0 (country, self->index_country) == 0)
+    return;
+
+  g_free (self->index_country);
+  self->index_country = g_strdup (country);
+  g_hash_table_remove_all (self->number_index);
+  g_hash_table_remove_all (self->national_index);
+  g_hash_table_remove_all (self->value_index);
+
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->contacts_list));
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+
+    contact = g_list_model_get_item (G_LIST_MODEL (self->contacts_list), i);
+    eds_index_update (self, contact, TRUE);
+  }
+
+  g_debug ("Indexed %u phone numbers for country '%s'",
+           g_hash_table_size (self->number_index), country);
+}
+
 static ChattyContact *
 chatty_contact_provider_get_match (ChattyEds      *self,
                                    const char     *value,
                                    ChattyProtocol  protocols)
 {
-  GListModel *model;
-  guint n_items;
-  gboolean match;
+  ChattyPhoneKey key, national;
+  GPtrArray *contacts;
 
-  model = G_LIST_MODEL (self->contacts_list);
-  n_items = g_list_model_get_n_items (model);
+  if (!value || !*value ||
+      !(protocols & (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS)))
+    return NULL;
 
-  for (guint i = 0; i < n_items; i++)
-    {
-      g_autoptr(ChattyContact) contact = NULL;
+  eds_index_check_country (self);
 
-      contact = g_list_model_get_item (model, i);
-      match = chatty_contact_is_exact_match (contact, value, protocols);
+  if (!chatty_phone_utils_get_key (value, self->index_country, &key)) {
+    contacts = g_hash_table_lookup (self->value_index, value);
 
-      if (match)
-        return contact;
-    }
+    return contacts ? contacts->pdata[0] : NULL;
+  }
+
+  /* Both were parsed for the same country, so this is an exact match */
+  contacts = g_hash_table_lookup (self->number_index, &key);
+
+  if (contacts)
+    return contacts->pdata[0];
+
+  /*
+   * A number without a country code got the one of the country,
+   * which may not be the right one.  Check the few with the same
+   * national number, see chatty_contact_is_exact_match().
+   */
+  eds_phone_key_get_national (&key, &national);
+  contacts = g_hash_table_lookup (self->national_index, &national);
+
+  for (guint i = 0; contacts && i < contacts->len; i++) {
+    ChattyPhoneKey contact_key;
+
+    if (chatty_contact_get_phone_key (contacts->pdata[i], &contact_key) &&
+        chatty_phone_utils_key_match (&contact_key, &key))
+      return contacts->pdata[i];
+  }
 
   return NULL;
 }
 
+/*
+ * Update uid_index after the @n_removed contacts at @position
+ * were replaced by @n_added ones.  Only the new contacts are
+ * walked, the ranges after them are moved if the count changed.
+ */
 static void
-eds_find_contact_index (ChattyEds  *self,
-                        const char *uid,
-                        guint      *position,
-                        guint      *count)
+eds_uid_index_update (ChattyEds *self,
+                      guint      position,
+                      guint      n_removed,
+                      guint      n_added)
 {
-  const char *old_uid;
-  guint n_items, i;
-  gboolean match;
+  GListModel *model;
+  UidRange *range = NULL;
+  const char *last_uid = NULL;
 
-  g_assert (CHATTY_IS_EDS (self));
-  g_assert (position && count);
-  g_assert (uid && *uid);
+  model = G_LIST_MODEL (self->contacts_list);
 
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->contacts_list));
-  *position = *count = 0;
+  if (n_added != n_removed) {
+    GHashTableIter iter;
+
+    g_hash_table_iter_init (&iter, self->uid_index);
 
-  for (i = 0; i < n_items; i++) {
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&range))
+      if (range->position >= position + n_removed)
+        range->position = range->position - n_removed + n_added;
+
+    range = NULL;
+  }
+
+  for (guint i = position; i < position + n_added; i++) {
     g_autoptr(ChattyContact) contact = NULL;
+    const char *uid;
+
+    contact = g_list_model_get_item (model, i);
+    uid = chatty_contact_get_uid (contact);
+
+    if (range && g_str_equal (uid, last_uid)) {
+      range->count++;
+    } else {
+      range = g_new (UidRange, 1);
+      range->position = i;
+      range->count = 1;
+      g_hash_table_insert (self->uid_index, g_strdup (uid), range);
+      /* The contact is still referenced by contacts_list */
+      last_uid = uid;
+    }
+  }
+}
 
-    contact = g_list_model_get_item (G_LIST_MODEL (self->contacts_list), i);
-    old_uid = chatty_contact_get_uid (contact);
-    match = g_str_equal (old_uid, uid);
-
-    /* The list is sorted.  Find the first match and total count. */
-    if (!*count && match)
-      *position = i, *count = 1;
-    else if (match) /* Subsequent matches */
-      ++*count;
-    else if (*position) /* We moved past the last match */
-      break;
+/*
+ * Get the contacts in @added with the ones of the same uid
+ * next to each other, in the order each uid first appears.
+ */
+static GPtrArray *
+eds_group_by_uid (GPtrArray *added)
+{
+  g_autoptr(GHashTable) groups = NULL;
+  g_autoptr(GPtrArray) uids = NULL;
+  GPtrArray *grouped;
+
+  groups = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify)g_ptr_array_unref);
+  uids = g_ptr_array_new ();
+
+  for (guint i = 0; i < added->len; i++) {
+    GPtrArray *group;
+    const char *uid;
+
+    uid = chatty_contact_get_uid (added->pdata[i]);
+    group = g_hash_table_lookup (groups, uid);
+
+    if (!group) {
+      group = g_ptr_array_new ();
+      g_hash_table_insert (groups, (gpointer)uid, group);
+      g_ptr_array_add (uids, (gpointer)uid);
+    }
+
+    g_ptr_array_add (group, added->pdata[i]);
   }
+
+  grouped = g_ptr_array_new_full (added->len, g_object_unref);
+
+  for (guint i = 0; i < uids->len; i++) {
+    GPtrArray *group;
+
+    group = g_hash_table_lookup (groups, uids->pdata[i]);
+
+    for (guint j = 0; j < group->len; j++)
+      g_ptr_array_add (grouped, g_object_ref (group->pdata[j]));
+  }
+
+  return grouped;
 }
 
 
@@ -213,18 +434,119 @@ chatty_eds_load_contact (ChattyEds     *self,
     }
 }
 
+/*
+ * Remove the contacts with uids in @removed, and append
+ * @added to contacts_list.  The contacts in between the
+ * removed ones are kept, so that a batch of changes is
+ * done in a single splice, emitting a single items-changed.
+ *
+ * The contacts of a uid are always kept together: a uid
+ * that is already in the list is replaced by the new ones.
+ */
 static void
-chatty_eds_remove_contact (ChattyEds  *self,
-                           const char *uid)
+chatty_eds_update_contacts (ChattyEds  *self,
+                            GHashTable *removed,
+                            GPtrArray  *added)
 {
-  guint position, count;
+  g_autoptr(GHashTable) replaced = NULL;
+  g_autoptr(GPtrArray) grouped = NULL;
+  g_autoptr(GPtrArray) contacts = NULL;
+  GHashTableIter iter;
+  GListModel *model;
+  UidRange *range;
+  const char *uid;
+  guint n_items, start, end;
 
   g_assert (CHATTY_IS_EDS (self));
 
-  eds_find_contact_index (self, uid, &position, &count);
+  model = G_LIST_MODEL (self->contacts_list);
+  n_items = g_list_model_get_n_items (model);
+  start = n_items;
+  end = 0;
+
+  if (added && added->len) {
+    grouped = eds_group_by_uid (added);
+    added = grouped;
+  }
+
+  /* Remove the uids added again, so that they aren't split */
+  for (guint i = 0; added && i < added->len; i++) {
+    uid = chatty_contact_get_uid (added->pdata[i]);
+
+    if (!g_hash_table_contains (self->uid_index, uid) ||
+        (removed && g_hash_table_contains (removed, uid)))
+      continue;
+
+    if (!replaced) {
+      replaced = g_hash_table_new (g_str_hash, g_str_equal);
+
+      if (removed) {
+        const char *key;
+
+        g_hash_table_iter_init (&iter, removed);
+
+        while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+          g_hash_table_add (replaced, (gpointer)key);
+      }
+
+      removed = replaced;
+    }
+
+    g_hash_table_add (replaced, (gpointer)uid);
+  }
+
+  if (removed) {
+    g_hash_table_iter_init (&iter, removed);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *)&uid, NULL)) {
+      range = g_hash_table_lookup (self->uid_index, uid);
+
+      if (range) {
+        start = MIN (start, range->position);
+        end = MAX (end, range->position + range->count);
+      }
+    }
+  }
+
+  /* Nothing to remove, append to the end */
+  if (start == n_items)
+    end = n_items;
+
+  if (start == end && (!added || !added->len))
+    return;
+
+  eds_index_check_country (self);
+  contacts = g_ptr_array_new_full (end - start + (added ? added->len : 0),
+                                   g_object_unref);
+
+  for (guint i = start; i < end; i++) {
+    ChattyContact *contact;
+
+    contact = g_list_model_get_item (model, i);
+
+    if (removed && g_hash_table_contains (removed, chatty_contact_get_uid (contact))) {
+      eds_index_update (self, contact, FALSE);
+      g_object_unref (contact);
+    } else {
+      g_ptr_array_add (contacts, contact);
+    }
+  }
+
+  if (removed) {
+    g_hash_table_iter_init (&iter, removed);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *)&uid, NULL))
+      g_hash_table_remove (self->uid_index, uid);
+  }
+
+  for (guint i = 0; added && i < added->len; i++) {
+    eds_index_update (self, added->pdata[i], TRUE);
+    g_ptr_array_add (contacts, g_object_ref (added->pdata[i]));
+  }
 
-  if (count)
-    g_list_store_splice (self->contacts_list, position, count, NULL, 0);
+  g_list_store_splice (self->contacts_list, start, end - start,
+                       contacts->pdata, contacts->len);
+  eds_uid_index_update (self, start, end - start, contacts->len);
 }
 
 static void
@@ -249,13 +571,9 @@ chatty_eds_log (EBookClientView *view,
 }
 
 static void
-chatty_eds_objects_added_cb (ChattyEds       *self,
-                             const GSList    *objects,
-                             EBookClientView *view)
+chatty_eds_load_objects (ChattyEds    *self,
+                         const GSList *objects)
 {
-  g_assert (CHATTY_IS_EDS (self));
-  g_assert (E_IS_BOOK_CLIENT_VIEW (view));
-
   if (!self->contacts_array)
     self->contacts_array = g_ptr_array_new_full (100, g_object_unref);
 
@@ -268,6 +586,25 @@ chatty_eds_objects_added_cb (ChattyEds       *self,
       if (self->protocols & CHATTY_PROTOCOL_XMPP)
         chatty_eds_load_contact (self, l->data, E_CONTACT_IM_JABBER);
     }
+}
+
+static void
+chatty_eds_objects_added_cb (ChattyEds       *self,
+                             const GSList    *objects,
+                             EBookClientView *view)
+{
+  g_autoptr(GPtrArray) array = NULL;
+
+  g_assert (CHATTY_IS_EDS (self));
+  g_assert (E_IS_BOOK_CLIENT_VIEW (view));
+
+  chatty_eds_load_objects (self, objects);
+
+  /* Contacts are saved in batch on load complete, add the later ones now */
+  if (self->is_ready) {
+    array = g_steal_pointer (&self->contacts_array);
+    chatty_eds_update_contacts (self, NULL, array);
+  }
 
   chatty_eds_log (view, objects, "added");
 }
@@ -277,13 +614,23 @@ chatty_eds_objects_modified_cb (ChattyEds       *self,
                                 const GSList    *objects,
                                 EBookClientView *view)
 {
+  g_autoptr(GHashTable) removed = NULL;
+  g_autoptr(GPtrArray) array = NULL;
+
   g_assert (CHATTY_IS_EDS (self));
   g_assert (E_IS_BOOK_CLIENT_VIEW (view));
 
+  removed = g_hash_table_new (g_str_hash, g_str_equal);
+
   for (GSList *l = (GSList *)objects; l != NULL; l = l->next)
-    chatty_eds_remove_contact (self, e_contact_get_const (l->data, E_CONTACT_UID));
+    g_hash_table_add (removed, (gpointer)e_contact_get_const (l->data, E_CONTACT_UID));
+
+  chatty_eds_load_objects (self, objects);
+
+  if (self->is_ready)
+    array = g_steal_pointer (&self->contacts_array);
 
-  chatty_eds_objects_added_cb (self, objects, view);
+  chatty_eds_update_contacts (self, removed, array);
   chatty_eds_log (view, objects, "modified");
 }
 
@@ -292,11 +639,17 @@ chatty_eds_objects_removed_cb (ChattyEds       *self,
                                const GSList    *objects,
                                EBookClientView *view)
 {
+  g_autoptr(GHashTable) removed = NULL;
+
   g_assert (CHATTY_IS_EDS (self));
   g_assert (E_IS_BOOK_CLIENT_VIEW (view));
 
+  removed = g_hash_table_new (g_str_hash, g_str_equal);
+
   for (GSList *node = (GSList *)objects; node; node = node->next)
-    chatty_eds_remove_contact (self, node->data);
+    g_hash_table_add (removed, node->data);
+
+  chatty_eds_update_contacts (self, removed, NULL);
   chatty_eds_log (view, objects, "removed");
 }
 
@@ -309,7 +662,7 @@ chatty_eds_load_complete_cb (ChattyEds *self)
 
   if (self->contacts_array && (self->contacts_array->len > 0)) {
     array = g_steal_pointer (&self->contacts_array);
-    g_list_store_splice (self->contacts_list, 0, 0, array->pdata, array->len);
+    chatty_eds_update_contacts (self, NULL, array);
   }
 
   /* Notify that eds is ready even is there are no contacts */
@@ -541,6 +894,11 @@ chatty_eds_finalize (GObject *object)
   g_clear_object (&self->cancellable);
   g_clear_object (&self->eds_view_list);
   g_clear_object (&self->contacts_list);
+  g_clear_pointer (&self->uid_index, g_hash_table_unref);
+  g_clear_pointer (&self->number_index, g_hash_table_unref);
+  g_clear_pointer (&self->national_index, g_hash_table_unref);
+  g_clear_pointer (&self->value_index, g_hash_table_unref);
+  g_free (self->index_country);
   if (self->contacts_array)
     g_ptr_array_free (self->contacts_array, TRUE);
 
@@ -597,6 +955,15 @@ chatty_eds_init (ChattyEds *self)
   self->eds_view_list = g_list_store_new (E_TYPE_BOOK_CLIENT_VIEW);
   self->contacts_list = g_list_store_new (CHATTY_TYPE_CONTACT);
   self->cancellable = g_cancellable_new ();
+  self->uid_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->number_index = g_hash_table_new_full (chatty_phone_utils_key_hash,
+                                              chatty_phone_utils_key_equal, g_free,
+                                              (GDestroyNotify)g_ptr_array_unref);
+  self->national_index = g_hash_table_new_full (chatty_phone_utils_key_hash,
+                                                chatty_phone_utils_key_equal, g_free,
+                                                (GDestroyNotify)g_ptr_array_unref);
+  self->value_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_ptr_array_unref);
 }
 
 
@@ -654,6 +1021,9 @@ chatty_eds_get_model (ChattyEds *self)
  * A match can be either exact or one excluding the
  * country prefix (Eg: +1987654321 and 987654321 matches)
  *
+ * Contacts are looked up in a hash table of their numbers,
+ * so this is cheap even with large address books.
+ *
  * Returns: (transfer none) (nullable): A #ChattyContact.
  */
 ChattyContact *
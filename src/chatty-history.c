@@ -27,6 +27,7 @@
 #include "chatty-mm-account.h"
 #include "chatty-mm-buddy.h"
 #include "chatty-mm-chat.h"
+#include "chatty-log.h"
 #include "chatty-history.h"
 
 /* Used as placeholders until we get the real values */
@@ -36,7 +37,57 @@
 #define STRING_VALUE(arg) #arg
 
 /* increment when DB changes */
-#define HISTORY_VERSION 4
+#define HISTORY_VERSION 8
+
+/* Connection tuning applied to every durability profile */
+#define HISTORY_CACHE_SIZE_KIB  8192
+#define HISTORY_MMAP_SIZE       67108864 /* 64 MiB */
+
+#define HISTORY_CONNECTION_PRAGMAS                                      \
+  "PRAGMA temp_store = MEMORY;"                                         \
+  "PRAGMA cache_size = -" STRING (HISTORY_CACHE_SIZE_KIB) ";"           \
+  "PRAGMA mmap_size = " STRING (HISTORY_MMAP_SIZE) ";"
+
+/* Same as above for the attached archive, which has its own settings */
+#define HISTORY_ARCHIVE_PRAGMAS                                         \
+  "PRAGMA archive.cache_size = -" STRING (HISTORY_CACHE_SIZE_KIB) ";"   \
+  "PRAGMA archive.mmap_size = " STRING (HISTORY_MMAP_SIZE) ";"
+
+/* Read-only connections, each with its own thread, used when in WAL mode */
+#define HISTORY_READERS 2
+
+/* Run a passive WAL checkpoint after the worker was idle for this long */
+#define HISTORY_CHECKPOINT_INTERVAL (30 * G_USEC_PER_SEC)
+
+/*
+ * Idle maintenance runs in slices of at most this long, so that a
+ * task queued meanwhile waits for one slice at most.
+ */
+#define HISTORY_MAINTENANCE_SLICE (20 * G_TIME_SPAN_MILLISECOND)
+/* Number of files rows checked for references per statement */
+#define HISTORY_ORPHAN_FILES_BATCH 64
+/* A files row nothing refers to, see history_delete_orphan_files() */
+#define HISTORY_ORPHAN_FILES_CONDITION                                  \
+  "NOT EXISTS (SELECT 1 FROM message_files WHERE message_files.file_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM message_files WHERE message_files.preview_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM messages WHERE messages.preview_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM users WHERE users.avatar_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM threads WHERE threads.avatar_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM archive.message_files AS a WHERE a.file_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM archive.message_files AS a WHERE a.preview_id=files.id) " \
+  "AND NOT EXISTS (SELECT 1 FROM archive.messages AS a WHERE a.preview_id=files.id)"
+/* Upper bound on the rows ANALYZE reads per index */
+#define HISTORY_ANALYSIS_LIMIT 400
+/* Number of messages moved to the archive per transaction */
+#define HISTORY_ARCHIVE_BATCH 256
+
+/* Increment when the export format changes, see history_export() */
+#define HISTORY_EXPORT_VERSION 1
+#define HISTORY_EXPORT_HEADER  "chatty-history"
+/* Exported records are written out in chunks of about this size */
+#define HISTORY_EXPORT_BUFFER_SIZE (64 * 1024)
+/* Most fields in an exported record, including the record type */
+#define HISTORY_EXPORT_MAX_FIELDS 12
 
 /* Shouldn't be modified, new values should be appended */
 #define MESSAGE_DIRECTION_OUT    -1
@@ -110,15 +161,386 @@
 #define MESSAGE_STATUS_SENDING_FAILED   6
 #define MESSAGE_STATUS_DELIVERY_FAILED  7
 
+/*
+ * Indexes on messages.  Introduced in version 5.
+ */
+#define HISTORY_MESSAGES_INDEX_SCHEMA                                   \
+  "CREATE INDEX IF NOT EXISTS messages_uid_idx ON messages(uid);"       \
+  "CREATE INDEX IF NOT EXISTS messages_thread_time_idx "                \
+  "ON messages(thread_id,time);"
+
+/*
+ * Full text index of message body and subject.  The index doesn't
+ * keep a copy of the content, which is read back from messages
+ * table when required.  The triggers keep the index in sync with
+ * messages table.  Introduced in version 6.
+ */
+#define HISTORY_FTS_SCHEMA                                              \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("         \
+  "body, subject, "                                                     \
+  "content='messages', content_rowid='id', "                            \
+  "tokenize='unicode61 remove_diacritics 2');"                          \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS messages_fts_insert "                   \
+  "AFTER INSERT ON messages BEGIN "                                     \
+  "INSERT INTO messages_fts(rowid,body,subject) "                       \
+  "VALUES(new.id,new.body,new.subject); "                               \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS messages_fts_delete "                   \
+  "AFTER DELETE ON messages BEGIN "                                     \
+  "INSERT INTO messages_fts(messages_fts,rowid,body,subject) "          \
+  "VALUES('delete',old.id,old.body,old.subject); "                      \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS messages_fts_update "                   \
+  "AFTER UPDATE OF body,subject ON messages BEGIN "                     \
+  "INSERT INTO messages_fts(messages_fts,rowid,body,subject) "          \
+  "VALUES('delete',old.id,old.body,old.subject); "                      \
+  "INSERT INTO messages_fts(rowid,body,subject) "                       \
+  "VALUES(new.id,new.body,new.subject); "                               \
+  "END;"
+
+/* The messages of @schema matching the full text query ?1 */
+#define HISTORY_SEARCH_SQL(schema)                                      \
+  "SELECT messages.id,messages.thread_id,messages.sender_id,"           \
+  "messages.time,messages.direction,messages.body,messages.uid,"        \
+  "messages.body_type,messages.status,messages.subject,"                \
+  "snippet(messages_fts,-1,'','','…',12) AS snippet,rank AS rank "      \
+  "FROM " schema ".messages_fts "                                       \
+  "INNER JOIN " schema ".messages ON messages.id=messages_fts.rowid "   \
+  "WHERE messages_fts MATCH ?1"
+
+/*
+ * Per thread metadata needed to list chats, so that loading the
+ * chat list doesn't have to touch every message.  Kept up to date
+ * by triggers, within the same transaction that modifies threads
+ * or messages.  Introduced in version 7.
+ */
+#define HISTORY_SUMMARY_SCHEMA                                          \
+  "CREATE TABLE IF NOT EXISTS thread_summary ("                         \
+  "thread_id INTEGER NOT NULL PRIMARY KEY "                             \
+  "REFERENCES threads(id) ON DELETE CASCADE, "                          \
+  /* The last message that is not a draft */                            \
+  "last_message_id INTEGER REFERENCES messages(id), "                   \
+  "last_message_time INTEGER, "                                         \
+  "unread_count INTEGER NOT NULL DEFAULT 0);"                           \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS thread_summary_thread_insert "          \
+  "AFTER INSERT ON threads BEGIN "                                      \
+  "INSERT OR IGNORE INTO thread_summary(thread_id) VALUES(new.id); "    \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS thread_summary_thread_delete "          \
+  "AFTER DELETE ON threads BEGIN "                                      \
+  "DELETE FROM thread_summary WHERE thread_id=old.id; "                 \
+  "END;"                                                                \
+                                                                        \
+  /* We consider the message with last_read_id to be unread */          \
+  "CREATE TRIGGER IF NOT EXISTS thread_summary_thread_read "            \
+  "AFTER UPDATE OF last_read_id ON threads BEGIN "                      \
+  "UPDATE thread_summary SET unread_count=("                            \
+  "SELECT COUNT(*) FROM messages "                                      \
+  "WHERE messages.thread_id=new.id AND messages.id >= new.last_read_id) " \
+  "WHERE thread_id=new.id; "                                            \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS thread_summary_message_insert "         \
+  "AFTER INSERT ON messages BEGIN "                                     \
+  "UPDATE thread_summary SET unread_count=unread_count + 1 "            \
+  "WHERE thread_id=new.thread_id AND new.id >= ("                       \
+  "SELECT last_read_id FROM threads WHERE threads.id=new.thread_id); "  \
+  "UPDATE thread_summary "                                              \
+  "SET last_message_id=new.id, last_message_time=new.time "             \
+  "WHERE thread_id=new.thread_id "                                      \
+  "AND (new.status !=" STRING(MESSAGE_STATUS_DRAFT) " OR new.status IS NULL) " \
+  "AND (last_message_id IS NULL OR new.time > last_message_time "       \
+  "OR (new.time = last_message_time AND new.id > last_message_id)); "   \
+  "END;"
+
+/*
+ * Summarize threads from their messages, to be followed by a WHERE
+ * clause on threads, if not every thread is to be summarized.
+ */
+#define HISTORY_SUMMARY_UPDATE_SQL                                      \
+  "INSERT OR REPLACE INTO thread_summary(thread_id,last_message_id,last_message_time,unread_count) " \
+  "SELECT threads.id,latest.id,latest.time,"                            \
+  "(SELECT COUNT(*) FROM messages "                                     \
+  "WHERE messages.thread_id=threads.id AND messages.id >= threads.last_read_id) " \
+  "FROM threads "                                                       \
+  "LEFT JOIN messages AS latest ON latest.id=("                         \
+  "SELECT messages.id FROM messages "                                   \
+  "WHERE messages.thread_id=threads.id "                                \
+  "AND (messages.status !=" STRING(MESSAGE_STATUS_DRAFT) " OR messages.status IS NULL) " \
+  "ORDER BY messages.time DESC, messages.id DESC LIMIT 1) "
+
+/*
+ * Indexes on every column that refers to files, so that finding the
+ * files no longer referred to doesn't need a scan of these tables.
+ * Introduced in version 8.
+ */
+#define HISTORY_FILE_REFS_SCHEMA                                        \
+  "CREATE INDEX IF NOT EXISTS message_files_file_idx "                  \
+  "ON message_files(file_id);"                                          \
+  "CREATE INDEX IF NOT EXISTS message_files_preview_idx "               \
+  "ON message_files(preview_id) WHERE preview_id IS NOT NULL;"          \
+  "CREATE INDEX IF NOT EXISTS messages_preview_idx "                    \
+  "ON messages(preview_id) WHERE preview_id IS NOT NULL;"               \
+  "CREATE INDEX IF NOT EXISTS users_avatar_idx "                        \
+  "ON users(avatar_id) WHERE avatar_id IS NOT NULL;"                    \
+  "CREATE INDEX IF NOT EXISTS threads_avatar_idx "                      \
+  "ON threads(avatar_id) WHERE avatar_id IS NOT NULL;"
+
+/*
+ * The archive database, attached as "archive", has the messages
+ * moved out of the main database for being older than the hot
+ * window of their thread.  Rows keep their id, and still refer to
+ * the threads, users and files of the main database, which is why
+ * there are no foreign keys.  The archive isn't versioned as it
+ * only holds copies of rows, and so has no columns of its own.
+ * Archived messages have their own full text index, so that they
+ * can still be searched.
+ */
+#define HISTORY_ARCHIVE_SCHEMA                                          \
+  "PRAGMA archive.auto_vacuum = INCREMENTAL;"                           \
+                                                                        \
+  "CREATE TABLE IF NOT EXISTS archive.messages ("                       \
+  "id INTEGER NOT NULL PRIMARY KEY, "                                   \
+  "uid TEXT NOT NULL, "                                                 \
+  "thread_id INTEGER NOT NULL, "                                        \
+  "sender_id INTEGER, "                                                 \
+  "user_alias TEXT, "                                                   \
+  "body TEXT NOT NULL, "                                                \
+  "body_type INTEGER NOT NULL, "                                        \
+  "direction INTEGER NOT NULL, "                                        \
+  "time INTEGER NOT NULL, "                                             \
+  "status INTEGER, "                                                    \
+  "encrypted INTEGER DEFAULT 0, "                                       \
+  "preview_id INTEGER, "                                                \
+  "subject TEXT);"                                                      \
+                                                                        \
+  "CREATE TABLE IF NOT EXISTS archive.mm_messages ("                    \
+  "id INTEGER NOT NULL PRIMARY KEY, "                                   \
+  "message_id INTEGER NOT NULL UNIQUE, "                                \
+  "account_id INTEGER NOT NULL, "                                       \
+  "protocol INTEGER NOT NULL, "                                         \
+  "smsc TEXT, "                                                         \
+  "time_sent INTEGER, "                                                 \
+  "validity INTEGER, "                                                  \
+  "reference_number INTEGER);"                                          \
+                                                                        \
+  "CREATE TABLE IF NOT EXISTS archive.message_files ("                  \
+  "id INTEGER NOT NULL PRIMARY KEY, "                                   \
+  "message_id INTEGER NOT NULL, "                                       \
+  "file_id INTEGER NOT NULL, "                                          \
+  "preview_id INTEGER, "                                                \
+  "UNIQUE (message_id, file_id));"                                      \
+                                                                        \
+  "CREATE INDEX IF NOT EXISTS archive.messages_uid_idx "                \
+  "ON messages(uid,thread_id);"                                         \
+  "CREATE INDEX IF NOT EXISTS archive.messages_thread_time_idx "        \
+  "ON messages(thread_id,time);"                                        \
+  "CREATE INDEX IF NOT EXISTS archive.messages_preview_idx "            \
+  "ON messages(preview_id) WHERE preview_id IS NOT NULL;"               \
+  "CREATE INDEX IF NOT EXISTS archive.message_files_file_idx "          \
+  "ON message_files(file_id);"                                          \
+  "CREATE INDEX IF NOT EXISTS archive.message_files_preview_idx "       \
+  "ON message_files(preview_id) WHERE preview_id IS NOT NULL;"          \
+                                                                        \
+  /* Same as HISTORY_FTS_SCHEMA, indexed on open if new */              \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS archive.messages_fts USING fts5(" \
+  "body, subject, "                                                     \
+  "content='messages', content_rowid='id', "                            \
+  "tokenize='unicode61 remove_diacritics 2');"                          \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS archive.messages_fts_insert "           \
+  "AFTER INSERT ON messages BEGIN "                                     \
+  "INSERT INTO messages_fts(rowid,body,subject) "                       \
+  "VALUES(new.id,new.body,new.subject); "                               \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS archive.messages_fts_delete "           \
+  "AFTER DELETE ON messages BEGIN "                                     \
+  "INSERT INTO messages_fts(messages_fts,rowid,body,subject) "          \
+  "VALUES('delete',old.id,old.body,old.subject); "                      \
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER IF NOT EXISTS archive.messages_fts_update "           \
+  "AFTER UPDATE OF body,subject ON messages BEGIN "                     \
+  "INSERT INTO messages_fts(messages_fts,rowid,body,subject) "          \
+  "VALUES('delete',old.id,old.body,old.subject); "                      \
+  "INSERT INTO messages_fts(rowid,body,subject) "                       \
+  "VALUES(new.id,new.body,new.subject); "                               \
+  "END;"                                                                \
+                                                                        \
+  /* Ids of the messages being moved, see history_archive_messages() */ \
+  "CREATE TEMP TABLE IF NOT EXISTS archive_ids ("                       \
+  "id INTEGER NOT NULL PRIMARY KEY);"
+
+/* Number of ids of users, accounts and threads to keep in memory */
+#define HISTORY_IDS_SIZE 512
+
+typedef struct _HistoryReader HistoryReader;
+typedef struct _HistoryQueue  HistoryQueue;
+
+/*
+ * The id of a user, account or thread row, along with the values
+ * the row was last written with, if any.  @link is in
+ * ChattyHistory->ids_lru, which has the most recently used first.
+ */
+typedef struct {
+  GList  link;
+  char  *key;
+  char  *state;
+  int    id;
+} HistoryId;
+
+/*
+ * State of history_import().  Users and accounts are referred to by
+ * their id in the exported database, which @users and @accounts map
+ * to the id of the same row in this one.
+ */
+typedef struct {
+  GHashTable *users;
+  GHashTable *accounts;
+  /* Mime type names to ids */
+  GHashTable *mime_types;
+  /* The thread and the message the records that follow belong to */
+  int         thread_id;
+  int         message_id;
+  /* The last read message of the thread, if the thread is new */
+  int         last_read_id;
+  gboolean    thread_is_new;
+  /* The first message id added by the import */
+  int         first_message_id;
+  guint       n_messages;
+} HistoryImport;
+
+/*
+ * Tasks of a higher priority (lower value) run before any task of a
+ * lower priority, and tasks of the same priority in the order queued.
+ */
+typedef enum {
+  /* Opening the database, which every other task needs */
+  HISTORY_PRIORITY_OPEN,
+  /* Reads the user is waiting for, like opening a chat */
+  HISTORY_PRIORITY_UI,
+  /* Writes, and reads that have to see the writes queued before them */
+  HISTORY_PRIORITY_WRITE,
+  /* Bulk writes, like a batch of synced messages or an import */
+  HISTORY_PRIORITY_BULK,
+  /* Housekeeping, run only once nothing else is queued */
+  HISTORY_PRIORITY_IDLE,
+  HISTORY_N_PRIORITIES
+} HistoryPriority;
+
+/* Steps of the idle maintenance, run in this order */
+typedef enum {
+  HISTORY_MAINTENANCE_NONE,
+  /* Move messages out of the hot window to the archive */
+  HISTORY_MAINTENANCE_ARCHIVE,
+  /* Delete files rows no longer referred to */
+  HISTORY_MAINTENANCE_FILES,
+  /* Rewrite the database to enable auto_vacuum, if not done yet */
+  HISTORY_MAINTENANCE_AUTO_VACUUM,
+  /* Give free pages back to the file system */
+  HISTORY_MAINTENANCE_VACUUM,
+  /* Keep the statistics of the query planner up to date */
+  HISTORY_MAINTENANCE_OPTIMIZE,
+} HistoryMaintenance;
+
 struct _ChattyHistory
 {
-  GObject      parent_instance;
-  GAsyncQueue *queue;
-  GThread     *worker_thread;
-  sqlite3     *db;
-  char        *db_path;
+  GObject       parent_instance;
+  HistoryQueue *queue;
+  GThread      *worker_thread;
+  sqlite3      *db;
+  char         *db_path;
+  char         *archive_path;
+
+  /* Messages of a thread to keep out of the archive, 0 for no limit */
+  guint         hot_days;
+  guint         hot_messages;
+  /* No archived message is newer than this, worker thread only */
+  int           archive_max_time;
+
+  /* Tasks for the HistoryReaders, used only if readers_active is set */
+  HistoryQueue *read_queue;
+  GPtrArray    *readers;
+  int           readers_active;
+
+  /* Prepared statements keyed by their SQL, worker thread only */
+  GHashTable   *statements;
+  guint         statement_hits;
+  guint         statement_misses;
+
+  /* Recently used HistoryIds keyed by HistoryId->key, worker thread only */
+  GHashTable   *ids;
+  GQueue        ids_lru;
+  guint         id_hits;
+  guint         id_misses;
+
+  /* Number of changes on db when the WAL was last checkpointed */
+  int           checkpoint_changes;
+  gboolean      wal_enabled;
+
+  /* Idle maintenance state, worker thread only */
+  HistoryMaintenance maintenance;
+  /* Number of changes on db when maintenance last completed */
+  int           maintenance_changes;
+  /* The threads up to this id are archived */
+  int           maintenance_thread_id;
+  /* The files rows up to this id are checked for references */
+  int           maintenance_file_id;
+  /* auto_vacuum isn't enabled yet */
+  gboolean      auto_vacuum_pending;
+  /* Last sequence number of queue when VACUUM started */
+  guint         vacuum_seq;
+};
+
+/*
+ * A queue of GTasks with a GQueue per HistoryPriority.  Every task
+ * gets a sequence number when pushed, which lets a read wait for
+ * the writes queued before it even if they don't run in order.
+ */
+struct _HistoryQueue
+{
+  GMutex           lock;
+  GCond            cond;
+  GQueue           tasks[HISTORY_N_PRIORITIES];
+
+  /* Sequence number of the last task pushed */
+  guint            last_seq;
+  /* Sequence number and priority of the running task, 0 if none */
+  guint            running_seq;
+  HistoryPriority  running_priority;
+  gboolean         closed;
+
+  /* Statistics since last logged */
+  guint            max_depth[HISTORY_N_PRIORITIES];
+  guint            done;
+  guint            dropped;
 };
 
+/*
+ * A read-only connection to the database, owned by its thread.
+ * Readers are created by @worker_thread once the database is open
+ * and run only read tasks, which thus don't have to wait for writes
+ * in @worker_thread to complete.  This works only with write-ahead
+ * logging, where readers don't block the writer nor the other way.
+ */
+struct _HistoryReader
+{
+  ChattyHistory *history;
+  GThread       *thread;
+  sqlite3       *db;
+  /* Prepared statements, same as ChattyHistory->statements */
+  GHashTable    *statements;
+};
+
+/* The HistoryReader of the current thread, if any */
+static GPrivate current_reader;
+
 /*
  * ChattyHistory->db should never be accessed nor modified in main thread
  * except for checking if it’s %NULL.  Any operation should be done only
@@ -133,24 +555,39 @@ static int     add_file_info   (ChattyHistory  *self,
 G_DEFINE_TYPE (ChattyHistory, chatty_history, G_TYPE_OBJECT)
 
 
-/**
- * history_db_wait_for_completion:
- * @task: The task to complete
- *
- * Iterate the main context until the given task completes.
+/*
+ * Used as the callback for write operations that don't
+ * care about the result, so that errors are still logged.
+ * @user_data is a static string describing the operation.
  */
 static void
-history_db_wait_for_completion (GTask *task)
+history_log_error_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    g_warning ("Error %s: %s", (const char *)user_data,
+               error ? error->message : "unknown");
+}
+
+static int
+history_propagate_timestamp (GAsyncResult  *result,
+                             int            fallback,
+                             GError       **error)
 {
-  GMainContext *context;
+  g_autoptr(GError) local_error = NULL;
+  int time_stamp;
 
-  context = g_main_context_get_thread_default ();
-  if (!context)
-    context = g_main_context_default ();
+  time_stamp = g_task_propagate_int (G_TASK (result), &local_error);
 
-  /* Wait until the task is completed */
-  while (!g_task_get_completed (task))
-    g_main_context_iteration (context, TRUE);
+  if (local_error) {
+    g_propagate_error (error, g_steal_pointer (&local_error));
+    return fallback;
+  }
+
+  return time_stamp;
 }
 
 
@@ -470,6 +907,155 @@ history_bind_int (sqlite3_stmt *statement,
   warn_if_sql_error (status, message);
 }
 
+/*
+ * Get the database connection of the current thread, which
+ * is either @worker_thread or the thread of a HistoryReader.
+ */
+static sqlite3 *
+history_get_db (ChattyHistory *self)
+{
+  HistoryReader *reader;
+
+  reader = g_private_get (&current_reader);
+
+  if (reader)
+    return reader->db;
+
+  return self->db;
+}
+
+static gboolean
+history_in_worker (ChattyHistory *self)
+{
+  HistoryReader *reader;
+
+  reader = g_private_get (&current_reader);
+
+  if (reader)
+    return reader->history == self;
+
+  return g_thread_self () == self->worker_thread;
+}
+
+/*
+ * history_prepare:
+ * @self: a #ChattyHistory
+ * @sql: A static SQL string
+ *
+ * Get the compiled statement for @sql, preparing it if this is
+ * the first use.  The statement is owned by @self and should be
+ * given back with history_reset() once done instead of finalizing.
+ * As the statement is shared, the same @sql shouldn't be used
+ * again before the statement is reset.
+ *
+ * Returns: (transfer none) (nullable): A #sqlite3_stmt
+ */
+static sqlite3_stmt *
+history_prepare (ChattyHistory *self,
+                 const char    *sql)
+{
+  HistoryReader *reader;
+  GHashTable *statements;
+  sqlite3_stmt *stmt;
+  sqlite3 *db;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+
+  reader = g_private_get (&current_reader);
+
+  if (reader) {
+    g_assert (reader->history == self);
+    db = reader->db;
+    statements = reader->statements;
+  } else {
+    g_assert (g_thread_self () == self->worker_thread);
+    db = self->db;
+    statements = self->statements;
+  }
+
+  g_assert (db);
+
+  stmt = g_hash_table_lookup (statements, sql);
+
+  if (stmt) {
+    g_atomic_int_inc (&self->statement_hits);
+    return stmt;
+  }
+
+  g_atomic_int_inc (&self->statement_misses);
+  status = sqlite3_prepare_v3 (db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+  warn_if_sql_error (status, "preparing statement");
+
+  if (status != SQLITE_OK)
+    return NULL;
+
+  g_hash_table_insert (statements, (gpointer)sql, stmt);
+
+  return stmt;
+}
+
+/*
+ * history_reset:
+ * @stmt: (nullable): A #sqlite3_stmt from history_prepare()
+ *
+ * Reset @stmt and clear its bindings so that it can be reused.
+ *
+ * Returns: The status of the last step of @stmt
+ */
+static int
+history_reset (sqlite3_stmt *stmt)
+{
+  int status;
+
+  if (!stmt)
+    return SQLITE_MISUSE;
+
+  status = sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+
+  return status;
+}
+
+/*
+ * Set @error if @stmt, from history_prepare(), is %NULL
+ * as it couldn't be prepared.
+ *
+ * Returns: %TRUE if @stmt is %NULL
+ */
+static gboolean
+history_prepare_failed (ChattyHistory  *self,
+                        sqlite3_stmt   *stmt,
+                        GError        **error)
+{
+  sqlite3 *db;
+
+  if (stmt)
+    return FALSE;
+
+  db = history_get_db (self);
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "Couldn't prepare statement. errno: %d, desc: %s",
+               sqlite3_errcode (db), sqlite3_errmsg (db));
+
+  return TRUE;
+}
+
+/* Same as history_prepare_failed(), but complete @task with the error */
+static gboolean
+history_prepare_failed_task (ChattyHistory *self,
+                             sqlite3_stmt  *stmt,
+                             GTask         *task)
+{
+  GError *error = NULL;
+
+  if (!history_prepare_failed (self, stmt, &error))
+    return FALSE;
+
+  g_task_return_error (task, error);
+
+  return TRUE;
+}
 
 static int
 chatty_history_get_db_version (ChattyHistory *self,
@@ -517,6 +1103,9 @@ chatty_history_create_schema (ChattyHistory *self,
    * So what to name? file or files?
    */
   sql =
+    /* Has to be set before any table is created.  Introduced in Version 8 */
+    "PRAGMA auto_vacuum = INCREMENTAL;"
+
     "CREATE TABLE IF NOT EXISTS mime_type ("
     "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
     "name TEXT NOT NULL UNIQUE);"
@@ -641,6 +1230,18 @@ chatty_history_create_schema (ChattyHistory *self,
     "FROM users "
     "WHERE users.username='"MM_NUMBER"';"
 
+    /* Introduced in Version 5 */
+    HISTORY_MESSAGES_INDEX_SCHEMA
+
+    /* Introduced in Version 6 */
+    HISTORY_FTS_SCHEMA
+
+    /* Introduced in Version 7 */
+    HISTORY_SUMMARY_SCHEMA
+
+    /* Introduced in Version 8 */
+    HISTORY_FILE_REFS_SCHEMA
+
     "PRAGMA user_version = " STRING (HISTORY_VERSION) ";";
 
   status = sqlite3_exec (self->db, sql, NULL, NULL, &error);
@@ -661,6 +1262,113 @@ chatty_history_create_schema (ChattyHistory *self,
   return FALSE;
 }
 
+static void
+history_id_free (HistoryId *entry)
+{
+  g_free (entry->key);
+  g_free (entry->state);
+  g_free (entry);
+}
+
+/*
+ * Get the cached id for @key.  If @state isn't %NULL, the id is
+ * returned only if the row was last written with @state, so that
+ * callers can skip writes that wouldn't change anything.
+ *
+ * Returns: The id, or 0 if not cached
+ */
+static int
+history_ids_lookup (ChattyHistory *self,
+                    const char    *key,
+                    const char    *state)
+{
+  HistoryId *entry;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  entry = g_hash_table_lookup (self->ids, key);
+
+  if (!entry || (state && g_strcmp0 (entry->state, state) != 0)) {
+    self->id_misses++;
+    return 0;
+  }
+
+  self->id_hits++;
+  g_queue_unlink (&self->ids_lru, &entry->link);
+  g_queue_push_head_link (&self->ids_lru, &entry->link);
+
+  return entry->id;
+}
+
+/* Cache @id for @key, a %NULL @state keeps the known state, if any */
+static void
+history_ids_insert (ChattyHistory *self,
+                    const char    *key,
+                    const char    *state,
+                    int            id)
+{
+  HistoryId *entry;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (id);
+
+  entry = g_hash_table_lookup (self->ids, key);
+
+  if (entry) {
+    g_queue_unlink (&self->ids_lru, &entry->link);
+  } else {
+    entry = g_new0 (HistoryId, 1);
+    entry->link.data = entry;
+    entry->key = g_strdup (key);
+    g_hash_table_insert (self->ids, entry->key, entry);
+  }
+
+  entry->id = id;
+  if (state) {
+    g_free (entry->state);
+    entry->state = g_strdup (state);
+  }
+  g_queue_push_head_link (&self->ids_lru, &entry->link);
+
+  if (self->ids_lru.length > HISTORY_IDS_SIZE) {
+    entry = g_queue_peek_tail (&self->ids_lru);
+    g_queue_unlink (&self->ids_lru, &entry->link);
+    g_hash_table_remove (self->ids, entry->key);
+  }
+}
+
+/* Forget every cached id, needed when rows may have been deleted */
+static void
+history_ids_clear (ChattyHistory *self)
+{
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  g_queue_init (&self->ids_lru);
+  g_hash_table_remove_all (self->ids);
+}
+
+static void
+history_ids_log_stats (ChattyHistory *self)
+{
+  guint total;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  total = self->id_hits + self->id_misses;
+
+  if (!total)
+    return;
+
+  CHATTY_TRACE_MSG ("Id cache: %u hits, %u misses (%.1f%% hit rate), %u cached",
+                    self->id_hits, self->id_misses, 100.0 * self->id_hits / total,
+                    self->ids_lru.length);
+  self->id_hits = self->id_misses = 0;
+}
+
 static int
 insert_or_ignore_user (ChattyHistory  *self,
                        ChattyProtocol  protocol,
@@ -669,47 +1377,62 @@ insert_or_ignore_user (ChattyHistory  *self,
                        GTask          *task)
 {
   g_autofree char *phone = NULL;
+  g_autofree char *key = NULL;
   sqlite3_stmt *stmt;
+  const char *country = NULL;
   int status, id = 0;
 
   if (!who || !*who)
     return 0;
 
-  if (protocol & (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS | CHATTY_PROTOCOL_TELEGRAM)) {
-    char *country;
+  /* The alias is updated only if it's different from the username */
+  if (alias && g_str_equal (who, alias))
+    alias = NULL;
 
+  if (protocol & (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS | CHATTY_PROTOCOL_TELEGRAM))
     country = g_object_get_data (G_OBJECT (task), "country-code");
+
+  key = g_strdup_printf ("user\x1f%d\x1f%s\x1f%s", protocol, country ? country : "", who);
+  id = history_ids_lookup (self, key, alias);
+
+  if (id)
+    return id;
+
+  if (country)
     phone = chatty_utils_check_phonenumber (who, country);
-  }
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT OR IGNORE INTO users(username,type,alias) "
-                      "VALUES(?1,?2,?3) "
-                      "ON CONFLICT(username,type) "
-                      "DO UPDATE SET alias=coalesce(?3,alias)",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO users(username,type,alias) "
+                          "VALUES(?1,?2,?3) "
+                          "ON CONFLICT(username,type) "
+                          "DO UPDATE SET alias=coalesce(?3,alias)");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_text (stmt, 1, phone ? phone : who, "binding when adding phone number");
   history_bind_int (stmt, 2, history_protocol_to_type_value (protocol), "binding when adding phone number");
-  if (alias && who && !g_str_equal (who, alias))
+  if (alias)
     history_bind_text (stmt, 3, alias, "binding when adding phone number");
 
   sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
   /* We can't use last_row_id as we may ignore the last insert */
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT users.id FROM users "
-                      "WHERE users.username=? AND type=?;",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT users.id FROM users "
+                          "WHERE users.username=? AND type=?;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_text (stmt, 1, phone ? phone : who, "binding when getting users");
   history_bind_int (stmt, 2, history_protocol_to_type_value (protocol), "binding when getting users");
   status = sqlite3_step (stmt);
 
   if (status == SQLITE_ROW)
     id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
-  if (status != SQLITE_ROW)
+  if (status == SQLITE_ROW)
+    history_ids_insert (self, key, alias, id);
+  else
     g_task_return_new_error (task,
                              G_IO_ERROR,
                              G_IO_ERROR_FAILED,
@@ -724,35 +1447,46 @@ insert_or_ignore_account (ChattyHistory  *self,
                           int             user_id,
                           GTask          *task)
 {
+  g_autofree char *key = NULL;
   sqlite3_stmt *stmt;
   int status, id = 0;
 
   if (!user_id)
     g_return_val_if_reached (0);
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT OR IGNORE INTO accounts(user_id,protocol) "
-                      "VALUES(?,?);",
-                      -1, &stmt, NULL);
+  key = g_strdup_printf ("account\x1f%d\x1f%d", protocol, user_id);
+  id = history_ids_lookup (self, key, NULL);
+
+  if (id)
+    return id;
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO accounts(user_id,protocol) "
+                          "VALUES(?,?);");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_int (stmt, 1, user_id, "binding when adding account");
   history_bind_int (stmt, 2, history_protocol_to_value (protocol), "binding when adding account");
   sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
   /* We can't use last_row_id as we may ignore the last insert */
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT accounts.id FROM accounts "
-                      "WHERE user_id=? AND protocol=?;",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT accounts.id FROM accounts "
+                          "WHERE user_id=? AND protocol=?;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_int (stmt, 1, user_id, "binding when getting account");
   history_bind_int (stmt, 2, history_protocol_to_value (protocol), "binding when getting account");
   status = sqlite3_step (stmt);
 
   if (status == SQLITE_ROW)
     id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
-  if (status != SQLITE_ROW)
+  if (status == SQLITE_ROW)
+    history_ids_insert (self, key, NULL, id);
+  else
     g_task_return_new_error (task,
                              G_IO_ERROR,
                              G_IO_ERROR_FAILED,
@@ -767,16 +1501,25 @@ history_add_phone_user (ChattyHistory *self,
                         const char    *username,
                         const char    *alias)
 {
+  g_autofree char *key = NULL;
   sqlite3_stmt *stmt;
   int status, id = 0;
 
-  sqlite3_prepare_v2 (self->db, "INSERT OR IGNORE INTO users(username,alias,type) "
-                      "VALUES(?,?,"STRING(CHATTY_ID_PHONE_VALUE)");",
-                      -1, &stmt, NULL);
+  /* The alias is set only if the user is new */
+  key = g_strdup_printf ("phone\x1f%s", username);
+  id = history_ids_lookup (self, key, NULL);
+
+  if (id)
+    return id;
+
+  stmt = history_prepare (self, "INSERT OR IGNORE INTO users(username,alias,type) "
+                          "VALUES(?,?,"STRING(CHATTY_ID_PHONE_VALUE)");");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_text (stmt, 1, username, "binding when adding user");
   history_bind_text (stmt, 2, alias, "binding when adding user");
   status = sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
   if (status != SQLITE_DONE) {
     g_task_return_new_error (task,
@@ -788,18 +1531,21 @@ history_add_phone_user (ChattyHistory *self,
   }
 
   /* We can't use last_row_id as we may ignore the last insert */
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT users.id FROM users "
-                      "WHERE users.username=? AND type="STRING(CHATTY_ID_PHONE_VALUE)";",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT users.id FROM users "
+                          "WHERE users.username=? AND type="STRING(CHATTY_ID_PHONE_VALUE)";");
+  if (history_prepare_failed_task (self, stmt, task))
+    return 0;
   history_bind_text (stmt, 1, username, "binding when getting phone user");
   status = sqlite3_step (stmt);
 
   if (status == SQLITE_ROW)
     id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
-  if (status != SQLITE_ROW)
+  if (status == SQLITE_ROW)
+    history_ids_insert (self, key, NULL, id);
+  else
     g_task_return_new_error (task,
                              G_IO_ERROR,
                              G_IO_ERROR_FAILED,
@@ -809,21 +1555,48 @@ history_add_phone_user (ChattyHistory *self,
   return id;
 }
 
+static char *
+get_thread_id_key (ChattyChat *chat)
+{
+  return g_strdup_printf ("thread\x1f%d\x1f%s\x1f%s",
+                          chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                          chatty_item_get_username (CHATTY_ITEM (chat)),
+                          chatty_chat_get_chat_name (chat));
+}
+
+/*
+ * Get the id of the thread of @chat.
+ *
+ * Returns: The thread id, 0 if not found or on error,
+ * in which case @error is set.
+ */
 static int
-get_thread_id (ChattyHistory *self,
-               ChattyChat    *chat)
+get_thread_id (ChattyHistory  *self,
+               ChattyChat     *chat,
+               GError        **error)
 {
+  g_autofree char *key = NULL;
   sqlite3_stmt *stmt;
   int status, id = 0;
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT threads.id FROM threads "
-                      "INNER JOIN accounts "
-                      "ON accounts.id=account_id "
-                      "INNER JOIN users "
-                      "ON users.username=? AND accounts.user_id=users.id "
-                      "AND threads.name=? AND threads.type=?;",
-                      -1, &stmt, NULL);
+  /* Readers can't see the cache, it's updated by the worker thread */
+  if (g_thread_self () == self->worker_thread) {
+    key = get_thread_id_key (chat);
+    id = history_ids_lookup (self, key, NULL);
+
+    if (id)
+      return id;
+  }
+
+  stmt = history_prepare (self,
+                          "SELECT threads.id FROM threads "
+                          "INNER JOIN accounts "
+                          "ON accounts.id=account_id "
+                          "INNER JOIN users "
+                          "ON users.username=? AND accounts.user_id=users.id "
+                          "AND threads.name=? AND threads.type=?;");
+  if (history_prepare_failed (self, stmt, error))
+    return 0;
   history_bind_text (stmt, 1, chatty_item_get_username (CHATTY_ITEM (chat)), "binding when getting thread");
   history_bind_text (stmt, 2, chatty_chat_get_chat_name (chat), "binding when getting thread");
   history_bind_int (stmt, 3, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
@@ -832,7 +1605,10 @@ get_thread_id (ChattyHistory *self,
 
   if (status == SQLITE_ROW)
     id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
+
+  if (key && id)
+    history_ids_insert (self, key, NULL, id);
 
   return id;
 }
@@ -842,8 +1618,11 @@ insert_or_ignore_thread (ChattyHistory *self,
                          ChattyChat    *chat,
                          GTask         *task)
 {
+  g_autofree char *key = NULL;
+  g_autofree char *state = NULL;
   sqlite3_stmt *stmt;
-  int user_id, account_id;
+  const char *alias = NULL;
+  int user_id, account_id, visibility, encrypted;
   int status, id = 0;
 
   g_assert (CHATTY_IS_HISTORY (self));
@@ -877,40 +1656,65 @@ insert_or_ignore_thread (ChattyHistory *self,
   if (!account_id)
     return 0;
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT INTO threads(name,alias,account_id,type,visibility,encrypted,avatar_id) "
-                      "VALUES(?1,?2,?3,?4,?5,?6,?7) "
-                      "ON CONFLICT(name,account_id,type) "
-                      "DO UPDATE SET alias=?2, visibility=?5, encrypted=?6",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, chatty_chat_get_chat_name (chat), "binding when adding thread");
-
   if (CHATTY_IS_MM_CHAT (chat) && chatty_mm_chat_has_custom_name (CHATTY_MM_CHAT (chat)))
-    history_bind_text (stmt, 2, chatty_item_get_name (CHATTY_ITEM (chat)), "binding when adding thread");
-  history_bind_int (stmt, 3, account_id, "binding when adding thread");
-  history_bind_int (stmt, 4, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
-                    "binding when adding thread");
-  history_bind_int (stmt, 5, history_visibility_to_value (chatty_item_get_state (CHATTY_ITEM (chat))),
-                    "binding when adding thread");
-  history_bind_int (stmt, 6, chatty_chat_get_encryption (chat) == CHATTY_ENCRYPTION_ENABLED,
-                    "binding when adding thread");
-  sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+    alias = chatty_item_get_name (CHATTY_ITEM (chat));
+  visibility = history_visibility_to_value (chatty_item_get_state (CHATTY_ITEM (chat)));
+  encrypted = chatty_chat_get_encryption (chat) == CHATTY_ENCRYPTION_ENABLED;
+
+  /* Skip the upsert if the thread is already stored with the same values */
+  key = g_strdup_printf ("thread-row\x1f%d\x1f%d\x1f%s",
+                         chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                         account_id, chatty_chat_get_chat_name (chat));
+  state = g_strdup_printf ("%d\x1f%d\x1f%c%s", visibility, encrypted,
+                           alias ? '+' : '-', alias ? alias : "");
+  id = history_ids_lookup (self, key, state);
+
+  if (id) {
+    status = SQLITE_ROW;
+  } else {
+    stmt = history_prepare (self,
+                            "INSERT INTO threads(name,alias,account_id,type,visibility,encrypted,avatar_id) "
+                            "VALUES(?1,?2,?3,?4,?5,?6,?7) "
+                            "ON CONFLICT(name,account_id,type) "
+                            "DO UPDATE SET alias=?2, visibility=?5, encrypted=?6");
+    if (history_prepare_failed_task (self, stmt, task))
+      return 0;
+    history_bind_text (stmt, 1, chatty_chat_get_chat_name (chat), "binding when adding thread");
+
+    if (alias)
+      history_bind_text (stmt, 2, alias, "binding when adding thread");
+    history_bind_int (stmt, 3, account_id, "binding when adding thread");
+    history_bind_int (stmt, 4, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                      "binding when adding thread");
+    history_bind_int (stmt, 5, visibility, "binding when adding thread");
+    history_bind_int (stmt, 6, encrypted, "binding when adding thread");
+    sqlite3_step (stmt);
+    history_reset (stmt);
+
+    /* We can't use last_row_id as we may ignore the last insert */
+    stmt = history_prepare (self,
+                            "SELECT threads.id FROM threads "
+                            "WHERE name=? AND account_id=? AND type=?;");
+    if (history_prepare_failed_task (self, stmt, task))
+      return 0;
+    history_bind_text (stmt, 1, chatty_chat_get_chat_name (chat), "binding when getting thread");
+    history_bind_int (stmt, 2, account_id, "binding when getting thread");
+    history_bind_int (stmt, 3, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                      "binding when getting thread");
+    status = sqlite3_step (stmt);
 
-  /* We can't use last_row_id as we may ignore the last insert */
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT threads.id FROM threads "
-                      "WHERE name=? AND account_id=? AND type=?;",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, chatty_chat_get_chat_name (chat), "binding when getting thread");
-  history_bind_int (stmt, 2, account_id, "binding when getting thread");
-  history_bind_int (stmt, 3, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
-                    "binding when getting thread");
-  status = sqlite3_step (stmt);
+    if (status == SQLITE_ROW)
+      id = sqlite3_column_int (stmt, 0);
+    history_reset (stmt);
 
-  if (status == SQLITE_ROW)
-    id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+    if (status == SQLITE_ROW) {
+      g_autofree char *thread_key = NULL;
+
+      thread_key = get_thread_id_key (chat);
+      history_ids_insert (self, key, state, id);
+      history_ids_insert (self, thread_key, NULL, id);
+    }
+  }
 
   if (status == SQLITE_ROW &&
       CHATTY_IS_MM_CHAT (chat)) {
@@ -922,25 +1726,33 @@ insert_or_ignore_thread (ChattyHistory *self,
 
     for (guint i = 0; i < n_items; i++) {
       g_autoptr(ChattyMmBuddy) buddy = NULL;
+      g_autofree char *member_key = NULL;
       const char *number, *name;
 
       buddy = g_list_model_get_item (buddies, i);
       name = chatty_item_get_name (CHATTY_ITEM (buddy));
       number = chatty_mm_buddy_get_number (buddy);
+
+      member_key = g_strdup_printf ("member\x1f%d\x1f%s", id, number);
+      if (history_ids_lookup (self, member_key, NULL))
+        continue;
+
       user_id = history_add_phone_user (self, task, number, name);
 
       if (!user_id)
         return 0;
 
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                          "VALUES(?,?);",
-                          -1, &stmt, NULL);
+      stmt = history_prepare (self,
+                              "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                              "VALUES(?,?);");
+      if (history_prepare_failed_task (self, stmt, task))
+        return 0;
       history_bind_int (stmt, 1, id, "binding when adding phone number");
       history_bind_int (stmt, 2, user_id, "binding when adding phone number");
 
-      sqlite3_step (stmt);
-      sqlite3_finalize (stmt);
+      if (sqlite3_step (stmt) == SQLITE_DONE)
+        history_ids_insert (self, member_key, NULL, user_id);
+      history_reset (stmt);
     }
   }
 
@@ -1887,6 +2699,153 @@ chatty_history_migrate_db_to_v4 (ChattyHistory *self,
   return FALSE;
 }
 
+/* For migrating from v4 to v5 */
+static gboolean
+chatty_history_migrate_db_to_v5 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         /*
+                          * The UNIQUE constraint on messages already indexes uid,
+                          * but it also carries the whole body, which makes it
+                          * a poor fit for uid lookups done after every insert.
+                          * threads.name and message_files.message_id are already
+                          * the leading columns of their UNIQUE indexes.
+                          */
+                         "CREATE INDEX IF NOT EXISTS messages_uid_idx ON messages(uid);"
+                         /* Used for paging messages and for per thread lookups */
+                         "CREATE INDEX IF NOT EXISTS messages_thread_time_idx ON messages(thread_id,time);"
+
+                         "PRAGMA user_version = 5;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/* For migrating from v5 to v6 */
+static gboolean
+chatty_history_migrate_db_to_v6 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         HISTORY_FTS_SCHEMA
+
+                         /* Index the messages we already have */
+                         "INSERT INTO messages_fts(messages_fts) VALUES('rebuild');"
+
+                         "PRAGMA user_version = 6;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/* For migrating from v6 to v7 */
+static gboolean
+chatty_history_migrate_db_to_v7 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         HISTORY_SUMMARY_SCHEMA
+
+                         /* Summarize the threads we already have */
+                         HISTORY_SUMMARY_UPDATE_SQL ";"
+
+                         "PRAGMA user_version = 7;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/* For migrating from v7 to v8 */
+static gboolean
+chatty_history_migrate_db_to_v8 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         HISTORY_FILE_REFS_SCHEMA
+
+                         "PRAGMA user_version = 8;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
 static gboolean
 chatty_history_migrate (ChattyHistory *self,
                         GTask         *task)
@@ -1925,6 +2884,26 @@ chatty_history_migrate (ChattyHistory *self,
   case 3:
     if (!chatty_history_migrate_db_to_v4 (self, task))
       return FALSE;
+    /* fallthrough */
+
+  case 4:
+    if (!chatty_history_migrate_db_to_v5 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 5:
+    if (!chatty_history_migrate_db_to_v6 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 6:
+    if (!chatty_history_migrate_db_to_v7 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 7:
+    if (!chatty_history_migrate_db_to_v8 (self, task))
+      return FALSE;
     break;
 
   default:
@@ -1939,910 +2918,3490 @@ chatty_history_migrate (ChattyHistory *self,
   return TRUE;
 }
 
+static char *
+history_get_journal_mode (ChattyHistory *self,
+                          const char    *sql)
+{
+  sqlite3_stmt *stmt;
+  char *mode = NULL;
+
+  sqlite3_prepare_v2 (self->db, sql, -1, &stmt, NULL);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    mode = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+
+  sqlite3_finalize (stmt);
+
+  return mode;
+}
+
+/*
+ * "full" keeps the rollback journal and syncs on every commit.
+ * "normal" (the default) uses write-ahead logging, which lets
+ * commits skip fsync() and only sync at checkpoints.  The archive
+ * has to be attached already, so that it gets the same settings.
+ */
 static void
-history_open_db (ChattyHistory *self,
-                 GTask         *task)
+history_set_durability (ChattyHistory *self,
+                        const char    *durability)
 {
-  const char *dir, *file_name;
-  sqlite3 *db;
-  int status;
-  gboolean db_exists;
+  g_autofree char *mode = NULL;
+  g_autofree char *archive_mode = NULL;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (!self->db);
 
-  dir = g_object_get_data (G_OBJECT (task), "dir");
-  file_name = g_object_get_data (G_OBJECT (task), "file-name");
-  g_assert (dir && *dir);
-  g_assert (file_name && *file_name);
+  sqlite3_exec (self->db, HISTORY_CONNECTION_PRAGMAS HISTORY_ARCHIVE_PRAGMAS, NULL, NULL, NULL);
 
-  g_mkdir_with_parents (dir, S_IRWXU);
-  self->db_path = g_build_filename (dir, file_name, NULL);
+  if (g_strcmp0 (durability, "full") == 0) {
+    mode = history_get_journal_mode (self, "PRAGMA main.journal_mode = DELETE;");
+    archive_mode = history_get_journal_mode (self, "PRAGMA archive.journal_mode = DELETE;");
+  } else {
+    /*
+     * WAL needs shared memory, which isn't available on every
+     * file system.  In that case SQLite keeps the old journal
+     * mode, so always check the mode we actually got.
+     */
+    mode = history_get_journal_mode (self, "PRAGMA main.journal_mode = WAL;");
+    archive_mode = history_get_journal_mode (self, "PRAGMA archive.journal_mode = WAL;");
 
-  db_exists = g_file_test (self->db_path, G_FILE_TEST_EXISTS);
-  status = sqlite3_open (self->db_path, &db);
+    if (g_strcmp0 (mode, "wal") != 0)
+      g_warning ("Write-ahead logging not supported, using '%s' journal", mode);
+  }
 
-  if (status == SQLITE_OK) {
-    self->db = db;
+  self->wal_enabled = g_strcmp0 (mode, "wal") == 0;
+  self->checkpoint_changes = sqlite3_total_changes (self->db);
 
-    sqlite3_exec (self->db, "PRAGMA foreign_keys = OFF;", NULL, NULL, NULL);
-    sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-    if (db_exists) {
-      if (!chatty_history_migrate (self, task)) {
-        sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-        return;
-      }
-    } else {
-      if (!chatty_history_create_schema (self, task)) {
-        sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-        return;
-      }
-    }
+  if (self->wal_enabled)
+    sqlite3_exec (self->db, "PRAGMA main.synchronous = NORMAL;", NULL, NULL, NULL);
+  else
+    sqlite3_exec (self->db, "PRAGMA main.synchronous = FULL;", NULL, NULL, NULL);
 
-    sqlite3_exec (self->db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
-    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-    g_task_return_boolean (task, TRUE);
-  } else {
-    g_task_return_boolean (task, FALSE);
-  }
+  /* NORMAL is only safe from corruption with write-ahead logging */
+  if (g_strcmp0 (archive_mode, "wal") == 0)
+    sqlite3_exec (self->db, "PRAGMA archive.synchronous = NORMAL;", NULL, NULL, NULL);
+  else
+    sqlite3_exec (self->db, "PRAGMA archive.synchronous = FULL;", NULL, NULL, NULL);
+
+  g_debug ("Database journal mode: %s, durability: %s", mode,
+           self->wal_enabled ? "normal" : "full");
 }
 
 static void
-history_close_db (ChattyHistory *self,
-                  GTask         *task)
+history_checkpoint (ChattyHistory *self)
 {
-  sqlite3 *db;
-  int status;
+  int status, changes;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (self->db);
 
-  db = self->db;
-  status = sqlite3_close (db);
-  self->db = NULL;
+  if (!self->db || !self->wal_enabled)
+    return;
 
-  if (status == SQLITE_OK) {
-    /*
-     * We can’t know when @self associated with the task will
-     * be unref'ed.  So chatty_history_get_default() called immediately
-     * after this may return the @self that is yet to be finalized. But
-     * as the worker_thread is exited after closing the database, any
-     * actions with the same @self will not execute, and so the tasks
-     * will take ∞ time to complete.
-     *
-     * Hence invalidate the @self's ref to this task:
-     */
-    g_clear_pointer (&self->worker_thread, g_thread_unref);
-    g_debug ("Database closed successfully");
-    g_task_return_boolean (task, TRUE);
-  } else {
-    g_task_return_new_error (task,
-                             G_IO_ERROR,
-                             G_IO_ERROR_FAILED,
-                             "Database could not be closed. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (db));
+  changes = sqlite3_total_changes (self->db);
+
+  if (changes == self->checkpoint_changes)
+    return;
+
+  /* Passive checkpoints never block on readers nor writers */
+  status = sqlite3_wal_checkpoint_v2 (self->db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+                                      NULL, NULL);
+
+  if (status == SQLITE_OK)
+    self->checkpoint_changes = changes;
+  else
+    g_warning ("Failed to checkpoint database. errno: %d, desc: %s",
+               status, sqlite3_errmsg (self->db));
+}
+
+static const char *
+history_priority_to_string (HistoryPriority priority)
+{
+  switch (priority) {
+  case HISTORY_PRIORITY_OPEN:
+    return "open";
+  case HISTORY_PRIORITY_UI:
+    return "ui";
+  case HISTORY_PRIORITY_WRITE:
+    return "write";
+  case HISTORY_PRIORITY_BULK:
+    return "bulk";
+  case HISTORY_PRIORITY_IDLE:
+    return "idle";
+  case HISTORY_N_PRIORITIES:
+  default:
+    g_return_val_if_reached ("unknown");
   }
 }
 
-static GList *
-history_get_files (ChattyHistory *self,
-                   int            message_id)
+static HistoryQueue *
+history_queue_new (void)
 {
-  sqlite3_stmt *stmt;
-  GList *files = NULL;
+  HistoryQueue *queue;
 
-  if (!message_id)
-    return NULL;
+  queue = g_new0 (HistoryQueue, 1);
+  g_mutex_init (&queue->lock);
+  g_cond_init (&queue->cond);
 
-  /*                                     0   1        2      3     4      5      6      7          8 */
-  sqlite3_prepare_v2 (self->db, "SELECT url,path,files.name,size,status,width,height,duration,mime_type.name FROM files "
-                      "INNER JOIN message_files "
-                      "ON message_files.file_id=files.id "
-                      "LEFT JOIN mime_type "
-                      "ON mime_type.id=files.mime_type_id "
-                      "LEFT JOIN file_metadata "
-                      "ON file_metadata.file_id=files.id "
-                      "WHERE message_files.message_id=?;", -1, &stmt, NULL);
-  history_bind_int (stmt, 1, message_id, "binding when getting timestamp");
+  for (guint i = 0; i < HISTORY_N_PRIORITIES; i++)
+    g_queue_init (&queue->tasks[i]);
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    ChattyFile *file;
+  return queue;
+}
+
+static void
+history_queue_free (HistoryQueue *queue)
+{
+  for (guint i = 0; i < HISTORY_N_PRIORITIES; i++)
+    g_queue_clear_full (&queue->tasks[i], g_object_unref);
 
-    file = chatty_file_new_full ((const char *)sqlite3_column_text (stmt, 2),
-                                 (const char *)sqlite3_column_text (stmt, 0),
-                                 (const char *)sqlite3_column_text (stmt, 1),
-                                 (const char *)sqlite3_column_text (stmt, 8),
-                                 sqlite3_column_int (stmt, 3),
-                                 sqlite3_column_int (stmt, 5),
-                                 sqlite3_column_int (stmt, 6),
-                                 sqlite3_column_int (stmt, 7));
-    chatty_file_set_status (file, sqlite3_column_int (stmt, 4));
+  g_mutex_clear (&queue->lock);
+  g_cond_clear (&queue->cond);
+  g_free (queue);
+}
 
-    files = g_list_append (files, file);
-  }
+/* Push @task with @priority, @queue takes the reference */
+static guint
+history_queue_push (HistoryQueue    *queue,
+                    GTask           *task,
+                    HistoryPriority  priority)
+{
+  guint seq, depth;
 
-  sqlite3_finalize (stmt);
+  g_assert (priority < HISTORY_N_PRIORITIES);
+
+  g_mutex_lock (&queue->lock);
+  seq = ++queue->last_seq;
+  g_object_set_data (G_OBJECT (task), "seq", GUINT_TO_POINTER (seq));
+  g_queue_push_tail (&queue->tasks[priority], task);
+
+  depth = g_queue_get_length (&queue->tasks[priority]);
+  queue->max_depth[priority] = MAX (queue->max_depth[priority], depth);
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->lock);
 
-  return files;
+  return seq;
 }
 
-static GPtrArray *
-get_messages_before_time (ChattyHistory *self,
-                          ChattyChat    *chat,
-                          ChattyMessage *start,
-                          int            thread_id,
-                          guint          since_time,
-                          guint          limit)
+static guint
+history_queue_get_last_seq (HistoryQueue *queue)
 {
-  GPtrArray *messages = NULL;
-  sqlite3_stmt *stmt;
-  int status;
-  gboolean skip = TRUE;
+  guint seq;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (CHATTY_IS_CHAT (chat));
-  g_assert (g_thread_self () == self->worker_thread);
-  g_assert (limit != 0);
+  g_mutex_lock (&queue->lock);
+  seq = queue->last_seq;
+  g_mutex_unlock (&queue->lock);
 
-  if (!start)
-    skip = FALSE;
-
-  status = sqlite3_prepare_v2 (self->db,
-                                               /* 0      1      2    3                 4                         5 */
-                               "SELECT DISTINCT time,direction,body,uid,coalesce(users.alias,users.username),body_type,"
-                               /*    6            7           8               9            10             11 */
-                               "p_files.name,p_files.url,p_files.path,p_mime_type.name,p_files.size,p_files.status,"
-                                /* 12      13       14      */
-                               "m.width,m.height,m.duration,"
-                               /*     15            16        17 */
-                               "messages.status,messages.id,subject "
-                               "FROM messages "
-
-                               "LEFT JOIN files AS p_files ON messages.preview_id=p_files.id "
-                               "LEFT JOIN mime_type AS p_mime_type ON p_files.mime_type_id=p_mime_type.id "
-                               "LEFT JOIN file_metadata AS m on p_files.id=m.file_id "
-                               "LEFT JOIN users "
-                               "ON messages.sender_id=users.id "
-                               "WHERE thread_id=? "
-                               "AND messages.time <= ? "
-                               "AND body NOT NULL "
-                               "AND (messages.status !=" STRING(MESSAGE_STATUS_DRAFT) " OR messages.status is null) "
-                               "ORDER BY time DESC, messages.id DESC LIMIT ?;",
-                               -1, &stmt, NULL);
-  history_bind_int (stmt, 1, thread_id, "binding when getting messages");
-  history_bind_int (stmt, 2, since_time, "binding when getting messages");
-  history_bind_int (stmt, 3, limit, "binding when getting messages");
+  return seq;
+}
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    ChattyMessage *message;
-    const char *msg = NULL, *uid;
-    const char *who = NULL, *subject;
-    ChattyMsgType type;
-    guint time_stamp;
-    int direction;
+/*
+ * Pop the first task of the highest priority, waiting up to
+ * @timeout microseconds, or forever if @timeout is negative.
+ * Tasks cancelled while queued are completed with an error
+ * instead of being returned.
+ *
+ * Returns: (transfer full) (nullable): The task to run, %NULL
+ * on timeout.  Call history_queue_task_done() when complete.
+ */
+static GTask *
+history_queue_pop (HistoryQueue *queue,
+                   gint64        timeout)
+{
+  g_autoptr(GPtrArray) cancelled = NULL;
+  GTask *task = NULL;
+  gint64 end_time;
 
-    uid = (const char *)sqlite3_column_text (stmt, 3);
+  end_time = g_get_monotonic_time () + timeout;
+  cancelled = g_ptr_array_new_with_free_func (g_object_unref);
 
-    /* Skip until we pass the last message already in chat.
-     * This can happen as we load all messages with time <= message,
-     * which is required as there can be multiple messages with
-     * same timestamp.
-     */
-    if (skip && start) {
-      if (g_strcmp0 (uid, chatty_message_get_uid (start)) == 0)
-        skip = FALSE;
-      continue;
+  g_mutex_lock (&queue->lock);
+
+  while (!task) {
+    for (guint i = 0; i < HISTORY_N_PRIORITIES && !task; i++) {
+      while ((task = g_queue_pop_head (&queue->tasks[i])) &&
+             g_cancellable_is_cancelled (g_task_get_cancellable (task))) {
+        g_ptr_array_add (cancelled, task);
+        queue->dropped++;
+      }
+
+      if (task) {
+        queue->running_seq = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "seq"));
+        queue->running_priority = i;
+      }
     }
 
-    if (!messages)
-      messages = g_ptr_array_new_full (30, g_object_unref);
+    /* Dropped tasks may be the ones some read is waiting for */
+    if (cancelled->len)
+      g_cond_broadcast (&queue->cond);
 
-    time_stamp = sqlite3_column_int (stmt, 0);
-    direction = sqlite3_column_int (stmt, 1);
-    type = history_value_to_message_type (sqlite3_column_int (stmt, 5));
-    subject = (const char *)sqlite3_column_text (stmt, 17);
-    msg = (const char *)sqlite3_column_text (stmt, 2);
+    if (task)
+      break;
 
-    /* Skip if the message is empty and has no attachment */
-    if ((!msg || !*msg) && (!subject || !*subject)) {
-      sqlite3_stmt *check_stmt;
+    if (timeout < 0)
+      g_cond_wait (&queue->cond, &queue->lock);
+    else if (!g_cond_wait_until (&queue->cond, &queue->lock, end_time))
+      break;
+  }
 
-      status = sqlite3_prepare_v2 (self->db,
-                                   "SELECT file_id "
-                                   "FROM message_files "
-                                   "WHERE message_id=? "
-                                   "LIMIT 1;",
-                                   -1, &check_stmt, NULL);
-      history_bind_int (check_stmt, 1, sqlite3_column_int (stmt, 16), "binding when checking message files");
+  g_mutex_unlock (&queue->lock);
 
-      status = sqlite3_step (check_stmt);
-      sqlite3_finalize (check_stmt);
+  /* Complete outside of the lock, the callbacks run in the main thread */
+  for (guint i = 0; i < cancelled->len; i++)
+    g_task_return_error_if_cancelled (cancelled->pdata[i]);
 
-      if (status != SQLITE_ROW)
-        continue;
-    }
+  return task;
+}
 
-    if (!chatty_chat_is_im (chat) || CHATTY_IS_MA_CHAT (chat))
-      who = (const char *)sqlite3_column_text (stmt, 4);
+static void
+history_queue_task_done (HistoryQueue *queue)
+{
+  g_mutex_lock (&queue->lock);
+  queue->running_seq = 0;
+  queue->done++;
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->lock);
+}
 
-    status = sqlite3_column_int (stmt, 15);
+static gboolean
+history_queue_has_pending (HistoryQueue    *queue,
+                           guint            seq,
+                           HistoryPriority  priority)
+{
+  if (queue->running_seq && queue->running_seq <= seq &&
+      queue->running_priority <= priority)
+    return TRUE;
 
-    {
-      g_autoptr(ChattyContact) contact = NULL;
-      GList *files = NULL;
-      int message_id;
+  /* Tasks of the same priority are in the order pushed */
+  for (guint i = 0; i <= priority; i++) {
+    GTask *task;
 
-      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
-      chatty_contact_set_name (contact, who);
-      chatty_contact_set_value (contact, who);
-      message = chatty_message_new (CHATTY_ITEM (contact), msg, uid, time_stamp, type,
-                                    history_direction_from_value (direction),
-                                    history_msg_status_from_value (status));
-      message_id = sqlite3_column_int (stmt, 16);
-      files = history_get_files (self, message_id);
-      chatty_message_set_files (message, files);
-    }
+    task = g_queue_peek_head (&queue->tasks[i]);
 
-    chatty_message_set_subject (message, subject);
-    g_ptr_array_insert (messages, 0, message);
+    if (task && GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "seq")) <= seq)
+      return TRUE;
   }
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting messages");
-
-  return messages;
+  return FALSE;
 }
 
+/*
+ * Wait until the tasks of @priority or higher pushed up to @seq
+ * are complete, or @queue is closed.
+ */
 static void
-history_get_messages (ChattyHistory *self,
-                      GTask         *task)
+history_queue_wait (HistoryQueue    *queue,
+                    guint            seq,
+                    HistoryPriority  priority)
 {
-  GPtrArray *messages;
-  ChattyMessage *start;
-  ChattyChat *chat;
-  guint limit;
-  int thread_id, since = INT_MAX;
-
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  g_mutex_lock (&queue->lock);
+  while (!queue->closed && history_queue_has_pending (queue, seq, priority))
+    g_cond_wait (&queue->cond, &queue->lock);
+  g_mutex_unlock (&queue->lock);
+}
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
-  }
+/* Stop history_queue_wait() from waiting for tasks that may never run */
+static void
+history_queue_close (HistoryQueue *queue)
+{
+  g_mutex_lock (&queue->lock);
+  queue->closed = TRUE;
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->lock);
+}
 
-  limit = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "limit"));
-  start = g_object_get_data (G_OBJECT (task), "message");
-  chat  = g_object_get_data (G_OBJECT (task), "chat");
+/* Log the queue depths since last called, if there was any task */
+static void
+history_queue_log_stats (HistoryQueue *queue,
+                         const char   *name)
+{
+  g_autoptr(GString) depths = NULL;
 
-  g_assert (limit != 0);
-  g_assert (!start || CHATTY_IS_MESSAGE (start));
-  g_assert (CHATTY_IS_CHAT (chat));
+  g_mutex_lock (&queue->lock);
 
-  if (start)
-    since = chatty_message_get_time (start);
+  if (queue->done || queue->dropped) {
+    depths = g_string_new (NULL);
 
-  thread_id = get_thread_id (self, chat);
+    for (guint i = 0; i < HISTORY_N_PRIORITIES; i++) {
+      g_string_append_printf (depths, "%s%s: %u (%u queued)", i ? ", " : "",
+                              history_priority_to_string (i),
+                              queue->max_depth[i],
+                              g_queue_get_length (&queue->tasks[i]));
+      queue->max_depth[i] = g_queue_get_length (&queue->tasks[i]);
+    }
 
-  if (!thread_id) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                             "Couldn't find chat %s",
-                             chatty_chat_get_chat_name (chat));
-    return;
+    g_debug ("History %s queue: %u tasks done, %u cancelled dropped, max depth: %s",
+             name, queue->done, queue->dropped, depths->str);
+    queue->done = queue->dropped = 0;
   }
 
-  messages = get_messages_before_time (self, chat, start, thread_id, since, limit);
-  g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+  g_mutex_unlock (&queue->lock);
 }
 
+/*
+ * Databases created before version 8 don't have auto_vacuum set,
+ * which takes a VACUUM that can't run within the migration
+ * transaction.  See history_enable_auto_vacuum().
+ */
 static void
-history_get_chat_draft_message (ChattyHistory *self,
-                                GTask         *task)
+history_check_auto_vacuum (ChattyHistory *self)
 {
   sqlite3_stmt *stmt;
-  ChattyChat *chat;
-  int thread_id;
+  int mode = -1;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
-  }
+  sqlite3_prepare_v2 (self->db, "PRAGMA auto_vacuum;", -1, &stmt, NULL);
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    mode = sqlite3_column_int (stmt, 0);
 
-  g_assert (CHATTY_IS_CHAT (chat));
+  sqlite3_finalize (stmt);
 
-  thread_id = get_thread_id (self, chat);
+  self->auto_vacuum_pending = mode != SQLITE_AUTOVACUUM_INCREMENTAL;
+}
 
-  if (!thread_id) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                             "Couldn't find chat %s",
-                             chatty_chat_get_chat_name (chat));
-    return;
-  }
+static int
+history_vacuum_progress (gpointer user_data)
+{
+  ChattyHistory *self = user_data;
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT DISTINCT body "
-                      "FROM messages "
-                      "WHERE thread_id=? "
-                      "AND messages.status=" STRING(MESSAGE_STATUS_DRAFT) " "
-                      "ORDER BY time DESC, messages.id DESC LIMIT 1;",
-                      -1, &stmt, NULL);
+  /* Interrupt as soon as a task is queued */
+  return history_queue_get_last_seq (self->queue) != self->vacuum_seq;
+}
 
-  history_bind_int (stmt, 1, thread_id, "binding when getting draft message");
+/*
+ * Rewrite the database with auto_vacuum set, so that the pages freed
+ * by deletions can be given back with history_incremental_vacuum().
+ * This has to copy the whole database, which can take long and
+ * can't be split in slices.  So it's run only once idle, and
+ * interrupted if a task is queued meanwhile, to be started over
+ * on the next maintenance run.
+ *
+ * Returns: %TRUE, as this is done in a single step
+ */
+static gboolean
+history_enable_auto_vacuum (ChattyHistory  *self,
+                            GError        **error)
+{
+  int status;
 
-  if (sqlite3_step (stmt) == SQLITE_ROW) {
-    const char *msg = NULL;
+  if (!self->auto_vacuum_pending)
+    return TRUE;
 
-    msg = (const char *)sqlite3_column_text (stmt, 0);
-    g_task_return_pointer (task, g_strdup (msg), g_free);
+  self->vacuum_seq = history_queue_get_last_seq (self->queue);
+  sqlite3_progress_handler (self->db, 1000, history_vacuum_progress, self);
+  status = sqlite3_exec (self->db,
+                         "PRAGMA auto_vacuum = INCREMENTAL;"
+                         "VACUUM;",
+                         NULL, NULL, NULL);
+  sqlite3_progress_handler (self->db, 0, NULL, NULL);
+
+  if (status == SQLITE_INTERRUPT) {
+    g_debug ("Enabling auto vacuum interrupted, will retry");
   } else {
-    g_task_return_pointer (task, NULL, NULL);
+    /* Not retried on error, the database just won't shrink */
+    self->auto_vacuum_pending = FALSE;
+
+    if (status != SQLITE_OK)
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to enable auto vacuum. errno: %d, desc: %s",
+                   status, sqlite3_errmsg (self->db));
   }
 
-  sqlite3_finalize (stmt);
+  return TRUE;
 }
 
-static int
-add_file_info (ChattyHistory *self,
-               ChattyFile    *file)
+/*
+ * Move up to HISTORY_ARCHIVE_BATCH messages of the first thread
+ * after @maintenance_thread_id that are out of its hot window to
+ * the archive.  A message is out of the window if it's older than
+ * both @hot_days and the @hot_messages latest messages, counting
+ * only the limits set.  Unread messages and the last message of a
+ * thread are never moved, so that the chat list and unread counts
+ * only need the main database.  Threads never marked read have no
+ * unread messages.
+ *
+ * Returns: %TRUE if every thread has been archived
+ */
+static gboolean
+history_archive_messages (ChattyHistory  *self,
+                          GError        **error)
 {
   sqlite3_stmt *stmt;
-  const char *mime_type;
-  gsize file_size;
-  ChattyFileStatus file_status;
-  int file_id = 0, mime_id = 0;
-  int status;
-
-  g_assert (CHATTY_IS_HISTORY (self));
-
-  if (!file)
-    return 0;
+  int thread_id = 0, last_read_id = 0, last_message_id = 0;
+  int bound_time = INT_MAX, bound_id = INT_MAX, cutoff = INT_MAX;
+  int status, moved = 0;
 
-  mime_type = chatty_file_get_mime_type (file);
-  file_size = chatty_file_get_size (file);
-  file_status = chatty_file_get_status (file);
+  if (!self->hot_days && !self->hot_messages)
+    return TRUE;
 
-  if (mime_type) {
-    sqlite3_prepare_v2 (self->db,
-                        "INSERT OR IGNORE INTO mime_type(name) VALUES(?)",
-                        -1, &stmt, NULL);
-    history_bind_text (stmt, 1, mime_type, "binding when getting timestamp");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+  stmt = history_prepare (self,
+                          "SELECT threads.id,"
+                          "coalesce(threads.last_read_id,thread_summary.last_message_id),"
+                          "thread_summary.last_message_id "
+                          "FROM threads "
+                          "LEFT JOIN thread_summary ON thread_summary.thread_id=threads.id "
+                          "WHERE threads.id>? ORDER BY threads.id LIMIT 1;");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
+  history_bind_int (stmt, 1, self->maintenance_thread_id, "binding when getting thread to archive");
 
-    sqlite3_prepare_v2 (self->db, "SELECT id FROM mime_type WHERE name=?" ,
-                        -1, &stmt, NULL);
-    history_bind_text (stmt, 1, mime_type, "binding when getting timestamp");
-    if (sqlite3_step (stmt) == SQLITE_ROW)
-      mime_id = sqlite3_column_int (stmt, 0);
-    sqlite3_finalize (stmt);
+  if (sqlite3_step (stmt) == SQLITE_ROW) {
+    thread_id = sqlite3_column_int (stmt, 0);
+    last_read_id = sqlite3_column_int (stmt, 1);
+    last_message_id = sqlite3_column_int (stmt, 2);
   }
+  history_reset (stmt);
 
-  if (file_status == CHATTY_FILE_DOWNLOADED)
-    status = FILE_STATUS_DOWNLOADED;
-  else if (file_status == CHATTY_FILE_DECRYPT_FAILED)
-    status = FILE_STATUS_DECRYPT_FAILED;
-  else if (file_status == CHATTY_FILE_MISSING)
-    status = FILE_STATUS_MISSING;
-  else
-    status = 0;
-
-  sqlite3_prepare_v2 (self->db, "SELECT id FROM files WHERE url=?", -1, &stmt, NULL);
-  history_bind_text (stmt, 1, chatty_file_get_url (file), "binding when getting file");
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    file_id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  if (!thread_id)
+    return TRUE;
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT INTO files(name,url,path,mime_type_id,size,status) "
-                      "VALUES(?1,?2,?3,?4,?5,?6) "
-                      "ON CONFLICT(url) DO UPDATE SET path=?3, size=?5, status=?6",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, chatty_file_get_name (file), "binding when adding file");
-  history_bind_text (stmt, 2, chatty_file_get_url (file), "binding when adding file");
-  history_bind_text (stmt, 3, chatty_file_get_path (file), "binding when adding file");
-  if (mime_id)
-    history_bind_int (stmt, 4, mime_id, "binding when adding file");
-  if (file_size)
-    history_bind_int (stmt, 5, file_size, "binding when adding file");
-  if (status)
-    history_bind_int (stmt, 6, status, "binding when adding file");
-  sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  if (self->hot_messages) {
+    /* The latest message out of the window, if the thread has that many */
+    stmt = history_prepare (self,
+                            "SELECT time,id FROM messages "
+                            "WHERE thread_id=? "
+                            "ORDER BY time DESC, id DESC LIMIT 1 OFFSET ?;");
+    if (history_prepare_failed (self, stmt, error))
+      return TRUE;
+    history_bind_int (stmt, 1, thread_id, "binding when getting archive bound");
+    history_bind_int (stmt, 2, self->hot_messages, "binding when getting archive bound");
 
-  if (file_id)
-    return file_id;
+    status = sqlite3_step (stmt);
 
-  file_id = sqlite3_last_insert_rowid (self->db);
+    if (status == SQLITE_ROW) {
+      bound_time = sqlite3_column_int (stmt, 0);
+      bound_id = sqlite3_column_int (stmt, 1);
+    }
+    history_reset (stmt);
 
-  if (chatty_file_get_width (file) ||
-      chatty_file_get_height (file) ||
-      chatty_file_get_duration (file)) {
-    gsize width, height, duration;
+    /* Every message of the thread is within the window */
+    if (status != SQLITE_ROW) {
+      self->maintenance_thread_id = thread_id;
+      return FALSE;
+    }
+  }
 
-    width = chatty_file_get_width (file);
-    height = chatty_file_get_height (file);
-    duration = chatty_file_get_duration (file);
+  if (self->hot_days)
+    cutoff = time (NULL) - (time_t)self->hot_days * 24 * 60 * 60;
 
-    sqlite3_prepare_v2 (self->db,
-                        "INSERT INTO file_metadata(file_id,width,height,duration) "
-                        "VALUES(?1,?2,?3,?4)",
-                        -1, &stmt, NULL);
+  /* Don't move messages one by one outside of a transaction */
+  status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if (status != SQLITE_OK) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to begin archiving messages. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (self->db));
+    return TRUE;
+  }
 
-    history_bind_int (stmt, 1, file_id, "binding when adding media");
+  stmt = history_prepare (self,
+                          "INSERT INTO temp.archive_ids(id) "
+                          "SELECT id FROM messages "
+                          "WHERE thread_id=?1 AND (time<?2 OR (time=?2 AND id<=?3)) AND time<?4 "
+                          "AND id<?5 AND id!=?6 "
+                          "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status IS NULL) "
+                          "ORDER BY time, id LIMIT ?7;");
+  if (history_prepare_failed (self, stmt, error)) {
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    return TRUE;
+  }
+  history_bind_int (stmt, 1, thread_id, "binding when archiving messages");
+  history_bind_int (stmt, 2, bound_time, "binding when archiving messages");
+  history_bind_int (stmt, 3, bound_id, "binding when archiving messages");
+  history_bind_int (stmt, 4, cutoff, "binding when archiving messages");
+  history_bind_int (stmt, 5, last_read_id, "binding when archiving messages");
+  history_bind_int (stmt, 6, last_message_id, "binding when archiving messages");
+  history_bind_int (stmt, 7, HISTORY_ARCHIVE_BATCH, "binding when archiving messages");
+  status = sqlite3_step (stmt);
+  history_reset (stmt);
 
-    if (width)
-      history_bind_int (stmt, 2, width, "binding when adding media");
-    if (height)
-      history_bind_int (stmt, 3, height, "binding when adding media");
-    if (duration)
-      history_bind_int (stmt, 4, duration, "binding when adding media");
+  if (status == SQLITE_DONE) {
+    moved = sqlite3_changes (self->db);
+    /*
+     * Deleting the messages deletes their message_files and mm_messages
+     * rows by cascade, and their messages_fts rows by trigger.  The
+     * archive has its own messages_fts, indexed by trigger as well.
+     */
+    status = sqlite3_exec (self->db,
+                           "INSERT OR IGNORE INTO archive.messages"
+                           "(id,uid,thread_id,sender_id,user_alias,body,body_type,direction,"
+                           "time,status,encrypted,preview_id,subject) "
+                           "SELECT id,uid,thread_id,sender_id,user_alias,body,body_type,direction,"
+                           "time,status,encrypted,preview_id,subject "
+                           "FROM main.messages WHERE id IN temp.archive_ids;"
+
+                           "INSERT OR IGNORE INTO archive.mm_messages"
+                           "(id,message_id,account_id,protocol,smsc,time_sent,validity,reference_number) "
+                           "SELECT id,message_id,account_id,protocol,smsc,time_sent,validity,reference_number "
+                           "FROM main.mm_messages WHERE message_id IN temp.archive_ids;"
+
+                           "INSERT OR IGNORE INTO archive.message_files(id,message_id,file_id,preview_id) "
+                           "SELECT id,message_id,file_id,preview_id "
+                           "FROM main.message_files WHERE message_id IN temp.archive_ids;"
+
+                           "DELETE FROM main.messages WHERE id IN temp.archive_ids;"
+                           "DELETE FROM temp.archive_ids;",
+                           NULL, NULL, NULL);
+  }
 
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+  if (status == SQLITE_OK || status == SQLITE_DONE) {
+    sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+    /* Messages moved are older than both bounds */
+    if (moved)
+      self->archive_max_time = MAX (self->archive_max_time, MIN (bound_time, cutoff));
+  } else {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to archive messages. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (self->db));
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    return TRUE;
   }
 
-  return file_id;
+  if (moved)
+    g_debug ("Archived %d messages of thread %d", moved, thread_id);
+
+  /* Stay on the thread if there may be more to move */
+  if (moved < HISTORY_ARCHIVE_BATCH)
+    self->maintenance_thread_id = thread_id;
+
+  return FALSE;
 }
 
+/* Delete the local copy of a file, @path is relative to the data dir */
 static void
-history_add_files (ChattyHistory *self,
-                   ChattyMessage *message,
-                   int            message_id)
+history_delete_local_file (ChattyHistory *self,
+                           const char    *path)
 {
-  GList *files;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  sqlite3_stmt *stmt;
+  gboolean shared;
 
-  if (!CHATTY_IS_MESSAGE (message) || !message_id)
+  /* Never delete anything outside of our directory */
+  if (!path || !*path || g_path_is_absolute (path) || strstr (path, ".."))
     return;
 
-  files = chatty_message_get_files (message);
+  /* Some other files row may have the same local copy */
+  stmt = history_prepare (self, "SELECT 1 FROM files WHERE path=? LIMIT 1;");
+  if (!stmt)
+    return;
+  history_bind_text (stmt, 1, path, "binding when getting file path");
+  shared = sqlite3_step (stmt) == SQLITE_ROW;
+  history_reset (stmt);
 
-  for (GList *file = files; file; file = file->next) {
-    sqlite3_stmt *stmt;
-    int file_id;
+  if (shared)
+    return;
 
-    file_id = add_file_info (self, file->data);
+  file = g_file_new_build_filename (g_get_user_data_dir (), "chatty", path, NULL);
+  g_file_delete (file, NULL, &error);
 
-    if (!file_id)
-      continue;
+  if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_warning ("Deleting file failed: %s", error->message);
+}
+
+/*
+ * Delete up to HISTORY_ORPHAN_FILES_BATCH files rows after
+ * @maintenance_file_id that nothing refers to, along with their
+ * local copy, if any.  Deleting a message keeps its files, as
+ * other messages may share them.
+ *
+ * Returns: %TRUE if every files row has been checked
+ */
+static gboolean
+history_delete_orphan_files (ChattyHistory  *self,
+                             GError        **error)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  sqlite3_stmt *stmt;
+  int last_id = 0;
+  int status;
+
+  stmt = history_prepare (self,
+                          "SELECT MAX(id) FROM ("
+                          "SELECT id FROM files WHERE id>? ORDER BY id LIMIT ?);");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
+  history_bind_int (stmt, 1, self->maintenance_file_id, "binding when getting files");
+  history_bind_int (stmt, 2, HISTORY_ORPHAN_FILES_BATCH, "binding when getting files");
 
-    sqlite3_prepare_v2 (self->db,
-                        "INSERT OR IGNORE INTO message_files(message_id,file_id) "
-                        "VALUES(?1,?2)",
-                        -1, &stmt, NULL);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    last_id = sqlite3_column_int (stmt, 0);
+  history_reset (stmt);
 
-    history_bind_int (stmt, 1, message_id, "binding when adding message file");
-    history_bind_int (stmt, 2, file_id, "binding when adding message file");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+  /* No files left to check */
+  if (!last_id)
+    return TRUE;
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+  stmt = history_prepare (self,
+                          "SELECT path FROM files WHERE id>? AND id<=? AND path IS NOT NULL "
+                          "AND " HISTORY_ORPHAN_FILES_CONDITION ";");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
+  history_bind_int (stmt, 1, self->maintenance_file_id, "binding when getting orphan files");
+  history_bind_int (stmt, 2, last_id, "binding when getting orphan files");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    g_ptr_array_add (paths, g_strdup ((const char *)sqlite3_column_text (stmt, 0)));
+  history_reset (stmt);
+
+  stmt = history_prepare (self,
+                          "DELETE FROM files WHERE id>? AND id<=? "
+                          "AND " HISTORY_ORPHAN_FILES_CONDITION ";");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
+  history_bind_int (stmt, 1, self->maintenance_file_id, "binding when deleting files");
+  history_bind_int (stmt, 2, last_id, "binding when deleting files");
+  status = sqlite3_step (stmt);
+  history_reset (stmt);
+
+  if (status != SQLITE_DONE) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to delete files. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (self->db));
+    return TRUE;
   }
+
+  if (sqlite3_changes (self->db))
+    g_debug ("Deleted %d unused files", sqlite3_changes (self->db));
+
+  /* Only once the rows are gone, a file kept on error is just left over */
+  for (guint i = 0; i < paths->len; i++)
+    history_delete_local_file (self, paths->pdata[i]);
+
+  self->maintenance_file_id = last_id;
+
+  return FALSE;
 }
 
-static int
-get_chat_draft_id (ChattyHistory *self,
-                   int            thread_id)
+/*
+ * Free pages one at a time until @deadline.  Each step of the
+ * pragma frees a page, and the pages freed so far are committed
+ * when the statement is reset.
+ *
+ * Returns: %TRUE if there are no free pages left
+ */
+static gboolean
+history_incremental_vacuum (ChattyHistory  *self,
+                            gint64          deadline,
+                            GError        **error)
 {
-  int message_id = 0;
   sqlite3_stmt *stmt;
+  int status;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (thread_id);
+  stmt = history_prepare (self, "PRAGMA incremental_vacuum;");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT messages.id FROM messages "
-                      "WHERE thread_id=? AND status=" STRING(MESSAGE_STATUS_DRAFT),
-                      -1, &stmt, NULL);
-  history_bind_int (stmt, 1, thread_id, "binding when getting draft message");
+  do
+    status = sqlite3_step (stmt);
+  while (status == SQLITE_ROW && g_get_monotonic_time () < deadline);
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    message_id = sqlite3_column_int (stmt, 0);
+  history_reset (stmt);
 
-  sqlite3_finalize (stmt);
+  if (status != SQLITE_ROW && status != SQLITE_DONE)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to vacuum. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (self->db));
 
-  return message_id;
+  return status != SQLITE_ROW;
 }
 
-static void
-history_add_message (ChattyHistory *self,
-                     GTask         *task)
+static gboolean
+history_optimize (ChattyHistory  *self,
+                  GError        **error)
 {
-  ChattyMessage *message;
-  ChattyChat *chat;
   sqlite3_stmt *stmt;
-  const char *who, *uid, *msg, *alias;
-  ChattyMsgDirection direction;
-  ChattyMsgType type;
-  int thread_id = 0, sender_id = 0;
-  int status, msg_status, dir;
-  time_t time_stamp;
+  gboolean analyzed;
+  int status;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  /* 'PRAGMA optimize' only updates statistics, so ANALYZE once first */
+  stmt = history_prepare (self, "SELECT 1 FROM sqlite_master WHERE name='sqlite_stat1';");
+  if (history_prepare_failed (self, stmt, error))
+    return TRUE;
+  analyzed = sqlite3_step (stmt) == SQLITE_ROW;
+  history_reset (stmt);
+
+  /* analysis_limit keeps ANALYZE from reading whole indexes */
+  if (analyzed)
+    status = sqlite3_exec (self->db,
+                           "PRAGMA analysis_limit = " STRING (HISTORY_ANALYSIS_LIMIT) ";"
+                           "PRAGMA optimize;",
+                           NULL, NULL, NULL);
+  else
+    status = sqlite3_exec (self->db,
+                           "PRAGMA analysis_limit = " STRING (HISTORY_ANALYSIS_LIMIT) ";"
+                           "ANALYZE;",
+                           NULL, NULL, NULL);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
-  }
+  if (status != SQLITE_OK)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to optimize. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (self->db));
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  message = g_object_get_data (G_OBJECT (task), "message");
-  g_assert (CHATTY_IS_CHAT (chat));
-  g_assert (CHATTY_IS_MESSAGE (message));
+  return TRUE;
+}
 
-  who = chatty_message_get_user_name (message);
-  uid = chatty_message_get_uid (message);
-  msg = chatty_message_get_text (message);
-  time_stamp = chatty_message_get_time (message);
-  direction = chatty_message_get_msg_direction (message);
-  dir = history_direction_to_value (direction);
-  type = chatty_message_get_msg_type (message);
-  alias = chatty_message_get_user_alias (message);
-  msg_status = history_msg_status_to_value (chatty_message_get_status (message));
+/*
+ * history_maintain:
+ * @self: a #ChattyHistory
+ *
+ * Run maintenance on the database for at most
+ * HISTORY_MAINTENANCE_SLICE.  A maintenance run starts only if
+ * the database changed since the last one, and goes through every
+ * HistoryMaintenance step, which can take several slices.
+ *
+ * Returns: %TRUE if the maintenance run isn't complete
+ */
+static gboolean
+history_maintain (ChattyHistory *self)
+{
+  gint64 deadline;
 
-  if (direction == CHATTY_DIRECTION_OUT)
-    who = chatty_item_get_username (CHATTY_ITEM (chat));
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
 
-  if ((!who || !*who) && direction == CHATTY_DIRECTION_IN && chatty_chat_is_im (chat))
-    who = chatty_chat_get_chat_name (chat);
+  if (!self->db)
+    return FALSE;
 
-  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-  thread_id = insert_or_ignore_thread (self, chat, task);
-  if (!thread_id) {
-    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-    return;
+  if (self->maintenance == HISTORY_MAINTENANCE_NONE) {
+    if (sqlite3_total_changes (self->db) == self->maintenance_changes &&
+        !self->auto_vacuum_pending)
+      return FALSE;
+
+    self->maintenance = HISTORY_MAINTENANCE_ARCHIVE;
+    self->maintenance_thread_id = 0;
+    self->maintenance_file_id = 0;
   }
 
-  sender_id = insert_or_ignore_user (self, chatty_item_get_protocols (CHATTY_ITEM (chat)), who, alias, task);
+  deadline = g_get_monotonic_time () + HISTORY_MAINTENANCE_SLICE;
 
-  if (direction == CHATTY_DIRECTION_OUT &&
-      msg_status == MESSAGE_STATUS_DRAFT) {
-    int message_id = 0;
+  while (self->maintenance != HISTORY_MAINTENANCE_NONE &&
+         g_get_monotonic_time () < deadline) {
+    g_autoptr(GError) error = NULL;
+    gboolean done = FALSE;
 
-    if (!msg) {
-      sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-      g_task_return_boolean (task, TRUE);
-      return;
-    }
+    switch (self->maintenance) {
+    case HISTORY_MAINTENANCE_ARCHIVE:
+      done = history_archive_messages (self, &error);
+      break;
 
-    message_id = get_chat_draft_id (self, thread_id);
+    case HISTORY_MAINTENANCE_FILES:
+      done = history_delete_orphan_files (self, &error);
+      break;
 
-    if (message_id) {
-      sqlite3_prepare_v2 (self->db,
-                          "UPDATE messages SET body=?1 "
-                          "WHERE messages.id=?2",
-                          -1, &stmt, NULL);
-      history_bind_text (stmt, 1, msg, "binding when adding draft message");
-      history_bind_int (stmt, 2, message_id, "binding when adding draft message");
-    } else {
-      sqlite3_prepare_v2 (self->db,
-                          /*                     ?1    ?2      ?3     ?4        ?5      ?6    ?7 */
-                          "INSERT INTO messages(uid,thread_id,body,body_type,direction,time,status) "
-                          "VALUES(?1,?2,?3,?4,?5,?6," STRING(MESSAGE_STATUS_DRAFT) ") ",
-                          -1, &stmt, NULL);
-      history_bind_text (stmt, 1, uid, "binding when adding draft message");
-      history_bind_int (stmt, 2, thread_id, "binding when adding draft message");
-      history_bind_text (stmt, 3, msg, "binding when adding draft message");
-      history_bind_int (stmt, 4, history_message_type_to_value (type), "binding when adding draft message");
-      history_bind_int (stmt, 5, dir, "binding when adding draft message");
-      history_bind_int (stmt, 6, time_stamp, "binding when adding draft message");
-    }
+    case HISTORY_MAINTENANCE_AUTO_VACUUM:
+      done = history_enable_auto_vacuum (self, &error);
+      break;
 
-    status = sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
-    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+    case HISTORY_MAINTENANCE_VACUUM:
+      done = history_incremental_vacuum (self, deadline, &error);
+      break;
 
-    if (status == SQLITE_DONE)
-      g_task_return_boolean (task, TRUE);
-    else
-      g_task_return_new_error (task,
-                               G_IO_ERROR, G_IO_ERROR_FAILED,
-                               "Failed to save message. errno: %d, desc: %s",
-                               status, sqlite3_errmsg (self->db));
-    return;
-  }
+    case HISTORY_MAINTENANCE_OPTIMIZE:
+      done = history_optimize (self, &error);
+      break;
 
-  if (sender_id && direction == CHATTY_DIRECTION_IN) {
-    sqlite3_prepare_v2 (self->db,
-                        "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                        "VALUES(?1,?2)",
-                        -1, &stmt, NULL);
-    history_bind_int (stmt, 1, thread_id, "binding when adding thread member");
-    history_bind_int (stmt, 2, sender_id, "binding when adding thread member");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
-  }
+    case HISTORY_MAINTENANCE_NONE:
+    default:
+      g_assert_not_reached ();
+    }
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT INTO messages(uid,thread_id,sender_id,body,body_type,direction,time,preview_id,encrypted,status,subject) "
-                      "VALUES(?1,?2,?3,?4,"
-                      "?5,?6,?7,?9,?10,?11,?12) "
-                      "ON CONFLICT (uid,thread_id,body,time) DO UPDATE "
-                      "SET status=?11",
-                      -1, &stmt, NULL);
+    if (error)
+      g_warning ("Database maintenance failed: %s", error->message);
+
+    /* On error, give up until the database changes again */
+    if (error || (done && self->maintenance == HISTORY_MAINTENANCE_OPTIMIZE)) {
+      self->maintenance = HISTORY_MAINTENANCE_NONE;
+      /* Includes the changes of this run, so that it doesn't start over */
+      self->maintenance_changes = sqlite3_total_changes (self->db);
+      /* Pages moved by the vacuum don't count as changes, checkpoint anyway */
+      self->checkpoint_changes = -1;
+    } else if (done) {
+      self->maintenance++;
+    }
+  }
 
-  history_bind_text (stmt, 1, uid, "binding when adding message");
-  history_bind_int (stmt, 2, thread_id, "binding when adding message");
-  if (sender_id)
-    history_bind_int (stmt, 3, sender_id, "binding when adding message");
-  history_bind_text (stmt, 4, msg, "binding when adding message");
-  history_bind_int (stmt, 5, history_message_type_to_value (type),
-                    "binding when adding message");
-  history_bind_int (stmt, 6, dir, "binding when adding message");
-  history_bind_int (stmt, 7, time_stamp, "binding when adding message");
-  history_bind_int (stmt, 10, chatty_message_get_encrypted (message),
-                    "binding when adding message");
-  if (msg_status != MESSAGE_STATUS_UNKNOWN)
-    history_bind_int (stmt, 11, msg_status, "binding when adding message");
-  history_bind_text (stmt, 12, chatty_message_get_subject (message), "binding when adding message");
+  return self->maintenance != HISTORY_MAINTENANCE_NONE;
+}
 
-  status = sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+static void
+history_reader_quit (ChattyHistory *self,
+                     GTask         *task)
+{
+  g_task_return_boolean (task, TRUE);
+}
 
-  /* We can't use last_row_id as we may ignore the last insert */
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT messages.id FROM messages "
-                      "WHERE messages.uid=?;",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, uid, "binding when getting message id");
-  status = sqlite3_step (stmt);
+/* Wait until the writes queued before @task are done, but bulk writes */
+static void
+history_reader_wait_for_writes (ChattyHistory *self,
+                                GTask         *task)
+{
+  guint barrier;
 
-  if (status == SQLITE_ROW)
-    history_add_files (self, message, sqlite3_column_int (stmt, 0));
-  sqlite3_finalize (stmt);
-  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+  barrier = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "barrier"));
 
-  if (status == SQLITE_DONE || status == SQLITE_ROW)
-    g_task_return_boolean (task, TRUE);
-  else
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to save message. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (self->db));
+  if (barrier)
+    history_queue_wait (self->queue, barrier, HISTORY_PRIORITY_WRITE);
 }
 
-static GPtrArray *
-get_sms_thread_members (ChattyHistory *self,
-                        int            thread_id)
+static gpointer
+history_reader_worker (gpointer user_data)
 {
-  GPtrArray *members = NULL;
-  sqlite3_stmt *stmt;
+  HistoryReader *reader = user_data;
+  ChattyHistory *self = reader->history;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (g_thread_self () == self->worker_thread);
 
-  sqlite3_prepare_v2 (self->db, "SELECT username,alias FROM users "
-                      "INNER JOIN thread_members "
-                      "ON thread_id=? AND user_id=users.id "
-                      "WHERE users.username != 'SMS' AND users.username != 'MMS'",
-                      -1, &stmt, NULL);
-  history_bind_int (stmt, 1, thread_id, "binding when getting thread members");
+  g_private_set (&current_reader, reader);
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    ChattyMmBuddy *buddy;
-    const char *name, *alias;
+  do {
+    ChattyCallback callback;
+    g_autoptr(GTask) task = NULL;
 
-    if (!members)
-      members = g_ptr_array_new_full (30, g_object_unref);
+    task = history_queue_pop (self->read_queue, -1);
+    callback = g_task_get_task_data (task);
 
-    name = (const char *)sqlite3_column_text (stmt, 0);
-    alias = (const char *)sqlite3_column_text (stmt, 1);
+    history_reader_wait_for_writes (self, task);
+    callback (self, task);
+    history_queue_task_done (self->read_queue);
 
-    buddy = chatty_mm_buddy_new (name, alias);
-    g_ptr_array_insert (members, 0, buddy);
-  }
+    if (callback == history_reader_quit)
+      break;
+  } while (TRUE);
 
-  sqlite3_finalize (stmt);
+  g_clear_pointer (&reader->statements, g_hash_table_unref);
+  sqlite3_close (reader->db);
+  g_private_set (&current_reader, NULL);
 
-  return members;
+  return NULL;
 }
 
-static guint
-get_unread_message_count (ChattyHistory *self,
-                          int            thread_id)
+/* Attach the archive database at @path to @db as "archive" */
+static int
+history_attach_archive (sqlite3    *db,
+                        const char *path)
 {
   sqlite3_stmt *stmt;
-  guint unread_count = 0;
+  int status;
 
-  g_assert (CHATTY_IS_HISTORY (self));
+  status = sqlite3_prepare_v2 (db, "ATTACH DATABASE ? AS archive;", -1, &stmt, NULL);
 
-  if (!thread_id)
-    return 0;
+  if (status == SQLITE_OK) {
+    history_bind_text (stmt, 1, path, "binding when attaching archive");
+    status = sqlite3_step (stmt);
+  }
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT COUNT(*) FROM messages "
-                      "INNER JOIN threads "
-                      /* We consider the message with last_read_id to be unread */
-                      "ON messages.thread_id=threads.id AND messages.id >= threads.last_read_id  "
-                      "WHERE messages.thread_id=? ",
-                      -1, &stmt, NULL);
-  history_bind_int (stmt, 1, thread_id, "binding when getting unread message count");
+  sqlite3_finalize (stmt);
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    unread_count = sqlite3_column_int (stmt, 0);
+  return status == SQLITE_DONE ? SQLITE_OK : status;
+}
+
+/* Whether the archive has messages_fts, which older archives don't */
+static gboolean
+history_archive_has_index (ChattyHistory *self)
+{
+  sqlite3_stmt *stmt;
+  gboolean indexed;
 
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT 1 FROM archive.sqlite_master WHERE name='messages_fts';",
+                      -1, &stmt, NULL);
+  indexed = sqlite3_step (stmt) == SQLITE_ROW;
   sqlite3_finalize (stmt);
 
-  return unread_count;
+  return indexed;
 }
 
-static void
-history_get_chats (ChattyHistory *self,
-                   GTask         *task)
+static int
+history_load_archive_max_time (ChattyHistory *self)
 {
-  GPtrArray *threads = NULL;
-  ChattyAccount *account;
   sqlite3_stmt *stmt;
-  const char *user_id;
+  int status;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  status = sqlite3_prepare_v2 (self->db, "SELECT max(time) FROM archive.messages;", -1, &stmt, NULL);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
+  if (status == SQLITE_OK) {
+    status = sqlite3_step (stmt);
+    /* 0 if the archive is empty */
+    self->archive_max_time = sqlite3_column_int (stmt, 0);
+  }
+
+  sqlite3_finalize (stmt);
+
+  return status == SQLITE_ROW ? SQLITE_OK : status;
+}
+
+static void
+history_open_readers (ChattyHistory *self)
+{
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  /* Without WAL, readers and the writer would block each other */
+  if (!self->wal_enabled)
+    return;
+
+  for (guint i = 0; i < HISTORY_READERS; i++) {
+    HistoryReader *reader;
+    sqlite3 *db;
+    int status;
+
+    status = sqlite3_open_v2 (self->db_path, &db, SQLITE_OPEN_READONLY, NULL);
+
+    if (status == SQLITE_OK)
+      status = history_attach_archive (db, self->archive_path);
+
+    if (status != SQLITE_OK) {
+      g_warning ("Failed to open read-only database. errno: %d, desc: %s",
+                 status, sqlite3_errmsg (db));
+      sqlite3_close (db);
+      break;
+    }
+
+    sqlite3_exec (db, HISTORY_CONNECTION_PRAGMAS HISTORY_ARCHIVE_PRAGMAS, NULL, NULL, NULL);
+
+    reader = g_new0 (HistoryReader, 1);
+    reader->history = self;
+    reader->db = db;
+    reader->statements = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                (GDestroyNotify)sqlite3_finalize);
+    reader->thread = g_thread_new ("chatty-history-reader",
+                                   history_reader_worker,
+                                   reader);
+    g_ptr_array_add (self->readers, reader);
+  }
+
+  g_debug ("Started %u history readers", self->readers->len);
+
+  if (self->readers->len)
+    g_atomic_int_set (&self->readers_active, TRUE);
+}
+
+static void
+history_close_readers (ChattyHistory *self)
+{
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  /* Route new tasks to the worker thread, which is closing */
+  g_atomic_int_set (&self->readers_active, FALSE);
+
+  /* Reads waiting for writes queued after close won't get them */
+  history_queue_close (self->queue);
+
+  /* Each reader exits on the first quit task it gets, after the pending reads */
+  for (guint i = 0; i < self->readers->len; i++) {
+    GTask *task;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    g_task_set_task_data (task, history_reader_quit, NULL);
+    history_queue_push (self->read_queue, task, HISTORY_PRIORITY_IDLE);
+  }
+
+  for (guint i = 0; i < self->readers->len; i++) {
+    HistoryReader *reader = self->readers->pdata[i];
+
+    g_thread_join (reader->thread);
+  }
+
+  g_ptr_array_set_size (self->readers, 0);
+}
+
+static void
+history_open_db (ChattyHistory *self,
+                 GTask         *task)
+{
+  const char *dir, *file_name;
+  sqlite3 *db;
+  int status;
+  gboolean db_exists;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (!self->db);
+
+  dir = g_object_get_data (G_OBJECT (task), "dir");
+  file_name = g_object_get_data (G_OBJECT (task), "file-name");
+  g_assert (dir && *dir);
+  g_assert (file_name && *file_name);
+
+  g_mkdir_with_parents (dir, S_IRWXU);
+  self->db_path = g_build_filename (dir, file_name, NULL);
+
+  /* chatty-history.db is archived to chatty-history-archive.db */
+  if (g_str_has_suffix (self->db_path, ".db"))
+    self->archive_path = g_strdup_printf ("%.*s-archive.db",
+                                          (int)strlen (self->db_path) - 3, self->db_path);
+  else
+    self->archive_path = g_strconcat (self->db_path, "-archive", NULL);
+
+  self->hot_days = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "hot-days"));
+  self->hot_messages = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "hot-messages"));
+
+  db_exists = g_file_test (self->db_path, G_FILE_TEST_EXISTS);
+  status = sqlite3_open (self->db_path, &db);
+
+  if (status == SQLITE_OK) {
+    self->db = db;
+
+    /*
+     * If the last session didn't exit cleanly, some changes may still
+     * be in the WAL file.  Move them to the database file so that
+     * the backup taken before migrations is complete.
+     */
+    if (db_exists)
+      sqlite3_wal_checkpoint_v2 (self->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+
+    sqlite3_exec (self->db, "PRAGMA foreign_keys = OFF;", NULL, NULL, NULL);
+    sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    if (db_exists) {
+      if (!chatty_history_migrate (self, task)) {
+        sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+        return;
+      }
+    } else {
+      if (!chatty_history_create_schema (self, task)) {
+        sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+        return;
+      }
+    }
+
+    sqlite3_exec (self->db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
+    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+    /* Migrations may have deleted users and accounts looked up before */
+    history_ids_clear (self);
+
+    history_check_auto_vacuum (self);
+
+    /* ATTACH can't be run within a transaction either */
+    status = history_attach_archive (self->db, self->archive_path);
+
+    if (status == SQLITE_OK) {
+      gboolean indexed;
+
+      indexed = history_archive_has_index (self);
+      status = sqlite3_exec (self->db, HISTORY_ARCHIVE_SCHEMA, NULL, NULL, NULL);
+
+      /* Index the messages archived before the index was created */
+      if (status == SQLITE_OK && !indexed)
+        status = sqlite3_exec (self->db,
+                               "INSERT INTO archive.messages_fts(messages_fts) VALUES('rebuild');",
+                               NULL, NULL, NULL);
+    }
+
+    if (status == SQLITE_OK)
+      status = history_load_archive_max_time (self);
+
+    if (status != SQLITE_OK) {
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_FAILED,
+                               "Couldn't open archive. errno: %d, desc: %s",
+                               status, sqlite3_errmsg (self->db));
+      sqlite3_close (g_steal_pointer (&self->db));
+      return;
+    }
+
+    /* journal_mode can't be changed from within a transaction */
+    history_set_durability (self, g_object_get_data (G_OBJECT (task), "durability"));
+    history_open_readers (self);
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_boolean (task, FALSE);
+  }
+}
+
+static void
+history_close_db (ChattyHistory *self,
+                  GTask         *task)
+{
+  sqlite3 *db;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  history_close_readers (self);
+
+  g_debug ("Statement cache: %u hits, %u misses",
+           g_atomic_int_get (&self->statement_hits),
+           g_atomic_int_get (&self->statement_misses));
+  /* Cached statements have to be finalized for the db to close */
+  g_hash_table_remove_all (self->statements);
+  history_ids_log_stats (self);
+  history_ids_clear (self);
+
+  db = self->db;
+  status = sqlite3_close (db);
+  self->db = NULL;
+
+  if (status == SQLITE_OK) {
+    /*
+     * We can’t know when @self associated with the task will
+     * be unref'ed.  So chatty_history_get_default() called immediately
+     * after this may return the @self that is yet to be finalized. But
+     * as the worker_thread is exited after closing the database, any
+     * actions with the same @self will not execute, and so the tasks
+     * will take ∞ time to complete.
+     *
+     * Hence invalidate the @self's ref to this task:
+     */
+    g_clear_pointer (&self->worker_thread, g_thread_unref);
+    g_debug ("Database closed successfully");
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Database could not be closed. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (db));
+  }
+}
+
+/*
+ * Create a file from the columns url, path, files.name, size,
+ * status, width, height, duration and mime_type.name of @stmt,
+ * in that order, starting at @first_column.
+ */
+static ChattyFile *
+history_file_new_from_stmt (sqlite3_stmt *stmt,
+                            int           first_column)
+{
+  ChattyFile *file;
+  int i = first_column;
+
+  file = chatty_file_new_full ((const char *)sqlite3_column_text (stmt, i + 2),
+                               (const char *)sqlite3_column_text (stmt, i + 0),
+                               (const char *)sqlite3_column_text (stmt, i + 1),
+                               (const char *)sqlite3_column_text (stmt, i + 8),
+                               sqlite3_column_int (stmt, i + 3),
+                               sqlite3_column_int (stmt, i + 5),
+                               sqlite3_column_int (stmt, i + 6),
+                               sqlite3_column_int (stmt, i + 7));
+  chatty_file_set_status (file, sqlite3_column_int (stmt, i + 4));
+
+  return file;
+}
+
+/*
+ * Get the (time, id) of @start in @thread_id, which is the keyset
+ * cursor for the page of messages before @start.  If @start isn't
+ * in the database nor in the archive, every message up to its time
+ * is before it.
+ *
+ * Returns: %FALSE on error, with @error set
+ */
+static gboolean
+get_message_cursor (ChattyHistory  *self,
+                    ChattyMessage  *start,
+                    int             thread_id,
+                    int            *time_stamp,
+                    int            *message_id,
+                    GError        **error)
+{
+  sqlite3_stmt *stmt;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (CHATTY_IS_MESSAGE (start));
+  g_assert (history_in_worker (self));
+
+  *time_stamp = chatty_message_get_time (start);
+  *message_id = INT_MAX;
+
+  stmt = history_prepare (self,
+                          "SELECT time,id FROM messages "
+                          "WHERE uid=?1 AND thread_id=?2 "
+                          "UNION ALL "
+                          "SELECT time,id FROM archive.messages "
+                          "WHERE uid=?1 AND thread_id=?2 LIMIT 1;");
+  if (history_prepare_failed (self, stmt, error))
+    return FALSE;
+  history_bind_text (stmt, 1, chatty_message_get_uid (start), "binding when getting message cursor");
+  history_bind_int (stmt, 2, thread_id, "binding when getting message cursor");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW) {
+    *time_stamp = sqlite3_column_int (stmt, 0);
+    *message_id = sqlite3_column_int (stmt, 1);
+  }
+
+  history_reset (stmt);
+
+  return TRUE;
+}
+
+/*
+ * A page of messages of the main database or of the archive, see
+ * get_messages_before().  @schema is either "main" or "archive",
+ * the other tables are only in the main database.
+ */
+#define HISTORY_MESSAGES_PAGE_SQL(schema)                               \
+  "WITH page(id,time) AS ("                                             \
+  "SELECT * FROM (SELECT id,time FROM " schema ".messages "             \
+  "WHERE thread_id=?1 AND time=?2 AND id<?3 "                           \
+  "AND body NOT NULL "                                                  \
+  "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status is null) "  \
+  "ORDER BY id DESC LIMIT ?4) "                                         \
+  "UNION ALL "                                                          \
+  "SELECT * FROM (SELECT id,time FROM " schema ".messages "             \
+  "WHERE thread_id=?1 AND time<?2 "                                     \
+  "AND body NOT NULL "                                                  \
+  "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status is null) "  \
+  "ORDER BY time DESC, id DESC LIMIT ?4) "                              \
+  "ORDER BY time DESC, id DESC LIMIT ?4) "                              \
+  /*        0           1      2    3                 4                         5 */ \
+  "SELECT messages.time,direction,body,uid,coalesce(users.alias,users.username),body_type," \
+  /*    6            7           8               9            10             11 */ \
+  "p_files.name,p_files.url,p_files.path,p_mime_type.name,p_files.size,p_files.status," \
+  /* 12      13       14      */                                        \
+  "m.width,m.height,m.duration,"                                        \
+  /*     15            16        17 */                                  \
+  "messages.status,messages.id,subject,"                                \
+  /*        18               19        20         21         22         23 */ \
+  "message_files.file_id,files.url,files.path,files.name,files.size,files.status," \
+  /*         24                  25                  26                  27 */ \
+  "file_metadata.width,file_metadata.height,file_metadata.duration,mime_type.name " \
+  "FROM page "                                                          \
+  "INNER JOIN " schema ".messages AS messages ON messages.id=page.id "  \
+  "LEFT JOIN files AS p_files ON messages.preview_id=p_files.id "       \
+  "LEFT JOIN mime_type AS p_mime_type ON p_files.mime_type_id=p_mime_type.id " \
+  "LEFT JOIN file_metadata AS m on p_files.id=m.file_id "               \
+  "LEFT JOIN users "                                                    \
+  "ON messages.sender_id=users.id "                                     \
+  "LEFT JOIN " schema ".message_files AS message_files "                \
+  "ON message_files.message_id=messages.id "                            \
+  "LEFT JOIN files ON files.id=message_files.file_id "                  \
+  "LEFT JOIN mime_type ON mime_type.id=files.mime_type_id "             \
+  "LEFT JOIN file_metadata ON file_metadata.file_id=files.id "          \
+  "ORDER BY messages.time DESC, messages.id DESC, message_files.file_id;"
+
+/*
+ * Get @limit messages of @thread_id ordered before the keyset
+ * cursor (@before_time, @before_id).  SQLite can't seek an index
+ * to a row value, so the page is the merge of the messages at
+ * @before_time with an id before @before_id and the messages
+ * before @before_time.  The (thread_id,time) index also has the
+ * message id, so both seek straight to the cursor however many
+ * messages share its timestamp.  The attachments are loaded along,
+ * a message spans several rows if it has more than one file.
+ * The messages are read from the archive if @archived, and the
+ * id of each message is added to @ids in the same order.
+ *
+ * Returns: (transfer full) (nullable): The messages, %NULL if
+ * there are none or on error, in which case @error is set.
+ */
+static GPtrArray *
+get_messages_before (ChattyHistory *self,
+                     ChattyChat    *chat,
+                     gboolean       archived,
+                     int            thread_id,
+                     int            before_time,
+                     int            before_id,
+                     guint          limit,
+                     GArray        *ids,
+                     GError       **error)
+{
+  GPtrArray *messages = NULL;
+  ChattyMessage *message = NULL;
+  GList *files = NULL;
+  sqlite3_stmt *stmt;
+  int status, message_id = 0;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (history_in_worker (self));
+  g_assert (limit != 0);
+
+  if (archived)
+    stmt = history_prepare (self, HISTORY_MESSAGES_PAGE_SQL ("archive"));
+  else
+    stmt = history_prepare (self, HISTORY_MESSAGES_PAGE_SQL ("main"));
+
+  if (history_prepare_failed (self, stmt, error))
+    return NULL;
+
+  history_bind_int (stmt, 1, thread_id, "binding when getting messages");
+  history_bind_int (stmt, 2, before_time, "binding when getting messages");
+  history_bind_int (stmt, 3, before_id, "binding when getting messages");
+  history_bind_int (stmt, 4, limit, "binding when getting messages");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    const char *msg = NULL, *uid;
+    const char *who = NULL, *subject;
+    ChattyMsgType type;
+    guint time_stamp;
+    int direction;
+
+    /* Another attachment of the current message */
+    if (message_id && message_id == sqlite3_column_int (stmt, 16)) {
+      if (message)
+        files = g_list_append (files, history_file_new_from_stmt (stmt, 19));
+      continue;
+    }
+
+    if (message)
+      chatty_message_set_files (message, g_steal_pointer (&files));
+
+    message = NULL;
+    message_id = sqlite3_column_int (stmt, 16);
+    uid = (const char *)sqlite3_column_text (stmt, 3);
+
+    if (!messages)
+      messages = g_ptr_array_new_full (30, g_object_unref);
+
+    time_stamp = sqlite3_column_int (stmt, 0);
+    direction = sqlite3_column_int (stmt, 1);
+    type = history_value_to_message_type (sqlite3_column_int (stmt, 5));
+    subject = (const char *)sqlite3_column_text (stmt, 17);
+    msg = (const char *)sqlite3_column_text (stmt, 2);
+
+    /* Skip if the message is empty and has no attachment */
+    if ((!msg || !*msg) && (!subject || !*subject) &&
+        sqlite3_column_type (stmt, 18) == SQLITE_NULL)
+      continue;
+
+    if (!chatty_chat_is_im (chat) || CHATTY_IS_MA_CHAT (chat))
+      who = (const char *)sqlite3_column_text (stmt, 4);
+
+    status = sqlite3_column_int (stmt, 15);
+
+    {
+      g_autoptr(ChattyContact) contact = NULL;
+
+      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+      chatty_contact_set_name (contact, who);
+      chatty_contact_set_value (contact, who);
+      message = chatty_message_new (CHATTY_ITEM (contact), msg, uid, time_stamp, type,
+                                    history_direction_from_value (direction),
+                                    history_msg_status_from_value (status));
+    }
+
+    chatty_message_set_subject (message, subject);
+    g_ptr_array_insert (messages, 0, message);
+    g_array_prepend_val (ids, message_id);
+
+    if (sqlite3_column_type (stmt, 18) != SQLITE_NULL)
+      files = g_list_append (files, history_file_new_from_stmt (stmt, 19));
+  }
+
+  if (message)
+    chatty_message_set_files (message, g_steal_pointer (&files));
+
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting messages");
+
+  return messages;
+}
+
+/*
+ * Whether the archive may have messages that belong to the page
+ * @messages of @thread_id.  That's the case
+ * if the page is short, or if the archive has messages newer than
+ * the oldest of the page, which happens when the timestamp of a
+ * message kept in the main database is older than archived ones.
+ */
+static gboolean
+history_archive_has_page (ChattyHistory *self,
+                          int            thread_id,
+                          GPtrArray     *messages,
+                          guint          limit)
+{
+  sqlite3_stmt *stmt;
+  ChattyMessage *oldest;
+  gboolean found = FALSE;
+  int oldest_time;
+
+  if (!messages || messages->len < limit)
+    return TRUE;
+
+  oldest = messages->pdata[0];
+  oldest_time = chatty_message_get_time (oldest);
+
+  stmt = history_prepare (self,
+                          "SELECT 1 FROM archive.messages "
+                          "WHERE thread_id=?1 AND time>=?2 LIMIT 1;");
+  /* Read the archive anyway, which reports the error */
+  if (!stmt)
+    return TRUE;
+  history_bind_int (stmt, 1, thread_id, "binding when checking archive");
+  history_bind_int (stmt, 2, oldest_time, "binding when checking archive");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    found = TRUE;
+
+  history_reset (stmt);
+
+  return found;
+}
+
+static int
+history_compare_messages (ChattyMessage *a,
+                          int            a_id,
+                          ChattyMessage *b,
+                          int            b_id)
+{
+  time_t a_time, b_time;
+
+  a_time = chatty_message_get_time (a);
+  b_time = chatty_message_get_time (b);
+
+  if (a_time != b_time)
+    return a_time < b_time ? -1 : 1;
+
+  return a_id - b_id;
+}
+
+/*
+ * Merge the pages @hot and @cold, both ordered from the oldest
+ * message, into the page of the @limit latest messages.  A message
+ * may be in both if archiving it was interrupted, in which case
+ * the one in @hot is kept.
+ *
+ * Returns: (transfer full) (nullable): The merged page
+ */
+static GPtrArray *
+history_merge_pages (GPtrArray *hot,
+                     GArray    *hot_ids,
+                     GPtrArray *cold,
+                     GArray    *cold_ids,
+                     guint      limit)
+{
+  GPtrArray *messages;
+  guint i, j;
+
+  if (!cold)
+    return hot;
+
+  if (!hot)
+    return cold;
+
+  messages = g_ptr_array_new_full (limit, g_object_unref);
+  i = hot->len;
+  j = cold->len;
+
+  /* Take the latest of both pages until full */
+  while (messages->len < limit && (i || j)) {
+    int cmp;
+
+    if (!j)
+      cmp = 1;
+    else if (!i)
+      cmp = -1;
+    else
+      cmp = history_compare_messages (hot->pdata[i - 1], g_array_index (hot_ids, int, i - 1),
+                                      cold->pdata[j - 1], g_array_index (cold_ids, int, j - 1));
+
+    if (cmp >= 0)
+      g_ptr_array_add (messages, g_object_ref (hot->pdata[--i]));
+    else
+      g_ptr_array_add (messages, g_object_ref (cold->pdata[--j]));
+
+    if (cmp == 0)
+      j--;
+  }
+
+  g_ptr_array_unref (hot);
+  g_ptr_array_unref (cold);
+
+  /* Back to the oldest first */
+  for (guint k = 0; k < messages->len / 2; k++) {
+    gpointer message = messages->pdata[k];
+
+    messages->pdata[k] = messages->pdata[messages->len - 1 - k];
+    messages->pdata[messages->len - 1 - k] = message;
+  }
+
+  return messages;
+}
+
+static void
+history_get_messages (ChattyHistory *self,
+                      GTask         *task)
+{
+  g_autoptr(GArray) ids = NULL;
+  g_autoptr(GError) error = NULL;
+  GPtrArray *messages;
+  ChattyMessage *start;
+  ChattyChat *chat;
+  guint limit;
+  int thread_id, before_time = INT_MAX, before_id = INT_MAX;
+  sqlite3 *db;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (history_in_worker (self));
+
+  db = history_get_db (self);
+
+  if (!db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  limit = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "limit"));
+  start = g_object_get_data (G_OBJECT (task), "message");
+  chat  = g_object_get_data (G_OBJECT (task), "chat");
+
+  g_assert (limit != 0);
+  g_assert (!start || CHATTY_IS_MESSAGE (start));
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  thread_id = get_thread_id (self, chat, &error);
+
+  if (!thread_id) {
+    if (error)
+      g_task_return_error (task, g_steal_pointer (&error));
+    else
+      g_task_return_new_error (task,
+                               G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                               "Couldn't find chat %s",
+                               chatty_chat_get_chat_name (chat));
+    return;
+  }
+
+  if (start &&
+      !get_message_cursor (self, start, thread_id, &before_time, &before_id, &error)) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  ids = g_array_new (FALSE, FALSE, sizeof (int));
+  messages = get_messages_before (self, chat, FALSE, thread_id, before_time, before_id,
+                                  limit, ids, &error);
+
+  if (!error && history_archive_has_page (self, thread_id, messages, limit)) {
+    g_autoptr(GArray) archived_ids = NULL;
+    GPtrArray *archived;
+
+    archived_ids = g_array_new (FALSE, FALSE, sizeof (int));
+    archived = get_messages_before (self, chat, TRUE, thread_id, before_time, before_id,
+                                    limit, archived_ids, &error);
+    messages = history_merge_pages (messages, ids, archived, archived_ids, limit);
+  }
+
+  if (error) {
+    g_clear_pointer (&messages, g_ptr_array_unref);
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+history_get_chat_draft_message (ChattyHistory *self,
+                                GTask         *task)
+{
+  g_autoptr(GError) error = NULL;
+  sqlite3_stmt *stmt;
+  ChattyChat *chat;
+  int thread_id;
+  sqlite3 *db;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (history_in_worker (self));
+
+  db = history_get_db (self);
+
+  if (!db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  thread_id = get_thread_id (self, chat, &error);
+
+  if (!thread_id) {
+    if (error)
+      g_task_return_error (task, g_steal_pointer (&error));
+    else
+      g_task_return_new_error (task,
+                               G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                               "Couldn't find chat %s",
+                               chatty_chat_get_chat_name (chat));
+    return;
+  }
+
+  stmt = history_prepare (self,
+                          "SELECT DISTINCT body "
+                          "FROM messages "
+                          "WHERE thread_id=? "
+                          "AND messages.status=" STRING(MESSAGE_STATUS_DRAFT) " "
+                          "ORDER BY time DESC, messages.id DESC LIMIT 1;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
+
+  history_bind_int (stmt, 1, thread_id, "binding when getting draft message");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW) {
+    const char *msg = NULL;
+
+    msg = (const char *)sqlite3_column_text (stmt, 0);
+    g_task_return_pointer (task, g_strdup (msg), g_free);
+  } else {
+    g_task_return_pointer (task, NULL, NULL);
+  }
+
+  history_reset (stmt);
+}
+
+static int
+add_file_info (ChattyHistory *self,
+               ChattyFile    *file)
+{
+  sqlite3_stmt *stmt;
+  const char *mime_type;
+  gsize file_size;
+  ChattyFileStatus file_status;
+  int file_id = 0, mime_id = 0;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+
+  if (!file)
+    return 0;
+
+  mime_type = chatty_file_get_mime_type (file);
+  file_size = chatty_file_get_size (file);
+  file_status = chatty_file_get_status (file);
+
+  if (mime_type) {
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO mime_type(name) VALUES(?)");
+    if (!stmt)
+      return 0;
+    history_bind_text (stmt, 1, mime_type, "binding when getting timestamp");
+    sqlite3_step (stmt);
+    history_reset (stmt);
+
+    stmt = history_prepare (self, "SELECT id FROM mime_type WHERE name=?");
+    if (!stmt)
+      return 0;
+    history_bind_text (stmt, 1, mime_type, "binding when getting timestamp");
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+      mime_id = sqlite3_column_int (stmt, 0);
+    history_reset (stmt);
+  }
+
+  if (file_status == CHATTY_FILE_DOWNLOADED)
+    status = FILE_STATUS_DOWNLOADED;
+  else if (file_status == CHATTY_FILE_DECRYPT_FAILED)
+    status = FILE_STATUS_DECRYPT_FAILED;
+  else if (file_status == CHATTY_FILE_MISSING)
+    status = FILE_STATUS_MISSING;
+  else
+    status = 0;
+
+  stmt = history_prepare (self, "SELECT id FROM files WHERE url=?");
+  if (!stmt)
+    return 0;
+  history_bind_text (stmt, 1, chatty_file_get_url (file), "binding when getting file");
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    file_id = sqlite3_column_int (stmt, 0);
+  history_reset (stmt);
+
+  stmt = history_prepare (self,
+                          "INSERT INTO files(name,url,path,mime_type_id,size,status) "
+                          "VALUES(?1,?2,?3,?4,?5,?6) "
+                          "ON CONFLICT(url) DO UPDATE SET path=?3, size=?5, status=?6");
+  if (!stmt)
+    return 0;
+  history_bind_text (stmt, 1, chatty_file_get_name (file), "binding when adding file");
+  history_bind_text (stmt, 2, chatty_file_get_url (file), "binding when adding file");
+  history_bind_text (stmt, 3, chatty_file_get_path (file), "binding when adding file");
+  if (mime_id)
+    history_bind_int (stmt, 4, mime_id, "binding when adding file");
+  if (file_size)
+    history_bind_int (stmt, 5, file_size, "binding when adding file");
+  if (status)
+    history_bind_int (stmt, 6, status, "binding when adding file");
+  sqlite3_step (stmt);
+  history_reset (stmt);
+
+  if (file_id)
+    return file_id;
+
+  file_id = sqlite3_last_insert_rowid (self->db);
+
+  if (chatty_file_get_width (file) ||
+      chatty_file_get_height (file) ||
+      chatty_file_get_duration (file)) {
+    gsize width, height, duration;
+
+    width = chatty_file_get_width (file);
+    height = chatty_file_get_height (file);
+    duration = chatty_file_get_duration (file);
+
+    stmt = history_prepare (self,
+                            "INSERT INTO file_metadata(file_id,width,height,duration) "
+                            "VALUES(?1,?2,?3,?4)");
+    if (!stmt)
+      return 0;
+
+    history_bind_int (stmt, 1, file_id, "binding when adding media");
+
+    if (width)
+      history_bind_int (stmt, 2, width, "binding when adding media");
+    if (height)
+      history_bind_int (stmt, 3, height, "binding when adding media");
+    if (duration)
+      history_bind_int (stmt, 4, duration, "binding when adding media");
+
+    sqlite3_step (stmt);
+    history_reset (stmt);
+  }
+
+  return file_id;
+}
+
+/*
+ * Link the files of @message to @message_id.
+ *
+ * Returns: %FALSE if a statement couldn't be prepared
+ */
+static gboolean
+history_add_files (ChattyHistory *self,
+                   ChattyMessage *message,
+                   int            message_id)
+{
+  GList *files;
+
+  if (!CHATTY_IS_MESSAGE (message) || !message_id)
+    return TRUE;
+
+  files = chatty_message_get_files (message);
+
+  for (GList *file = files; file; file = file->next) {
+    sqlite3_stmt *stmt;
+    int file_id;
+
+    file_id = add_file_info (self, file->data);
+
+    if (!file_id)
+      return FALSE;
+
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO message_files(message_id,file_id) "
+                            "VALUES(?1,?2)");
+    if (!stmt)
+      return FALSE;
+
+    history_bind_int (stmt, 1, message_id, "binding when adding message file");
+    history_bind_int (stmt, 2, file_id, "binding when adding message file");
+    sqlite3_step (stmt);
+    history_reset (stmt);
+  }
+
+  return TRUE;
+}
+
+/*
+ * Set @message_id to the id of the draft of @thread_id, or 0.
+ *
+ * Returns: The SQLite status, %SQLITE_ROW or %SQLITE_DONE on success
+ */
+static int
+get_chat_draft_id (ChattyHistory *self,
+                   int            thread_id,
+                   int           *message_id)
+{
+  sqlite3_stmt *stmt;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (thread_id);
+
+  *message_id = 0;
+
+  stmt = history_prepare (self,
+                          "SELECT messages.id FROM messages "
+                          "WHERE thread_id=? AND status=" STRING(MESSAGE_STATUS_DRAFT));
+  if (!stmt)
+    return SQLITE_ERROR;
+  history_bind_int (stmt, 1, thread_id, "binding when getting draft message");
+  status = sqlite3_step (stmt);
+
+  if (status == SQLITE_ROW)
+    *message_id = sqlite3_column_int (stmt, 0);
+
+  history_reset (stmt);
+
+  return status;
+}
+
+static const char *
+history_get_message_sender (ChattyChat    *chat,
+                            ChattyMessage *message)
+{
+  ChattyMsgDirection direction;
+  const char *who;
+
+  who = chatty_message_get_user_name (message);
+  direction = chatty_message_get_msg_direction (message);
+
+  if (direction == CHATTY_DIRECTION_OUT)
+    who = chatty_item_get_username (CHATTY_ITEM (chat));
+
+  if ((!who || !*who) && direction == CHATTY_DIRECTION_IN && chatty_chat_is_im (chat))
+    who = chatty_chat_get_chat_name (chat);
+
+  return who;
+}
+
+/*
+ * history_insert_message:
+ * @self: a #ChattyHistory
+ * @chat: the #ChattyChat @message belongs to
+ * @message: The #ChattyMessage to store
+ * @thread_id: The id of the thread for @chat
+ * @sender_id: The id of the sender of @message or 0
+ *
+ * Store @message to the thread @thread_id.  This should
+ * be called within a transaction.
+ *
+ * Returns: %SQLITE_DONE or %SQLITE_ROW on success,
+ * any other SQLite status otherwise.
+ */
+static int
+history_insert_message (ChattyHistory *self,
+                        ChattyChat    *chat,
+                        ChattyMessage *message,
+                        int            thread_id,
+                        int            sender_id)
+{
+  sqlite3_stmt *stmt;
+  const char *uid, *msg;
+  ChattyMsgDirection direction;
+  ChattyMsgType type;
+  int status, msg_status, dir, message_id = 0;
+  time_t time_stamp;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (CHATTY_IS_MESSAGE (message));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (thread_id);
+
+  uid = chatty_message_get_uid (message);
+  msg = chatty_message_get_text (message);
+  time_stamp = chatty_message_get_time (message);
+  direction = chatty_message_get_msg_direction (message);
+  dir = history_direction_to_value (direction);
+  type = chatty_message_get_msg_type (message);
+  msg_status = history_msg_status_to_value (chatty_message_get_status (message));
+
+  if (direction == CHATTY_DIRECTION_OUT &&
+      msg_status == MESSAGE_STATUS_DRAFT) {
+    if (!msg)
+      return SQLITE_DONE;
+
+    status = get_chat_draft_id (self, thread_id, &message_id);
+
+    if (status != SQLITE_ROW && status != SQLITE_DONE)
+      return status;
+
+    if (message_id) {
+      stmt = history_prepare (self,
+                              "UPDATE messages SET body=?1 "
+                              "WHERE messages.id=?2");
+      if (!stmt)
+        return SQLITE_ERROR;
+      history_bind_text (stmt, 1, msg, "binding when adding draft message");
+      history_bind_int (stmt, 2, message_id, "binding when adding draft message");
+    } else {
+      stmt = history_prepare (self,
+                              /*                     ?1    ?2      ?3     ?4        ?5      ?6    ?7 */
+                              "INSERT INTO messages(uid,thread_id,body,body_type,direction,time,status) "
+                              "VALUES(?1,?2,?3,?4,?5,?6," STRING(MESSAGE_STATUS_DRAFT) ") ");
+      if (!stmt)
+        return SQLITE_ERROR;
+      history_bind_text (stmt, 1, uid, "binding when adding draft message");
+      history_bind_int (stmt, 2, thread_id, "binding when adding draft message");
+      history_bind_text (stmt, 3, msg, "binding when adding draft message");
+      history_bind_int (stmt, 4, history_message_type_to_value (type), "binding when adding draft message");
+      history_bind_int (stmt, 5, dir, "binding when adding draft message");
+      history_bind_int (stmt, 6, time_stamp, "binding when adding draft message");
+    }
+
+    status = sqlite3_step (stmt);
+    history_reset (stmt);
+
+    return status;
+  }
+
+  if (sender_id && direction == CHATTY_DIRECTION_IN) {
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                            "VALUES(?1,?2)");
+    if (!stmt)
+      return SQLITE_ERROR;
+    history_bind_int (stmt, 1, thread_id, "binding when adding thread member");
+    history_bind_int (stmt, 2, sender_id, "binding when adding thread member");
+    sqlite3_step (stmt);
+    history_reset (stmt);
+  }
+
+  /* Only messages as old as the archived ones may have been archived */
+  if (time_stamp <= self->archive_max_time) {
+    stmt = history_prepare (self,
+                            "UPDATE archive.messages SET status=?1 "
+                            "WHERE uid=?2 AND thread_id=?3 AND body=?4 AND time=?5;");
+    if (!stmt)
+      return SQLITE_ERROR;
+    if (msg_status != MESSAGE_STATUS_UNKNOWN)
+      history_bind_int (stmt, 1, msg_status, "binding when updating archived message");
+    history_bind_text (stmt, 2, uid, "binding when updating archived message");
+    history_bind_int (stmt, 3, thread_id, "binding when updating archived message");
+    history_bind_text (stmt, 4, msg, "binding when updating archived message");
+    history_bind_int (stmt, 5, time_stamp, "binding when updating archived message");
+    status = sqlite3_step (stmt);
+    history_reset (stmt);
+
+    if (status == SQLITE_DONE && sqlite3_changes (self->db) > 0)
+      return SQLITE_DONE;
+  }
+
+  stmt = history_prepare (self,
+                          "INSERT INTO messages(uid,thread_id,sender_id,body,body_type,direction,time,preview_id,encrypted,status,subject) "
+                          "VALUES(?1,?2,?3,?4,"
+                          "?5,?6,?7,?9,?10,?11,?12) "
+                          "ON CONFLICT (uid,thread_id,body,time) DO UPDATE "
+                          "SET status=?11");
+  if (!stmt)
+    return SQLITE_ERROR;
+
+  history_bind_text (stmt, 1, uid, "binding when adding message");
+  history_bind_int (stmt, 2, thread_id, "binding when adding message");
+  if (sender_id)
+    history_bind_int (stmt, 3, sender_id, "binding when adding message");
+  history_bind_text (stmt, 4, msg, "binding when adding message");
+  history_bind_int (stmt, 5, history_message_type_to_value (type),
+                    "binding when adding message");
+  history_bind_int (stmt, 6, dir, "binding when adding message");
+  history_bind_int (stmt, 7, time_stamp, "binding when adding message");
+  history_bind_int (stmt, 10, chatty_message_get_encrypted (message),
+                    "binding when adding message");
+  if (msg_status != MESSAGE_STATUS_UNKNOWN)
+    history_bind_int (stmt, 11, msg_status, "binding when adding message");
+  history_bind_text (stmt, 12, chatty_message_get_subject (message), "binding when adding message");
+
+  status = sqlite3_step (stmt);
+  history_reset (stmt);
+
+  /* We can't use last_row_id as we may ignore the last insert */
+  stmt = history_prepare (self,
+                          "SELECT messages.id FROM messages "
+                          "WHERE messages.uid=?;");
+  if (!stmt)
+    return SQLITE_ERROR;
+  history_bind_text (stmt, 1, uid, "binding when getting message id");
+  status = sqlite3_step (stmt);
+
+  if (status == SQLITE_ROW)
+    message_id = sqlite3_column_int (stmt, 0);
+  history_reset (stmt);
+
+  if (status == SQLITE_ROW && !history_add_files (self, message, message_id))
+    return SQLITE_ERROR;
+
+  return status;
+}
+
+static void
+history_add_message (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyMessage *message;
+  ChattyChat *chat;
+  const char *who;
+  int thread_id = 0, sender_id = 0;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  message = g_object_get_data (G_OBJECT (task), "message");
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (CHATTY_IS_MESSAGE (message));
+
+  who = history_get_message_sender (chat, message);
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  thread_id = insert_or_ignore_thread (self, chat, task);
+  if (!thread_id) {
+    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+    return;
+  }
+
+  sender_id = insert_or_ignore_user (self, chatty_item_get_protocols (CHATTY_ITEM (chat)), who,
+                                     chatty_message_get_user_alias (message), task);
+  status = history_insert_message (self, chat, message, thread_id, sender_id);
+  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+
+  if (status == SQLITE_DONE || status == SQLITE_ROW)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to save message. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+}
+
+static void
+history_add_messages (ChattyHistory *self,
+                      GTask         *task)
+{
+  g_autoptr(GHashTable) senders = NULL;
+  GPtrArray *messages;
+  ChattyChat *chat;
+  int thread_id;
+  int status = SQLITE_DONE;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  messages = g_object_get_data (G_OBJECT (task), "messages");
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (messages);
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  thread_id = insert_or_ignore_thread (self, chat, task);
+  if (!thread_id) {
+    /* Don't keep the users or account that may have been added */
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    history_ids_clear (self);
+    return;
+  }
+
+  /* Messages in a batch are usually from a handful of senders */
+  senders = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (guint i = 0; i < messages->len; i++) {
+    ChattyMessage *message = messages->pdata[i];
+    const char *who;
+    int sender_id = 0;
+
+    who = history_get_message_sender (chat, message);
+
+    if (who && *who) {
+      sender_id = GPOINTER_TO_INT (g_hash_table_lookup (senders, who));
+
+      if (!sender_id) {
+        sender_id = insert_or_ignore_user (self, chatty_item_get_protocols (CHATTY_ITEM (chat)), who,
+                                           chatty_message_get_user_alias (message), task);
+        if (!sender_id)
+          break;
+
+        g_hash_table_insert (senders, (gpointer)who, GINT_TO_POINTER (sender_id));
+      }
+    }
+
+    status = history_insert_message (self, chat, message, thread_id, sender_id);
+
+    if (status != SQLITE_DONE && status != SQLITE_ROW)
+      break;
+  }
+
+  /* insert_or_ignore_user() has already returned the error */
+  if (!g_task_had_error (task)) {
+    if (status == SQLITE_DONE || status == SQLITE_ROW)
+      status = sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+
+    if (status != SQLITE_DONE && status != SQLITE_ROW && status != SQLITE_OK)
+      g_task_return_new_error (task,
+                               G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to save messages. errno: %d, desc: %s",
+                               status, sqlite3_errmsg (self->db));
+  }
+
+  /*
+   * Store the batch as a whole or not at all, so that callers
+   * can retry it.  The ids cached since may be rolled back too.
+   */
+  if (g_task_had_error (task)) {
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    history_ids_clear (self);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * Get the members of every visible thread of the account @user_id
+ * in a single query, as a table of thread id to #GPtrArray of
+ * #ChattyMmBuddy, or %NULL on error with @error set.
+ */
+static GHashTable *
+get_sms_threads_members (ChattyHistory  *self,
+                         const char     *user_id,
+                         GError        **error)
+{
+  GHashTable *members;
+  sqlite3_stmt *stmt;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (history_in_worker (self));
+
+  stmt = history_prepare (self,
+                          /*               0                  1             2 */
+                          "SELECT thread_members.thread_id,users.username,users.alias "
+                          "FROM thread_members "
+                          "INNER JOIN threads ON threads.id=thread_members.thread_id "
+                          "INNER JOIN accounts ON accounts.id=threads.account_id "
+                          "INNER JOIN users AS owner ON owner.id=accounts.user_id "
+                          "AND owner.username=? AND accounts.protocol=? "
+                          "INNER JOIN users ON users.id=thread_members.user_id "
+                          "WHERE users.username != 'SMS' AND users.username != 'MMS' "
+                          "AND threads.visibility!=" STRING(THREAD_VISIBILITY_HIDDEN) " "
+                          "ORDER BY thread_members.thread_id, thread_members.user_id DESC;");
+  if (history_prepare_failed (self, stmt, error))
+    return NULL;
+
+  members = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                   NULL, (GDestroyNotify)g_ptr_array_unref);
+  history_bind_text (stmt, 1, user_id, "binding when getting thread members");
+  history_bind_int (stmt, 2, PROTOCOL_MMS_SMS, "binding when getting thread members");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    GPtrArray *buddies;
+    gpointer thread_id;
+    const char *name, *alias;
+
+    thread_id = GINT_TO_POINTER (sqlite3_column_int (stmt, 0));
+    name = (const char *)sqlite3_column_text (stmt, 1);
+    alias = (const char *)sqlite3_column_text (stmt, 2);
+
+    buddies = g_hash_table_lookup (members, thread_id);
+
+    if (!buddies) {
+      buddies = g_ptr_array_new_full (4, g_object_unref);
+      g_hash_table_insert (members, thread_id, buddies);
+    }
+
+    g_ptr_array_add (buddies, chatty_mm_buddy_new (name, alias));
+  }
+
+  history_reset (stmt);
+
+  return members;
+}
+
+static void
+history_chat_finish_loading (ChattyChat    *chat,
+                             ChattyMessage *message,
+                             GList         *files,
+                             GPtrArray     *members)
+{
+  g_assert (CHATTY_IS_MM_CHAT (chat));
+
+  if (message) {
+    g_autoptr(GPtrArray) messages = NULL;
+
+    messages = g_ptr_array_new_full (1, g_object_unref);
+    chatty_message_set_files (message, files);
+    g_ptr_array_add (messages, message);
+    chatty_mm_chat_prepend_messages (CHATTY_MM_CHAT (chat), messages);
+  }
+
+  chatty_mm_chat_add_users (CHATTY_MM_CHAT (chat), members);
+}
+
+static void
+history_get_chats (ChattyHistory *self,
+                   GTask         *task)
+{
+  g_autoptr(GHashTable) members = NULL;
+  g_autoptr(GError) error = NULL;
+  GPtrArray *threads = NULL;
+  ChattyAccount *account;
+  ChattyMessage *message = NULL;
+  ChattyChat *chat = NULL;
+  GList *files = NULL;
+  sqlite3_stmt *stmt;
+  const char *user_id;
+  int thread_id = 0;
+  sqlite3 *db;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (history_in_worker (self));
+
+  db = history_get_db (self);
+
+  if (!db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  /* We currently handle only MM accounts */
+  g_assert (CHATTY_IS_MM_ACCOUNT (account));
+
+  user_id = chatty_item_get_username (CHATTY_ITEM (account));
+  members = get_sms_threads_members (self, user_id, &error);
+
+  if (!members) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  /*
+   * Load every thread along with its last message, the attachments
+   * of that message and the unread count in a single pass.  A thread
+   * spans several rows if its last message has more than one file.
+   */
+  stmt = history_prepare (self,
+                          /*           0           1             2              3                4  */
+                          "SELECT threads.id,threads.name,threads.alias,threads.encrypted,threads.type,"
+                          /*   5           6          7   */
+                          "avatar.url,avatar.path,visibility,"
+                          /*               8              */
+                          "coalesce(thread_summary.unread_count,0),"
+                          /*    9          10        11        12   13 */
+                          "messages.id,messages.time,direction,body,uid,"
+                          /*              14                         15           16          17 */
+                          "coalesce(sender.alias,sender.username),body_type,messages.status,subject,"
+                          /*        18               19        20         21         22         23 */
+                          "message_files.file_id,files.url,files.path,files.name,files.size,files.status,"
+                          /*         24                  25                  26                  27 */
+                          "file_metadata.width,file_metadata.height,file_metadata.duration,mime_type.name "
+                          "FROM threads "
+                          "INNER JOIN accounts ON accounts.id=threads.account_id "
+                          "INNER JOIN users ON users.id=accounts.user_id "
+                          "AND users.username=? AND accounts.protocol=? "
+                          "LEFT JOIN files AS avatar ON threads.avatar_id=avatar.id "
+                          "LEFT JOIN thread_summary ON thread_summary.thread_id=threads.id "
+                          "LEFT JOIN messages ON messages.id=thread_summary.last_message_id "
+                          "LEFT JOIN users AS sender ON sender.id=messages.sender_id "
+                          "LEFT JOIN message_files ON message_files.message_id=messages.id "
+                          "LEFT JOIN files ON files.id=message_files.file_id "
+                          "LEFT JOIN mime_type ON mime_type.id=files.mime_type_id "
+                          "LEFT JOIN file_metadata ON file_metadata.file_id=files.id "
+                          "WHERE visibility!=" STRING(THREAD_VISIBILITY_HIDDEN) " "
+                          "ORDER BY threads.id, message_files.file_id;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
+  history_bind_text (stmt, 1, user_id, "binding when getting threads");
+  history_bind_int (stmt, 2, PROTOCOL_MMS_SMS, "binding when getting threads");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    const char *name, *alias, *msg, *subject, *who = NULL;
+    int visibility;
+
+    if (!threads)
+      threads = g_ptr_array_new_full (30, g_object_unref);
+
+    /* Another attachment of the last message of the current thread */
+    if (chat && thread_id == sqlite3_column_int (stmt, 0)) {
+      if (message)
+        files = g_list_append (files, history_file_new_from_stmt (stmt, 19));
+      continue;
+    }
+
+    if (chat)
+      history_chat_finish_loading (chat, g_steal_pointer (&message), g_steal_pointer (&files),
+                                   g_hash_table_lookup (members, GINT_TO_POINTER (thread_id)));
+
+    thread_id = sqlite3_column_int (stmt, 0);
+    name = (const char *)sqlite3_column_text (stmt, 1);
+    alias = (const char *)sqlite3_column_text (stmt, 2);
+    visibility = sqlite3_column_int (stmt, 7);
+
+    if (sqlite3_column_int (stmt, 4) == THREAD_GROUP_CHAT) {
+      chat = (gpointer)chatty_mm_chat_new (name, alias, CHATTY_PROTOCOL_MMS, FALSE,
+                                           history_value_to_visibility (visibility));
+    } else {
+      chat = (gpointer)chatty_mm_chat_new (name, alias, CHATTY_PROTOCOL_MMS_SMS, TRUE,
+                                           history_value_to_visibility (visibility));
+    }
+
+    chatty_chat_set_unread_count (chat, sqlite3_column_int (stmt, 8));
+    g_ptr_array_insert (threads, -1, chat);
+
+    /* The thread has no messages */
+    if (sqlite3_column_type (stmt, 9) == SQLITE_NULL)
+      continue;
+
+    msg = (const char *)sqlite3_column_text (stmt, 12);
+    subject = (const char *)sqlite3_column_text (stmt, 17);
+
+    /* Skip if the message is empty and has no attachment */
+    if ((!msg || !*msg) && (!subject || !*subject) &&
+        sqlite3_column_type (stmt, 18) == SQLITE_NULL)
+      continue;
+
+    if (!chatty_chat_is_im (chat))
+      who = (const char *)sqlite3_column_text (stmt, 14);
+
+    {
+      g_autoptr(ChattyContact) contact = NULL;
+
+      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+      chatty_contact_set_name (contact, who);
+      chatty_contact_set_value (contact, who);
+      message = chatty_message_new (CHATTY_ITEM (contact), msg,
+                                    (const char *)sqlite3_column_text (stmt, 13),
+                                    sqlite3_column_int (stmt, 10),
+                                    history_value_to_message_type (sqlite3_column_int (stmt, 15)),
+                                    history_direction_from_value (sqlite3_column_int (stmt, 11)),
+                                    history_msg_status_from_value (sqlite3_column_int (stmt, 16)));
+      chatty_message_set_subject (message, subject);
+    }
+
+    if (sqlite3_column_type (stmt, 18) != SQLITE_NULL)
+      files = g_list_append (files, history_file_new_from_stmt (stmt, 19));
+  }
+
+  if (chat)
+    history_chat_finish_loading (chat, g_steal_pointer (&message), g_steal_pointer (&files),
+                                 g_hash_table_lookup (members, GINT_TO_POINTER (thread_id)));
+
+  history_reset (stmt);
+  g_task_return_pointer (task, threads, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+history_update_chat (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyChat *chat;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  if (insert_or_ignore_thread (self, chat, task))
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+history_update_user (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyAccount *account;
+  const char *user_name, *name;
+  ChattyProtocol protocol;
+  int id;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  g_assert (CHATTY_IS_ACCOUNT (account));
+
+  user_name = chatty_item_get_username (CHATTY_ITEM (account));
+  protocol = chatty_item_get_protocols (CHATTY_ITEM (account));
+  name = chatty_item_get_name (CHATTY_ITEM (account));
+
+  if (!user_name || !*user_name) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Username is empty");
+    return;
+  }
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  id = insert_or_ignore_user (self, protocol, user_name, name, task);
+  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+
+  if (!id)
+    return;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+history_delete_chat (ChattyHistory *self,
+                     GTask         *task)
+{
+  g_autoptr(GError) error = NULL;
+  ChattyChat *chat;
+  sqlite3_stmt *stmt;
+  const char *account, *chat_name;
+  int status, thread_id;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  chat_name = chatty_chat_get_chat_name (chat);
+
+  if (!chat_name || !*chat_name) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Error: chat name is empty");
+    return;
+  }
+
+  account = chatty_item_get_username (CHATTY_ITEM (chat));
+  thread_id = get_thread_id (self, chat, &error);
+
+  if (error) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if (status == SQLITE_OK)
+    status = SQLITE_DONE;
+
+  /* The archive has no foreign keys, delete the archived messages first */
+  if (thread_id) {
+    const char *sql[] = {
+      "DELETE FROM archive.mm_messages WHERE message_id IN ("
+      "SELECT id FROM archive.messages WHERE thread_id=?);",
+      "DELETE FROM archive.message_files WHERE message_id IN ("
+      "SELECT id FROM archive.messages WHERE thread_id=?);",
+      "DELETE FROM archive.messages WHERE thread_id=?;",
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS (sql) && status == SQLITE_DONE; i++) {
+      stmt = history_prepare (self, sql[i]);
+
+      if (!stmt) {
+        status = sqlite3_errcode (self->db);
+        break;
+      }
+
+      history_bind_int (stmt, 1, thread_id, "binding when deleting archived messages");
+      status = sqlite3_step (stmt);
+      history_reset (stmt);
+    }
+  }
+
+  if (status == SQLITE_DONE) {
+    stmt = history_prepare (self,
+                            "DELETE FROM threads "
+                            "WHERE threads.type=? AND threads.name=? "
+                            "AND threads.account_id IN ("
+                            "SELECT accounts.id FROM accounts "
+                            "INNER JOIN users "
+                            "ON accounts.id=threads.account_id "
+                            "AND users.id=accounts.user_id AND users.username=?);");
+
+    if (stmt) {
+      history_bind_int (stmt, 1, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                        "binding when deleting thread");
+      history_bind_text (stmt, 2, chat_name, "binding when deleting thread");
+      history_bind_text (stmt, 3, account, "binding when deleting thread");
+
+      status = sqlite3_step (stmt);
+      history_reset (stmt);
+    } else {
+      status = sqlite3_errcode (self->db);
+    }
+  }
+
+  if (status == SQLITE_DONE)
+    status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+
+  /* Ids of the thread and its members may be reused by new rows */
+  history_ids_clear (self);
+
+  if (status == SQLITE_OK) {
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to delete chat. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    /* Nothing is deleted, neither the thread nor its archived messages */
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+}
+
+/*
+ * The history is exported as lines of tab separated fields, the
+ * first of which is the type of the record.  Backslash, tab, line
+ * feed and carriage return are escaped with a backslash in fields,
+ * and NULL is written as \N.  The records, after the header, are:
+ *
+ *   U  id username alias type
+ *   A  id user_id protocol enabled
+ *   T  account_id name alias type encrypted visibility notification
+ *   R  user_id
+ *   M  uid sender_id user_alias body body_type direction time status
+ *      encrypted subject last_read
+ *   F  url name path mime_type size status width height duration
+ *
+ * for users, accounts, threads, thread members, messages and
+ * message files.  Ids are only used to refer to the users and
+ * accounts listed before.  Members and messages belong to the
+ * thread before them, and files to the message before them.
+ * Passwords, avatars, previews and SMS delivery details are not
+ * exported.
+ */
+#define HISTORY_EXPORT_MESSAGES_SQL(schema)                             \
+  /*       0         1     2          3        4      5         6       7     8 */ \
+  "SELECT messages.id,uid,sender_id,user_alias,body,body_type,direction,time,messages.status," \
+  /*   9        10          11 */                                       \
+  "encrypted,subject,messages.id=?2,"                                   \
+  /*   12        13         14            15           16          17 */ \
+  "files.url,files.name,files.path,mime_type.name,files.size,files.status," \
+  /*        18                  19                  20 */               \
+  "file_metadata.width,file_metadata.height,file_metadata.duration "    \
+  "FROM " schema ".messages AS messages "                               \
+  "LEFT JOIN " schema ".message_files AS message_files "                \
+  "ON message_files.message_id=messages.id "                            \
+  "LEFT JOIN files ON files.id=message_files.file_id "                  \
+  "LEFT JOIN mime_type ON mime_type.id=files.mime_type_id "             \
+  "LEFT JOIN file_metadata ON file_metadata.file_id=files.id "          \
+  "WHERE messages.thread_id=?1 "                                        \
+  "ORDER BY messages.time, messages.id;"
+
+static void
+history_export_append_field (GString    *buffer,
+                             const char *field)
+{
+  g_string_append_c (buffer, '\t');
+
+  if (!field) {
+    g_string_append (buffer, "\\N");
+    return;
+  }
+
+  while (*field) {
+    gsize len;
+
+    len = strcspn (field, "\\\t\n\r");
+    g_string_append_len (buffer, field, len);
+    field += len;
+
+    if (!*field)
+      break;
+
+    g_string_append_c (buffer, '\\');
+
+    if (*field == '\t')
+      g_string_append_c (buffer, 't');
+    else if (*field == '\n')
+      g_string_append_c (buffer, 'n');
+    else if (*field == '\r')
+      g_string_append_c (buffer, 'r');
+    else
+      g_string_append_c (buffer, '\\');
+
+    field++;
+  }
+}
+
+/* Append a record of @type with the columns @first to @last of @stmt */
+static void
+history_export_append_row (GString      *buffer,
+                           const char   *type,
+                           sqlite3_stmt *stmt,
+                           int           first,
+                           int           last)
+{
+  g_string_append (buffer, type);
+
+  for (int i = first; i <= last; i++)
+    history_export_append_field (buffer, (const char *)sqlite3_column_text (stmt, i));
+
+  g_string_append_c (buffer, '\n');
+}
+
+/* Write out @buffer to @stream, if it has at least @size bytes */
+static gboolean
+history_export_flush (GOutputStream  *stream,
+                      GString        *buffer,
+                      gsize           size,
+                      GError        **error)
+{
+  if (!buffer->len || buffer->len < size)
+    return TRUE;
+
+  if (!g_output_stream_write_all (stream, buffer->str, buffer->len, NULL, NULL, error))
+    return FALSE;
+
+  g_string_truncate (buffer, 0);
+
+  return TRUE;
+}
+
+static gboolean
+history_export_messages (ChattyHistory  *self,
+                         GOutputStream  *stream,
+                         GString        *buffer,
+                         gboolean        archived,
+                         int             thread_id,
+                         int             last_read_id,
+                         guint          *n_messages,
+                         GError        **error)
+{
+  sqlite3_stmt *stmt;
+  int status, message_id = 0;
+
+  if (archived)
+    stmt = history_prepare (self, HISTORY_EXPORT_MESSAGES_SQL ("archive"));
+  else
+    stmt = history_prepare (self, HISTORY_EXPORT_MESSAGES_SQL ("main"));
+
+  if (history_prepare_failed (self, stmt, error))
+    return FALSE;
+
+  history_bind_int (stmt, 1, thread_id, "binding when exporting messages");
+  history_bind_int (stmt, 2, last_read_id, "binding when exporting messages");
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW) {
+    /* A message spans several rows if it has more than one file */
+    if (message_id != sqlite3_column_int (stmt, 0)) {
+      message_id = sqlite3_column_int (stmt, 0);
+      history_export_append_row (buffer, "M", stmt, 1, 11);
+      (*n_messages)++;
+    }
+
+    if (sqlite3_column_type (stmt, 12) != SQLITE_NULL)
+      history_export_append_row (buffer, "F", stmt, 12, 20);
+
+    if (!history_export_flush (stream, buffer, HISTORY_EXPORT_BUFFER_SIZE, error))
+      break;
+  }
+
+  history_reset (stmt);
+
+  if (status == SQLITE_ROW)
+    return FALSE;
+
+  if (status != SQLITE_DONE) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to export messages. errno: %d, desc: %s",
+                 status, sqlite3_errstr (status));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Append a @type record for each row of @sql, which has 4 columns */
+static gboolean
+history_export_table (ChattyHistory  *self,
+                      GString        *buffer,
+                      const char     *type,
+                      const char     *sql,
+                      GError        **error)
+{
+  sqlite3_stmt *stmt;
+  int status;
+
+  stmt = history_prepare (self, sql);
+  if (history_prepare_failed (self, stmt, error))
+    return FALSE;
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    history_export_append_row (buffer, type, stmt, 0, 3);
+
+  history_reset (stmt);
+
+  if (status != SQLITE_DONE) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to export '%s' records. errno: %d, desc: %s",
+                 type, status, sqlite3_errstr (status));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+history_export_threads (ChattyHistory  *self,
+                        GOutputStream  *stream,
+                        GString        *buffer,
+                        guint          *n_messages,
+                        GError        **error)
+{
+  sqlite3_stmt *stmt, *members;
+  gboolean success = TRUE;
+  int status;
+
+  stmt = history_prepare (self,
+                          /*  0        1           2        3    4     5      6          7          8 */
+                          "SELECT id,last_read_id,account_id,name,alias,type,encrypted,visibility,notification "
+                          "FROM threads ORDER BY id;");
+  if (history_prepare_failed (self, stmt, error))
+    return FALSE;
+
+  while (success && (status = sqlite3_step (stmt)) == SQLITE_ROW) {
+    int thread_id, last_read_id;
+
+    thread_id = sqlite3_column_int (stmt, 0);
+    last_read_id = sqlite3_column_int (stmt, 1);
+    history_export_append_row (buffer, "T", stmt, 2, 8);
+
+    members = history_prepare (self, "SELECT user_id FROM thread_members WHERE thread_id=?;");
+
+    if (history_prepare_failed (self, members, error)) {
+      success = FALSE;
+      break;
+    }
+
+    history_bind_int (members, 1, thread_id, "binding when exporting members");
+    while ((status = sqlite3_step (members)) == SQLITE_ROW)
+      history_export_append_row (buffer, "R", members, 0, 0);
+    history_reset (members);
+
+    if (status != SQLITE_DONE) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to export members. errno: %d, desc: %s",
+                   status, sqlite3_errstr (status));
+      success = FALSE;
+      break;
+    }
+
+    success = history_export_messages (self, stream, buffer, FALSE, thread_id,
+                                       last_read_id, n_messages, error) &&
+              history_export_messages (self, stream, buffer, TRUE, thread_id,
+                                       last_read_id, n_messages, error);
+  }
+
+  history_reset (stmt);
+
+  if (success && status != SQLITE_DONE) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to export threads. errno: %d, desc: %s",
+                 status, sqlite3_errstr (status));
+    success = FALSE;
+  }
+
+  return success;
+}
+
+static void
+history_export (ChattyHistory *self,
+                GTask         *task)
+{
+  g_autoptr(GOutputStream) stream = NULL;
+  g_autoptr(GString) buffer = NULL;
+  g_autoptr(GError) error = NULL;
+  GFile *file;
+  sqlite3 *db;
+  guint n_messages = 0;
+  gboolean compress;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (history_in_worker (self));
+
+  db = history_get_db (self);
+
+  if (!db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
     return;
   }
 
-  account = g_object_get_data (G_OBJECT (task), "account");
-  /* We currently handle only MM accounts */
-  g_assert (CHATTY_IS_MM_ACCOUNT (account));
+  file = g_object_get_data (G_OBJECT (task), "file");
+  compress = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "compress"));
+  g_assert (G_IS_FILE (file));
 
-  user_id = chatty_item_get_username (CHATTY_ITEM (account));
+  stream = (GOutputStream *)g_file_replace (file, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                                            NULL, &error);
 
-  sqlite3_prepare_v2 (self->db,
-                      /*           0           1             2              3                4  */
-                      "SELECT threads.id,threads.name,threads.alias,threads.encrypted,threads.type,"
-                      "files.url,files.path,visibility "
-                      "FROM threads "
-                      "INNER JOIN accounts ON accounts.id=threads.account_id "
-                      "INNER JOIN users ON users.id=accounts.user_id "
-                      "AND users.username=? AND accounts.protocol=? "
-                      "LEFT JOIN files ON threads.avatar_id=files.id "
-                      "WHERE visibility!=" STRING(THREAD_VISIBILITY_HIDDEN),
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, user_id, "binding when getting threads");
-  history_bind_int (stmt, 2, PROTOCOL_MMS_SMS, "binding when getting threads");
+  if (!stream) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    g_autoptr(GPtrArray) messages = NULL;
-    const char *name, *alias;
-    ChattyChat *chat;
-    int thread_id, visibility;
-    int unread_count;
+  if (compress) {
+    g_autoptr(GConverter) compressor = NULL;
+    GOutputStream *base_stream;
 
-    if (!threads)
-      threads = g_ptr_array_new_full (30, g_object_unref);
+    compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+    base_stream = g_steal_pointer (&stream);
+    stream = g_converter_output_stream_new (base_stream, compressor);
+    g_object_unref (base_stream);
+  }
 
-    thread_id = sqlite3_column_int (stmt, 0);
-    name = (const char *)sqlite3_column_text (stmt, 1);
-    alias = (const char *)sqlite3_column_text (stmt, 2);
-    visibility = sqlite3_column_int (stmt, 7);
+  buffer = g_string_sized_new (HISTORY_EXPORT_BUFFER_SIZE * 2);
+  g_string_append_printf (buffer, HISTORY_EXPORT_HEADER "\t%d\n", HISTORY_EXPORT_VERSION);
 
-    if (sqlite3_column_int (stmt, 4) == THREAD_GROUP_CHAT) {
-      chat = (gpointer)chatty_mm_chat_new (name, alias, CHATTY_PROTOCOL_MMS, FALSE,
-                                           history_value_to_visibility (visibility));
+  /* Read everything in the same transaction, so that the export is consistent */
+  sqlite3_exec (db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  if (history_export_table (self, buffer, "U", "SELECT id,username,alias,type FROM users;", &error) &&
+      history_export_table (self, buffer, "A", "SELECT id,user_id,protocol,enabled FROM accounts;", &error) &&
+      history_export_threads (self, stream, buffer, &n_messages, &error))
+    history_export_flush (stream, buffer, 0, &error);
+
+  sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+
+  if (error) {
+    g_autoptr(GCancellable) cancellable = NULL;
+
+    /* Closing with a cancelled cancellable keeps the file as it was */
+    cancellable = g_cancellable_new ();
+    g_cancellable_cancel (cancellable);
+    g_output_stream_close (stream, cancellable, NULL);
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  if (!g_output_stream_close (stream, NULL, &error)) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  g_debug ("Exported %u messages", n_messages);
+  g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * Split the record @line in place into at most @max fields, which
+ * are unescaped.
+ *
+ * Returns: The number of fields, or @max + 1 if @line has more
+ */
+static guint
+history_import_split (char        *line,
+                      const char **fields,
+                      guint        max)
+{
+  char *field = line;
+  guint n_fields = 0;
+
+  while (TRUE) {
+    char *end, *in, *out;
+
+    /* Not a record we know, don't guess which fields to keep */
+    if (n_fields == max)
+      return max + 1;
+
+    end = strchr (field, '\t');
+    if (end)
+      *end = '\0';
+
+    if (strcmp (field, "\\N") == 0) {
+      fields[n_fields++] = NULL;
     } else {
-      chat = (gpointer)chatty_mm_chat_new (name, alias, CHATTY_PROTOCOL_MMS_SMS, TRUE,
-                                           history_value_to_visibility (visibility));
+      for (in = out = field; *in; in++, out++) {
+        if (*in == '\\' && in[1]) {
+          in++;
+
+          if (*in == 't')
+            *out = '\t';
+          else if (*in == 'n')
+            *out = '\n';
+          else if (*in == 'r')
+            *out = '\r';
+          else
+            *out = *in;
+        } else {
+          *out = *in;
+        }
+      }
+
+      *out = '\0';
+      fields[n_fields++] = field;
+    }
+
+    if (!end)
+      break;
+
+    field = end + 1;
+  }
+
+  return n_fields;
+}
+
+/* Bind the integer @field, or NULL if @field is %NULL */
+static void
+history_import_bind_int (sqlite3_stmt *stmt,
+                         guint         position,
+                         const char   *field)
+{
+  int status;
+
+  if (!field)
+    return;
+
+  status = sqlite3_bind_int64 (stmt, position, g_ascii_strtoll (field, NULL, 10));
+  warn_if_sql_error (status, "binding when importing");
+}
+
+/* Map the exported id @field with @ids, 0 if unknown */
+static int
+history_import_map_id (GHashTable *ids,
+                       const char *field)
+{
+  if (!field)
+    return 0;
+
+  return GPOINTER_TO_INT (g_hash_table_lookup (ids, GINT_TO_POINTER (atoi (field))));
+}
+
+/* Run @stmt, that selects an id, and reset it */
+static int
+history_import_get_id (sqlite3_stmt *stmt)
+{
+  int id = 0;
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    id = sqlite3_column_int (stmt, 0);
+  history_reset (stmt);
+
+  return id;
+}
+
+/* Run @stmt, that inserts a row, and reset it */
+static gboolean
+history_import_insert (ChattyHistory *self,
+                       sqlite3_stmt  *stmt)
+{
+  int status;
+
+  status = sqlite3_step (stmt);
+  history_reset (stmt);
+
+  return status == SQLITE_DONE && sqlite3_changes (self->db) > 0;
+}
+
+/* Returns: %FALSE if the thread couldn't be updated */
+static gboolean
+history_import_end_thread (ChattyHistory *self,
+                           HistoryImport *import)
+{
+  sqlite3_stmt *stmt;
+  int status = SQLITE_DONE;
+
+  if (import->thread_is_new && import->last_read_id) {
+    stmt = history_prepare (self, "UPDATE threads SET last_read_id=?1 WHERE id=?2;");
+    if (!stmt)
+      return FALSE;
+    history_bind_int (stmt, 1, import->last_read_id, "binding when importing thread");
+    history_bind_int (stmt, 2, import->thread_id, "binding when importing thread");
+    status = sqlite3_step (stmt);
+    history_reset (stmt);
+  }
+
+  import->thread_id = 0;
+  import->message_id = 0;
+  import->last_read_id = 0;
+  import->thread_is_new = FALSE;
+
+  return status == SQLITE_DONE;
+}
+
+static int
+history_import_file (ChattyHistory  *self,
+                     HistoryImport  *import,
+                     const char    **fields)
+{
+  const char *mime_type = fields[4];
+  sqlite3_stmt *stmt;
+  int file_id, mime_id = 0;
+
+  if (mime_type) {
+    mime_id = GPOINTER_TO_INT (g_hash_table_lookup (import->mime_types, mime_type));
+
+    if (!mime_id) {
+      stmt = history_prepare (self, "INSERT OR IGNORE INTO mime_type(name) VALUES(?)");
+      if (!stmt)
+        return 0;
+      history_bind_text (stmt, 1, mime_type, "binding when importing file");
+      history_import_insert (self, stmt);
+
+      stmt = history_prepare (self, "SELECT id FROM mime_type WHERE name=?");
+      if (!stmt)
+        return 0;
+      history_bind_text (stmt, 1, mime_type, "binding when importing file");
+      mime_id = history_import_get_id (stmt);
+      g_hash_table_insert (import->mime_types, g_strdup (mime_type), GINT_TO_POINTER (mime_id));
     }
+  }
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO files(url,name,path,mime_type_id,size,status) "
+                          "VALUES(?1,?2,?3,?4,?5,?6);");
+  if (!stmt)
+    return 0;
+  history_bind_text (stmt, 1, fields[1], "binding when importing file");
+  history_bind_text (stmt, 2, fields[2], "binding when importing file");
+  history_bind_text (stmt, 3, fields[3], "binding when importing file");
+  if (mime_id)
+    history_bind_int (stmt, 4, mime_id, "binding when importing file");
+  history_import_bind_int (stmt, 5, fields[5]);
+  history_import_bind_int (stmt, 6, fields[6]);
+
+  /* Files are shared, keep the one we have */
+  if (!history_import_insert (self, stmt)) {
+    stmt = history_prepare (self, "SELECT id FROM files WHERE url=?");
+    if (!stmt)
+      return 0;
+    history_bind_text (stmt, 1, fields[1], "binding when importing file");
+
+    return history_import_get_id (stmt);
+  }
+
+  file_id = sqlite3_last_insert_rowid (self->db);
+
+  if (fields[7] || fields[8] || fields[9]) {
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO file_metadata(file_id,width,height,duration) "
+                            "VALUES(?1,?2,?3,?4)");
+    if (!stmt)
+      return 0;
+    history_bind_int (stmt, 1, file_id, "binding when importing file");
+    history_import_bind_int (stmt, 2, fields[7]);
+    history_import_bind_int (stmt, 3, fields[8]);
+    history_import_bind_int (stmt, 4, fields[9]);
+    history_import_insert (self, stmt);
+  }
+
+  return file_id;
+}
+
+/*
+ * Unlike history_insert_message(), this stores the exported values
+ * as they are, like the sender alias, and needs no #ChattyMessage.
+ *
+ * Returns: The id of the imported message, 0 if it's in the
+ * archive, or -1 on error
+ */
+static int
+history_import_message (ChattyHistory  *self,
+                        HistoryImport  *import,
+                        const char    **fields)
+{
+  sqlite3_stmt *stmt;
+  int sender_id;
+
+  /* New threads have nothing in the archive */
+  if (!import->thread_is_new) {
+    stmt = history_prepare (self,
+                            "SELECT 1 FROM archive.messages "
+                            "WHERE uid=?1 AND thread_id=?2 AND body=?3 AND time=?4;");
+    if (!stmt)
+      return -1;
+    history_bind_text (stmt, 1, fields[1], "binding when importing message");
+    history_bind_int (stmt, 2, import->thread_id, "binding when importing message");
+    history_bind_text (stmt, 3, fields[4], "binding when importing message");
+    history_import_bind_int (stmt, 4, fields[7]);
+
+    if (history_import_get_id (stmt))
+      return 0;
+  }
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,user_alias,body,"
+                          "body_type,direction,time,status,encrypted,subject) "
+                          "VALUES(?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11);");
+  if (!stmt)
+    return -1;
+  history_bind_text (stmt, 1, fields[1], "binding when importing message");
+  history_bind_int (stmt, 2, import->thread_id, "binding when importing message");
+  sender_id = history_import_map_id (import->users, fields[2]);
+  if (sender_id)
+    history_bind_int (stmt, 3, sender_id, "binding when importing message");
+  history_bind_text (stmt, 4, fields[3], "binding when importing message");
+  history_bind_text (stmt, 5, fields[4], "binding when importing message");
+  history_import_bind_int (stmt, 6, fields[5]);
+  history_import_bind_int (stmt, 7, fields[6]);
+  history_import_bind_int (stmt, 8, fields[7]);
+  history_import_bind_int (stmt, 9, fields[8]);
+  history_import_bind_int (stmt, 10, fields[9]);
+  history_bind_text (stmt, 11, fields[10], "binding when importing message");
+
+  if (history_import_insert (self, stmt)) {
+    import->n_messages++;
+
+    return sqlite3_last_insert_rowid (self->db);
+  }
+
+  /* Imported before, or a duplicate */
+  stmt = history_prepare (self,
+                          "SELECT id FROM messages "
+                          "WHERE uid=?1 AND thread_id=?2 AND body=?3 AND time=?4;");
+  if (!stmt)
+    return -1;
+  history_bind_text (stmt, 1, fields[1], "binding when importing message");
+  history_bind_int (stmt, 2, import->thread_id, "binding when importing message");
+  history_bind_text (stmt, 3, fields[4], "binding when importing message");
+  history_import_bind_int (stmt, 4, fields[7]);
+
+  return history_import_get_id (stmt);
+}
+
+static int
+history_import_thread (ChattyHistory  *self,
+                       HistoryImport  *import,
+                       const char    **fields)
+{
+  sqlite3_stmt *stmt;
+  int account_id;
+
+  account_id = history_import_map_id (import->accounts, fields[1]);
+
+  if (!account_id)
+    return 0;
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO threads(account_id,name,alias,type,"
+                          "encrypted,visibility,notification) "
+                          "VALUES(?1,?2,?3,?4,?5,?6,?7);");
+  if (!stmt)
+    return 0;
+  history_bind_int (stmt, 1, account_id, "binding when importing thread");
+  history_bind_text (stmt, 2, fields[2], "binding when importing thread");
+  history_bind_text (stmt, 3, fields[3], "binding when importing thread");
+  history_import_bind_int (stmt, 4, fields[4]);
+  history_import_bind_int (stmt, 5, fields[5]);
+  history_import_bind_int (stmt, 6, fields[6]);
+  history_import_bind_int (stmt, 7, fields[7]);
+  import->thread_is_new = history_import_insert (self, stmt);
+
+  if (import->thread_is_new)
+    return sqlite3_last_insert_rowid (self->db);
+
+  stmt = history_prepare (self,
+                          "SELECT id FROM threads "
+                          "WHERE account_id=?1 AND name=?2 AND type=?3;");
+  if (!stmt)
+    return 0;
+  history_bind_int (stmt, 1, account_id, "binding when importing thread");
+  history_bind_text (stmt, 2, fields[2], "binding when importing thread");
+  history_import_bind_int (stmt, 3, fields[4]);
+
+  return history_import_get_id (stmt);
+}
+
+static int
+history_import_user (ChattyHistory  *self,
+                     const char    **fields)
+{
+  sqlite3_stmt *stmt;
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO users(username,alias,type) "
+                          "VALUES(?1,?2,?3);");
+  if (!stmt)
+    return 0;
+  history_bind_text (stmt, 1, fields[2], "binding when importing user");
+  history_bind_text (stmt, 2, fields[3], "binding when importing user");
+  history_import_bind_int (stmt, 3, fields[4]);
+  history_import_insert (self, stmt);
+
+  stmt = history_prepare (self, "SELECT id FROM users WHERE username=?1 AND type=?2;");
+  if (!stmt)
+    return 0;
+  history_bind_text (stmt, 1, fields[2], "binding when importing user");
+  history_import_bind_int (stmt, 2, fields[4]);
+
+  return history_import_get_id (stmt);
+}
+
+static int
+history_import_account (ChattyHistory  *self,
+                        HistoryImport  *import,
+                        const char    **fields)
+{
+  sqlite3_stmt *stmt;
+  int user_id;
+
+  user_id = history_import_map_id (import->users, fields[2]);
+
+  if (!user_id)
+    return 0;
+
+  stmt = history_prepare (self,
+                          "INSERT OR IGNORE INTO accounts(user_id,protocol,enabled) "
+                          "VALUES(?1,?2,?3);");
+  if (!stmt)
+    return 0;
+  history_bind_int (stmt, 1, user_id, "binding when importing account");
+  history_import_bind_int (stmt, 2, fields[3]);
+  history_import_bind_int (stmt, 3, fields[4]);
+  history_import_insert (self, stmt);
+
+  stmt = history_prepare (self, "SELECT id FROM accounts WHERE user_id=?1 AND protocol=?2;");
+  if (!stmt)
+    return 0;
+  history_bind_int (stmt, 1, user_id, "binding when importing account");
+  history_import_bind_int (stmt, 2, fields[3]);
+
+  return history_import_get_id (stmt);
+}
+
+/*
+ * Add the record @fields to the database.
+ *
+ * Returns: %FALSE if the record is invalid
+ */
+static gboolean
+history_import_record (ChattyHistory  *self,
+                       HistoryImport  *import,
+                       const char    **fields,
+                       guint           n_fields)
+{
+  const char *type = fields[0];
+  sqlite3_stmt *stmt;
+  int id;
+
+  if (!type || !type[0] || type[1])
+    return FALSE;
+
+  switch (type[0]) {
+  case 'U':
+    if (n_fields != 5 || !fields[1] || !fields[2])
+      return FALSE;
+
+    id = history_import_user (self, fields);
+    if (id)
+      g_hash_table_insert (import->users, GINT_TO_POINTER (atoi (fields[1])), GINT_TO_POINTER (id));
+    return id != 0;
+
+  case 'A':
+    if (n_fields != 5 || !fields[1])
+      return FALSE;
+
+    id = history_import_account (self, import, fields);
+    if (id)
+      g_hash_table_insert (import->accounts, GINT_TO_POINTER (atoi (fields[1])), GINT_TO_POINTER (id));
+    return id != 0;
+
+  case 'T':
+    if (n_fields != 8 || !fields[2])
+      return FALSE;
+
+    if (!history_import_end_thread (self, import))
+      return FALSE;
+
+    import->thread_id = history_import_thread (self, import, fields);
+    return import->thread_id != 0;
+
+  case 'R':
+    if (n_fields != 2 || !import->thread_id)
+      return FALSE;
+
+    id = history_import_map_id (import->users, fields[1]);
+    if (!id)
+      return FALSE;
+
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                            "VALUES(?1,?2)");
+    if (!stmt)
+      return FALSE;
+    history_bind_int (stmt, 1, import->thread_id, "binding when importing member");
+    history_bind_int (stmt, 2, id, "binding when importing member");
+    history_import_insert (self, stmt);
+    return TRUE;
+
+  case 'M':
+    if (n_fields != 12 || !import->thread_id || !fields[1] || !fields[4])
+      return FALSE;
+
+    /* 0 if the message is in the archive, its files are skipped */
+    import->message_id = history_import_message (self, import, fields);
+
+    if (import->message_id < 0)
+      return FALSE;
+
+    if (import->message_id && g_strcmp0 (fields[11], "1") == 0)
+      import->last_read_id = import->message_id;
+    return TRUE;
+
+  case 'F':
+    if (n_fields != 10 || !fields[1])
+      return FALSE;
+
+    if (!import->message_id)
+      return TRUE;
+
+    id = history_import_file (self, import, fields);
+    if (!id)
+      return FALSE;
+
+    stmt = history_prepare (self,
+                            "INSERT OR IGNORE INTO message_files(message_id,file_id) "
+                            "VALUES(?1,?2)");
+    if (!stmt)
+      return FALSE;
+    history_bind_int (stmt, 1, import->message_id, "binding when importing message file");
+    history_bind_int (stmt, 2, id, "binding when importing message file");
+    history_import_insert (self, stmt);
+    return TRUE;
+
+  default:
+    return FALSE;
+  }
+}
 
-    messages = get_messages_before_time (self, chat, NULL, thread_id, INT_MAX, 1);
+/* Wrap @base_stream to decompress it, if it's compressed */
+static GInputStream *
+history_import_stream_new (GInputStream  *base_stream,
+                           GError       **error)
+{
+  g_autoptr(GInputStream) stream = NULL;
+  const guchar *data;
+  gsize size;
 
-    unread_count = get_unread_message_count (self, thread_id);
-    chatty_chat_set_unread_count (chat, unread_count);
+  stream = g_buffered_input_stream_new (base_stream);
 
-    chatty_mm_chat_prepend_messages (CHATTY_MM_CHAT (chat), messages);
+  if (g_buffered_input_stream_fill (G_BUFFERED_INPUT_STREAM (stream), 2, NULL, error) < 0)
+    return NULL;
 
-    g_ptr_array_insert (threads, -1, chat);
+  data = g_buffered_input_stream_peek_buffer (G_BUFFERED_INPUT_STREAM (stream), &size);
 
-    {
-      g_autoptr(GPtrArray) members = NULL;
+  /* gzip magic */
+  if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+    g_autoptr(GConverter) decompressor = NULL;
 
-      members = get_sms_thread_members (self, thread_id);
-      chatty_mm_chat_add_users (CHATTY_MM_CHAT (chat), members);
-    }
+    decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+
+    return g_converter_input_stream_new (stream, decompressor);
   }
 
-  sqlite3_finalize (stmt);
-  g_task_return_pointer (task, threads, (GDestroyNotify)g_ptr_array_unref);
+  return g_steal_pointer (&stream);
 }
 
-static void
-history_update_chat (ChattyHistory *self,
-                     GTask         *task)
+/*
+ * Add the records of @stream, a history export, to the database.
+ */
+static gboolean
+history_import_stream (ChattyHistory     *self,
+                       HistoryImport     *import,
+                       GDataInputStream  *stream,
+                       GError           **error)
 {
-  ChattyChat *chat;
+  g_autofree char *header = NULL;
+  GError *local_error = NULL;
+  const char *version;
+  char *line;
+  guint n_line = 1;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  header = g_data_input_stream_read_line (stream, NULL, NULL, error);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
+  if (!header) {
+    if (error && !*error)
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Export is empty");
+    return FALSE;
   }
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  g_assert (CHATTY_IS_CHAT (chat));
-
-  if (insert_or_ignore_thread (self, chat, task))
-    g_task_return_boolean (task, TRUE);
-}
-
-static void
-history_update_user (ChattyHistory *self,
-                     GTask         *task)
-{
-  ChattyAccount *account;
-  const char *user_name, *name;
-  ChattyProtocol protocol;
-  int id;
+  if (!g_str_has_prefix (header, HISTORY_EXPORT_HEADER "\t")) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not a history export");
+    return FALSE;
+  }
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  version = header + strlen (HISTORY_EXPORT_HEADER "\t");
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
+  if (atoi (version) < 1 || atoi (version) > HISTORY_EXPORT_VERSION) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "Unsupported export version %s", version);
+    return FALSE;
   }
 
-  account = g_object_get_data (G_OBJECT (task), "account");
-  g_assert (CHATTY_IS_ACCOUNT (account));
+  while ((line = g_data_input_stream_read_line (stream, NULL, NULL, &local_error))) {
+    const char *fields[HISTORY_EXPORT_MAX_FIELDS];
+    guint n_fields;
+    gboolean valid;
 
-  user_name = chatty_item_get_username (CHATTY_ITEM (account));
-  protocol = chatty_item_get_protocols (CHATTY_ITEM (account));
-  name = chatty_item_get_name (CHATTY_ITEM (account));
+    n_line++;
+    n_fields = history_import_split (line, fields, G_N_ELEMENTS (fields));
+    valid = history_import_record (self, import, fields, n_fields);
+    g_free (line);
 
-  if (!user_name || !*user_name) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Username is empty");
-    return;
+    if (!valid) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid record on line %u", n_line);
+      return FALSE;
+    }
   }
 
-  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-  id = insert_or_ignore_user (self, protocol, user_name, name, task);
-  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+  if (local_error) {
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
 
-  if (!id)
-    return;
+  if (!history_import_end_thread (self, import)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to import thread. errno: %d, desc: %s",
+                 sqlite3_errcode (self->db), sqlite3_errmsg (self->db));
+    return FALSE;
+  }
 
-  g_task_return_boolean (task, TRUE);
+  return TRUE;
 }
 
+/*
+ * Import is done in a single transaction, without the indexes and
+ * triggers on messages, which are created again and caught up with
+ * the imported messages at the end.  That's way faster than keeping
+ * them up to date for each message.
+ */
 static void
-history_delete_chat (ChattyHistory *self,
-                     GTask         *task)
+history_import (ChattyHistory *self,
+                GTask         *task)
 {
-  ChattyChat *chat;
+  g_autoptr(GInputStream) base_stream = NULL;
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GDataInputStream) data_stream = NULL;
+  g_autoptr(GError) error = NULL;
+  HistoryImport import = { 0 };
   sqlite3_stmt *stmt;
-  const char *account, *chat_name;
+  GFile *file;
   int status;
 
   g_assert (CHATTY_IS_HISTORY (self));
@@ -2856,45 +6415,113 @@ history_delete_chat (ChattyHistory *self,
     return;
   }
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  g_assert (CHATTY_IS_CHAT (chat));
+  file = g_object_get_data (G_OBJECT (task), "file");
+  g_assert (G_IS_FILE (file));
 
-  chat_name = chatty_chat_get_chat_name (chat);
+  base_stream = (GInputStream *)g_file_read (file, NULL, &error);
 
-  if (!chat_name || !*chat_name) {
+  if (base_stream)
+    stream = history_import_stream_new (base_stream, &error);
+
+  if (!stream) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  data_stream = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (data_stream, G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+  status = sqlite3_exec (self->db,
+                         "BEGIN TRANSACTION;"
+                         "DROP TRIGGER IF EXISTS messages_fts_insert;"
+                         "DROP TRIGGER IF EXISTS thread_summary_message_insert;"
+                         "DROP TRIGGER IF EXISTS thread_summary_thread_read;"
+                         "DROP INDEX IF EXISTS messages_uid_idx;"
+                         "DROP INDEX IF EXISTS messages_thread_time_idx;"
+                         "DROP INDEX IF EXISTS messages_preview_idx;"
+                         "DROP INDEX IF EXISTS message_files_file_idx;",
+                         NULL, NULL, NULL);
+
+  if (status != SQLITE_OK) {
     g_task_return_new_error (task,
                              G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Error: chat name is empty");
+                             "Failed to start import. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
     return;
   }
 
-  account = chatty_item_get_username (CHATTY_ITEM (chat));
+  import.users = g_hash_table_new (g_direct_hash, g_direct_equal);
+  import.accounts = g_hash_table_new (g_direct_hash, g_direct_equal);
+  import.mime_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  stmt = history_prepare (self, "SELECT coalesce(max(id),0) + 1 FROM messages;");
+  if (!history_prepare_failed (self, stmt, &error))
+    import.first_message_id = history_import_get_id (stmt);
+
+  if (!error && history_import_stream (self, &import, data_stream, &error)) {
+    status = sqlite3_exec (self->db,
+                           HISTORY_MESSAGES_INDEX_SCHEMA
+                           HISTORY_FTS_SCHEMA
+                           HISTORY_SUMMARY_SCHEMA
+                           HISTORY_FILE_REFS_SCHEMA,
+                           NULL, NULL, NULL);
+
+    if (status == SQLITE_OK) {
+      stmt = history_prepare (self,
+                              "INSERT INTO messages_fts(rowid,body,subject) "
+                              "SELECT id,body,subject FROM messages WHERE id>=?;");
+      if (!stmt)
+        status = sqlite3_errcode (self->db);
+    }
 
-  status = sqlite3_prepare_v2 (self->db,
-                               "DELETE FROM threads "
-                               "WHERE threads.type=? AND threads.name=? "
-                               "AND threads.account_id IN ("
-                               "SELECT accounts.id FROM accounts "
-                               "INNER JOIN users "
-                               "ON accounts.id=threads.account_id "
-                               "AND users.id=accounts.user_id AND users.username=?);",
-                               -1, &stmt, NULL);
+    if (status == SQLITE_OK) {
+      history_bind_int (stmt, 1, import.first_message_id, "binding when indexing imported messages");
+      status = sqlite3_step (stmt);
+      history_reset (stmt);
+    }
 
-  history_bind_int (stmt, 1, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
-                    "binding when deleting thread");
-  history_bind_text (stmt, 2, chat_name, "binding when deleting thread");
-  history_bind_text (stmt, 3, account, "binding when deleting thread");
+    if (status == SQLITE_DONE) {
+      stmt = history_prepare (self,
+                              HISTORY_SUMMARY_UPDATE_SQL
+                              "WHERE threads.id IN (SELECT thread_id FROM messages WHERE id>=?);");
+      if (!stmt)
+        status = sqlite3_errcode (self->db);
+    }
 
-  status = sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+    if (status == SQLITE_DONE && stmt) {
+      history_bind_int (stmt, 1, import.first_message_id, "binding when summarizing imported threads");
+      status = sqlite3_step (stmt);
+      history_reset (stmt);
+    }
 
-  if (status == SQLITE_DONE)
-    g_task_return_boolean (task, TRUE);
-  else
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to delete chat. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (self->db));
+    if (status == SQLITE_DONE)
+      status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+
+    if (status != SQLITE_OK)
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to import. errno: %d, desc: %s",
+                   status, sqlite3_errmsg (self->db));
+  }
+
+  /* Rolling back brings back the indexes and triggers too */
+  if (error)
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+
+  /* New rows may have been added, or added ones rolled back */
+  history_ids_clear (self);
+
+  g_hash_table_unref (import.users);
+  g_hash_table_unref (import.accounts);
+  g_hash_table_unref (import.mime_types);
+
+  if (error) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  g_debug ("Imported %u messages", import.n_messages);
+  g_task_return_boolean (task, TRUE);
 }
 
 static void
@@ -2929,9 +6556,11 @@ history_load_account (ChattyHistory *self,
     return;
   }
 
-  sqlite3_prepare_v2 (self->db, "SELECT users.alias,files.url,files.path FROM users "
-                      "LEFT JOIN files ON files.id=users.avatar_id "
-                      "WHERE users.username=? LIMIT 1;", -1, &stmt, NULL);
+  stmt = history_prepare (self, "SELECT users.alias,files.url,files.path FROM users "
+                          "LEFT JOIN files ON files.id=users.avatar_id "
+                          "WHERE users.username=? LIMIT 1;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
   history_bind_text (stmt, 1, user_name, "binding when getting user details");
 
   if (sqlite3_step (stmt) == SQLITE_ROW) {
@@ -2948,8 +6577,8 @@ history_load_account (ChattyHistory *self,
     g_object_set_data_full (object, "avatar-path", g_strdup (avatar_path), g_free);
   }
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting user details");
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting user details");
 
   g_task_return_boolean (task, TRUE);
 }
@@ -2991,24 +6620,32 @@ history_set_last_read_msg (ChattyHistory *self,
     return;
   }
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT messages.id FROM messages "
-                      "INNER JOIN threads ON threads.id=messages.thread_id AND threads.id=?"
-                      "WHERE messages.uid=?;", -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT messages.id FROM messages "
+                          "INNER JOIN threads ON threads.id=messages.thread_id AND threads.id=?"
+                          "WHERE messages.uid=?;");
+  if (history_prepare_failed_task (self, stmt, task)) {
+    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+    return;
+  }
   history_bind_int (stmt, 1, thread_id, "binding when setting last read message");
   history_bind_text (stmt, 2, uid, "binding when setting last read message");
 
   if (sqlite3_step (stmt) == SQLITE_ROW)
     message_id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
 
-  sqlite3_prepare_v2 (self->db,
-                      "UPDATE threads SET last_read_id=iif(?1 = 0, null, ?1) "
-                      "WHERE threads.id=?2;", -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "UPDATE threads SET last_read_id=iif(?1 = 0, null, ?1) "
+                          "WHERE threads.id=?2;");
+  if (history_prepare_failed_task (self, stmt, task)) {
+    sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+    return;
+  }
   history_bind_int (stmt, 1, message_id, "binding when setting last read message");
   history_bind_int (stmt, 2, thread_id, "binding when setting last read message");
   sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  history_reset (stmt);
   sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
 
   g_task_return_boolean (task, TRUE);
@@ -3024,6 +6661,14 @@ history_get_chat_timestamp (ChattyHistory *self,
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
 
   uuid = g_object_get_data (G_OBJECT (task), "uuid");
   room = g_object_get_data (G_OBJECT (task), "room");
@@ -3031,18 +6676,20 @@ history_get_chat_timestamp (ChattyHistory *self,
   g_assert (uuid);
   g_assert (room);
 
-  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.name=? "
-                      "WHERE uid=? LIMIT 1;", -1, &stmt, NULL);
+  stmt = history_prepare (self, "SELECT time FROM messages "
+                          "INNER JOIN threads "
+                          "ON threads.name=? "
+                          "WHERE uid=? LIMIT 1;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
   history_bind_text (stmt, 1, room, "binding when getting timestamp");
   history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
 
   if (sqlite3_step (stmt) == SQLITE_ROW)
     timestamp = sqlite3_column_int (stmt, 0);
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting timestamp");
 
   g_task_return_int (task, timestamp);
 }
@@ -3057,27 +6704,36 @@ history_get_im_timestamp (ChattyHistory *self,
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
 
   uuid = g_object_get_data (G_OBJECT (task), "uuid");
   account = g_object_get_data (G_OBJECT (task), "account");
 
-  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.account_id=accounts.id "
-                      "INNER JOIN accounts "
-                      "ON accounts.user_id=users.id "
-                      "INNER JOIN users "
-                      "ON users.id=accounts.user_id AND users.username=? "
-                      "WHERE messages.uid=? LIMIT 1",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self, "SELECT time FROM messages "
+                          "INNER JOIN threads "
+                          "ON threads.account_id=accounts.id "
+                          "INNER JOIN accounts "
+                          "ON accounts.user_id=users.id "
+                          "INNER JOIN users "
+                          "ON users.id=accounts.user_id AND users.username=? "
+                          "WHERE messages.uid=? LIMIT 1");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
   history_bind_text (stmt, 1, account, "binding when getting timestamp");
   history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
 
   if (sqlite3_step (stmt) == SQLITE_ROW)
     timestamp = sqlite3_column_int (stmt, 0);
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting timestamp");
 
   g_task_return_int (task, timestamp);
 }
@@ -3092,28 +6748,36 @@ history_get_last_message_time (ChattyHistory *self,
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
 
   account = g_object_get_data (G_OBJECT (task), "account");
   room = g_object_get_data (G_OBJECT (task), "room");
 
-  status = sqlite3_prepare_v2 (self->db,
-                               "SELECT max(time),messages.id FROM messages "
-                               "INNER JOIN threads "
-                               "ON threads.name=? AND messages.thread_id=threads.id "
-                               "INNER JOIN accounts "
-                               "ON accounts.id=threads.account_id "
-                               "INNER JOIN users "
-                               "ON users.id=accounts.user_id AND users.username=? "
-                               "ORDER BY messages.id DESC LIMIT 1;",
-                               -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT max(last_message_time) FROM thread_summary "
+                          "INNER JOIN threads "
+                          "ON threads.name=? AND thread_summary.thread_id=threads.id "
+                          "INNER JOIN accounts "
+                          "ON accounts.id=threads.account_id "
+                          "INNER JOIN users "
+                          "ON users.id=accounts.user_id AND users.username=?;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
   history_bind_text (stmt, 1, room, "binding when getting timestamp");
   history_bind_text (stmt, 2, account, "binding when getting timestamp");
 
   if (sqlite3_step (stmt) == SQLITE_ROW)
     timestamp = sqlite3_column_int (stmt, 0);
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting timestamp");
 
   g_task_return_int (task, timestamp);
 }
@@ -3129,6 +6793,14 @@ history_exists (ChattyHistory *self,
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
 
   account = g_object_get_data (G_OBJECT (task), "account");
   room = g_object_get_data (G_OBJECT (task), "room");
@@ -3137,16 +6809,17 @@ history_exists (ChattyHistory *self,
   g_assert (account);
   g_assert (room || who);
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.name=? "
-                      "INNER JOIN accounts "
-                      "ON threads.account_id=accounts.id "
-                      "INNER JOIN users "
-                      "ON users.id=accounts.user_id AND users.username=? "
-                      "WHERE messages.thread_id=threads.id LIMIT 1;",
-                      -1, &stmt, NULL);
+  stmt = history_prepare (self,
+                          "SELECT time FROM messages "
+                          "INNER JOIN threads "
+                          "ON threads.name=? "
+                          "INNER JOIN accounts "
+                          "ON threads.account_id=accounts.id "
+                          "INNER JOIN users "
+                          "ON users.id=accounts.user_id AND users.username=? "
+                          "WHERE messages.thread_id=threads.id LIMIT 1;");
+  if (history_prepare_failed_task (self, stmt, task))
+    return;
 
   if (room)
     history_bind_text (stmt, 1, room, "binding when getting timestamp");
@@ -3158,26 +6831,206 @@ history_exists (ChattyHistory *self,
   if (sqlite3_step (stmt) == SQLITE_ROW)
     found = TRUE;
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  status = history_reset (stmt);
+  warn_if_sql_error (status, "resetting when getting timestamp");
 
   g_task_return_boolean (task, found);
 }
 
+/*
+ * Convert the user provided @text to an FTS5 query string.
+ * Every word is quoted so that FTS5 operators in @text are
+ * matched literally, and is matched as a prefix so that
+ * partially typed words find results.
+ */
+static char *
+history_fts_query_from_text (const char *text)
+{
+  g_auto(GStrv) words = NULL;
+  GString *query;
+
+  if (!text)
+    return NULL;
+
+  words = g_strsplit_set (text, " \t\n\r", -1);
+  query = g_string_new (NULL);
+
+  for (guint i = 0; words[i]; i++) {
+    g_autofree char *escaped = NULL;
+    g_auto(GStrv) parts = NULL;
+
+    if (!*words[i])
+      continue;
+
+    parts = g_strsplit (words[i], "\"", -1);
+    escaped = g_strjoinv ("\"\"", parts);
+
+    if (query->len)
+      g_string_append_c (query, ' ');
+    g_string_append_printf (query, "\"%s\"*", escaped);
+  }
+
+  if (!query->len) {
+    g_string_free (query, TRUE);
+    return NULL;
+  }
+
+  return g_string_free (query, FALSE);
+}
+
+static void
+history_search_messages (ChattyHistory *self,
+                         GTask         *task)
+{
+  GPtrArray *messages = NULL;
+  sqlite3_stmt *stmt;
+  const char *query, *account;
+  guint limit, offset;
+  int status, protocol;
+  sqlite3 *db;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (history_in_worker (self));
+
+  db = history_get_db (self);
+
+  if (!db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  query = g_object_get_data (G_OBJECT (task), "query");
+  account = g_object_get_data (G_OBJECT (task), "account");
+  protocol = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "protocol"));
+  limit = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "limit"));
+  offset = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "offset"));
+
+  g_assert (query && *query);
+  g_assert (limit != 0);
+
+  /* Matches of both databases, each with its own full text index */
+  status = sqlite3_prepare_v2 (db,
+                               /*           0         1               2             3 */
+                               "SELECT messages.time,direction,messages.body,messages.uid,"
+                               /*             4                         5           6 */
+                               "coalesce(users.alias,users.username),body_type,messages.status,"
+                               /*      7              8            9 */
+                               "messages.subject,threads.name,threads.type,"
+                               /*     10  */
+                               "messages.snippet "
+                               "FROM ("
+                               HISTORY_SEARCH_SQL ("main")
+                               " UNION ALL "
+                               HISTORY_SEARCH_SQL ("archive")
+                               ") AS messages "
+                               "INNER JOIN threads ON threads.id=messages.thread_id "
+                               "INNER JOIN accounts ON accounts.id=threads.account_id "
+                               "INNER JOIN users AS a ON a.id=accounts.user_id "
+                               "LEFT JOIN users ON users.id=messages.sender_id "
+                               "WHERE (?2 IS NULL OR (a.username=?2 AND accounts.protocol=?5)) "
+                               "AND (messages.status !=" STRING(MESSAGE_STATUS_DRAFT) " OR messages.status is null) "
+                               "AND threads.visibility!=" STRING(THREAD_VISIBILITY_HIDDEN) " "
+                               "ORDER BY messages.rank LIMIT ?3 OFFSET ?4;",
+                               -1, &stmt, NULL);
+
+  if (status != SQLITE_OK) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to search messages. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (db));
+    sqlite3_finalize (stmt);
+    return;
+  }
+
+  history_bind_text (stmt, 1, query, "binding when searching messages");
+  if (account) {
+    history_bind_text (stmt, 2, account, "binding when searching messages");
+    history_bind_int (stmt, 5, protocol, "binding when searching messages");
+  }
+  history_bind_int (stmt, 3, limit, "binding when searching messages");
+  history_bind_int (stmt, 4, offset, "binding when searching messages");
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW) {
+    g_autoptr(ChattyContact) contact = NULL;
+    ChattyMessage *message;
+    const char *who, *chat_name, *snippet;
+
+    if (!messages)
+      messages = g_ptr_array_new_full (limit, g_object_unref);
+
+    who = (const char *)sqlite3_column_text (stmt, 4);
+    chat_name = (const char *)sqlite3_column_text (stmt, 8);
+    snippet = (const char *)sqlite3_column_text (stmt, 10);
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, who);
+    chatty_contact_set_value (contact, who);
+    message = chatty_message_new (CHATTY_ITEM (contact),
+                                  (const char *)sqlite3_column_text (stmt, 2),
+                                  (const char *)sqlite3_column_text (stmt, 3),
+                                  sqlite3_column_int (stmt, 0),
+                                  history_value_to_message_type (sqlite3_column_int (stmt, 5)),
+                                  history_direction_from_value (sqlite3_column_int (stmt, 1)),
+                                  history_msg_status_from_value (sqlite3_column_int (stmt, 6)));
+    chatty_message_set_subject (message, (const char *)sqlite3_column_text (stmt, 7));
+
+    g_object_set_data_full (G_OBJECT (message), "chat-name", g_strdup (chat_name), g_free);
+    g_object_set_data_full (G_OBJECT (message), "snippet", g_strdup (snippet), g_free);
+    g_object_set_data (G_OBJECT (message), "is-im",
+                       GINT_TO_POINTER (sqlite3_column_int (stmt, 9) == THREAD_DIRECT_CHAT));
+
+    g_ptr_array_add (messages, message);
+  }
+
+  if (status != SQLITE_DONE) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to search messages. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (db));
+    g_clear_pointer (&messages, g_ptr_array_unref);
+  } else {
+    g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+  }
+
+  sqlite3_finalize (stmt);
+}
+
 static gpointer
 chatty_history_worker (gpointer user_data)
 {
   ChattyHistory *self = user_data;
+  gboolean maintaining = FALSE;
 
   g_assert (CHATTY_IS_HISTORY (self));
 
   do {
     ChattyCallback callback;
-    g_autoptr(GTask) task = g_async_queue_pop (self->queue);
+    g_autoptr(GTask) task = NULL;
+
+    /* Between maintenance slices, only check for new tasks */
+    task = history_queue_pop (self->queue, maintaining ? 0 : HISTORY_CHECKPOINT_INTERVAL);
+
+    /* Idle, flush the WAL to the database file */
+    if (!task) {
+      if (!maintaining) {
+        history_queue_log_stats (self->queue, "write");
+        history_queue_log_stats (self->read_queue, "read");
+        history_ids_log_stats (self);
+        history_checkpoint (self);
+      }
+
+      maintaining = history_maintain (self);
+      continue;
+    }
 
-    g_assert (task);
+    /* Resume maintenance, if any left, once idle again */
+    maintaining = FALSE;
     callback = g_task_get_task_data (task);
     callback (self, task);
+    history_queue_task_done (self->queue);
 
     if (callback == history_close_db)
       break;
@@ -3204,8 +7057,13 @@ chatty_history_finalize (GObject *object)
   if (self->db)
     g_warning ("Database not closed");
 
-  g_clear_pointer (&self->queue, g_async_queue_unref);
+  g_clear_pointer (&self->queue, history_queue_free);
+  g_clear_pointer (&self->read_queue, history_queue_free);
+  g_clear_pointer (&self->readers, g_ptr_array_unref);
+  g_clear_pointer (&self->statements, g_hash_table_unref);
+  g_clear_pointer (&self->ids, g_hash_table_unref);
   g_free (self->db_path);
+  g_free (self->archive_path);
 
   G_OBJECT_CLASS (chatty_history_parent_class)->finalize (object);
 }
@@ -3222,7 +7080,49 @@ chatty_history_class_init (ChattyHistoryClass *klass)
 static void
 chatty_history_init (ChattyHistory *self)
 {
-  self->queue = g_async_queue_new ();
+  self->queue = history_queue_new ();
+  self->read_queue = history_queue_new ();
+  self->readers = g_ptr_array_new_with_free_func (g_free);
+  self->statements = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                            (GDestroyNotify)sqlite3_finalize);
+  self->ids = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                     (GDestroyNotify)history_id_free);
+}
+
+/* Queue @task to the worker thread */
+static void
+history_push (ChattyHistory   *self,
+              GTask           *task,
+              HistoryPriority  priority)
+{
+  history_queue_push (self->queue, task, priority);
+}
+
+/*
+ * Queue the read-only @task to the readers if any, or else to
+ * the worker thread.  If @ordered, @task sees every write queued
+ * before it, except for bulk writes which would stall the UI.
+ * Otherwise it may run before them, which is fine for reads that
+ * don't depend on pending writes.
+ */
+static void
+history_push_read (ChattyHistory *self,
+                   GTask         *task,
+                   gboolean       ordered)
+{
+  guint barrier = 0;
+
+  if (!g_atomic_int_get (&self->readers_active)) {
+    /* Ordered reads queue behind the single writes, not the bulk ones */
+    history_push (self, task, ordered ? HISTORY_PRIORITY_WRITE : HISTORY_PRIORITY_UI);
+    return;
+  }
+
+  if (ordered)
+    barrier = history_queue_get_last_seq (self->queue);
+
+  g_object_set_data (G_OBJECT (task), "barrier", GUINT_TO_POINTER (barrier));
+  history_queue_push (self->read_queue, task, HISTORY_PRIORITY_UI);
 }
 
 /**
@@ -3258,7 +7158,9 @@ chatty_history_open_async (ChattyHistory       *self,
                            gpointer             user_data)
 {
   g_autoptr(GTask) task = NULL;
-  const char *country;
+  ChattySettings *settings;
+  const char *country, *durability;
+  guint hot_days, hot_messages;
 
   g_return_if_fail (CHATTY_IS_HISTORY (self));
   g_return_if_fail (dir && *dir);
@@ -3280,12 +7182,19 @@ chatty_history_open_async (ChattyHistory       *self,
                                         chatty_history_worker,
                                         self);
 
-  country = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+  settings = chatty_settings_get_default ();
+  country = chatty_settings_get_country_iso_code (settings);
+  durability = chatty_settings_get_history_durability (settings);
+  chatty_settings_get_history_hot_window (settings, &hot_days, &hot_messages);
   g_object_set_data_full (G_OBJECT (task), "dir", dir, g_free);
   g_object_set_data_full (G_OBJECT (task), "file-name", g_strdup (file_name), g_free);
   g_object_set_data_full (G_OBJECT (task), "country-code", g_strdup (country), g_free);
+  g_object_set_data_full (G_OBJECT (task), "durability", g_strdup (durability), g_free);
+  g_object_set_data (G_OBJECT (task), "hot-days", GUINT_TO_POINTER (hot_days));
+  g_object_set_data (G_OBJECT (task), "hot-messages", GUINT_TO_POINTER (hot_messages));
 
-  g_async_queue_push (self->queue, g_steal_pointer (&task));
+  /* Run before any task, even the ones queued before */
+  history_push (self, g_steal_pointer (&task), HISTORY_PRIORITY_OPEN);
 }
 
 /**
@@ -3331,6 +7240,30 @@ chatty_history_is_closed (ChattyHistory *self)
   return !self->db;
 }
 
+/**
+ * chatty_history_get_statement_stats:
+ * @self: a #ChattyHistory
+ * @hits: (out) (optional): Location to store cache hits
+ * @misses: (out) (optional): Location to store cache misses
+ *
+ * Get the number of times a prepared statement was reused
+ * from the statement cache (@hits) and the number of times
+ * a statement had to be compiled (@misses).
+ */
+void
+chatty_history_get_statement_stats (ChattyHistory *self,
+                                    guint         *hits,
+                                    guint         *misses)
+{
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+
+  if (hits)
+    *hits = g_atomic_int_get (&self->statement_hits);
+
+  if (misses)
+    *misses = g_atomic_int_get (&self->statement_misses);
+}
+
 /**
  * chatty_history_close_async:
  * @self: a #ChattyHistory
@@ -3354,7 +7287,8 @@ chatty_history_close_async (ChattyHistory       *self,
   g_task_set_source_tag (task, chatty_history_close_async);
   g_task_set_task_data (task, history_close_db, NULL);
 
-  g_async_queue_push (self->queue, task);
+  /* Run after every task queued before */
+  history_push (self, task, HISTORY_PRIORITY_IDLE);
 }
 
 /**
@@ -3422,7 +7356,8 @@ chatty_history_get_messages_async  (ChattyHistory       *self,
   g_object_set_data_full (G_OBJECT (task), "message", start, g_object_unref);
   g_object_set_data (G_OBJECT (task), "limit", GINT_TO_POINTER (limit));
 
-  g_async_queue_push (self->queue, task);
+  /* Older messages are already stored, don't wait for pending writes */
+  history_push_read (self, task, !start);
 }
 
 /**
@@ -3450,9 +7385,22 @@ chatty_history_get_messages_finish (ChattyHistory  *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_get_draft_async:
+ * @self: a #ChattyHistory
+ * @chat: a #ChattyChat
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
+ *
+ * Load the draft message of @chat.  If @cancellable is
+ * cancelled before the draft is loaded, the query isn't
+ * run at all.  Complete with chatty_history_get_draft_finish().
+ */
 void
 chatty_history_get_draft_async (ChattyHistory       *self,
                                 ChattyChat          *chat,
+                                GCancellable        *cancellable,
                                 GAsyncReadyCallback  callback,
                                 gpointer             user_data)
 {
@@ -3460,13 +7408,15 @@ chatty_history_get_draft_async (ChattyHistory       *self,
 
   g_return_if_fail (CHATTY_IS_HISTORY (self));
   g_return_if_fail (CHATTY_IS_CHAT (chat));
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-  task = g_task_new (self, NULL, callback, user_data);
+  task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_source_tag (task, chatty_history_get_draft_async);
   g_task_set_task_data (task, history_get_chat_draft_message, NULL);
   g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
 
-  g_async_queue_push_front (self->queue, task);
+  /* Drafts are written only from the same chat, don't wait for other writes */
+  history_push_read (self, task, FALSE);
 }
 
 char *
@@ -3489,7 +7439,8 @@ chatty_history_get_draft_finish (ChattyHistory  *self,
  * @callback: a #GAsyncReadyCallback, or %NULL
  * @user_data: closure data for @callback
  *
- * Store @message content to database.
+ * Store @message content to database.  If @callback
+ * is %NULL, errors are logged.
  */
 void
 chatty_history_add_message_async (ChattyHistory       *self,
@@ -3504,13 +7455,18 @@ chatty_history_add_message_async (ChattyHistory       *self,
   g_return_if_fail (CHATTY_IS_CHAT (chat));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "saving message";
+  }
+
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, chatty_history_add_message_async);
   g_task_set_task_data (task, history_add_message, NULL);
   g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
   g_object_set_data_full (G_OBJECT (task), "message", g_object_ref (message), g_object_unref);
 
-  g_async_queue_push (self->queue, task);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 /**
@@ -3536,6 +7492,81 @@ chatty_history_add_message_finish  (ChattyHistory  *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_add_messages_async:
+ * @self: a #ChattyHistory
+ * @chat: the #ChattyChat @messages belong to
+ * @messages: A #GPtrArray of #ChattyMessage
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Store all @messages to database in a single transaction.
+ * This is faster than storing messages one by one, and
+ * should be preferred when loading a backlog of messages.
+ * Single writes and reads queued later may run before it.
+ * @messages shouldn't be modified until the operation completes.
+ * If @callback is %NULL, errors are logged.
+ */
+void
+chatty_history_add_messages_async (ChattyHistory       *self,
+                                   ChattyChat          *chat,
+                                   GPtrArray           *messages,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+  g_return_if_fail (messages);
+
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "saving messages";
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_add_messages_async);
+
+  if (!messages->len) {
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+    return;
+  }
+
+  g_task_set_task_data (task, history_add_messages, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+  g_object_set_data_full (G_OBJECT (task), "messages",
+                          g_ptr_array_ref (messages),
+                          (GDestroyNotify)g_ptr_array_unref);
+
+  /* Don't hold up single messages and the chat being opened */
+  history_push (self, task, HISTORY_PRIORITY_BULK);
+}
+
+/**
+ * chatty_history_add_messages_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_add_messages_async() call.
+ *
+ * Returns: %TRUE if saving all messages succeeded.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_add_messages_finish (ChattyHistory  *self,
+                                    GAsyncResult   *result,
+                                    GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 void
 chatty_history_get_chats_async (ChattyHistory       *self,
                                 ChattyAccount       *account,
@@ -3558,7 +7589,7 @@ chatty_history_get_chats_async (ChattyHistory       *self,
   g_task_set_task_data (task, history_get_chats, NULL);
   g_object_set_data_full (G_OBJECT (task), "account", g_object_ref (account), g_object_unref);
 
-  g_async_queue_push (self->queue, task);
+  history_push_read (self, task, TRUE);
 }
 
 GPtrArray *
@@ -3573,110 +7604,376 @@ chatty_history_get_chats_finish (ChattyHistory  *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_search_async:
+ * @self: a #ChattyHistory
+ * @query: The text to search for
+ * @account: (nullable): a #ChattyAccount to limit the search to
+ * @limit: a non-zero number
+ * @offset: The number of matches to skip
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Search message body and subject for the words in @query.
+ * Every word in @query is matched as a prefix of a word in
+ * the message.  If @account is %NULL messages from every
+ * account are searched.
+ *
+ * Use @limit and @offset to load more results.  Finish
+ * with chatty_history_search_finish() to get the result.
+ */
+void
+chatty_history_search_async (ChattyHistory       *self,
+                             const char          *query,
+                             ChattyAccount       *account,
+                             guint                limit,
+                             guint                offset,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GTask *task;
+  char *fts_query;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (query);
+  g_return_if_fail (!account || CHATTY_IS_ACCOUNT (account));
+  g_return_if_fail (limit != 0);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_search_async);
+
+  fts_query = history_fts_query_from_text (query);
+
+  if (!fts_query) {
+    g_task_return_pointer (task, NULL, NULL);
+    g_object_unref (task);
+    return;
+  }
+
+  g_task_set_task_data (task, history_search_messages, NULL);
+  g_object_set_data_full (G_OBJECT (task), "query", fts_query, g_free);
+  if (account) {
+    g_object_set_data_full (G_OBJECT (task), "account",
+                            g_strdup (chatty_item_get_username (CHATTY_ITEM (account))),
+                            g_free);
+    g_object_set_data (G_OBJECT (task), "protocol",
+                       GINT_TO_POINTER (history_protocol_to_value (chatty_item_get_protocols (CHATTY_ITEM (account)))));
+  }
+  g_object_set_data (G_OBJECT (task), "limit", GUINT_TO_POINTER (limit));
+  g_object_set_data (G_OBJECT (task), "offset", GUINT_TO_POINTER (offset));
+
+  history_push_read (self, task, TRUE);
+}
+
+/**
+ * chatty_history_search_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_search_async() call.
+ *
+ * The matches are sorted by relevance, best match first.
+ * Each #ChattyMessage has "chat-name" string, "snippet"
+ * string with the matching part of the message and "is-im"
+ * boolean (as pointer) set with g_object_set_data().
+ *
+ * Returns: (element-type #ChattyMessage) (transfer full):
+ * An array of #ChattyMessage or %NULL if nothing matched
+ * or on error.  Free with g_ptr_array_unref() or similar.
+ */
+GPtrArray *
+chatty_history_search_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_update_chat_async:
+ * @self: a #ChattyHistory
+ * @chat: a #ChattyChat
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Store the details of @chat (name, avatar, etc.) to
+ * the database.  If @callback is %NULL, errors are logged.
+ */
+void
+chatty_history_update_chat_async (ChattyHistory       *self,
+                                  ChattyChat          *chat,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "updating chat";
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_update_chat_async);
+  g_task_set_task_data (task, history_update_chat, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
+}
+
+/**
+ * chatty_history_update_chat_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_update_chat_async() call.
+ *
+ * Returns: %TRUE if the chat was updated.  %FALSE
+ * otherwise with @error set.
+ */
 gboolean
-chatty_history_update_chat (ChattyHistory *self,
-                            ChattyChat    *chat)
+chatty_history_update_chat_finish (ChattyHistory  *self,
+                                   GAsyncResult   *result,
+                                   GError        **error)
 {
-  g_autoptr(GTask) task = NULL;
-  g_autoptr(GError) error = NULL;
-  gboolean status;
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_update_user_async:
+ * @self: a #ChattyHistory
+ * @account: a #ChattyAccount
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Store the details of @account to the database.
+ * If @callback is %NULL, errors are logged.
+ */
+void
+chatty_history_update_user_async (ChattyHistory       *self,
+                                  ChattyAccount       *account,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_ACCOUNT (account));
+
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "updating user";
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_update_user_async);
+  g_task_set_task_data (task, history_update_user, NULL);
+  g_object_ref (account);
+  g_object_set_data_full (G_OBJECT (task), "account", account, g_object_unref);
+
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
+}
 
+/**
+ * chatty_history_update_user_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_update_user_async() call.
+ *
+ * Returns: %TRUE if the user was updated.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_update_user_finish (ChattyHistory  *self,
+                                   GAsyncResult   *result,
+                                   GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_delete_chat_async:
+ * @self: a #ChattyHistory
+ * @chat: the #ChattyChat to delete
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Delete all messages belonging to @chat from
+ * database.  To get the result, finish with
+ * chatty_history_delete_chat_finish().  If
+ * @callback is %NULL, errors are logged.
+ */
+void
+chatty_history_delete_chat_async (ChattyHistory       *self,
+                                  ChattyChat          *chat,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "deleting chat";
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_delete_chat_async);
+  g_task_set_task_data (task, history_delete_chat, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
+}
+
+/**
+ * chatty_history_delete_chat_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_delete_chat_async() call.
+ *
+ * Returns: %TRUE if saving message succeeded.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_delete_chat_finish (ChattyHistory  *self,
+                                   GAsyncResult   *result,
+                                   GError        **error)
+{
   g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
-  g_return_val_if_fail (CHATTY_IS_CHAT (chat), FALSE);
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
-  g_task_set_source_tag (task, chatty_history_update_chat);
-  g_task_set_task_data (task, history_update_chat, NULL);
-  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
 
-  g_async_queue_push (self->queue, task);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
 
-  history_db_wait_for_completion (task);
+/**
+ * chatty_history_export_async:
+ * @self: a #ChattyHistory
+ * @file: The #GFile to export to
+ * @compress: Whether to compress with gzip
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
+ *
+ * Export the threads, messages and references to the files
+ * of the messages to @file, which is replaced, in a format
+ * that chatty_history_import_async() can read.  Finish with
+ * chatty_history_export_finish().
+ */
+void
+chatty_history_export_async (ChattyHistory       *self,
+                             GFile               *file,
+                             gboolean             compress,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GTask *task;
 
-  status = g_task_propagate_boolean (task, &error);
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (callback);
 
-  if (error)
-    g_warning ("Error updating chat: %s", error->message);
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_export_async);
+  g_task_set_task_data (task, history_export, NULL);
+  g_object_set_data_full (G_OBJECT (task), "file", g_object_ref (file), g_object_unref);
+  g_object_set_data (G_OBJECT (task), "compress", GINT_TO_POINTER (!!compress));
 
-  return status;
+  history_push_read (self, task, TRUE);
 }
 
+/**
+ * chatty_history_export_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_export_async() call.
+ *
+ * Returns: %TRUE if the history was exported.  %FALSE
+ * otherwise with @error set.
+ */
 gboolean
-chatty_history_update_user (ChattyHistory *self,
-                            ChattyAccount *account)
+chatty_history_export_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
 {
-  g_autoptr(GTask) task = NULL;
-  g_autoptr(GError) error = NULL;
-  gboolean status;
-
   g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
-  g_return_val_if_fail (CHATTY_IS_ACCOUNT (account), FALSE);
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
-  g_task_set_source_tag (task, chatty_history_update_user);
-  g_task_set_task_data (task, history_update_user, NULL);
-  g_object_ref (account);
-  g_object_set_data_full (G_OBJECT (task), "account", account, g_object_unref);
-
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-
-  status = g_task_propagate_boolean (task, &error);
-
-  if (error)
-    g_warning ("Error updating user: %s", error->message);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
 
-  return status;
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 /**
- * chatty_history_delete_chat_async:
+ * chatty_history_import_async:
  * @self: a #ChattyHistory
- * @chat: the #ChattyChat to delete
- * @callback: a #GAsyncReadyCallback, or %NULL
+ * @file: The #GFile to import from
+ * @callback: a #GAsyncReadyCallback
  * @user_data: closure data for @callback
  *
- * Delete all messages belonging to @chat from
- * database.  To get the result, finish with
- * chatty_history_delete_chat_finish()
+ * Add the history exported to @file with
+ * chatty_history_export_async(), compressed or not, to the
+ * database.  Messages already in the database are skipped.
+ * Either everything is imported or nothing is.  Finish with
+ * chatty_history_import_finish().
  */
 void
-chatty_history_delete_chat_async (ChattyHistory       *self,
-                                  ChattyChat          *chat,
-                                  GAsyncReadyCallback  callback,
-                                  gpointer             user_data)
+chatty_history_import_async (ChattyHistory       *self,
+                             GFile               *file,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
 {
   GTask *task;
 
   g_return_if_fail (CHATTY_IS_HISTORY (self));
-  g_return_if_fail (CHATTY_IS_CHAT (chat));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (callback);
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, chatty_history_delete_chat_async);
-  g_task_set_task_data (task, history_delete_chat, NULL);
-  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+  g_task_set_source_tag (task, chatty_history_import_async);
+  g_task_set_task_data (task, history_import, NULL);
+  g_object_set_data_full (G_OBJECT (task), "file", g_object_ref (file), g_object_unref);
 
-  g_async_queue_push (self->queue, task);
+  history_push (self, task, HISTORY_PRIORITY_BULK);
 }
 
 /**
- * chatty_history_delete_chat_finish:
+ * chatty_history_import_finish:
  * @self: a #ChattyHistory
  * @result: a #GAsyncResult provided to callback
  * @error: a location for a #GError or %NULL
  *
- * Completes chatty_history_delete_chat_async() call.
+ * Completes chatty_history_import_async() call.
  *
- * Returns: %TRUE if saving message succeeded.  %FALSE
+ * Returns: %TRUE if the history was imported.  %FALSE
  * otherwise with @error set.
  */
 gboolean
-chatty_history_delete_chat_finish (ChattyHistory  *self,
-                                   GAsyncResult   *result,
-                                   GError        **error)
+chatty_history_import_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
 {
   g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
   g_return_val_if_fail (G_IS_TASK (result), FALSE);
@@ -3703,7 +8000,7 @@ chatty_history_load_account_async (ChattyHistory       *self,
   g_object_ref (account);
   g_object_set_data_full (G_OBJECT (task), "account", account, g_object_unref);
 
-  g_async_queue_push (self->queue, task);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 gboolean
@@ -3718,14 +8015,26 @@ chatty_history_load_account_finish (ChattyHistory  *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_set_last_read_msg_async:
+ * @self: a #ChattyHistory
+ * @chat: a #ChattyChat
+ * @message: (nullable): The last read #ChattyMessage
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Mark @message as the last message read in @chat.
+ * If @callback is %NULL, errors are logged.
+ */
 void
-chatty_history_set_last_read_msg (ChattyHistory *self,
-                                  ChattyChat    *chat,
-                                  ChattyMessage *message)
+chatty_history_set_last_read_msg_async (ChattyHistory       *self,
+                                        ChattyChat          *chat,
+                                        ChattyMessage       *message,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data)
 {
-  g_autoptr(GTask) task = NULL;
+  GTask *task;
 
-  g_return_if_fail (self->db);
   g_return_if_fail (CHATTY_IS_HISTORY (self));
   g_return_if_fail (CHATTY_IS_MM_CHAT (chat));
   g_return_if_fail (!message || CHATTY_IS_MESSAGE (message));
@@ -3733,348 +8042,311 @@ chatty_history_set_last_read_msg (ChattyHistory *self,
   if (message)
     g_object_ref (message);
 
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
+  if (!callback) {
+    callback = history_log_error_cb;
+    user_data = "setting last read message";
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_set_last_read_msg_async);
   g_task_set_task_data (task, history_set_last_read_msg, NULL);
   g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
   g_object_set_data_full (G_OBJECT (task), "message", message, g_object_unref);
 
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-}
-
-static void
-finish_cb (GObject      *object,
-           GAsyncResult *result,
-           gpointer      user_data)
-{
-  g_autoptr(GError) error = NULL;
-
-  g_task_propagate_boolean (G_TASK (result), &error);
-
-  if (error)
-    g_warning ("Error: %s", error->message);
-
-  g_task_return_boolean (G_TASK (user_data), !error);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 /**
- * chatty_history_open:
- * @self: A #ChattyHistory
- * @dir: The database directory
- * @file_name: The file name of database
- *
- * Open the database file @file_name from path @dir
- * with the default #ChattyHistory.
- *
- * This method runs synchronously.
+ * chatty_history_set_last_read_msg_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
  *
+ * Completes chatty_history_set_last_read_msg_async() call.
  *
+ * Returns: %TRUE if the last read message was stored.
+ * %FALSE otherwise with @error set.
  */
-void
-chatty_history_open (ChattyHistory *self,
-                     const char    *dir,
-                     const char    *file_name)
+gboolean
+chatty_history_set_last_read_msg_finish (ChattyHistory  *self,
+                                         GAsyncResult   *result,
+                                         GError        **error)
 {
-  g_autoptr(GTask) task = NULL;
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  chatty_history_open_async (self, g_strdup (dir), file_name, finish_cb, task);
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
 
-  history_db_wait_for_completion (task);
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 /**
- * chatty_history_close:
+ * chatty_history_get_chat_timestamp_async:
  * @self: A #ChattyHistory
+ * @uuid: A valid uid string
+ * @room: A valid chat room name.
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
  *
- * Close database opened with default #ChattyHistory,
- * if any.
- *
- * This method runs synchronously.
- *
+ * Get the timestamp for the message matching
+ * @uuid and @room, if any.  Finish with
+ * chatty_history_get_chat_timestamp_finish().
  */
 void
-chatty_history_close (ChattyHistory *self)
+chatty_history_get_chat_timestamp_async (ChattyHistory       *self,
+                                         const char          *uuid,
+                                         const char          *room,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data)
 {
-  g_autoptr(GTask) task = NULL;
+  GTask *task;
 
-  if (!self->db)
-    return;
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (uuid);
+  g_return_if_fail (room);
+  g_return_if_fail (callback);
 
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  chatty_history_close_async (self, finish_cb, task);
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_chat_timestamp_async);
+  g_task_set_task_data (task, history_get_chat_timestamp, NULL);
+  g_object_set_data_full (G_OBJECT (task), "uuid", g_strdup (uuid), g_free);
+  g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
 
-  history_db_wait_for_completion (task);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 /**
- * chatty_history_get_chat_timestamp:
- * @self: A #ChattyHistory
- * @uuid: A valid uid string
- * @room: A valid chat room name.
- *
- * Get the timestamp for the message matching
- * @uuid and @room, if any.
+ * chatty_history_get_chat_timestamp_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
  *
- * This method runs synchronously.
+ * Completes chatty_history_get_chat_timestamp_async() call.
  *
  * Returns: the timestamp for the matching message.
- * or %INT_MAX if no match found.
+ * or %INT_MAX if no match found or on error.
  */
 int
-chatty_history_get_chat_timestamp (ChattyHistory *self,
-                                   const char    *uuid,
-                                   const char    *room)
+chatty_history_get_chat_timestamp_finish (ChattyHistory  *self,
+                                          GAsyncResult   *result,
+                                          GError        **error)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GTask) task = NULL;
-  int time_stamp;
-
-  g_return_val_if_fail (uuid, 0);
-  g_return_val_if_fail (room, 0);
-
-  g_return_val_if_fail (self->db, FALSE);
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
-  g_task_set_task_data (task, history_get_chat_timestamp, NULL);
-  g_object_set_data_full (G_OBJECT (task), "uuid", g_strdup (uuid), g_free);
-  g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), INT_MAX);
+  g_return_val_if_fail (G_IS_TASK (result), INT_MAX);
+  g_return_val_if_fail (!error || !*error, INT_MAX);
 
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-
-  time_stamp = g_task_propagate_int (task, &error);
-
-  if (error) {
-    g_warning ("Error: %s", error->message);
-    return INT_MAX;
-  }
-
-  return time_stamp;
+  return history_propagate_timestamp (result, INT_MAX, error);
 }
 
 /**
- * chatty_history_get_im_timestamp:
+ * chatty_history_get_im_timestamp_async:
  * @self: A #ChattyHistory
  * @uuid: A valid uid string
  * @account: A valid user id name.
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
  *
  * Get the timestamp for the IM message matching
- * @uuid and @account, if any.
- *
- * This method runs synchronously.
- *
- * Returns: the timestamp for the matching message.
- * or %INT_MAX if no match found.
+ * @uuid and @account, if any.  Finish with
+ * chatty_history_get_im_timestamp_finish().
  */
-int
-chatty_history_get_im_timestamp (ChattyHistory *self,
-                                 const char    *uuid,
-                                 const char    *account)
+void
+chatty_history_get_im_timestamp_async (ChattyHistory       *self,
+                                       const char          *uuid,
+                                       const char          *account,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GTask) task = NULL;
-  int time_stamp;
-
-  g_return_val_if_fail (CHATTY_IS_HISTORY (self), 0);
-  g_return_val_if_fail (uuid, 0);
-  g_return_val_if_fail (account, 0);
+  GTask *task;
 
-  g_return_val_if_fail (self->db, FALSE);
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (uuid);
+  g_return_if_fail (account);
+  g_return_if_fail (callback);
 
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_im_timestamp_async);
   g_task_set_task_data (task, history_get_im_timestamp, NULL);
   g_object_set_data_full (G_OBJECT (task), "uuid", g_strdup (uuid), g_free);
   g_object_set_data_full (G_OBJECT (task), "account", g_strdup (account), g_free);
 
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-
-  time_stamp = g_task_propagate_int (task, &error);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
+}
 
-  if (error) {
-    g_warning ("Error: %s", error->message);
-    return INT_MAX;
-  }
+/**
+ * chatty_history_get_im_timestamp_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_get_im_timestamp_async() call.
+ *
+ * Returns: the timestamp for the matching message.
+ * or %INT_MAX if no match found or on error.
+ */
+int
+chatty_history_get_im_timestamp_finish (ChattyHistory  *self,
+                                        GAsyncResult   *result,
+                                        GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), INT_MAX);
+  g_return_val_if_fail (G_IS_TASK (result), INT_MAX);
+  g_return_val_if_fail (!error || !*error, INT_MAX);
 
-  return time_stamp;
+  return history_propagate_timestamp (result, INT_MAX, error);
 }
 
 /**
- * chatty_history_get_last_message_time:
+ * chatty_history_get_last_message_time_async:
  * @self: A #ChattyHistory
  * @account: A valid account name
- * @roome: A valid room name.
+ * @room: A valid room name.
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
  *
  * Get the timestamp of the last message in @room
- * with the account @account.
- *
- * This method runs synchronously.
- *
- * Returns: The timestamp of the last matching message
- * or 0 if no match found.
+ * with the account @account.  Finish with
+ * chatty_history_get_last_message_time_finish().
  */
-int
-chatty_history_get_last_message_time (ChattyHistory *self,
-                                      const char    *account,
-                                      const char    *room)
+void
+chatty_history_get_last_message_time_async (ChattyHistory       *self,
+                                            const char          *account,
+                                            const char          *room,
+                                            GAsyncReadyCallback  callback,
+                                            gpointer             user_data)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GTask) task = NULL;
-  int time_stamp;
+  GTask *task;
 
-  g_return_val_if_fail (CHATTY_IS_HISTORY (self), 0);
-  g_return_val_if_fail (account, 0);
-  g_return_val_if_fail (room, 0);
-  g_return_val_if_fail (self->db, 0);
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (account);
+  g_return_if_fail (room);
+  g_return_if_fail (callback);
 
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_last_message_time_async);
   g_task_set_task_data (task, history_get_last_message_time, NULL);
-
   g_object_set_data_full (G_OBJECT (task), "account", g_strdup (account), g_free);
   g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
 
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-
-  time_stamp = g_task_propagate_int (task, &error);
-
-  if (error) {
-    g_warning ("Error: %s", error->message);
-    return 0;
-  }
-
-  return time_stamp;
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 /**
- * chatty_history_delete_chat:
- * @self: A #ChattyHistory
- * @chat: a #ChattyChat
- *
- * Delete all messages matching @chat
- * from default #ChattyHistory.
+ * chatty_history_get_last_message_time_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
  *
- * This method runs synchronously.
+ * Completes chatty_history_get_last_message_time_async() call.
  *
+ * Returns: The timestamp of the last matching message
+ * or 0 if no match found or on error.
  */
-void
-chatty_history_delete_chat (ChattyHistory *self,
-                            ChattyChat    *chat)
+int
+chatty_history_get_last_message_time_finish (ChattyHistory  *self,
+                                             GAsyncResult   *result,
+                                             GError        **error)
 {
-  g_autoptr(GTask) task = NULL;
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  chatty_history_delete_chat_async (self, chat, finish_cb, task);
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), 0);
+  g_return_val_if_fail (G_IS_TASK (result), 0);
+  g_return_val_if_fail (!error || !*error, 0);
 
-  history_db_wait_for_completion (task);
+  return history_propagate_timestamp (result, 0, error);
 }
 
-static gboolean
-chatty_history_exists (ChattyHistory *self,
-                       const char    *account,
-                       const char    *room,
-                       const char    *who)
+static void
+chatty_history_exists_async (ChattyHistory       *self,
+                             const char          *account,
+                             const char          *room,
+                             const char          *who,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
 {
+  GTask *task;
 
-  g_autoptr(GTask) task = NULL;
-
-  g_return_val_if_fail (self->db, FALSE);
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  g_object_ref (task);
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_exists_async);
   g_task_set_task_data (task, history_exists, NULL);
   g_object_set_data_full (G_OBJECT (task), "account", g_strdup (account), g_free);
   g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
   g_object_set_data_full (G_OBJECT (task), "who", g_strdup (who), g_free);
 
-  g_async_queue_push (self->queue, task);
-
-  history_db_wait_for_completion (task);
-
-  return g_task_propagate_boolean (task, NULL);
+  history_push (self, task, HISTORY_PRIORITY_WRITE);
 }
 
 /**
- * chatty_history_im_exists:
+ * chatty_history_im_exists_async:
  * @self: A #ChattyHistory
  * @account: a valid account name
  * @who: A valid user name
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
  *
  * Get if atleast one message exists for
- * the given IM.
- *
- * This method runs synchronously.
- *
- * Return: %TRUE if atleast one message exists
- * for the given detail.  %FALSE otherwise.
+ * the given IM.  Finish with
+ * chatty_history_exists_finish().
  */
-gboolean
-chatty_history_im_exists (ChattyHistory *self,
-                          const char    *account,
-                          const char    *who)
+void
+chatty_history_im_exists_async (ChattyHistory       *self,
+                                const char          *account,
+                                const char          *who,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
 {
-  g_return_val_if_fail (account, 0);
-  g_return_val_if_fail (who, 0);
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (account);
+  g_return_if_fail (who);
+  g_return_if_fail (callback);
 
-  return chatty_history_exists (self, account, NULL, who);
+  chatty_history_exists_async (self, account, NULL, who, callback, user_data);
 }
 
 /**
- * chatty_history_exists:
+ * chatty_history_chat_exists_async:
  * @self: A #ChattyHistory
  * @account: a valid account name
  * @room: A Valid room name
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
  *
  * Get if atleast one message exists for
- * the given chat.
- *
- * This method runs synchronously.
- *
- * Return: %TRUE if atleast one message exists
- * for the given detail.  %FALSE otherwise.
+ * the given chat.  Finish with
+ * chatty_history_exists_finish().
  */
-gboolean
-chatty_history_chat_exists (ChattyHistory *self,
-                            const char    *account,
-                            const char    *room)
+void
+chatty_history_chat_exists_async (ChattyHistory       *self,
+                                  const char          *account,
+                                  const char          *room,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
 {
-  g_return_val_if_fail (account, 0);
-  g_return_val_if_fail (room, 0);
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (account);
+  g_return_if_fail (room);
+  g_return_if_fail (callback);
 
-  return chatty_history_exists (self, account, room, NULL);
+  chatty_history_exists_async (self, account, room, NULL, callback, user_data);
 }
 
 /**
- * chatty_history_add_message:
- * @self: A #ChattyHistory
- * @chat: the #ChattyChat @message belongs to
- * @message: A #ChattyMessage
+ * chatty_history_exists_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
  *
- * This method runs synchronously.
+ * Completes chatty_history_im_exists_async() or
+ * chatty_history_chat_exists_async() call.
  *
- * Return: %TRUE if the message was stored to database.
- * %FALSE otherwise.
+ * Return: %TRUE if atleast one message exists
+ * for the given detail.  %FALSE otherwise.
  */
 gboolean
-chatty_history_add_message (ChattyHistory *self,
-                            ChattyChat    *chat,
-                            ChattyMessage *message)
+chatty_history_exists_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
 {
-  g_autoptr(GTask) task = NULL;
-
-  task = g_task_new (NULL, NULL, NULL, NULL);
-  chatty_history_add_message_async (self, chat, message, finish_cb, task);
-
-  history_db_wait_for_completion (task);
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
 
-  return g_task_propagate_boolean (task, NULL);
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
@@ -31,6 +31,9 @@ gboolean       chatty_history_open_finish         (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
 gboolean       chatty_history_is_closed           (ChattyHistory        *self);
+void           chatty_history_get_statement_stats (ChattyHistory        *self,
+                                                   guint                *hits,
+                                                   guint                *misses);
 void           chatty_history_close_async         (ChattyHistory        *self,
                                                    GAsyncReadyCallback   callback,
                                                    gpointer              user_data);
@@ -48,6 +51,7 @@ GPtrArray     *chatty_history_get_messages_finish (ChattyHistory        *self,
                                                    GError              **error);
 void           chatty_history_get_draft_async     (ChattyHistory        *self,
                                                    ChattyChat           *chat,
+                                                   GCancellable         *cancellable,
                                                    GAsyncReadyCallback  callback,
                                                    gpointer             user_data);
 char          *chatty_history_get_draft_finish    (ChattyHistory        *self,
@@ -61,6 +65,14 @@ void           chatty_history_add_message_async   (ChattyHistory        *self,
 gboolean       chatty_history_add_message_finish  (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_add_messages_async  (ChattyHistory        *self,
+                                                   ChattyChat           *chat,
+                                                   GPtrArray            *messages,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_add_messages_finish (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 void           chatty_history_get_chats_async     (ChattyHistory       *self,
                                                    ChattyAccount       *account,
                                                    GAsyncReadyCallback  callback,
@@ -68,10 +80,30 @@ void           chatty_history_get_chats_async     (ChattyHistory       *self,
 GPtrArray     *chatty_history_get_chats_finish    (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
-gboolean       chatty_history_update_chat         (ChattyHistory        *self,
-                                                   ChattyChat           *chat);
-gboolean       chatty_history_update_user         (ChattyHistory        *self,
-                                                   ChattyAccount        *account);
+void           chatty_history_search_async        (ChattyHistory       *self,
+                                                   const char          *query,
+                                                   ChattyAccount       *account,
+                                                   guint                limit,
+                                                   guint                offset,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+GPtrArray     *chatty_history_search_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_update_chat_async   (ChattyHistory        *self,
+                                                   ChattyChat           *chat,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_update_chat_finish  (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_update_user_async   (ChattyHistory        *self,
+                                                   ChattyAccount        *account,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_update_user_finish  (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 void           chatty_history_delete_chat_async   (ChattyHistory        *self,
                                                    ChattyChat           *chat,
                                                    GAsyncReadyCallback   callback,
@@ -79,6 +111,21 @@ void           chatty_history_delete_chat_async   (ChattyHistory        *self,
 gboolean       chatty_history_delete_chat_finish  (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_export_async        (ChattyHistory        *self,
+                                                   GFile                *file,
+                                                   gboolean              compress,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_export_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_import_async        (ChattyHistory        *self,
+                                                   GFile                *file,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_import_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 void           chatty_history_load_account_async  (ChattyHistory       *self,
                                                    ChattyAccount       *account,
                                                    GAsyncReadyCallback  callback,
@@ -86,34 +133,50 @@ void           chatty_history_load_account_async  (ChattyHistory       *self,
 gboolean       chatty_history_load_account_finish (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
-void           chatty_history_set_last_read_msg   (ChattyHistory        *self,
-                                                   ChattyChat           *chat,
-                                                   ChattyMessage        *message);
-
-/* old APIs */
-void           chatty_history_open                (ChattyHistory         *self,
-                                                   const char            *dir,
-                                                   const char            *file_name);
-void           chatty_history_close               (ChattyHistory         *self);
-int            chatty_history_get_chat_timestamp  (ChattyHistory         *self,
-                                                   const char            *uuid,
-                                                   const char            *room);
-int            chatty_history_get_im_timestamp    (ChattyHistory         *self,
-                                                   const char            *uuid,
-                                                   const char            *account);
-int            chatty_history_get_last_message_time (ChattyHistory         *self,
-                                                     const char            *account,
-                                                     const char            *room);
-void           chatty_history_delete_chat         (ChattyHistory         *self,
-                                                   ChattyChat            *chat);
-gboolean       chatty_history_im_exists           (ChattyHistory         *self,
-                                                   const char            *account,
-                                                   const char            *who);
-gboolean       chatty_history_chat_exists         (ChattyHistory         *self,
-                                                   const char            *account,
-                                                   const char            *room);
-gboolean       chatty_history_add_message         (ChattyHistory         *self,
-                                                   ChattyChat            *chat,
-                                                   ChattyMessage         *message);
+void           chatty_history_set_last_read_msg_async  (ChattyHistory        *self,
+                                                        ChattyChat           *chat,
+                                                        ChattyMessage        *message,
+                                                        GAsyncReadyCallback   callback,
+                                                        gpointer              user_data);
+gboolean       chatty_history_set_last_read_msg_finish (ChattyHistory        *self,
+                                                        GAsyncResult         *result,
+                                                        GError              **error);
+void           chatty_history_get_chat_timestamp_async  (ChattyHistory        *self,
+                                                         const char           *uuid,
+                                                         const char           *room,
+                                                         GAsyncReadyCallback   callback,
+                                                         gpointer              user_data);
+int            chatty_history_get_chat_timestamp_finish (ChattyHistory        *self,
+                                                         GAsyncResult         *result,
+                                                         GError              **error);
+void           chatty_history_get_im_timestamp_async  (ChattyHistory        *self,
+                                                       const char           *uuid,
+                                                       const char           *account,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+int            chatty_history_get_im_timestamp_finish (ChattyHistory        *self,
+                                                       GAsyncResult         *result,
+                                                       GError              **error);
+void           chatty_history_get_last_message_time_async  (ChattyHistory        *self,
+                                                            const char           *account,
+                                                            const char           *room,
+                                                            GAsyncReadyCallback   callback,
+                                                            gpointer              user_data);
+int            chatty_history_get_last_message_time_finish (ChattyHistory        *self,
+                                                            GAsyncResult         *result,
+                                                            GError              **error);
+void           chatty_history_im_exists_async     (ChattyHistory        *self,
+                                                   const char           *account,
+                                                   const char           *who,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+void           chatty_history_chat_exists_async   (ChattyHistory        *self,
+                                                   const char           *account,
+                                                   const char           *room,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_exists_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 
 G_END_DECLS
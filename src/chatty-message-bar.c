@@ -50,6 +50,7 @@ struct _ChattyMessageBar
 
   ChattyHistory *history;
   ChattyChat    *chat;
+  GCancellable  *draft_cancellable;
   guint          save_timeout_id;
   gboolean       draft_is_loading;
   gboolean       is_self_change;
@@ -243,7 +244,7 @@ chat_page_save_message_to_db (gpointer user_data)
   draft = chatty_message_new (NULL, text, uid, time (NULL),
                               CHATTY_MESSAGE_TEXT,
                               CHATTY_DIRECTION_OUT, CHATTY_STATUS_DRAFT);
-  chatty_history_add_message (self->history, self->chat, draft);
+  chatty_history_add_message_async (self->history, self->chat, draft, NULL, NULL);
   gtk_text_buffer_set_modified (GTK_TEXT_BUFFER (self->message_buffer), FALSE);
 
   return G_SOURCE_REMOVE;
@@ -441,7 +442,7 @@ message_bar_send_message_button_clicked_cb (ChattyMessageBar *self)
     draft = chatty_message_new (NULL, "", uid, time (NULL),
                                 CHATTY_MESSAGE_TEXT,
                                 CHATTY_DIRECTION_OUT, CHATTY_STATUS_DRAFT);
-    chatty_history_add_message (self->history, self->chat, draft);
+    chatty_history_add_message_async (self->history, self->chat, draft, NULL, NULL);
   }
 
  end:
@@ -598,6 +599,7 @@ chatty_message_bar_finalize (GObject *object)
   ChattyMessageBar *self = (ChattyMessageBar *)object;
 
   g_clear_handle_id (&self->save_timeout_id, g_source_remove);
+  g_clear_object (&self->draft_cancellable);
   g_clear_object (&self->chat);
   g_clear_object (&self->history);
 #ifdef LIBSPELL_ENABLED
@@ -699,10 +701,15 @@ chat_get_draft_cb (GObject      *object,
                    GAsyncResult *result,
                    gpointer      user_data)
 {
-  ChattyMessageBar *self = CHATTY_MESSAGE_BAR (user_data);
+  g_autoptr(ChattyMessageBar) self = user_data;
+  g_autoptr(GError) error = NULL;
   g_autofree char *draft = NULL;
 
-  draft = chatty_history_get_draft_finish (self->history, result, NULL);
+  draft = chatty_history_get_draft_finish (self->history, result, &error);
+
+  /* Another chat was selected before the draft got loaded */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
 
   self->draft_is_loading = TRUE;
   g_object_set (GTK_TEXT_BUFFER (self->message_buffer), "text", draft ? draft : "", NULL);
@@ -758,7 +765,12 @@ chatty_message_bar_set_chat (ChattyMessageBar *self,
 
   chatty_attachments_bar_reset (CHATTY_ATTACHMENTS_BAR (self->attachment_bar));
 
+  g_cancellable_cancel (self->draft_cancellable);
+  g_clear_object (&self->draft_cancellable);
+  self->draft_cancellable = g_cancellable_new ();
+
   chatty_history_get_draft_async (self->history, self->chat,
+                                  self->draft_cancellable,
                                   chat_get_draft_cb,
                                   g_object_ref (self));
 
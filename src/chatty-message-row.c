@@ -13,6 +13,7 @@
 # include "config.h"
 #endif
 
+#include <ctype.h>
 #include <glib/gi18n.h>
 
 #include "chatty-avatar.h"
@@ -57,57 +58,227 @@ struct _ChattyMessageRow
 
 G_DEFINE_TYPE (ChattyMessageRow, chatty_message_row, GTK_TYPE_LIST_BOX_ROW)
 
+#define URL_DELIMITERS " \n()[],\t\r"
+
+/* Bytes that g_markup_escape_text() may replace */
+#define MARKUP_SPECIAL(_c)                                              \
+  ((_c) == '&' || (_c) == '<' || (_c) == '>' || (_c) == '\'' ||         \
+   (_c) == '"' || (_c) == 0x7f || (_c) == 0xc2 ||                       \
+   ((_c) < 0x20 && (_c) != '\t' && (_c) != '\n' && (_c) != '\r'))
+
+static void
+text_append_escaped (GString    *str,
+                     const char *text,
+                     gsize       len)
+{
+  g_autofree char *escaped = NULL;
+
+  for (gsize i = 0; i < len; i++)
+    if (MARKUP_SPECIAL ((guchar)text[i])) {
+      escaped = g_markup_escape_text (text, len);
+      g_string_append (str, escaped);
+
+      return;
+    }
+
+  g_string_append_len (str, text, len);
+}
+
+/* Check if an url of @type starts just before @match, see chatty_utils_find_url() */
+static gboolean
+text_url_starts_at (const char *start,
+                    const char *match,
+                    const char *type,
+                    const char *prefix)
+{
+  const char *uri;
+  gsize type_len, len;
+
+  type_len = strlen (type);
+  len = strlen (prefix);
+  uri = match - type_len;
+
+  return (gsize)(match - start) >= type_len &&
+    g_ascii_strncasecmp (uri, prefix, len) == 0 &&
+    (isalnum (uri[len]) || uri[len] == '/');
+}
+
+/*
+ * Find the end of the url at @url, the same as chatty_utils_find_url()
+ * does, but without rescanning the rest of the string.
+ */
+static const char *
+text_find_url_end (const char *url)
+{
+  const char *ptr;
+
+  ptr = url + strcspn (url, URL_DELIMITERS);
+
+  if (!*ptr)
+    return ptr;
+
+  ptr++;
+
+  /* Include balanced parentheses */
+  while (ptr[-1] == '(') {
+    const char *close;
+
+    close = ptr + strcspn (ptr, URL_DELIMITERS);
+
+    if (*close != ')')
+      break;
+
+    if (!close[1])
+      return close + 1;
+
+    ptr = close + 2;
+  }
+
+  while (!isspace (ptr[-1]) && !isspace (ptr[0]) &&
+         ptr[-1] != '(' && ptr[-1] != ')') {
+    ptr += strcspn (ptr, URL_DELIMITERS) + 1;
+
+    if (!ptr[-1])
+      break;
+  }
+
+  return ptr - 1;
+}
+
+static void
+text_add_quote (PangoAttrList *quotes,
+                guint          start,
+                guint          end)
+{
+  PangoAttribute *attribute;
+
+  attribute = pango_attr_foreground_new (30000, 30000, 30000);
+  attribute->start_index = start;
+  attribute->end_index = end;
+  pango_attr_list_insert (quotes, attribute);
+}
+
+/*
+ * text_item_linkify:
+ * @text: The message text
+ * @linkify: Whether to create links
+ * @strip_tracking_ids: Whether to strip tracking ids from links
+ * @quotes: (out) (optional): The quote attributes of the label text
+ *
+ * Create the label markup for @text in a single pass: escape
+ * the text, add links for urls, and find the lines starting with
+ * ‘>’ as quotes.  The quote indices are of the label text, where
+ * links may be shorter than in @text as tracking ids are stripped.
+ *
+ * Returns: (nullable): The markup, or %NULL if there are no links
+ */
 static char *
-text_item_linkify (const char *message)
+text_item_linkify (const char     *text,
+                   gboolean        linkify,
+                   gboolean        strip_tracking_ids,
+                   PangoAttrList **quotes)
 {
-  g_autoptr(GString) link_str = NULL;
+  g_autoptr(GString) link = NULL;
+  g_autoptr(GString) href = NULL;
   GString *str = NULL;
-  char *start, *end, *url;
+  const char *p, *buffer, *start;
+  gssize delta = 0, quote_start = -1;
+  gboolean line_start = TRUE;
+
+  if (quotes)
+    *quotes = pango_attr_list_new ();
 
-  if (!message || !*message)
+  if (!text || !*text)
     return NULL;
 
-  str = g_string_sized_new (256);
-  link_str = g_string_sized_new (256);
-  start = end = (char *)message;
-
-  while ((url = chatty_utils_find_url (start, &end))) {
-    ChattySettings *settings;
-    g_autofree char *link = NULL;
-    g_autofree char *escaped_link = NULL;
-    g_autofree char *utm_stripped_link = NULL;
-    char *escaped = NULL;
-
-    settings = chatty_settings_get_default ();
-    escaped = g_markup_escape_text (start, url - start);
-    g_string_append (str, escaped);
-    g_free (escaped);
-
-    link = g_strndup (url, end - url);
-    if (chatty_settings_get_strip_url_tracking_ids (settings))
-      utm_stripped_link = chatty_utils_strip_utm_from_url (link);
-    else
-      utm_stripped_link = g_strdup (link);
+  buffer = start = text;
+
+  for (p = text; *p; p++) {
+    const char *url = NULL, *end;
+
+    if (linkify && *p == ':') {
+      if (text_url_starts_at (start, p, "http", "http://"))
+        url = p - strlen ("http");
+      else if (text_url_starts_at (start, p, "https", "https://"))
+        url = p - strlen ("https");
+      else if (text_url_starts_at (start, p, "file", "file://"))
+        url = p - strlen ("file");
+    } else if (linkify && *p == '.') {
+      if (text_url_starts_at (start, p, "www", "www."))
+        url = p - strlen ("www");
+    }
 
-    escaped_link = g_markup_escape_text (utm_stripped_link, -1);
-    g_string_set_size (link_str, 0);
-    /* Don't escape sub-delims and gen-delims */
-    g_string_append_uri_escaped (link_str, utm_stripped_link, ":/?#[]@!$&'()*+,;=", TRUE);
-    escaped = g_markup_escape_text (link_str->str, link_str->len);
-    g_string_append_printf (str, "<a href=\"%s\">%s</a>", escaped, escaped_link);
-    g_free (escaped);
+    if (url && url > buffer &&
+        !isspace (url[-1]) && !ispunct (url[-1]))
+      url = NULL;
 
-    start = end;
-  }
+    if (url) {
+      g_autofree char *stripped = NULL;
+      const char *link_text;
+
+      if (!str) {
+        str = g_string_sized_new (strlen (text) + 64);
+        link = g_string_sized_new (128);
+        href = g_string_sized_new (128);
+      }
+
+      end = text_find_url_end (url);
+      text_append_escaped (str, buffer, url - buffer);
+
+      g_string_assign (link, "");
+      g_string_append_len (link, url, end - url);
+      link_text = link->str;
+
+      if (strip_tracking_ids) {
+        stripped = chatty_utils_strip_utm_from_url (link->str);
+        link_text = stripped;
+      }
+
+      g_string_set_size (href, 0);
+      /* Don't escape sub-delims and gen-delims */
+      g_string_append_uri_escaped (href, link_text, ":/?#[]@!$&'()*+,;=", TRUE);
+
+      g_string_append (str, "<a href=\"");
+      text_append_escaped (str, href->str, href->len);
+      g_string_append (str, "\">");
+      text_append_escaped (str, link_text, strlen (link_text));
+      g_string_append (str, "</a>");
+
+      /* Urls have no newlines, so only the offsets of quotes change */
+      delta += (gssize)strlen (link_text) - (end - url);
+      buffer = start = end;
+      line_start = FALSE;
+
+      if (!*end)
+        break;
+
+      p = end;
+    }
+
+    if (*p == ':' || *p == '.')
+      start = p + 1;
 
-  /* Append rest of the string, only if we there is already content */
-  if (str->len && start && *start) {
-    g_autofree char *escaped = NULL;
+    if (*p == '>' && line_start && quote_start < 0) {
+      quote_start = p - text + delta;
+    } else if (*p == '\n' && quote_start >= 0) {
+      if (quotes)
+        text_add_quote (*quotes, quote_start, p - text + delta + 1);
+      quote_start = -1;
+    }
 
-    escaped = g_markup_escape_text (start, -1);
-    g_string_append (str, escaped);
+    line_start = *p == '\n';
   }
 
+  /* Quotes without a newline extend past the end */
+  if (quote_start >= 0 && quotes)
+    text_add_quote (*quotes, quote_start, strlen (text) + delta + 1);
+
+  if (!str)
+    return NULL;
+
+  /* Append rest of the string */
+  text_append_escaped (str, buffer, strlen (buffer));
+
   return g_string_free (str, FALSE);
 }
 
@@ -134,53 +305,6 @@ chatty_msg_list_escape_message (const char *message)
   return g_strdup ("");
 }
 
-static void
-text_item_update_quotes (ChattyMessageRow *self)
-{
-  const char *text, *end;
-  char *quote;
-
-  text = gtk_label_get_text (GTK_LABEL (self->message_body));
-  end = text;
-
-  if (!gtk_label_get_attributes (GTK_LABEL (self->message_body))) {
-    PangoAttrList *list;
-
-    list = pango_attr_list_new ();
-    gtk_label_set_attributes (GTK_LABEL (self->message_body), list);
-    pango_attr_list_unref (list);
-
-  }
-
-  if (!text || !*text)
-    return;
-
-  do {
-    quote = strchr (end, '>');
-
-    if (quote &&
-        (quote == text ||
-         *(quote - 1) == '\n')) {
-      PangoAttrList *list;
-      PangoAttribute *attribute;
-
-      list = gtk_label_get_attributes (GTK_LABEL (self->message_body));
-      end = strchr (quote, '\n');
-
-      if (!end)
-        end = quote + strlen (quote);
-
-      attribute = pango_attr_foreground_new (30000, 30000, 30000);
-      attribute->start_index = quote - text;
-      attribute->end_index = end - text + 1;
-      pango_attr_list_insert (list, attribute);
-    } else if (quote && *quote) {
-      /* Move forward one character if '>' happend midst a line */
-      end = end + 1;
-    }
-  } while (quote && *quote);
-}
-
 static const char *
 message_row_get_clock_signal (time_t time_stamp)
 {
@@ -416,8 +540,11 @@ chatty_message_row_new (ChattyMessage  *message,
                         gboolean        is_im)
 {
   ChattyMessageRow *self;
-  const char *text, *subject;
+  g_autoptr(PangoAttrList) list = NULL;
+  PangoAttrList *quotes = NULL;
+  const char *text, *subject, *body = NULL;
   ChattyMsgDirection direction;
+  gboolean strip_tracking_ids;
 
   g_return_val_if_fail (CHATTY_IS_MESSAGE (message), NULL);
 
@@ -450,42 +577,57 @@ chatty_message_row_new (ChattyMessage  *message,
 
   gtk_widget_set_visible (self->message_title, subject && *subject);
   gtk_widget_set_visible (self->message_body, text && *text);
+  strip_tracking_ids = chatty_settings_get_strip_url_tracking_ids (chatty_settings_get_default ());
 
-  if (protocol == CHATTY_PROTOCOL_XMPP ||
-      protocol == CHATTY_PROTOCOL_TELEGRAM) {
+  if (protocol != CHATTY_PROTOCOL_XMPP &&
+      protocol != CHATTY_PROTOCOL_TELEGRAM &&
+      subject && *subject) {
+    g_autofree char *content = NULL;
+
+    content = text_item_linkify (subject, TRUE, strip_tracking_ids, NULL);
+
+    if (content)
+      gtk_label_set_markup (GTK_LABEL (self->message_title), content);
+    else
+      gtk_label_set_text (GTK_LABEL (self->message_title), subject);
+  }
+
+  if (chatty_message_get_markup_cache (message, strip_tracking_ids, &body, &quotes)) {
+    if (body)
+      gtk_label_set_markup (GTK_LABEL (self->message_body), body);
+    else if (text && *text)
+      gtk_label_set_text (GTK_LABEL (self->message_body), text);
+  } else if (protocol == CHATTY_PROTOCOL_XMPP ||
+             protocol == CHATTY_PROTOCOL_TELEGRAM) {
     g_autofree char *content = NULL;
 
     content = chatty_msg_list_escape_message (text);
     gtk_label_set_markup (GTK_LABEL (self->message_body), content);
-  } else {
-    if (subject && *subject) {
-      g_autofree char *content = NULL;
 
-      content = text_item_linkify (subject);
-
-      if (content && *content)
-        gtk_label_set_markup (GTK_LABEL (self->message_title), content);
-      else
-        gtk_label_set_text (GTK_LABEL (self->message_title), subject);
-    }
+    /* Only find the quotes in the label text */
+    text_item_linkify (gtk_label_get_text (GTK_LABEL (self->message_body)),
+                       FALSE, FALSE, &list);
+    chatty_message_set_markup_cache (message, strip_tracking_ids, content, list);
+    quotes = list;
+  } else {
+    g_autofree char *content = NULL;
 
-    if (text && *text) {
-      g_autofree char *content = NULL;
+    content = text_item_linkify (text, TRUE, strip_tracking_ids, &list);
 
-      content = text_item_linkify (text);
+    if (content)
+      gtk_label_set_markup (GTK_LABEL (self->message_body), content);
+    else if (text && *text)
+      gtk_label_set_text (GTK_LABEL (self->message_body), text);
 
-      if (content && *content)
-        gtk_label_set_markup (GTK_LABEL (self->message_body), content);
-      else
-        gtk_label_set_text (GTK_LABEL (self->message_body), text);
-    }
+    chatty_message_set_markup_cache (message, strip_tracking_ids, content, list);
+    quotes = list;
   }
 
   if (((text && *text) || (subject && *subject)) &&
       chatty_message_get_files (message))
     gtk_widget_set_visible (self->content_separator, TRUE);
 
-  text_item_update_quotes (self);
+  gtk_label_set_attributes (GTK_LABEL (self->message_body), quotes);
 
   if (direction == CHATTY_DIRECTION_IN) {
     gtk_widget_add_css_class (self->message_content, "bubble_white");
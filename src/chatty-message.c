@@ -42,6 +42,11 @@ struct _ChattyMessage
 
   GList           *files;
 
+  /* Rendered body, see chatty_message_set_markup_cache() */
+  char            *markup;
+  PangoAttrList   *quotes;
+  gsize            markup_size;
+
   ChattyMsgType    type;
   ChattyMsgStatus  status;
   ChattyMsgDirection direction;
@@ -50,9 +55,22 @@ struct _ChattyMessage
   guint            encrypted : 1;
   /* Set if files are created with file path string */
   guint            files_are_path : 1;
+  guint            markup_cached : 1;
+  guint            markup_strip_tracking_ids : 1;
   guint            sms_id;
 };
 
+/*
+ * Rendered markup is kept on the message so that rows can be
+ * recreated without parsing the text again.  To avoid keeping
+ * huge histories twice in memory, the size of all cached markups
+ * is capped, and larger messages are never cached.
+ */
+#define MARKUP_CACHE_MAX_SIZE      (8 * 1024 * 1024)
+#define MARKUP_CACHE_MAX_ITEM_SIZE (64 * 1024)
+
+static gssize markup_cache_size;
+
 G_DEFINE_TYPE (ChattyMessage, chatty_message, G_TYPE_OBJECT)
 
 enum {
@@ -62,11 +80,24 @@ enum {
 
 static guint signals[N_SIGNALS];
 
+static void
+message_clear_markup_cache (ChattyMessage *self)
+{
+  if (self->markup_size)
+    g_atomic_pointer_add (&markup_cache_size, -(gssize)self->markup_size);
+
+  g_clear_pointer (&self->markup, g_free);
+  g_clear_pointer (&self->quotes, pango_attr_list_unref);
+  self->markup_size = 0;
+  self->markup_cached = FALSE;
+}
+
 static void
 chatty_message_finalize (GObject *object)
 {
   ChattyMessage *self = (ChattyMessage *)object;
 
+  message_clear_markup_cache (self);
   g_clear_object (&self->user);
   g_clear_object (&self->cm_event);
   g_free (self->message);
@@ -492,6 +523,84 @@ chatty_message_get_msg_type (ChattyMessage *self)
   return self->type;
 }
 
+/**
+ * chatty_message_get_markup_cache:
+ * @self: A #ChattyMessage
+ * @strip_tracking_ids: Whether tracking ids were stripped from links
+ * @markup: (out) (transfer none) (nullable): Return location for the markup
+ * @quotes: (out) (transfer none) (nullable): Return location for the quotes
+ *
+ * Get the rendered message text previously set with
+ * chatty_message_set_markup_cache() for @strip_tracking_ids.
+ * @markup is set to %NULL if the text should be shown
+ * as is.
+ *
+ * Returns: %TRUE if a cached markup was found, %FALSE otherwise
+ */
+gboolean
+chatty_message_get_markup_cache (ChattyMessage  *self,
+                                 gboolean        strip_tracking_ids,
+                                 const char    **markup,
+                                 PangoAttrList **quotes)
+{
+  g_return_val_if_fail (CHATTY_IS_MESSAGE (self), FALSE);
+  g_return_val_if_fail (markup, FALSE);
+  g_return_val_if_fail (quotes, FALSE);
+
+  if (!self->markup_cached ||
+      self->markup_strip_tracking_ids != !!strip_tracking_ids)
+    return FALSE;
+
+  *markup = self->markup;
+  *quotes = self->quotes;
+
+  return TRUE;
+}
+
+/**
+ * chatty_message_set_markup_cache:
+ * @self: A #ChattyMessage
+ * @strip_tracking_ids: Whether tracking ids were stripped from links
+ * @markup: (nullable): The markup for the message text
+ * @quotes: (nullable): The quote attributes for the message text
+ *
+ * Store the rendered message text so that it can be
+ * reused with chatty_message_get_markup_cache().  Any
+ * previous cache is replaced.  Nothing is stored if
+ * @markup is too large or if the total cache size
+ * would exceed the limit.
+ */
+void
+chatty_message_set_markup_cache (ChattyMessage *self,
+                                 gboolean       strip_tracking_ids,
+                                 const char    *markup,
+                                 PangoAttrList *quotes)
+{
+  gsize size;
+
+  g_return_if_fail (CHATTY_IS_MESSAGE (self));
+
+  message_clear_markup_cache (self);
+  size = markup ? strlen (markup) + 1 : 0;
+
+  if (size > MARKUP_CACHE_MAX_ITEM_SIZE)
+    return;
+
+  if (size &&
+      g_atomic_pointer_add (&markup_cache_size, size) + (gssize)size > MARKUP_CACHE_MAX_SIZE) {
+    g_atomic_pointer_add (&markup_cache_size, -(gssize)size);
+    return;
+  }
+
+  self->markup = g_strdup (markup);
+  self->markup_size = size;
+  self->markup_strip_tracking_ids = !!strip_tracking_ids;
+  self->markup_cached = TRUE;
+
+  if (quotes)
+    self->quotes = pango_attr_list_ref (quotes);
+}
+
 ChattyMsgDirection
 chatty_message_get_msg_direction (ChattyMessage *self)
 {
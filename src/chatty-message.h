@@ -13,6 +13,7 @@
 #define CMATRIX_USE_EXPERIMENTAL_API
 #include <cmatrix.h>
 #include <glib-object.h>
+#include <pango/pango.h>
 
 #include "chatty-item.h"
 #include "chatty-enums.h"
@@ -64,5 +65,13 @@ void                chatty_message_set_status      (ChattyMessage      *self,
                                                     time_t              mtime);
 ChattyMsgType       chatty_message_get_msg_type    (ChattyMessage      *self);
 ChattyMsgDirection  chatty_message_get_msg_direction (ChattyMessage    *self);
+gboolean            chatty_message_get_markup_cache (ChattyMessage     *self,
+                                                     gboolean           strip_tracking_ids,
+                                                     const char       **markup,
+                                                     PangoAttrList    **quotes);
+void                chatty_message_set_markup_cache (ChattyMessage     *self,
+                                                     gboolean           strip_tracking_ids,
+                                                     const char        *markup,
+                                                     PangoAttrList     *quotes);
 
 G_END_DECLS
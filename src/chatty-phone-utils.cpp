@@ -15,6 +15,7 @@
 # include "config.h"
 #endif
 
+#include <locale.h>
 #include <phonenumbers/phonenumberutil.h>
 
 #include "chatty-phone-utils.h"
@@ -22,6 +23,48 @@
 using i18n::phonenumbers::PhoneNumber;
 using i18n::phonenumbers::PhoneNumberUtil;
 
+/* Get the region from the locale, as evolution-data-server does */
+static std::string
+phone_utils_get_default_region (void)
+{
+  const char *locale, *region;
+
+#ifdef LC_ADDRESS
+  locale = setlocale (LC_ADDRESS, NULL);
+#else
+  locale = setlocale (LC_MESSAGES, NULL);
+#endif
+
+  if (locale && (region = strchr (locale, '_')) &&
+      g_ascii_isalpha (region[1]) && g_ascii_isalpha (region[2]))
+    return std::string ({g_ascii_toupper (region[1]), g_ascii_toupper (region[2])});
+
+  return "ZZ";
+}
+
+static void
+phone_utils_set_key (const PhoneNumber &number,
+                     ChattyPhoneKey    *key)
+{
+  key->national_number = number.national_number ();
+  key->country_code = number.country_code ();
+  key->leading_zeros = number.italian_leading_zero () ? number.number_of_leading_zeros () : 0;
+  key->has_country_code = number.country_code_source () != PhoneNumber::FROM_DEFAULT_COUNTRY;
+}
+
+static void
+phone_utils_get_number (const ChattyPhoneKey *key,
+                        PhoneNumber          *number)
+{
+  number->set_country_code (key->country_code);
+  number->set_national_number (key->national_number);
+
+  if (key->leading_zeros) {
+    number->set_italian_leading_zero (true);
+    number->set_number_of_leading_zeros (key->leading_zeros);
+  }
+}
+
 
 gboolean
 chatty_phone_utils_is_valid (const char *number,
@@ -52,3 +95,133 @@ chatty_phone_utils_is_possible (const char *number,
 
   return util->IsPossibleNumberForString (number, country_code);
 }
+
+/**
+ * chatty_phone_utils_get_key:
+ * @number: A phone number string
+ * @country_code: (nullable): An ISO 3166-1 two letter country code
+ * @key: (out): A #ChattyPhoneKey
+ *
+ * Parse @number once into @key, so that it can be
+ * formatted and compared without parsing it again.
+ * If @country_code is %NULL, the region of the
+ * current locale is used.
+ *
+ * Returns: %TRUE if @number could be parsed
+ */
+gboolean
+chatty_phone_utils_get_key (const char     *number,
+                            const char     *country_code,
+                            ChattyPhoneKey *key)
+{
+  PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
+  PhoneNumber phone_number;
+  std::string region;
+
+  g_return_val_if_fail (key, FALSE);
+
+  if (!number || !*number)
+    return FALSE;
+
+  if (country_code)
+    region = country_code;
+  else
+    region = phone_utils_get_default_region ();
+
+  /* Keep the raw input to know where the country code came from */
+  if (util->ParseAndKeepRawInput (number, region, &phone_number) != PhoneNumberUtil::NO_PARSING_ERROR)
+    return FALSE;
+
+  phone_utils_set_key (phone_number, key);
+
+  return TRUE;
+}
+
+gboolean
+chatty_phone_utils_key_is_valid (const ChattyPhoneKey *key)
+{
+  PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
+  PhoneNumber phone_number;
+
+  g_return_val_if_fail (key, FALSE);
+
+  phone_utils_get_number (key, &phone_number);
+
+  return util->IsValidNumber (phone_number);
+}
+
+/**
+ * chatty_phone_utils_key_to_string:
+ * @key: A #ChattyPhoneKey
+ * @national: Whether to format in national format
+ *
+ * Get the normalized string of @key, either in
+ * E.164 format or, if @national, in the national
+ * format of its country.
+ *
+ * Returns: (transfer full): The phone number string.
+ * Free with g_free().
+ */
+char *
+chatty_phone_utils_key_to_string (const ChattyPhoneKey *key,
+                                  gboolean              national)
+{
+  PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
+  PhoneNumber phone_number;
+  std::string formatted;
+
+  g_return_val_if_fail (key, NULL);
+
+  phone_utils_get_number (key, &phone_number);
+  util->Format (phone_number,
+                national ? PhoneNumberUtil::NATIONAL : PhoneNumberUtil::E164,
+                &formatted);
+
+  return g_strdup (formatted.c_str ());
+}
+
+/**
+ * chatty_phone_utils_key_match:
+ * @a: A #ChattyPhoneKey
+ * @b: A #ChattyPhoneKey
+ *
+ * Check if @a and @b are the same number, like an exact
+ * or a national match of e_phone_number_compare(), without
+ * parsing the numbers again.  If either number had no
+ * country code, only the national numbers are compared.
+ *
+ * Returns: %TRUE if @a and @b match
+ */
+gboolean
+chatty_phone_utils_key_match (const ChattyPhoneKey *a,
+                              const ChattyPhoneKey *b)
+{
+  g_return_val_if_fail (a && b, FALSE);
+
+  if (!a->has_country_code || !b->has_country_code)
+    return a->national_number == b->national_number &&
+      a->leading_zeros == b->leading_zeros;
+
+  return chatty_phone_utils_key_equal (a, b);
+}
+
+guint
+chatty_phone_utils_key_hash (gconstpointer key)
+{
+  const ChattyPhoneKey *phone_key = (const ChattyPhoneKey *)key;
+
+  return g_int64_hash (&phone_key->national_number) ^
+    (phone_key->country_code << 8 | phone_key->leading_zeros);
+}
+
+gboolean
+chatty_phone_utils_key_equal (gconstpointer a,
+                              gconstpointer b)
+{
+  const ChattyPhoneKey *key_a = (const ChattyPhoneKey *)a;
+  const ChattyPhoneKey *key_b = (const ChattyPhoneKey *)b;
+
+  return key_a->national_number == key_b->national_number &&
+    key_a->country_code == key_b->country_code &&
+    key_a->leading_zeros == key_b->leading_zeros;
+}
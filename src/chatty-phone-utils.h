@@ -14,9 +14,34 @@
 
 G_BEGIN_DECLS
 
+/*
+ * A parsed phone number, as the country calling code and the
+ * national number, with the count of its leading zeros if any.
+ * has_country_code is unset if the number had no country code,
+ * and the one of the region it was parsed for was used.
+ */
+typedef struct {
+  guint64 national_number;
+  guint16 country_code;
+  guint8  leading_zeros;
+  guint8  has_country_code;
+} ChattyPhoneKey;
+
 gboolean     chatty_phone_utils_is_valid      (const char *number,
                                                const char *country_code);
 gboolean     chatty_phone_utils_is_possible   (const char *number,
                                                const char *country_code);
+
+gboolean     chatty_phone_utils_get_key       (const char           *number,
+                                               const char           *country_code,
+                                               ChattyPhoneKey       *key);
+gboolean     chatty_phone_utils_key_is_valid  (const ChattyPhoneKey *key);
+char        *chatty_phone_utils_key_to_string (const ChattyPhoneKey *key,
+                                               gboolean              national);
+gboolean     chatty_phone_utils_key_match     (const ChattyPhoneKey *a,
+                                               const ChattyPhoneKey *b);
+guint        chatty_phone_utils_key_hash      (gconstpointer         key);
+gboolean     chatty_phone_utils_key_equal     (gconstpointer         a,
+                                               gconstpointer         b);
 G_END_DECLS
 
@@ -28,6 +28,7 @@
 #endif
 
 #include "chatty-settings.h"
+#include "chatty-utils.h"
 
 /**
  * SECTION: chatty-settings
@@ -46,6 +47,9 @@ struct _ChattySettings
   GSettings  *settings;
   GSettings  *pgp_settings;
   char       *country_code;
+  char       *history_durability;
+  guint       history_hot_days;
+  guint       history_hot_messages;
   char       *pgp_user_id;
   char       *pgp_public_key_fingerprint;
 };
@@ -273,6 +277,9 @@ chatty_settings_constructed (GObject *object)
   g_settings_bind (self->settings, "clear-out-stuck-sms",
                    self, "clear-out-stuck-sms", G_SETTINGS_BIND_DEFAULT);
   self->country_code = g_settings_get_string (self->settings, "country-code");
+  self->history_durability = g_settings_get_string (self->settings, "history-durability");
+  self->history_hot_days = g_settings_get_uint (self->settings, "history-hot-days");
+  self->history_hot_messages = g_settings_get_uint (self->settings, "history-hot-messages");
   self->pgp_user_id = g_settings_get_string (self->pgp_settings, "user-id");
   self->pgp_public_key_fingerprint = g_settings_get_string (self->pgp_settings, "public-key-fingerprint");
 }
@@ -285,6 +292,7 @@ chatty_settings_finalize (GObject *object)
   g_settings_set_boolean (self->settings, "first-start", FALSE);
   g_object_unref (self->settings);
   g_free (self->country_code);
+  g_free (self->history_durability);
   g_free (self->pgp_user_id);
   g_free (self->pgp_public_key_fingerprint);
 
@@ -749,11 +757,59 @@ chatty_settings_set_country_iso_code (ChattySettings *self,
 {
   g_return_if_fail (CHATTY_IS_SETTINGS (self));
 
+  if (g_strcmp0 (country_code, self->country_code) != 0)
+    chatty_utils_clear_phonenumber_cache ();
+
   g_free (self->country_code);
   self->country_code = g_strdup (country_code);
   g_settings_set (G_SETTINGS (self->settings), "country-code", "s", country_code);
 }
 
+/**
+ * chatty_settings_get_history_durability:
+ * @self: A #ChattySettings
+ *
+ * Get the durability profile used for the message
+ * history database, either "full" or "normal".
+ * The value is read once on startup.
+ *
+ * Returns: (transfer none): The durability profile
+ */
+const char *
+chatty_settings_get_history_durability (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), NULL);
+
+  if (self->history_durability && *self->history_durability)
+    return self->history_durability;
+
+  return NULL;
+}
+
+/**
+ * chatty_settings_get_history_hot_window:
+ * @self: A #ChattySettings
+ * @days: (out) (optional): Return location for the days to keep
+ * @messages: (out) (optional): Return location for the messages to keep
+ *
+ * Get how much of every chat is kept in the main message
+ * history database, older messages being archived.  0 means
+ * no limit.  The values are read once on startup.
+ */
+void
+chatty_settings_get_history_hot_window (ChattySettings *self,
+                                        guint          *days,
+                                        guint          *messages)
+{
+  g_return_if_fail (CHATTY_IS_SETTINGS (self));
+
+  if (days)
+    *days = self->history_hot_days;
+
+  if (messages)
+    *messages = self->history_hot_messages;
+}
+
 const char *
 chatty_settings_get_pgp_user_id (ChattySettings *self)
 {
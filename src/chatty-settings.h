@@ -57,6 +57,10 @@ void            chatty_settings_set_window_geometry          (ChattySettings *se
 const char     *chatty_settings_get_country_iso_code         (ChattySettings *self);
 void            chatty_settings_set_country_iso_code         (ChattySettings *self,
                                                               const char     *iso_code);
+const char     *chatty_settings_get_history_durability       (ChattySettings *self);
+void            chatty_settings_get_history_hot_window       (ChattySettings *self,
+                                                              guint          *days,
+                                                              guint          *messages);
 const char     *chatty_settings_get_pgp_user_id              (ChattySettings *self);
 void            chatty_settings_set_pgp_user_id              (ChattySettings *self,
                                                               const char     *pgp_signing_id);
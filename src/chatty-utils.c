@@ -19,7 +19,6 @@
 #include "chatty-settings.h"
 #include "chatty-phone-utils.h"
 #include "chatty-utils.h"
-#include <libebook-contacts/libebook-contacts.h>
 #include <ctype.h>
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <libgnome-desktop/gnome-desktop-thumbnail.h>
@@ -30,6 +29,9 @@
 #define ASCII_CAPS  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 #define ASCII_SMALL "abcdefghijklmnopqrstuvwxyz"
 
+/* Maximum number of phone numbers cached before the cache is reset */
+#define PHONE_CACHE_SIZE 1024
+
 #define URL_WWW "www"
 #define URL_HTTP "http"
 #define URL_HTTPS "https"
@@ -135,6 +137,35 @@ load_tracking_ids (void)
   return lines;
 }
 
+/*
+ * Get the set of tracking ids.  It's loaded on first use
+ * and never modified after, so it can be read from any
+ * thread.  The set is empty if the ids failed to load.
+ */
+static GHashTable *
+get_tracking_ids (void)
+{
+  static GHashTable *tracking_ids;
+
+  if (g_once_init_enter (&tracking_ids)) {
+    g_auto(GStrv) lines = NULL;
+    GHashTable *ids;
+
+    ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    lines = load_tracking_ids ();
+
+    for (guint i = 0; lines && lines[i]; i++) {
+      /* The g_resource has "//" as comments, ignore those */
+      if (!g_str_has_prefix (lines[i], "//"))
+        g_hash_table_add (ids, g_strdup (lines[i]));
+    }
+
+    g_once_init_leave (&tracking_ids, ids);
+  }
+
+  return tracking_ids;
+}
+
 /*
  * https://datatracker.ietf.org/doc/html/rfc1738#section-3.3
  * An URL takes the form: http://<host>:<port>/<path>?<searchpart>
@@ -148,7 +179,7 @@ chatty_utils_strip_utm_from_url (const char *url_to_parse)
   GString *str = NULL;
   char *stripped_url, *unowned_attr, *unowned_value;
   GUriParamsIter iter;
-  char **tracking_ids = NULL;
+  GHashTable *tracking_ids;
 
   if (!url_to_parse || !strstr (url_to_parse, "?"))
     return g_strdup (url_to_parse);
@@ -157,29 +188,17 @@ chatty_utils_strip_utm_from_url (const char *url_to_parse)
   if (!url || !g_uri_get_query (url))
     return g_strdup (url_to_parse);
 
-  tracking_ids = load_tracking_ids ();
-  if (!tracking_ids)
+  tracking_ids = get_tracking_ids ();
+  if (!g_hash_table_size (tracking_ids))
     return g_strdup (url_to_parse);
 
-  str = g_string_new (NULL);
+  str = g_string_sized_new (strlen (g_uri_get_query (url)));
   g_uri_params_iter_init (&iter, g_uri_get_query (url), -1, "&", G_URI_PARAMS_NONE);
   while (g_uri_params_iter_next (&iter, &unowned_attr, &unowned_value, &error)) {
     g_autofree char *attr = g_steal_pointer (&unowned_attr);
     g_autofree char *value = g_steal_pointer (&unowned_value);
-    gboolean tracking_id = FALSE;
-
-    for (unsigned int j = 0; tracking_ids[j] != NULL; j++) {
-       /* The g_resource has "//" as comments, ignore those */
-       if (g_str_has_prefix (tracking_ids[j], "//"))
-          continue;
 
-       if (g_strcmp0 ((char *) attr, tracking_ids[j]) == 0) {
-         tracking_id = TRUE;
-         break;
-       }
-    }
-
-    if (!tracking_id) {
+    if (!g_hash_table_contains (tracking_ids, attr)) {
       str = g_string_append (str, attr);
       str = g_string_append (str, "=");
       str = g_string_append (str, value);
@@ -204,7 +223,6 @@ chatty_utils_strip_utm_from_url (const char *url_to_parse)
                              g_uri_get_fragment (url));
 
   g_string_free (str, TRUE);
-  g_strfreev (tracking_ids);
 
   return stripped_url;
 }
@@ -297,15 +315,25 @@ matrix_id_is_valid (const char *name,
   return FALSE;
 }
 
-char *
-chatty_utils_check_phonenumber (const char *phone_number,
-                                const char *country)
+/*
+ * Parsed phone numbers keyed by "country\nnumber", as the same
+ * few numbers are checked again and again for every message.
+ * The value is NULL if the number isn't a phone number.  The
+ * history worker threads check numbers too, so guard with a lock.
+ */
+static GMutex      phone_cache_lock;
+static GHashTable *phone_cache;
+static guint       phone_cache_hits;
+static guint       phone_cache_misses;
+
+static char *
+utils_check_phonenumber (const char *phone_number,
+                         const char *country)
 {
-  EPhoneNumber      *number;
+  ChattyPhoneKey     key;
   g_autofree char   *raw = NULL;
   char              *stripped;
-  char              *result;
-  g_autoptr(GError)  err = NULL;
+  gboolean           national;
 
   CHATTY_DEBUG (phone_number, "checking number");
 
@@ -326,26 +354,103 @@ chatty_utils_check_phonenumber (const char *phone_number,
   if (strspn (stripped, "+()- 0123456789") != strlen (stripped))
     return NULL;
 
-  if (!e_phone_number_is_supported ()) {
-    g_warning ("evolution-data-server built without libphonenumber support");
+  /* Parse once, and check and format the parsed number */
+  if (!chatty_phone_utils_get_key (stripped, country, &key)) {
+    g_debug ("Error parsing ‘%s’ for country ‘%s’", phone_number, country);
+
     return NULL;
   }
 
-  number = e_phone_number_from_string (stripped, country, &err);
+  national = *phone_number != '+' &&
+    !(country && strlen (country) == 2 && chatty_phone_utils_key_is_valid (&key));
+
+  return chatty_phone_utils_key_to_string (&key, national);
+}
+
+static void
+utils_phone_cache_log_stats (void)
+{
+  guint total;
+
+  total = phone_cache_hits + phone_cache_misses;
+
+  if (total)
+    g_debug ("Phone number cache: %u hits, %u misses (%u%% hit rate), %u cached",
+             phone_cache_hits, phone_cache_misses,
+             (guint)((guint64)phone_cache_hits * 100 / total),
+             phone_cache ? g_hash_table_size (phone_cache) : 0);
+}
+
+/**
+ * chatty_utils_clear_phonenumber_cache:
+ *
+ * Clear the numbers cached by chatty_utils_check_phonenumber().
+ * This should be called when the country code setting changes.
+ */
+void
+chatty_utils_clear_phonenumber_cache (void)
+{
+  g_mutex_lock (&phone_cache_lock);
+
+  utils_phone_cache_log_stats ();
 
-  if (!number) {
-    g_debug ("Error parsing ‘%s’ for country ‘%s’: %s", phone_number, country, err->message);
+  if (phone_cache)
+    g_hash_table_remove_all (phone_cache);
 
+  phone_cache_hits = phone_cache_misses = 0;
+
+  g_mutex_unlock (&phone_cache_lock);
+}
+
+char *
+chatty_utils_check_phonenumber (const char *phone_number,
+                                const char *country)
+{
+  g_autofree char *key = NULL;
+  char *result = NULL;
+  gpointer value;
+  gboolean found;
+
+  if (!phone_number || !*phone_number)
     return NULL;
+
+  key = g_strconcat (country ? country : "", "\n", phone_number, NULL);
+
+  g_mutex_lock (&phone_cache_lock);
+
+  found = phone_cache &&
+          g_hash_table_lookup_extended (phone_cache, key, NULL, &value);
+
+  if (found) {
+    phone_cache_hits++;
+    result = g_strdup (value);
+  } else {
+    phone_cache_misses++;
   }
 
-  if (*phone_number != '+' &&
-      !chatty_phone_utils_is_valid (phone_number, country))
-    result = e_phone_number_to_string (number, E_PHONE_NUMBER_FORMAT_NATIONAL);
-  else
-    result = e_phone_number_to_string (number, E_PHONE_NUMBER_FORMAT_E164);
+  /* Log the stats every few thousand lookups */
+  if ((phone_cache_hits + phone_cache_misses) % (PHONE_CACHE_SIZE * 4) == 0)
+    utils_phone_cache_log_stats ();
+
+  g_mutex_unlock (&phone_cache_lock);
+
+  if (found)
+    return result;
+
+  /* Don't block other threads on the slow parsing */
+  result = utils_check_phonenumber (phone_number, country);
+
+  g_mutex_lock (&phone_cache_lock);
+
+  if (!phone_cache)
+    phone_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (g_hash_table_size (phone_cache) >= PHONE_CACHE_SIZE)
+    g_hash_table_remove_all (phone_cache);
+
+  g_hash_table_replace (phone_cache, g_steal_pointer (&key), g_strdup (result));
 
-  e_phone_number_free (number);
+  g_mutex_unlock (&phone_cache_lock);
 
   return result;
 }
@@ -25,6 +25,7 @@ char *chatty_utils_strip_utm_from_url (const char *url_to_parse);
 char *chatty_utils_strip_utm_from_message (const char *message);
 char *chatty_utils_check_phonenumber (const char *phone_number,
                                       const char *country);
+void  chatty_utils_clear_phonenumber_cache (void);
 ChattyProtocol chatty_utils_username_is_valid  (const char     *name,
                                                 ChattyProtocol  protocol);
 ChattyProtocol chatty_utils_groupname_is_valid (const char     *name,
@@ -409,8 +409,8 @@ window_delete_chat_response_cb (AdwMessageDialog *dialog,
 
     chat = (ChattyChat *)chatty_main_view_get_item (CHATTY_MAIN_VIEW (self->main_view));
 
-    chatty_history_delete_chat (chatty_manager_get_history (self->manager),
-                                chat);
+    chatty_history_delete_chat_async (chatty_manager_get_history (self->manager),
+                                      chat, NULL, NULL);
 #ifdef PURPLE_ENABLED
     if (CHATTY_IS_PP_CHAT (chat)) {
       chatty_pp_chat_delete (CHATTY_PP_CHAT (chat));
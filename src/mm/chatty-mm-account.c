@@ -19,6 +19,7 @@
 #include "chatty-history.h"
 #include "chatty-mm-chat.h"
 #include "chatty-utils.h"
+#include "chatty-phone-utils.h"
 #include "itu-e212-iso.h"
 #include "chatty-mm-account-private.h"
 #include "chatty-mm-account.h"
@@ -112,6 +113,8 @@ struct _ChattyMmAccount
   GListStore       *device_list;
   GListStore       *chat_list;
   GListStore       *blocked_chat_list;
+  /* chat name, which is the sorted recipient list, to chat in chat_list */
+  GHashTable       *chat_index;
   GHashTable       *pending_sms;
   GHashTable       *stuck_sms;
   GCancellable     *cancellable;
@@ -137,6 +140,16 @@ typedef struct _StuckSmSPayload {
   guint            stuck_watch_id;
 } StuckSmSPayload;
 
+/* Received SMS of a chat that are saved to history in one go */
+typedef struct _SmsBacklog {
+  ChattyMmAccount *object;
+  ChattyMmDevice  *device;
+  ChattyChat      *chat;
+  GPtrArray       *messages;
+  /* SMS to delete from modem once messages are saved */
+  GPtrArray       *sms_list;
+} SmsBacklog;
+
 G_DEFINE_TYPE (ChattyMmAccount, chatty_mm_account, CHATTY_TYPE_ACCOUNT)
 
 
@@ -154,6 +167,36 @@ stuck_sms_payload_free (gpointer data)
   g_free (payload);
 }
 
+static void
+sms_backlog_free (gpointer data)
+{
+  SmsBacklog *backlog = data;
+
+  g_object_unref (backlog->object);
+  g_object_unref (backlog->device);
+  g_object_unref (backlog->chat);
+  g_ptr_array_unref (backlog->messages);
+  g_ptr_array_unref (backlog->sms_list);
+  g_free (backlog);
+}
+
+static SmsBacklog *
+sms_backlog_new (ChattyMmAccount *self,
+                 ChattyMmDevice  *device,
+                 ChattyChat      *chat)
+{
+  SmsBacklog *backlog;
+
+  backlog = g_new0 (SmsBacklog, 1);
+  backlog->object = g_object_ref (self);
+  backlog->device = g_object_ref (device);
+  backlog->chat = g_object_ref (chat);
+  backlog->messages = g_ptr_array_new_with_free_func (g_object_unref);
+  backlog->sms_list = g_ptr_array_new_with_free_func (g_object_unref);
+
+  return backlog;
+}
+
 static int
 sort_strv (gconstpointer a,
            gconstpointer b)
@@ -214,6 +257,27 @@ create_sorted_numbers (const char *numbers,
   return g_strjoinv (",", (char **)sorted->pdata);
 }
 
+/*
+ * Chats are not referenced in chat_index, as chat_list keeps
+ * them alive.  If there are chats with the same name, the one
+ * earlier in chat_list is kept, so set @replace only if @chat
+ * is added before the others.
+ */
+static void
+mm_account_index_chat (ChattyMmAccount *self,
+                       ChattyChat      *chat,
+                       gboolean         replace)
+{
+  const char *name;
+
+  name = chatty_chat_get_chat_name (chat);
+
+  if (!name || (!replace && g_hash_table_contains (self->chat_index, name)))
+    return;
+
+  g_hash_table_insert (self->chat_index, g_strdup (name), chat);
+}
+
 static char *
 strip_phone_number (const char *number)
 {
@@ -276,7 +340,7 @@ sent_message_delete_cb (GObject      *object,
 
   /* We add the item to db only if we are able to delete it from modem */
   if (mm_modem_messaging_delete_finish (messaging, result, &error))
-    chatty_history_add_message (self->history_db, chat, message);
+    chatty_history_add_message_async (self->history_db, chat, message, NULL, NULL);
   else if (error)
     g_warning ("Error deleting message: %s", error->message);
 
@@ -341,7 +405,7 @@ sms_send_cb (GObject      *object,
     g_autofree char *title = NULL;
 
     chatty_message_set_status (message, CHATTY_STATUS_SENDING_FAILED, 0);
-    chatty_history_add_message (self->history_db, chat, message);
+    chatty_history_add_message_async (self->history_db, chat, message, NULL, NULL);
     title = g_strdup_printf (_("Error Sending SMS to %s"),
                               chatty_item_get_name (CHATTY_ITEM (chat)));
     chatty_mm_notify_message (title, ERROR_MM_SMS_SEND_RECEIVE, "");
@@ -392,7 +456,7 @@ sms_create_cb (GObject      *object,
     g_assert (CHATTY_IS_CHAT (chat));
 
     chatty_message_set_status (message, CHATTY_STATUS_SENDING_FAILED, 0);
-    chatty_history_add_message (self->history_db, chat, message);
+    chatty_history_add_message_async (self->history_db, chat, message, NULL, NULL);
     title = g_strdup_printf (_("Error Sending SMS to %s"),
                               chatty_item_get_name (CHATTY_ITEM (chat)));
     chatty_mm_notify_message (title, ERROR_MM_SMS_SEND_RECEIVE, "");
@@ -448,13 +512,12 @@ chatty_mm_account_check_eds (gpointer user_data)
   return G_SOURCE_CONTINUE;
 }
 
-static gboolean
-chatty_mm_account_append_message (ChattyMmAccount *self,
-                                  ChattyMessage   *message,
-                                  ChattyChat      *chat)
+static void
+mm_account_show_message (ChattyMmAccount *self,
+                         ChattyMessage   *message,
+                         ChattyChat      *chat)
 {
   guint position;
-  gboolean success;
 
   g_assert (CHATTY_IS_MM_ACCOUNT (self));
   g_assert (CHATTY_IS_MESSAGE (message));
@@ -465,7 +528,6 @@ chatty_mm_account_append_message (ChattyMmAccount *self,
     chatty_item_set_state (CHATTY_ITEM (chat), CHATTY_ITEM_VISIBLE);
 
   chatty_mm_chat_append_message (CHATTY_MM_CHAT (chat), message);
-  success = chatty_history_add_message (self->history_db, chat, message);
   chatty_chat_set_unread_count (chat, chatty_chat_get_unread_count (chat) + 1);
   g_signal_emit_by_name (chat, "changed", 0);
   if (chatty_message_get_msg_direction (message) == CHATTY_DIRECTION_IN) {
@@ -479,8 +541,15 @@ chatty_mm_account_append_message (ChattyMmAccount *self,
 
   if (chatty_utils_get_item_position (G_LIST_MODEL (self->chat_list), chat, &position))
     g_list_model_items_changed (G_LIST_MODEL (self->chat_list), position, 1, 1);
+}
 
-  return success;
+static void
+chatty_mm_account_append_message (ChattyMmAccount *self,
+                                  ChattyMessage   *message,
+                                  ChattyChat      *chat)
+{
+  mm_account_show_message (self, message, chat);
+  chatty_history_add_message_async (self->history_db, chat, message, NULL, NULL);
 }
 
 gboolean
@@ -521,7 +590,7 @@ chatty_mm_account_recieve_mms_cb (ChattyMmAccount *self,
                                                          chatty_message_get_uid (message));
     if (messagecheck != NULL) {
       chatty_message_set_status (messagecheck, chatty_message_get_status (message), 0);
-      chatty_history_add_message (self->history_db, chat, message);
+      chatty_history_add_message_async (self->history_db, chat, message, NULL, NULL);
     } else { /* The MMS was deleted before the update, so just delete the MMS */
       chatty_mmsd_delete_mms (self->mmsd, chatty_message_get_uid (message));
       return FALSE;
@@ -552,31 +621,40 @@ chatty_mm_account_recieve_mms_cb (ChattyMmAccount *self,
 
   if (message_dir == CHATTY_DIRECTION_IN) {
     GListModel *users;
+    ChattyPhoneKey sender_key, buddy_key;
+    const char *buddy_number, *country;
+    gboolean has_sender_key;
     guint items;
-    const char *buddy_number;
-    g_autofree char *phone1 = NULL;
-    g_autofree char *phone2 = NULL;
 
-    /* Find the sender of the message */
+    country = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+    has_sender_key = chatty_phone_utils_get_key (sender, country, &sender_key);
+
+    /* Find the sender of the message, compare numbers as parsed keys */
     users = chatty_chat_get_users (chat);
     items = g_list_model_get_n_items (users);
     for (guint i = 0; i < items; i++) {
+      g_clear_object (&senderbuddy);
       senderbuddy = g_list_model_get_item (users, i);
       buddy_number = chatty_mm_buddy_get_number (senderbuddy);
-      phone1 = chatty_utils_check_phonenumber (buddy_number,
-                                               chatty_settings_get_country_iso_code (chatty_settings_get_default ()));
-      if (phone1 == NULL) {
+
+      if (g_strcmp0 (buddy_number, sender) == 0)
+        break;
+
+      /*
+       * If the sender isn't a number, the buddy number was compared
+       * with itself, so the first buddy matched.  Keep doing so,
+       * instead of ending up with the last one.
+       */
+      if (!has_sender_key)
+        break;
+
+      if (!chatty_phone_utils_get_key (buddy_number, country, &buddy_key)) {
         g_warning ("Error with the number!");
-        phone1 = g_strdup (buddy_number);
-      }
-      phone2 = chatty_utils_check_phonenumber (sender,
-                                               chatty_settings_get_country_iso_code (chatty_settings_get_default ()));
-      if (phone2 == NULL) {
-        phone2 = g_strdup (buddy_number);
+        continue;
       }
-      if (g_strcmp0 (phone1, phone2) == 0) {
+
+      if (chatty_phone_utils_key_match (&buddy_key, &sender_key))
         break;
-      }
     }
   } else if (message_dir == CHATTY_DIRECTION_OUT) {
     senderbuddy = chatty_mm_buddy_new (sender, sender);
@@ -608,11 +686,60 @@ mm_account_delete_message_async (ChattyMmAccount     *self,
   g_hash_table_remove (self->stuck_sms, sms_path);
 }
 
-static gboolean
+static void
+sms_backlog_saved_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  SmsBacklog *backlog = user_data;
+  g_autoptr(GError) error = NULL;
+
+  /* Delete the SMS from modem only if we were able to store them */
+  if (chatty_history_add_messages_finish (CHATTY_HISTORY (object), result, &error)) {
+    for (guint i = 0; i < backlog->sms_list->len; i++)
+      mm_account_delete_message_async (backlog->object, backlog->device,
+                                       backlog->sms_list->pdata[i], NULL, NULL);
+  } else {
+    g_warning ("Error saving %u SMS: %s", backlog->messages->len, error->message);
+  }
+
+  sms_backlog_free (backlog);
+}
+
+static void
+mm_account_save_sms_backlog (ChattyMmAccount *self,
+                             GHashTable      *backlog)
+{
+  GHashTableIter iter;
+  SmsBacklog *batch;
+
+  g_assert (CHATTY_IS_MM_ACCOUNT (self));
+
+  g_hash_table_iter_init (&iter, backlog);
+
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&batch)) {
+    CHATTY_TRACE_MSG ("saving %u messages from modem", batch->messages->len);
+    chatty_history_add_messages_async (self->history_db, batch->chat, batch->messages,
+                                       sms_backlog_saved_cb, batch);
+    g_hash_table_iter_steal (&iter);
+  }
+}
+
+/*
+ * mm_account_add_sms:
+ * @backlog: (nullable): A #GHashTable of #SmsBacklog by chat
+ *
+ * Show @sms in its chat and store it in history.  If @backlog
+ * is set, the message is queued to be stored with other messages
+ * of the chat, see mm_account_save_sms_backlog().  Received SMS
+ * are deleted from the modem once they are stored.
+ */
+static void
 mm_account_add_sms (ChattyMmAccount *self,
                     ChattyMmDevice  *device,
                     MMSms           *sms,
-                    MMSmsState       state)
+                    MMSmsState       state,
+                    GHashTable      *backlog)
 {
   g_autoptr(ChattyMessage) message = NULL;
   g_autoptr(GDateTime) date_time = NULL;
@@ -622,15 +749,16 @@ mm_account_add_sms (ChattyMmAccount *self,
   g_autofree char *uuid = NULL;
   const char *msg;
   ChattyMsgDirection direction = CHATTY_DIRECTION_UNKNOWN;
+  g_autoptr(GHashTable) own_backlog = NULL;
+  SmsBacklog *batch;
   gint64 unix_time = 0;
-  gboolean message_added;
 
   g_assert (CHATTY_IS_MM_ACCOUNT (self));
   g_assert (MM_IS_SMS (sms));
 
   msg = mm_sms_get_text (sms);
   if (!msg)
-    return FALSE;
+    return;
 
   phone = chatty_utils_check_phonenumber (mm_sms_get_number (sms),
                                           chatty_settings_get_country_iso_code (chatty_settings_get_default ()));
@@ -661,12 +789,24 @@ mm_account_add_sms (ChattyMmAccount *self,
   message = chatty_message_new (CHATTY_ITEM (senderbuddy),
                                 msg, uuid, unix_time, CHATTY_MESSAGE_TEXT, direction, 0);
 
-  message_added = chatty_mm_account_append_message (self, message, chat);
+  if (!backlog)
+    backlog = own_backlog = g_hash_table_new_full (NULL, NULL, NULL, sms_backlog_free);
 
-  if (message_added && direction == CHATTY_DIRECTION_IN)
-    mm_account_delete_message_async (self, device, sms, NULL, NULL);
+  batch = g_hash_table_lookup (backlog, chat);
+
+  if (!batch) {
+    batch = sms_backlog_new (self, device, chat);
+    g_hash_table_insert (backlog, chat, batch);
+  }
 
-  return message_added;
+  mm_account_show_message (self, message, chat);
+  g_ptr_array_add (batch->messages, g_object_ref (message));
+
+  if (direction == CHATTY_DIRECTION_IN)
+    g_ptr_array_add (batch->sms_list, g_object_ref (sms));
+
+  if (own_backlog)
+    mm_account_save_sms_backlog (self, own_backlog);
 }
 
 static void
@@ -685,13 +825,7 @@ sms_state_changed_cb (ChattyMmAccount *self,
     ChattyMmDevice *device;
 
     device = g_object_get_data (G_OBJECT (sms), "device");
-    if (mm_account_add_sms (self, device, sms, state)) {
-      CHATTY_TRACE_MSG ("deleting message %s", mm_sms_get_path (sms));
-      mm_modem_messaging_delete (mm_object_peek_modem_messaging (device->mm_object),
-                                 mm_sms_get_path (sms),
-                                 NULL, NULL, NULL);
-      g_hash_table_remove (self->stuck_sms, mm_sms_get_path (sms));
-    }
+    mm_account_add_sms (self, device, sms, state, NULL);
   }
 }
 
@@ -807,7 +941,8 @@ mm_account_check_state (ChattyMmAccount *self,
 static void
 parse_sms (ChattyMmAccount *self,
            ChattyMmDevice  *device,
-           MMSms           *sms)
+           MMSms           *sms,
+           GHashTable      *backlog)
 {
   MMSmsPduType type;
   MMSmsState state;
@@ -838,31 +973,34 @@ parse_sms (ChattyMmAccount *self,
     if (delivery_state <= MM_SMS_DELIVERY_STATE_COMPLETED_REPLACED_BY_SC) {
       ChattyMessage *message;
       ChattyChat *chat = NULL;
-      gboolean success = FALSE;
 
       message = g_hash_table_lookup (self->pending_sms, GINT_TO_POINTER (sms_id));
       if (message) {
         chatty_message_set_status (message, CHATTY_STATUS_DELIVERED, 0);
         chat = chatty_mm_account_find_chat (self, mm_sms_get_number (sms));
-        if (chat)
-          success = chatty_history_add_message (self->history_db, chat, message);
       }
 
-      CHATTY_TRACE_MSG ("deleting message %s", mm_sms_get_path (sms));
-      if (!chat || success)
+      /* Delete the report from modem once the new status is stored */
+      if (chat) {
+        SmsBacklog *batch;
+
+        batch = sms_backlog_new (self, device, chat);
+        g_ptr_array_add (batch->messages, g_object_ref (message));
+        g_ptr_array_add (batch->sms_list, g_object_ref (sms));
+        chatty_history_add_messages_async (self->history_db, chat, batch->messages,
+                                           sms_backlog_saved_cb, batch);
+      } else {
+        CHATTY_TRACE_MSG ("deleting message %s", mm_sms_get_path (sms));
         mm_modem_messaging_delete (mm_object_peek_modem_messaging (device->mm_object),
                                    mm_sms_get_path (sms),
                                    NULL, NULL, NULL);
+      }
       g_hash_table_remove (self->pending_sms, GINT_TO_POINTER (sms_id));
     }
   } else if (type == MM_SMS_PDU_TYPE_CDMA_DELIVER ||
              type == MM_SMS_PDU_TYPE_DELIVER) {
-    if (state == MM_SMS_STATE_RECEIVED && mm_account_add_sms (self, device, sms, state)) {
-        CHATTY_TRACE_MSG ("deleting message %s", mm_sms_get_path (sms));
-        mm_modem_messaging_delete (mm_object_peek_modem_messaging (device->mm_object),
-                                   mm_sms_get_path (sms),
-                                   NULL, NULL, NULL);
-        g_hash_table_remove (self->stuck_sms, mm_sms_get_path (sms));
+    if (state == MM_SMS_STATE_RECEIVED) {
+      mm_account_add_sms (self, device, sms, state, backlog);
     } else if (state == MM_SMS_STATE_RECEIVING) {
       g_object_set_data_full (G_OBJECT (sms), "device",
                               g_object_ref (device),
@@ -885,6 +1023,7 @@ mm_account_messaging_list_cb (GObject      *object,
   MessagingData *data = user_data;
   g_autoptr(GError) error = NULL;
   g_autoptr(ChattyMmDevice) device = NULL;
+  g_autoptr(GHashTable) backlog = NULL;
   GList *list;
   char *path;
 
@@ -904,14 +1043,21 @@ mm_account_messaging_list_cb (GObject      *object,
   path = data->message_path;
   device = mm_account_lookup_device (self, NULL, mm_messaging);
 
+  /* Store all messages of a chat in one go when loading from modem */
+  if (!path)
+    backlog = g_hash_table_new_full (NULL, NULL, NULL, sms_backlog_free);
+
   for (GList *node = list; node; node = node->next)
     if (!path || g_str_equal (mm_sms_get_path (node->data), path)) {
-      parse_sms (self, device, node->data);
+      parse_sms (self, device, node->data, backlog);
 
       if (path)
         break;
     }
 
+  if (backlog)
+    mm_account_save_sms_backlog (self, backlog);
+
   g_object_unref (data->object);
   g_free (data->message_path);
   g_free (data);
@@ -1270,6 +1416,7 @@ chatty_mm_account_finalize (GObject *object)
 
   g_clear_handle_id (&self->mm_watch_id, g_bus_unwatch_name);
   g_clear_object (&self->history_db);
+  g_clear_pointer (&self->chat_index, g_hash_table_unref);
   g_clear_object (&self->chat_list);
   g_clear_object (&self->device_list);
   g_clear_object (&self->chatty_eds);
@@ -1303,6 +1450,7 @@ chatty_mm_account_init (ChattyMmAccount *self)
 {
   self->blocked_chat_list = g_list_store_new (CHATTY_TYPE_MM_CHAT);
   self->chat_list = g_list_store_new (CHATTY_TYPE_MM_CHAT);
+  self->chat_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   self->device_list = g_list_store_new (CHATTY_TYPE_MM_DEVICE);
   self->mmsd = chatty_mmsd_new (self);
   self->pending_sms = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -1446,6 +1594,10 @@ mm_get_chats_cb (GObject      *object,
       chatty_mm_chat_set_eds (chats->pdata[i], self->chatty_eds);
     }
 
+    /* The chats are added before the others, and the first one wins */
+    for (guint i = chats->len; i > 0; i--)
+      mm_account_index_chat (self, chats->pdata[i - 1], TRUE);
+
     g_list_store_splice (self->chat_list, 0, 0, chats->pdata, chats->len);
   }
 
@@ -1492,7 +1644,6 @@ chatty_mm_account_find_chat (ChattyMmAccount *self,
                              const char      *recipientlist)
 {
   g_autofree char *sorted_name = NULL;
-  gulong n_items;
 
   g_return_val_if_fail (CHATTY_MM_ACCOUNT (self), NULL);
 
@@ -1509,18 +1660,8 @@ chatty_mm_account_find_chat (ChattyMmAccount *self,
    * same way as the old chatty_mm_account_find_chat ()
    */
   sorted_name = create_sorted_numbers (recipientlist, NULL);
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->chat_list));
-
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr (ChattyChat) chat = NULL;
 
-    chat = g_list_model_get_item (G_LIST_MODEL (self->chat_list), i);
-
-    if (g_strcmp0 (chatty_chat_get_chat_name (chat), sorted_name) == 0)
-      return chat;
-  }
-
-  return NULL;
+  return g_hash_table_lookup (self->chat_index, sorted_name);
 }
 
 ChattyChat *
@@ -1554,6 +1695,7 @@ chatty_mm_account_start_chat (ChattyMmAccount *self,
     g_signal_connect_object (chat, "changed",
                              G_CALLBACK (mm_chat_changed_cb),
                              self, G_CONNECT_SWAPPED);
+    mm_account_index_chat (self, chat, FALSE);
     g_list_store_append (self->chat_list, chat);
     g_object_unref (chat);
   }
@@ -1587,6 +1729,7 @@ chatty_mm_account_start_chat_with_uri (ChattyMmAccount *self,
     g_signal_connect_object (chat, "changed",
                              G_CALLBACK (mm_chat_changed_cb),
                              self, G_CONNECT_SWAPPED);
+    mm_account_index_chat (self, chat, FALSE);
     g_list_store_append (self->chat_list, chat);
     g_object_unref (chat);
   }
@@ -1597,10 +1740,36 @@ void
 chatty_mm_account_delete_chat (ChattyMmAccount *self,
                                ChattyChat      *chat)
 {
+  g_autofree char *name = NULL;
+  gboolean indexed;
+  guint n_items;
+
   g_return_if_fail (CHATTY_IS_MM_ACCOUNT (self));
   g_return_if_fail (CHATTY_IS_MM_CHAT (chat));
 
+  /* @chat may be freed once removed from the list */
+  name = g_strdup (chatty_chat_get_chat_name (chat));
+  indexed = name && g_hash_table_lookup (self->chat_index, name) == (gpointer)chat;
   chatty_utils_remove_list_item (self->chat_list, chat);
+
+  if (!indexed)
+    return;
+
+  g_hash_table_remove (self->chat_index, name);
+
+  /* Index the next chat of the same name, if any */
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->chat_list));
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyChat) item = NULL;
+
+    item = g_list_model_get_item (G_LIST_MODEL (self->chat_list), i);
+
+    if (g_strcmp0 (chatty_chat_get_chat_name (item), name) == 0) {
+      mm_account_index_chat (self, item, TRUE);
+      break;
+    }
+  }
 }
 
 gboolean
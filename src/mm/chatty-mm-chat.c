@@ -56,6 +56,13 @@ struct _ChattyMmChat
   gboolean         has_custom_name;
 };
 
+/* A visibility change that is being saved to history */
+typedef struct _StateUpdate {
+  ChattyMmChat    *object;
+  ChattyItemState  old_state;
+  ChattyItemState  new_state;
+} StateUpdate;
+
 G_DEFINE_TYPE (ChattyMmChat, chatty_mm_chat, CHATTY_TYPE_CHAT)
 
 static void
@@ -290,7 +297,8 @@ chatty_mm_chat_set_unread_count (ChattyChat *chat,
     if (unread_count)
       last_unread_msg = g_list_model_get_item (G_LIST_MODEL (self->message_store),
                                                n_items - unread_count);
-    chatty_history_set_last_read_msg (self->history_db, chat, last_unread_msg);
+    chatty_history_set_last_read_msg_async (self->history_db, chat, last_unread_msg,
+                                            NULL, NULL);
   }
   g_signal_emit_by_name (self, "changed", 0);
 }
@@ -490,7 +498,7 @@ chatty_mm_chat_set_name (ChattyItem *item,
 
   /* We add the item to db only if we have at least one message */
   if (g_list_model_get_n_items (messages))
-    chatty_history_update_chat (self->history_db, CHATTY_CHAT (item));
+    chatty_history_update_chat_async (self->history_db, CHATTY_CHAT (item), NULL, NULL);
 
   g_object_notify (G_OBJECT (self), "name");
   g_signal_emit_by_name (self, "avatar-changed");
@@ -512,25 +520,63 @@ chatty_mm_chat_get_state (ChattyItem *item)
   return self->visibility_state;
 }
 
+static void
+state_update_free (gpointer data)
+{
+  StateUpdate *update = data;
+
+  g_object_unref (update->object);
+  g_free (update);
+}
+
+static void
+mm_chat_state_updated_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  StateUpdate *update = user_data;
+  g_autoptr(GError) error = NULL;
+  ChattyMmChat *self;
+
+  self = update->object;
+  g_assert (CHATTY_IS_MM_CHAT (self));
+
+  if (!chatty_history_update_chat_finish (CHATTY_HISTORY (object), result, &error)) {
+    g_warning ("Error updating chat state: %s", error->message);
+
+    /*
+     * Restore the old state as the change was never saved,
+     * unless the state has been changed again since.
+     */
+    if (self->visibility_state == update->new_state) {
+      self->visibility_state = update->old_state;
+      g_signal_emit_by_name (self, "changed", 0);
+    }
+  }
+
+  state_update_free (update);
+}
+
 static void
 chatty_mm_chat_set_state (ChattyItem      *item,
                           ChattyItemState  state)
 {
   ChattyMmChat *self = (ChattyMmChat *)item;
-  ChattyItemState old;
-  gboolean success;
+  StateUpdate *update;
 
   g_assert (CHATTY_IS_MM_CHAT (self));
 
   if (state == self->visibility_state)
     return;
 
-  old = self->visibility_state;
-  self->visibility_state = state;
-  success = chatty_history_update_chat (self->history_db, CHATTY_CHAT (item));
+  update = g_new0 (StateUpdate, 1);
+  update->object = g_object_ref (self);
+  update->old_state = self->visibility_state;
+  update->new_state = state;
 
-  if (!success)
-    self->visibility_state = old;
+  self->visibility_state = state;
+  chatty_history_update_chat_async (self->history_db, CHATTY_CHAT (item),
+                                    mm_chat_state_updated_cb, update);
   g_signal_emit_by_name (self, "changed", 0);
 }
 
@@ -872,6 +918,6 @@ chatty_mm_chat_refresh (ChattyMmChat *self)
 
   buddy = chatty_mm_buddy_new (number, chatty_item_get_name (CHATTY_ITEM (self)));
   chatty_mm_chat_add_user (self, buddy);
-  chatty_history_update_chat (self->history_db, CHATTY_CHAT (self));
+  chatty_history_update_chat_async (self->history_db, CHATTY_CHAT (self), NULL, NULL);
   chatty_mm_chat_update_contact (self);
 }
@@ -129,26 +129,6 @@ chatty_pp_chat_update_buddy_icon (ChattyPpChat    *self,
     self->avatar = chatty_utils_get_pixbuf_from_data (data, len);
 }
 
-static void
-pp_chat_add_history_since_component (ChattyPpChat *self,
-                                     GHashTable   *components,
-                                     const char   *account,
-                                     const char   *room)
-{
-  time_t mtime;
-  struct tm * timeinfo;
-  char *iso_timestamp = g_malloc0 (MAX_GMT_ISO_SIZE * sizeof (char));
-
-  mtime = chatty_history_get_last_message_time (self->history, account, room);
-  mtime += 1; // Use the next epoch to exclude the last stored message(s)
-  timeinfo = gmtime (&mtime);
-  g_return_if_fail (strftime (iso_timestamp, MAX_GMT_ISO_SIZE * sizeof(char),
-                              "%Y-%m-%dT%H:%M:%SZ", timeinfo));
-
-  g_hash_table_steal (components, "history_since");
-  g_hash_table_insert (components, "history_since", iso_timestamp);
-}
-
 static void
 pp_chat_setup_file_upload (ChattyPpChat *self)
 {
@@ -1795,8 +1775,7 @@ chatty_pp_chat_join (ChattyPpChat *self)
     self->conv = conv;
 
   if (!conv || purple_conv_chat_has_left (PURPLE_CONV_CHAT (conv))) {
-    pp_chat_add_history_since_component (self, components, pp_account->username, name);
-    serv_join_chat (purple_account_get_connection (pp_account), components);
+    chatty_pp_utils_join_chat (self->history, pp_account, components, name);
   } else if (conv) {
     purple_conversation_present (conv);
   }
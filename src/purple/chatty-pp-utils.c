@@ -9,6 +9,8 @@
 
 #include <purple.h>
 
+#include "chatty-history.h"
+#include "chatty-utils.h"
 #include "chatty-pp-utils.h"
 
 PurpleBlistNode *
@@ -50,3 +52,83 @@ chatty_pp_utils_direction_from_flag (PurpleMessageFlags flag)
 
   g_return_val_if_reached (CHATTY_DIRECTION_UNKNOWN);
 }
+
+typedef struct _JoinChatData {
+  PurpleAccount *account;
+  GHashTable    *components;
+} JoinChatData;
+
+static void
+pp_utils_join_chat_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  JoinChatData *data = user_data;
+  g_autoptr(GError) error = NULL;
+  PurpleConnection *gc = NULL;
+  char iso_timestamp[MAX_GMT_ISO_SIZE];
+  struct tm *timeinfo;
+  time_t mtime;
+
+  mtime = chatty_history_get_last_message_time_finish (CHATTY_HISTORY (object), result, &error);
+
+  if (error)
+    g_warning ("Error getting last message time: %s", error->message);
+
+  /* The account may have been removed or gone offline meanwhile */
+  if (g_list_find (purple_accounts_get_all (), data->account))
+    gc = purple_account_get_connection (data->account);
+
+  if (gc) {
+    mtime += 1; // Use the next epoch to exclude the last stored message(s)
+    timeinfo = gmtime (&mtime);
+
+    if (strftime (iso_timestamp, sizeof iso_timestamp, "%Y-%m-%dT%H:%M:%SZ", timeinfo))
+      g_hash_table_insert (data->components, g_strdup ("history_since"),
+                           g_strdup (iso_timestamp));
+
+    serv_join_chat (gc, data->components);
+  }
+
+  g_hash_table_unref (data->components);
+  g_free (data);
+}
+
+/**
+ * chatty_pp_utils_join_chat:
+ * @history: A #ChattyHistory
+ * @account: The #PurpleAccount to join with
+ * @components: The chat components
+ * @room: The chat room name
+ *
+ * Join the chat @room, requesting only the history
+ * since the last message stored in @history.  The
+ * join happens once the time of the last message is
+ * known.  @components is copied.
+ */
+void
+chatty_pp_utils_join_chat (ChattyHistory *history,
+                           PurpleAccount *account,
+                           GHashTable    *components,
+                           const char    *room)
+{
+  JoinChatData *data;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (history));
+  g_return_if_fail (account);
+  g_return_if_fail (components);
+  g_return_if_fail (room);
+
+  data = g_new0 (JoinChatData, 1);
+  data->account = account;
+  data->components = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_hash_table_iter_init (&iter, components);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (data->components, g_strdup (key), g_strdup (value));
+
+  chatty_history_get_last_message_time_async (history, account->username, room,
+                                              pp_utils_join_chat_cb, data);
+}
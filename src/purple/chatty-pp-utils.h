@@ -9,6 +9,11 @@
 #include <purple.h>
 
 #include "chatty-enums.h"
+#include "chatty-history.h"
 
 PurpleBlistNode     *chatty_pp_utils_get_conv_blist_node   (PurpleConversation *conv);
 ChattyMsgDirection   chatty_pp_utils_direction_from_flag   (PurpleMessageFlags flag);
+void                 chatty_pp_utils_join_chat             (ChattyHistory      *history,
+                                                            PurpleAccount      *account,
+                                                            GHashTable         *components,
+                                                            const char         *room);
@@ -721,29 +721,6 @@ purple_conversation_buddy_leaving_cb (PurpleConversation *conv,
   return TRUE;
 }
 
-static void
-chatty_conv_add_history_since_component (GHashTable *components,
-                                         const char *account,
-                                         const char *room)
-{
-  time_t mtime;
-  struct tm * timeinfo;
-
-  g_autofree gchar *iso_timestamp = g_malloc0(MAX_GMT_ISO_SIZE * sizeof(char));
-
-  mtime = chatty_history_get_last_message_time (chatty_manager_get_history (chatty_manager_get_default ()),
-                                                account, room);
-  mtime += 1; // Use the next epoch to exclude the last stored message(s)
-  timeinfo = gmtime (&mtime);
-  g_return_if_fail (strftime (iso_timestamp,
-                              MAX_GMT_ISO_SIZE * sizeof(char),
-                              "%Y-%m-%dT%H:%M:%SZ",
-                              timeinfo));
-
-  g_hash_table_steal (components, "history_since");
-  g_hash_table_insert (components, "history_since", g_steal_pointer(&iso_timestamp));
-}
-
 static gboolean
 auto_join_chat_cb (gpointer data)
 {
@@ -770,10 +747,8 @@ auto_join_chat_cb (gpointer data)
         if (!chat_name || !*chat_name)
           continue;
 
-        chatty_conv_add_history_since_component(components, account->username, chat_name);
-
-        serv_join_chat (purple_account_get_connection (account),
-                        purple_chat_get_components (chat));
+        chatty_pp_utils_join_chat (chatty_manager_get_history (chatty_manager_get_default ()),
+                                   account, components, chat_name);
       }
     }
   }
@@ -1017,6 +992,34 @@ chatty_conv_write_im (PurpleConversation *conv,
   purple_conversation_write (conv, who, message, flags, mtime);
 }
 
+/* A message sent from another client, see chatty_conv_write_conversation() */
+typedef struct _OfflineSent
+{
+  ChattyChat *chat;
+  int         time;
+} OfflineSent;
+
+static void
+purple_offline_sent_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  OfflineSent *sent = user_data;
+  g_autoptr(GError) error = NULL;
+  int last_time;
+
+  last_time = chatty_history_get_last_message_time_finish (CHATTY_HISTORY (object),
+                                                           result, &error);
+
+  if (error)
+    g_warning ("Error getting last message time: %s", error->message);
+  else if (sent->time > last_time)
+    chatty_chat_set_unread_count (sent->chat, 0);
+
+  g_object_unref (sent->chat);
+  g_free (sent);
+}
+
 static void
 chatty_conv_write_conversation (PurpleConversation *conv,
                                 const char         *who,
@@ -1141,6 +1144,8 @@ chatty_conv_write_conversation (PurpleConversation *conv,
 
       chatty_chat_set_unread_count (CHATTY_CHAT (chat), 0);
     } else if (pcm.flags & PURPLE_MESSAGE_SEND) {
+      OfflineSent *sent;
+
       // offline send (from MAM)
       // FIXME: current list_box does not allow ordering rows by timestamp
       // TODO: Needs proper sort function and timestamp as user_data for rows
@@ -1150,8 +1155,12 @@ chatty_conv_write_conversation (PurpleConversation *conv,
       chatty_message_set_status (chat_message, CHATTY_STATUS_SENT, 0);
       chatty_pp_chat_append_message (chat, chat_message);
 
-      if (mtime > chatty_history_get_last_message_time (self->history, account->username, pcm.who))
-        chatty_chat_set_unread_count (CHATTY_CHAT (chat), 0);
+      /* A message sent from elsewhere after the last stored one marks the chat read */
+      sent = g_new0 (OfflineSent, 1);
+      sent->chat = g_object_ref (CHATTY_CHAT (chat));
+      sent->time = mtime;
+      chatty_history_get_last_message_time_async (self->history, account->username, pcm.who,
+                                                  purple_offline_sent_cb, sent);
     }
 
     /*
@@ -1161,7 +1170,8 @@ chatty_conv_write_conversation (PurpleConversation *conv,
      * set in @flags, it won't be saved to database.
      */
     if (!(pcm.flags & PURPLE_MESSAGE_NO_LOG) && chat_message)
-      chatty_history_add_message (self->history, CHATTY_CHAT (chat), chat_message);
+      chatty_history_add_message_async (self->history, CHATTY_CHAT (chat), chat_message,
+                                        NULL, NULL);
   }
 
   if (chat) {
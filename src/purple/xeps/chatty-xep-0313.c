@@ -30,6 +30,9 @@
 #define NS_DATA "jabber:x:data"
 #define NS_RSM "http://jabber.org/protocol/rsm"
 
+/* Max number of archived messages to store in one go */
+#define MAM_BATCH_SIZE 100
+
 typedef struct {
   PurpleConversation *conv;
   PurpleConvMessage p;
@@ -52,12 +55,39 @@ typedef struct {
 /* FIXME: What if purple becomes multithreaded 8-O */
 typedef struct {
   GHashTable *qs;
+  PurpleAccount *pa;
   time_t   last_ts;
+  /* last_ts to be saved once the archived messages are stored */
+  time_t   save_ts;
+  int      saving;
+  gboolean save_failed;
   MamMsg  *cur_msg;
   char    *cur_oid;
   char    *ns;
+  /* Archived messages of batch_chat yet to be stored */
+  ChattyChat *batch_chat;
+  GPtrArray  *batch;
+  /* "chat/uid" of the archived messages history lookups may miss */
+  GHashTable *batch_ids;
+  /* Received messages waiting for history lookups, in order */
+  GQueue     *pending;
+  gboolean    flush_pending;
 } MamCtx;
 
+typedef struct {
+  MamCtx             *mamc; /* NULL once processed or the context is gone */
+  PurpleConnection   *pc;
+  xmlnode            *message;
+  char               *stanza_id;
+  char               *stamp;
+  PurpleMessageFlags  flags;
+  gboolean            archived;
+  gboolean            account_archive;
+  gboolean            duplicate;
+  int                 lookups;
+  int                 ref_count;
+} MamPending;
+
 static GHashTable *ht_mam_ctx = NULL;
 
 /**
@@ -97,6 +127,168 @@ mamm_free(void *ptr)
   g_free(mm);
 }
 
+/**
+ * mam_pending_unref:
+ *
+ * Drop a reference of MamPending, freeing it with the last one
+ */
+static void
+mam_pending_unref(gpointer ptr)
+{
+  MamPending *pending = ptr;
+  if(ptr==NULL) return;
+  if(--pending->ref_count > 0)
+    return;
+  if(pending->message)
+    xmlnode_free(pending->message);
+  g_free(pending->stanza_id);
+  g_free(pending->stamp);
+  g_free(pending);
+}
+
+/**
+ * mam_pending_cancel:
+ *
+ * Detach MamPending from its dying context and drop the queue reference
+ */
+static void
+mam_pending_cancel(gpointer ptr)
+{
+  MamPending *pending = ptr;
+  pending->mamc = NULL;
+  mam_pending_unref(pending);
+}
+
+/**
+ * mamc_save_ts:
+ * @mamc: MamCtx context
+ *
+ * Save the account archive stop point once every message
+ * before it is stored.  If some of them couldn't be stored
+ * the stop point is kept, so that they are fetched again.
+ */
+static void
+mamc_save_ts(MamCtx *mamc)
+{
+  if(mamc->save_ts == 0 || mamc->saving > 0 ||
+     !g_queue_is_empty(mamc->pending) || mamc->flush_pending)
+    return;
+
+  if(mamc->save_failed)
+    g_warning("Archived messages not stored, keeping MAM stop point");
+  else
+    purple_account_set_int(mamc->pa, "mam_last_ts", mamc->save_ts);
+
+  mamc->save_ts = 0;
+  mamc->save_failed = FALSE;
+}
+
+/**
+ * mamc_forget_stored:
+ * @mamc: MamCtx context
+ *
+ * Once every batch is stored and no lookup is pending, history
+ * lookups of the messages to come will find the archived ones.
+ */
+static void
+mamc_forget_stored(MamCtx *mamc)
+{
+  if(mamc->saving == 0 && mamc->batch_chat == NULL &&
+     g_queue_is_empty(mamc->pending))
+    g_hash_table_remove_all(mamc->batch_ids);
+}
+
+static void
+mam_batch_saved_cb (GObject      *object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  MamCtx *mamc = NULL;
+
+  if (!chatty_history_add_messages_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error saving archived messages: %s", error->message);
+
+  // The context is gone if the account was disconnected meanwhile
+  if (ht_mam_ctx)
+    mamc = g_hash_table_lookup (ht_mam_ctx, user_data);
+  g_free (user_data);
+
+  if (!mamc || mamc->saving == 0)
+    return;
+
+  mamc->saving--;
+  if (error)
+    mamc->save_failed = TRUE;
+  mamc_save_ts (mamc);
+  mamc_forget_stored (mamc);
+}
+
+/**
+ * mamc_flush:
+ * @mamc: MamCtx context
+ *
+ * Store the archived messages collected so far to history
+ */
+static void
+mamc_flush(MamCtx *mamc)
+{
+  ChattyHistory *history;
+
+  if(mamc->batch_chat == NULL)
+    return;
+
+  // If the history is still being opened, this runs once it is
+  history = chatty_manager_get_history (chatty_manager_get_default ());
+  g_debug ("Saving %u archived messages", mamc->batch->len);
+  mamc->saving++;
+  chatty_history_add_messages_async (history, mamc->batch_chat, mamc->batch,
+                                     mam_batch_saved_cb,
+                                     g_strdup (purple_account_get_username (mamc->pa)));
+
+  g_clear_object (&mamc->batch_chat);
+  g_clear_pointer (&mamc->batch, g_ptr_array_unref);
+}
+
+/**
+ * mamc_add_message:
+ * @mamc: MamCtx context
+ * @chat: The ChattyChat @message belongs to
+ * @message: An archived ChattyMessage
+ *
+ * Queue @message to be saved with other archived messages of @chat.
+ * Messages are stored when the chat changes, when the batch is full
+ * or when the current page of the archive query is complete.
+ */
+static void
+mamc_add_message(MamCtx        *mamc,
+                 ChattyChat    *chat,
+                 ChattyMessage *message)
+{
+  char *key;
+
+  // History lookups don't see the messages not yet stored
+  key = g_strdup_printf("%s/%s", chatty_chat_get_chat_name(chat),
+                        chatty_message_get_uid(message));
+  if(!g_hash_table_add(mamc->batch_ids, key)) {
+    g_debug("Message id %s is already queued", chatty_message_get_uid(message));
+    return;
+  }
+
+  if(mamc->batch_chat != chat)
+    mamc_flush(mamc);
+
+  if(mamc->batch_chat == NULL) {
+    mamc->batch_chat = g_object_ref (chat);
+    mamc->batch = g_ptr_array_new_full (MAM_BATCH_SIZE, g_object_unref);
+  }
+
+  g_ptr_array_add (mamc->batch, g_object_ref (message));
+
+  if(mamc->batch->len >= MAM_BATCH_SIZE)
+    mamc_flush(mamc);
+}
+
 /**
  * MAM Context Management API
  */
@@ -111,6 +303,10 @@ mamc_free(void *ptr)
 {
   MamCtx *mamc = (MamCtx*)ptr;
   if(ptr==NULL) return;
+  // Messages still waiting for lookups are dropped, they are not in last_ts yet
+  g_queue_free_full(mamc->pending, mam_pending_cancel);
+  mamc_flush(mamc);
+  g_hash_table_destroy(mamc->batch_ids);
   g_free(mamc->ns);
   g_free(mamc->cur_oid);
   mamm_free(mamc->cur_msg);
@@ -131,6 +327,8 @@ mamc_new(void)
                                    g_str_equal,
                                    g_free,
                                    mamq_free);
+  mamc->pending = g_queue_new();
+  mamc->batch_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   return mamc;
 }
 
@@ -163,6 +361,7 @@ chatty_mam_ctx_add(PurpleAccount *pa)
   g_return_val_if_fail(pa != NULL, NULL);
   if(mamc == NULL) {
     mamc = mamc_new();
+    mamc->pa = pa;
     g_hash_table_insert(ht_mam_ctx,
                         g_strdup(purple_account_get_username(pa)), mamc);
   }
@@ -301,6 +500,12 @@ cb_mam_query_result(JabberStream *js, const char *from,
   MamCtx *mamc = chatty_mam_ctx_get(pa);
   MAMQuery *mamq = (MAMQuery*) data;
 
+  // All results of this page are in, store them once processed
+  if(g_queue_is_empty(mamc->pending))
+    mamc_flush(mamc);
+  else
+    mamc->flush_pending = TRUE;
+
   if(type == JABBER_IQ_RESULT && fin != NULL) {
     const char *complete = xmlnode_get_attrib(fin, "complete");
     if(g_strcmp0(complete, "true")) {
@@ -318,9 +523,11 @@ cb_mam_query_result(JabberStream *js, const char *from,
       fin = NULL; // Flag error state
     } else {
       g_debug("This is the last of them, standing down at %ld", mamc->last_ts);
-      // Save ts but not for muc
-      if(mamc->last_ts > 0 && mamq->to == NULL)
-        purple_account_set_int(pa, "mam_last_ts", mamc->last_ts);
+      // Save ts but not for muc, once the messages are stored
+      if(mamc->last_ts > 0 && mamq->to == NULL) {
+        mamc->save_ts = mamc->last_ts;
+        mamc_save_ts(mamc);
+      }
     }
   } else {
       fin = NULL; // Flag error state
@@ -445,6 +652,82 @@ chatty_mam_is_enabled(PurpleAccount *pa, const char *room)
   return TRUE;
 }
 
+/**
+ * chatty_mam_start_query:
+ * @pc: PurpleConnection on which to query
+ * @mamq: MAMQuery with the query context
+ * @dt: (nullable) (transfer full): the time to start querying from
+ *
+ * Send the archive query and resync archiving preferences.
+ */
+static void
+chatty_mam_start_query(PurpleConnection *pc, MAMQuery *mamq, GDateTime *dt)
+{
+  PurpleAccount *pa = purple_connection_get_account(pc);
+  MamCtx *mamc = chatty_mam_ctx_get(pa);
+  const char *bare = mamq->to ? mamq->to : purple_account_get_username(pa);
+
+  if(dt == NULL) {
+    if(mamc->last_ts > 0 && mamq->to == NULL) {
+      dt = g_date_time_new_from_unix_utc(mamc->last_ts);
+    } else {
+      // last week should be good enough for the start
+      GDateTime *now = g_date_time_new_now_utc();
+      dt = g_date_time_add_days(now, -7);
+      g_date_time_unref(now);
+    }
+  }
+  mamq->start = g_date_time_format(dt,"%FT%TZ");
+  g_date_time_unref(dt);
+  CHATTY_DEBUG (bare, "Server supports MAM %s; Querying by %s from %s after %s, id:",
+                NS_MAMv2, mamq->id, mamq->start, mamq->after);
+  // Request MAM backlog
+  chatty_mam_query_archive(mamq);
+  // Also - request preferences and correct them if required
+  chatty_mam_query_prefs(pc, mamq->to);
+}
+
+typedef struct {
+  PurpleAccount *pa;
+  char          *qid;
+} MamRoomQuery;
+
+static void
+cb_chatty_mam_room_last_time(GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  MamRoomQuery *rq = user_data;
+  g_autoptr(GError) error = NULL;
+  PurpleConnection *pc = NULL;
+  GDateTime *dt = NULL;
+  MAMQuery *mamq = NULL;
+  MamCtx *mamc = NULL;
+  time_t ts;
+
+  ts = chatty_history_get_last_message_time_finish (CHATTY_HISTORY (object), result, &error);
+  if(error)
+    g_warning ("Error getting last message time: %s", error->message);
+
+  // The account may have been removed or disconnected meanwhile
+  if(g_list_find(purple_accounts_get_all(), rq->pa)) {
+    pc = purple_account_get_connection(rq->pa);
+    mamc = chatty_mam_ctx_get(rq->pa);
+  }
+  if(pc && mamc)
+    mamq = g_hash_table_lookup(mamc->qs, rq->qid);
+
+  if(mamq) {
+    // For MUC we're getting all messages so last history ts is ok
+    if(ts>0)
+      dt = g_date_time_new_from_unix_utc(ts);
+    chatty_mam_start_query(pc, mamq, dt);
+  }
+
+  g_free(rq->qid);
+  g_free(rq);
+}
+
 /**
  * cb_chatty_mam_bare_info:
  * @pc: PurpleConnection on which bare was discovered
@@ -463,7 +746,6 @@ cb_chatty_mam_bare_info(PurpleConnection *pc,
   if(g_strcmp0(var, NS_MAMv2) == 0) {
     JabberStream  *js = purple_connection_get_protocol_data (pc);
     char *qid = jabber_get_next_id(js);
-    GDateTime *dt = NULL;
     PurpleAccount *pa = purple_connection_get_account(pc);
     // Init CTX
     MamCtx *mamc = chatty_mam_ctx_add(pa);
@@ -478,39 +760,26 @@ cb_chatty_mam_bare_info(PurpleConnection *pc,
     mamq = g_new0(MAMQuery, 1);
     mamq->js = js;
     mamq->id = g_strdup(qid);
+    g_hash_table_insert(mamc->qs, qid, mamq);
     if(g_strcmp0(bare, purple_account_get_username(pa))) {
-      ChattyManager *manager = chatty_manager_get_default ();
-      time_t ts;
-
-      ts = chatty_history_get_last_message_time (chatty_manager_get_history (manager),
-                                                 purple_account_get_username(pa), bare);
-      // For MUC we're getting all messages so last history ts is ok
-      if(ts>0)
-        dt = g_date_time_new_from_unix_utc(ts);
+      ChattyHistory *history = chatty_manager_get_history (chatty_manager_get_default ());
+      MamRoomQuery *rq;
+
       // This becomes indication of the foreign archive, eg MUC
       mamq->to = g_strdup(bare);
-    } else
-      // Get last stop point on the account
-      mamc->last_ts = purple_account_get_int(pa, "mam_last_ts", 0);
-    g_hash_table_insert(mamc->qs, qid, mamq);
-    if(dt == NULL) {
-      if(mamc->last_ts > 0 && mamq->to == NULL) {
-        dt = g_date_time_new_from_unix_utc(mamc->last_ts);
-      } else {
-        // last week should be good enough for the start
-        GDateTime *now = g_date_time_new_now_utc();
-        dt = g_date_time_add_days(now, -7);
-        g_date_time_unref(now);
-      }
+
+      // Start from the last message we have in history
+      rq = g_new0(MamRoomQuery, 1);
+      rq->pa = pa;
+      rq->qid = g_strdup(qid);
+      chatty_history_get_last_message_time_async (history, purple_account_get_username(pa),
+                                                  bare, cb_chatty_mam_room_last_time, rq);
+      return;
     }
-    mamq->start = g_date_time_format(dt,"%FT%TZ");
-    g_date_time_unref(dt);
-    CHATTY_DEBUG (bare, "Server supports MAM %s; Querying by %s from %s after %s, id:",
-                  var, qid, mamq->start, mamq->after);
-    // Request MAM backlog
-    chatty_mam_query_archive(mamq);
-    // Also - request preferences and correct them if required
-    chatty_mam_query_prefs(pc, mamq->to);
+
+    // Get last stop point on the account
+    mamc->last_ts = purple_account_get_int(pa, "mam_last_ts", 0);
+    chatty_mam_start_query(pc, mamq, NULL);
   }
 }
 
@@ -622,6 +891,160 @@ cb_chatty_mam_msg_receiving(PurpleAccount *pa, char **who, char **msg,
   return FALSE;
 }
 
+/**
+ * mam_parse_message:
+ * @mamc: MamCtx context
+ * @pending: MamPending message, known not to be a duplicate
+ *
+ * Steal the parser to process the message and store it in history.
+ */
+static void
+mam_parse_message (MamCtx     *mamc,
+                   MamPending *pending)
+{
+  JabberStream *js = purple_connection_get_protocol_data (pending->pc);
+  PurpleConnection *pc = pending->pc;
+  const char *stanza_id = pending->stanza_id;
+  const char *peer;
+
+  peer = xmlnode_get_attrib (pending->message, "from");
+  CHATTY_DEBUG (peer, "Stealing parser for MAM, ID %s user:", stanza_id);
+  /**
+   * Before we resume message processing we need to pre-cook the message.
+   * If there's no body the whole server_got_stuff is skipped, so we may never
+   * see the conversation. On the other hand making full parsing with html and
+   * oob here is an overkill. Let's just try to fish end-state message from
+   * the parser using signals which will override our empty message.
+   */
+  mamc->cur_msg = g_new0(MamMsg, 1);
+  mamc->cur_msg->id = (char*)stanza_id;
+  mamc->cur_msg->p.who = (char*)peer;
+  mamc->cur_msg->p.flags = pending->flags;
+  if(pending->stamp)
+    mamc->cur_msg->p.when = purple_str_to_time (pending->stamp, TRUE, NULL, NULL, NULL);
+  jabber_message_parse (js, pending->message);
+  if(stanza_id != NULL || mamc->cur_msg->p.what != NULL) {
+    ChattyManager *manager = chatty_manager_get_default ();
+    PurpleConvMessage *pcm = &(mamc->cur_msg->p);
+    PurpleConversation *conv = mamc->cur_msg->conv;
+    g_autoptr(ChattyMessage) chat_message = NULL;
+    g_autofree char *who = NULL;
+    g_autofree char *uuid = NULL;
+
+    if (!conv)
+      conv = purple_find_conversation_with_account (PURPLE_CONV_TYPE_ANY,
+                                                    pcm->alias ? pcm->alias : pcm->who,
+                                                    pc->account);
+
+    /* conv shall be missing only for IM chats */
+    if (!conv && !pcm->alias)
+        conv = purple_conversation_new (PURPLE_CONV_TYPE_IM,
+                                        pc->account, pcm->who);
+    if (pcm->who) {
+      if (chatty_chat_is_im (conv->ui_data) ||
+          !g_str_has_prefix (pcm->who, conv->name))
+        who = chatty_utils_jabber_id_strip (pcm->who);
+    }
+
+    if (!stanza_id)
+      stanza_id = uuid = g_uuid_string_random ();
+
+    {
+      g_autoptr(ChattyContact) contact = NULL;
+
+      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+      chatty_contact_set_name (contact, who);
+      chatty_contact_set_value (contact, who);
+      chat_message = chatty_message_new (CHATTY_ITEM (contact), pcm->what, stanza_id,
+                                         pcm->when, CHATTY_MESSAGE_HTML_ESCAPED,
+                                         chatty_pp_utils_direction_from_flag (pcm->flags), 0);
+    }
+
+    if (conv && pending->archived)
+      mamc_add_message (mamc, conv->ui_data, chat_message);
+    else if (conv) {
+      // Keep the order with archived messages not yet stored
+      mamc_flush (mamc);
+      chatty_history_add_message_async (chatty_manager_get_history (manager),
+                                        conv->ui_data, chat_message, NULL, NULL);
+    } else
+      g_warning ("NULL conversation for : who: %s, message: %s",
+                  who ? who: pcm->who, pcm->what);
+
+  }
+  // Update last timestamp for account's archive
+  if(pending->account_archive)
+    mamc->last_ts = mamc->cur_msg->p.when;
+
+  // Clear resubmission state
+  if(peer == mamc->cur_msg->p.who)
+    mamc->cur_msg->p.who = NULL;
+  mamc->cur_msg->id = NULL;
+  mamm_free(mamc->cur_msg);
+  mamc->cur_msg = NULL;
+}
+
+/**
+ * mamc_process_pending:
+ * @mamc: MamCtx context
+ *
+ * Process the received messages in order, as long as
+ * the history lookups for them are complete.
+ */
+static void
+mamc_process_pending (MamCtx *mamc)
+{
+  MamPending *pending;
+
+  while ((pending = g_queue_peek_head (mamc->pending)) && pending->lookups == 0) {
+    g_queue_pop_head (mamc->pending);
+
+    if (!pending->duplicate)
+      mam_parse_message (mamc, pending);
+
+    pending->mamc = NULL;
+    mam_pending_unref (pending);
+  }
+
+  if (g_queue_is_empty (mamc->pending) && mamc->flush_pending) {
+    mamc->flush_pending = FALSE;
+    mamc_flush (mamc);
+    mamc_save_ts (mamc);
+  }
+
+  mamc_forget_stored (mamc);
+}
+
+static void
+mam_dedup_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  MamPending *pending = user_data;
+  g_autoptr(GError) error = NULL;
+  int dts;
+
+  if (g_async_result_is_tagged (result, chatty_history_get_chat_timestamp_async))
+    dts = chatty_history_get_chat_timestamp_finish (CHATTY_HISTORY (object), result, &error);
+  else
+    dts = chatty_history_get_im_timestamp_finish (CHATTY_HISTORY (object), result, &error);
+
+  if (error)
+    g_warning ("Error checking message %s: %s", pending->stanza_id, error->message);
+  else if (dts < INT_MAX) {
+    g_debug ("Message id %s is already stored on %d", pending->stanza_id, dts);
+    pending->duplicate = TRUE;
+  }
+
+  pending->lookups--;
+
+  // The context is gone if the account was disconnected meanwhile
+  if (pending->mamc)
+    mamc_process_pending (pending->mamc);
+
+  mam_pending_unref (pending);
+}
+
 /**
  * cb_chatty_mam_msg_received:
  * @pc: a PurpleConnection
@@ -630,6 +1053,8 @@ cb_chatty_mam_msg_receiving(PurpleAccount *pa, char **who, char **msg,
  * This function is called via the "jabber-receiving-message" signal
  * and is intended to intercept the parser (return TRUE)
  *
+ * The message is queued until history is checked for duplicates,
+ * see mamc_process_pending().
  */
 static gboolean
 cb_chatty_mam_msg_received (PurpleConnection *pc,
@@ -646,10 +1071,11 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   const char *stamp = NULL;
   const char *user;
   PurpleMessageFlags flags = 0;
-  JabberStream  *js = purple_connection_get_protocol_data (pc);
   PurpleAccount *pa = purple_connection_get_account (pc);
   MamCtx *mamc = chatty_mam_ctx_add(pa);
   MAMQuery *mamq = NULL;
+  MamPending *pending;
+  ChattyHistory *history;
 
   if (msg == NULL)
     return FALSE;
@@ -668,10 +1094,14 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   }
 
   user = purple_account_get_username (pa);
+  history = chatty_manager_get_history (chatty_manager_get_default ());
+
+  pending = g_new0 (MamPending, 1);
+  pending->ref_count = 1;
+  pending->mamc = mamc;
+  pending->pc = pc;
 
   if(node_result != NULL || node_sid != NULL) {
-    ChattyManager *manager = chatty_manager_get_default ();
-    int dts;
     const char *msg_type;
     if(node_result != NULL) {
       xmlnode    *node_fwd;
@@ -682,23 +1112,26 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       // Check result and query-id are valid
       if(query_id == NULL) {
         g_debug ("Malformed MAM result from %s missing queryid", from);
+        mam_pending_unref (pending);
         return FALSE;
       }
       mamq = g_hash_table_lookup(mamc->qs, query_id);
       if(mamq == NULL) {
         // Fake result injection?
         g_debug ("Fake MAM result[%s] injection from %s", query_id, from);
+        mam_pending_unref (pending);
         return FALSE;
       }
 
       node_fwd = xmlnode_get_child_with_namespace (node_result, "forwarded", NS_FWDv0);
-      if(node_fwd == NULL) // this is rather unexpected, yield
-        return FALSE;
-
-      message = xmlnode_get_child (node_fwd, "message");
-      if(message == NULL)
+      // this is rather unexpected, yield
+      message = node_fwd ? xmlnode_get_child (node_fwd, "message") : NULL;
+      if(message == NULL) {
+        mam_pending_unref (pending);
         return FALSE; // Now this is bizare
+      }
 
+      pending->message = message = xmlnode_copy (message);
       node_delay = xmlnode_get_child (node_fwd, "delay");
       if(node_delay != NULL) {
         stamp = xmlnode_get_attrib (node_delay, "stamp");
@@ -710,23 +1143,22 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       stanza_id = xmlnode_get_attrib (node_sid, "id");
       // If it's forward notification of the archive-id (SID) - we need to
       // store the SID in history at the least - to know where to start.
-      message = msg;
+      pending->message = message = xmlnode_copy (msg);
       peer = from;
       CHATTY_DEBUG (peer, "Received forward id %s from", stanza_id);
     }
     // check history and drop the dup
     msg_type = xmlnode_get_attrib(message, "type");
 
-    if(from && msg_type && g_strcmp0(msg_type, "groupchat") == 0) {
-      dts = chatty_history_get_chat_timestamp (chatty_manager_get_history (manager),
-                                               stanza_id, from);
-    } else {
-      dts = chatty_history_get_im_timestamp (chatty_manager_get_history (manager),
-                                             stanza_id, user);
-    }
-    if(dts < INT_MAX) {
-      g_debug ("Message id %s for acc %s is already stored on %d", stanza_id, user, dts);
-      return TRUE; // note - true means stop processing
+    if(stanza_id) {
+      pending->lookups++;
+      pending->ref_count++;
+      if(from && msg_type && g_strcmp0(msg_type, "groupchat") == 0)
+        chatty_history_get_chat_timestamp_async (history, stanza_id, from,
+                                                 mam_dedup_cb, pending);
+      else
+        chatty_history_get_im_timestamp_async (history, stanza_id, user,
+                                               mam_dedup_cb, pending);
     }
     // Swap from/to for outgoing messages
     peer = xmlnode_get_attrib (message, "from");
@@ -739,12 +1171,10 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
         xmlnode_set_attrib (message, "from", msg_to);
         g_free (msg_to);
         flags |= PURPLE_MESSAGE_SEND;
-        peer = xmlnode_get_attrib (message, "from");
       }
       g_free (bare_peer);
     } else {
       xmlnode_set_attrib (message, "from", xmlnode_get_attrib (message, "to"));
-      peer = xmlnode_get_attrib (message, "from");
       flags |= PURPLE_MESSAGE_SEND;
     }
     if(flags & PURPLE_MESSAGE_SEND) {
@@ -753,89 +1183,28 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       if(node_oid) {
         const char *uuid = xmlnode_get_attrib (node_oid, "id");
         if(uuid) {
-          dts = chatty_history_get_im_timestamp (chatty_manager_get_history (manager), uuid, user);
-          if(dts < INT_MAX) {
-            g_debug ("Message id %s for acc %s is already stored on %d", uuid, user, dts);
-            return TRUE; // note - true means stop processing
-          }
+          pending->lookups++;
+          pending->ref_count++;
+          chatty_history_get_im_timestamp_async (history, uuid, user,
+                                                 mam_dedup_cb, pending);
         }
       }
     }
   } else {
     // The server does not support MAM but we still need to handle history
-    message = msg;
-    peer = from;
+    pending->message = xmlnode_copy (msg);
   }
-  CHATTY_DEBUG (peer, "Stealing parser for MAM, ID %s user:", stanza_id);
-  /**
-   * Before we resume message processing we need to pre-cook the message.
-   * If there's no body the whole server_got_stuff is skipped, so we may never
-   * see the conversation. On the other hand making full parsing with html and
-   * oob here is an overkill. Let's just try to fish end-state message from
-   * the parser using signals which will override our empty message.
-   */
-  mamc->cur_msg = g_new0(MamMsg, 1);
-  mamc->cur_msg->id = (char*)stanza_id;
-  mamc->cur_msg->p.who = (char*)peer;
-  mamc->cur_msg->p.flags = flags;
-  if(stamp)
-    mamc->cur_msg->p.when = purple_str_to_time (stamp, TRUE, NULL, NULL, NULL);
-  jabber_message_parse (js, message);
-  if(stanza_id != NULL || mamc->cur_msg->p.what != NULL) {
-    ChattyManager *manager = chatty_manager_get_default ();
-    PurpleConvMessage *pcm = &(mamc->cur_msg->p);
-    PurpleConversation *conv = mamc->cur_msg->conv;
-    g_autoptr(ChattyMessage) chat_message = NULL;
-    g_autofree char *who = NULL;
 
-    if (!conv)
-      conv = purple_find_conversation_with_account (PURPLE_CONV_TYPE_ANY,
-                                                    pcm->alias ? pcm->alias : pcm->who,
-                                                    pc->account);
+  pending->stanza_id = g_strdup (stanza_id);
+  pending->stamp = g_strdup (stamp);
+  pending->flags = flags;
+  pending->archived = mamq != NULL;
+  pending->account_archive = mamq != NULL && mamq->to == NULL;
 
-    /* conv shall be missing only for IM chats */
-    if (!conv && !pcm->alias)
-        conv = purple_conversation_new (PURPLE_CONV_TYPE_IM,
-                                        pc->account, pcm->who);
-    if (pcm->who) {
-      if (chatty_chat_is_im (conv->ui_data) ||
-          !g_str_has_prefix (pcm->who, conv->name))
-        who = chatty_utils_jabber_id_strip (pcm->who);
-    }
-
-    if (!stanza_id)
-      stanza_id = g_uuid_string_random ();
-
-    {
-      g_autoptr(ChattyContact) contact = NULL;
-
-      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
-      chatty_contact_set_name (contact, who);
-      chatty_contact_set_value (contact, who);
-      chat_message = chatty_message_new (CHATTY_ITEM (contact), pcm->what, stanza_id,
-                                         pcm->when, CHATTY_MESSAGE_HTML_ESCAPED,
-                                         chatty_pp_utils_direction_from_flag (pcm->flags), 0);
-    }
-
-    if (conv)
-      chatty_history_add_message (chatty_manager_get_history (manager),
-                                  conv->ui_data, chat_message);
-    else
-      g_warning ("NULL conversation for : who: %s, message: %s",
-                  who ? who: pcm->who, pcm->what);
-
-  }
-  // Update last timestamp for account's archive
-  if(mamq != NULL && mamq->to == NULL)
-    mamc->last_ts = mamc->cur_msg->p.when;
+  g_queue_push_tail (mamc->pending, pending);
+  mamc_process_pending (mamc);
 
-  // Clear resubmission state
-  if(peer == mamc->cur_msg->p.who)
-    mamc->cur_msg->p.who = NULL;
-  mamc->cur_msg->id = NULL;
-  mamm_free(mamc->cur_msg);
-  mamc->cur_msg = NULL;
-  // Stop processing, we have done that already
+  // Stop processing, we will do that ourselves
   return TRUE;
 }
 
@@ -10,6 +10,9 @@
 
 #pragma once
 
+#include "chatty-phone-utils.h"
 #include "chatty-contact.h"
 
-void chatty_contact_clear_cache (ChattyContact *self);
+void     chatty_contact_clear_cache     (ChattyContact  *self);
+gboolean chatty_contact_get_phone_key   (ChattyContact  *self,
+                                         ChattyPhoneKey *key);
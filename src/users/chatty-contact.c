@@ -20,6 +20,7 @@
 
 #include "chatty-settings.h"
 #include "chatty-utils.h"
+#include "chatty-phone-utils.h"
 #include "chatty-contact.h"
 #include "chatty-contact-private.h"
 
@@ -43,6 +44,12 @@ struct _ChattyContact
   char       *name;
   char       *value;
   GdkPixbuf *avatar;
+
+  /* value parsed as phone number for phone_key_country */
+  ChattyPhoneKey  phone_key;
+  char           *phone_key_country;
+  gboolean        phone_key_parsed;
+  gboolean        has_phone_key;
 };
 
 G_DEFINE_TYPE (ChattyContact, chatty_contact, CHATTY_TYPE_ITEM)
@@ -62,6 +69,48 @@ chatty_contact_get_protocols (ChattyItem *item)
 }
 
 
+/*
+ * Get the value of @self parsed as phone number, the
+ * result is kept until the country code changes.
+ */
+static gboolean
+contact_get_phone_key (ChattyContact   *self,
+                       const char      *country,
+                       ChattyPhoneKey **key)
+{
+  if (!self->phone_key_parsed ||
+      g_strcmp0 (country, self->phone_key_country) != 0) {
+    const char *value;
+
+    value = chatty_item_get_username (CHATTY_ITEM (self));
+    self->has_phone_key = chatty_phone_utils_get_key (value, country, &self->phone_key);
+    self->phone_key_parsed = TRUE;
+    g_free (self->phone_key_country);
+    self->phone_key_country = g_strdup (country);
+  }
+
+  *key = &self->phone_key;
+
+  return self->has_phone_key;
+}
+
+/* Match the same way as an exact or national e_phone_number_compare() */
+static gboolean
+contact_number_matches (ChattyContact *self,
+                        const char    *number)
+{
+  ChattyPhoneKey number_key, *key;
+  const char *country;
+
+  country = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+
+  if (!contact_get_phone_key (self, country, &key) ||
+      !chatty_phone_utils_get_key (number, country, &number_key))
+    return FALSE;
+
+  return chatty_phone_utils_key_match (key, &number_key);
+}
+
 static gboolean
 chatty_contact_matches (ChattyItem     *item,
                         const char     *needle,
@@ -79,19 +128,10 @@ chatty_contact_matches (ChattyItem     *item,
 
   if (protocol == CHATTY_PROTOCOL_MMS_SMS &&
       protocols & CHATTY_PROTOCOL_MMS_SMS) {
-    ChattySettings *settings;
-    const char *country;
-    EPhoneNumberMatch match;
-
     if (strstr (value, needle))
       return TRUE;
 
-    settings = chatty_settings_get_default ();
-    country = chatty_settings_get_country_iso_code (settings);
-    match = e_phone_number_compare_strings_with_region (value, needle, country, NULL);
-
-    if (match == E_PHONE_NUMBER_MATCH_EXACT ||
-        match == E_PHONE_NUMBER_MATCH_NATIONAL)
+    if (contact_number_matches (self, needle))
       return TRUE;
 
     if (g_str_equal (value, needle))
@@ -211,6 +251,7 @@ chatty_contact_dispose (GObject *object)
   g_clear_pointer (&self->attribute, e_vcard_attribute_free);
   g_clear_pointer (&self->name, g_free);
   g_clear_pointer (&self->value, g_free);
+  g_clear_pointer (&self->phone_key_country, g_free);
 
   G_OBJECT_CLASS (chatty_contact_parent_class)->dispose (object);
 }
@@ -300,6 +341,7 @@ chatty_contact_set_value (ChattyContact *self,
 
   g_free (self->value);
   self->value = g_strdup (value);
+  self->phone_key_parsed = FALSE;
 }
 
 /**
@@ -366,25 +408,47 @@ chatty_contact_is_exact_match (ChattyContact  *self,
 
   if (protocol & (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS) &&
       protocols & (CHATTY_PROTOCOL_MMS_SMS | CHATTY_PROTOCOL_MMS)) {
-    ChattySettings *settings;
-    const char *country;
-    EPhoneNumberMatch match;
-
     if (g_str_equal (contact_value, value))
       return TRUE;
 
-    settings = chatty_settings_get_default ();
-    country = chatty_settings_get_country_iso_code (settings);
-    match = e_phone_number_compare_strings_with_region (contact_value, value, country, NULL);
-
-    if (match == E_PHONE_NUMBER_MATCH_EXACT ||
-        match == E_PHONE_NUMBER_MATCH_NATIONAL)
+    if (contact_number_matches (self, value))
       return TRUE;
   }
 
   return FALSE;
 }
 
+/**
+ * chatty_contact_get_phone_key:
+ * @self: #ChattyContact
+ * @key: (out): A #ChattyPhoneKey
+ *
+ * Get the value of @self parsed as a phone number
+ * for the current country code.
+ * This API is only to be used by contact-provider.
+ *
+ * Returns: %TRUE if the value is a phone number
+ */
+gboolean
+chatty_contact_get_phone_key (ChattyContact  *self,
+                              ChattyPhoneKey *key)
+{
+  ChattyPhoneKey *phone_key;
+  const char *country;
+
+  g_return_val_if_fail (CHATTY_IS_CONTACT (self), FALSE);
+  g_return_val_if_fail (key, FALSE);
+
+  country = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+
+  if (!contact_get_phone_key (self, country, &phone_key))
+    return FALSE;
+
+  *key = *phone_key;
+
+  return TRUE;
+}
+
 /**
  * chatty_contact_clear_cache:
  * @self: #ChattyContact
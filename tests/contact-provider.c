@@ -0,0 +1,504 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* contact-provider.c
+ *
+ * Copyright 2026 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "chatty-contact-provider.c"
+
+static ChattyContact *
+contact_new (const char *uid,
+             const char *number)
+{
+  g_autoptr(EContact) econtact = NULL;
+  EVCardAttribute *attr;
+
+  econtact = e_contact_new ();
+  e_contact_set (econtact, E_CONTACT_UID, uid);
+
+  attr = e_vcard_attribute_new (NULL, EVC_TEL);
+  e_vcard_attribute_add_value (attr, number);
+
+  return chatty_contact_new (econtact, attr, CHATTY_PROTOCOL_MMS_SMS);
+}
+
+/*
+ * @removed is a space separated list of uids, and @added
+ * a space separated list of uid=number to be added, both
+ * done in a single update, like an EDS view signal does.
+ */
+static void
+eds_update (ChattyEds  *eds,
+            const char *removed,
+            const char *added)
+{
+  g_autoptr(GHashTable) removed_uids = NULL;
+  g_autoptr(GPtrArray) added_contacts = NULL;
+  g_auto(GStrv) uids = NULL;
+  g_auto(GStrv) contacts = NULL;
+
+  if (removed) {
+    uids = g_strsplit (removed, " ", -1);
+    removed_uids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (guint i = 0; uids[i]; i++)
+      g_hash_table_add (removed_uids, uids[i]);
+  }
+
+  if (added) {
+    contacts = g_strsplit (added, " ", -1);
+    added_contacts = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (guint i = 0; contacts[i]; i++) {
+      g_auto(GStrv) values = NULL;
+
+      values = g_strsplit (contacts[i], "=", 2);
+      g_assert_cmpint (g_strv_length (values), ==, 2);
+      g_ptr_array_add (added_contacts, contact_new (values[0], values[1]));
+    }
+  }
+
+  chatty_eds_update_contacts (eds, removed_uids, added_contacts);
+}
+
+static void
+assert_number_uid (ChattyEds  *eds,
+                   const char *number,
+                   const char *uid)
+{
+  ChattyContact *contact;
+
+  contact = chatty_eds_find_by_number (eds, number);
+
+  if (!uid) {
+    g_assert_null (contact);
+    return;
+  }
+
+  g_assert_true (CHATTY_IS_CONTACT (contact));
+  g_assert_cmpstr (chatty_contact_get_uid (contact), ==, uid);
+}
+
+typedef struct {
+  guint n_emitted;
+  guint position;
+  guint removed;
+  guint added;
+} SpliceInfo;
+
+static void
+contacts_items_changed_cb (GListModel *model,
+                           guint       position,
+                           guint       removed,
+                           guint       added,
+                           SpliceInfo *info)
+{
+  info->n_emitted++;
+  info->position = position;
+  info->removed = removed;
+  info->added = added;
+}
+
+static void
+assert_splice (SpliceInfo *info,
+               guint       position,
+               guint       removed,
+               guint       added)
+{
+  g_assert_cmpint (info->n_emitted, ==, 1);
+  g_assert_cmpint (info->position, ==, position);
+  g_assert_cmpint (info->removed, ==, removed);
+  g_assert_cmpint (info->added, ==, added);
+  memset (info, 0, sizeof (*info));
+}
+
+/* Space separated uids of the contacts in contacts_list */
+static char *
+eds_get_uids (ChattyEds *eds)
+{
+  GListModel *model;
+  GString *uids;
+  guint n_items;
+
+  model = G_LIST_MODEL (eds->contacts_list);
+  n_items = g_list_model_get_n_items (model);
+  uids = g_string_new (NULL);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+
+    contact = g_list_model_get_item (model, i);
+    if (i)
+      g_string_append_c (uids, ' ');
+    g_string_append (uids, chatty_contact_get_uid (contact));
+  }
+
+  return g_string_free (uids, FALSE);
+}
+
+/* Every uid in contacts_list should have the exact range it's in */
+static void
+assert_uid_index (ChattyEds *eds)
+{
+  GListModel *model;
+  guint n_items, n_ranges = 0;
+
+  model = G_LIST_MODEL (eds->contacts_list);
+  n_items = g_list_model_get_n_items (model);
+
+  for (guint i = 0; i < n_items; n_ranges++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    UidRange *range;
+    const char *uid;
+
+    contact = g_list_model_get_item (model, i);
+    uid = chatty_contact_get_uid (contact);
+    range = g_hash_table_lookup (eds->uid_index, uid);
+
+    g_assert_nonnull (range);
+    g_assert_cmpint (range->position, ==, i);
+    g_assert_cmpint (range->count, >, 0);
+    g_assert_cmpint (range->position + range->count, <=, n_items);
+
+    for (guint j = i + 1; j < range->position + range->count; j++) {
+      g_autoptr(ChattyContact) item = NULL;
+
+      item = g_list_model_get_item (model, j);
+      g_assert_cmpstr (chatty_contact_get_uid (item), ==, uid);
+    }
+
+    i += range->count;
+
+    /* The range should end where the uid does */
+    if (i < n_items) {
+      g_autoptr(ChattyContact) item = NULL;
+
+      item = g_list_model_get_item (model, i);
+      g_assert_cmpstr (chatty_contact_get_uid (item), !=, uid);
+    }
+  }
+
+  g_assert_cmpint (g_hash_table_size (eds->uid_index), ==, n_ranges);
+}
+
+static void
+assert_uids (ChattyEds  *eds,
+             const char *expected)
+{
+  g_autofree char *uids = NULL;
+
+  uids = eds_get_uids (eds);
+  g_assert_cmpstr (uids, ==, expected);
+  assert_uid_index (eds);
+}
+
+static void
+test_contact_provider_number_add (void)
+{
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+
+  assert_number_uid (eds, "2015550123", NULL);
+
+  eds_update (eds, NULL, "a=(201)555-0123");
+  assert_number_uid (eds, "2015550123", "a");
+  assert_number_uid (eds, "+1 201 555 0123", "a");
+  assert_number_uid (eds, "201-555-0123", "a");
+  assert_number_uid (eds, "2015550124", NULL);
+
+  /* Values that aren't numbers are matched as such */
+  eds_update (eds, NULL, "b=GNU");
+  assert_number_uid (eds, "GNU", "b");
+  assert_number_uid (eds, "gnu", NULL);
+  assert_number_uid (eds, "2015550123", "a");
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_number_change (void)
+{
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+
+  eds_update (eds, NULL, "a=2015550123 b=2015550144");
+  assert_number_uid (eds, "2015550123", "a");
+  assert_number_uid (eds, "2015550144", "b");
+
+  /* A modified contact is removed and added again */
+  eds_update (eds, "a", "a=2015550199");
+  assert_number_uid (eds, "2015550123", NULL);
+  assert_number_uid (eds, "2015550199", "a");
+  assert_number_uid (eds, "2015550144", "b");
+
+  eds_update (eds, "a", NULL);
+  assert_number_uid (eds, "2015550199", NULL);
+  assert_number_uid (eds, "2015550144", "b");
+
+  eds_update (eds, "b", NULL);
+  assert_number_uid (eds, "2015550144", NULL);
+  g_assert_cmpint (g_hash_table_size (eds->number_index), ==, 0);
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_number_shared (void)
+{
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+
+  /* The first contact added is the one matched */
+  eds_update (eds, NULL, "a=2015550123 b=+12015550123");
+  assert_number_uid (eds, "2015550123", "a");
+
+  eds_update (eds, "a", NULL);
+  assert_number_uid (eds, "2015550123", "b");
+
+  eds_update (eds, NULL, "a=201-555-0123");
+  assert_number_uid (eds, "2015550123", "b");
+
+  /* Changing one shouldn't change the other */
+  eds_update (eds, "b", "b=2015550144");
+  assert_number_uid (eds, "2015550123", "a");
+  assert_number_uid (eds, "2015550144", "b");
+
+  eds_update (eds, "a b", NULL);
+  assert_number_uid (eds, "2015550123", NULL);
+  assert_number_uid (eds, "2015550144", NULL);
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_number_national (void)
+{
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+
+  /* A Norwegian number saved without its country code */
+  eds_update (eds, NULL, "a=22334455");
+  assert_number_uid (eds, "+47 22 33 44 55", "a");
+  assert_number_uid (eds, "+4722334455", "a");
+  assert_number_uid (eds, "22 33 44 55", "a");
+
+  /* A number without a country code matches one with it */
+  eds_update (eds, NULL, "b=+47 23 45 67 89");
+  assert_number_uid (eds, "23456789", "b");
+
+  /* If both have a country code, they have to be the same */
+  assert_number_uid (eds, "+45 23 45 67 89", NULL);
+
+  /* An exact match wins over a national one */
+  eds_update (eds, NULL, "c=+4722334455");
+  assert_number_uid (eds, "+47 22 33 44 55", "c");
+  assert_number_uid (eds, "22334455", "a");
+
+  eds_update (eds, "a b c", NULL);
+  assert_number_uid (eds, "+47 22 33 44 55", NULL);
+  g_assert_cmpint (g_hash_table_size (eds->national_index), ==, 0);
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_update_add (void)
+{
+  SpliceInfo info = {0};
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+  g_signal_connect (eds->contacts_list, "items-changed",
+                    G_CALLBACK (contacts_items_changed_cb), &info);
+
+  eds_update (eds, NULL, "a=2015550101 a=2015550102 b=2015550103");
+  assert_splice (&info, 0, 0, 3);
+  assert_uids (eds, "a a b");
+
+  /* New contacts are always appended */
+  eds_update (eds, NULL, "c=2015550104 d=2015550105 d=2015550106");
+  assert_splice (&info, 3, 0, 3);
+  assert_uids (eds, "a a b c d d");
+
+  /* Nothing changed, nothing emitted */
+  eds_update (eds, "x", NULL);
+  g_assert_cmpint (info.n_emitted, ==, 0);
+  assert_uids (eds, "a a b c d d");
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_update_remove (void)
+{
+  SpliceInfo info = {0};
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+  g_signal_connect (eds->contacts_list, "items-changed",
+                    G_CALLBACK (contacts_items_changed_cb), &info);
+
+  eds_update (eds, NULL, "a=2015550101 b=2015550102 b=2015550103 c=2015550104 d=2015550105");
+  assert_splice (&info, 0, 0, 5);
+
+  eds_update (eds, "b", NULL);
+  assert_splice (&info, 1, 2, 0);
+  assert_uids (eds, "a c d");
+
+  /* The ones in between are kept in the same splice */
+  eds_update (eds, "a d", NULL);
+  assert_splice (&info, 0, 3, 1);
+  assert_uids (eds, "c");
+
+  eds_update (eds, "c", NULL);
+  assert_splice (&info, 0, 1, 0);
+  assert_uids (eds, "");
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_update_change (void)
+{
+  SpliceInfo info = {0};
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+  g_signal_connect (eds->contacts_list, "items-changed",
+                    G_CALLBACK (contacts_items_changed_cb), &info);
+
+  eds_update (eds, NULL, "a=2015550101 b=2015550102 c=2015550103");
+  assert_splice (&info, 0, 0, 3);
+
+  /* A changed contact is kept in place */
+  eds_update (eds, "b", "b=2015550104");
+  assert_splice (&info, 1, 1, 1);
+  assert_uids (eds, "a b c");
+  assert_number_uid (eds, "2015550104", "b");
+
+  /* The ones after should move if the number of contacts changed */
+  eds_update (eds, "b", "b=2015550105 b=2015550106");
+  assert_splice (&info, 1, 1, 2);
+  assert_uids (eds, "a b b c");
+
+  eds_update (eds, "a", "a=2015550107 a=2015550108 a=2015550109");
+  assert_splice (&info, 0, 1, 3);
+  assert_uids (eds, "a a a b b c");
+
+  eds_update (eds, "a", "a=2015550110");
+  assert_splice (&info, 0, 3, 1);
+  assert_uids (eds, "a b b c");
+
+  eds_update (eds, "c", "c=2015550111");
+  assert_splice (&info, 3, 1, 1);
+  assert_uids (eds, "a b b c");
+  assert_number_uid (eds, "2015550103", NULL);
+  assert_number_uid (eds, "2015550111", "c");
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_update_mixed (void)
+{
+  SpliceInfo info = {0};
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+  g_signal_connect (eds->contacts_list, "items-changed",
+                    G_CALLBACK (contacts_items_changed_cb), &info);
+
+  eds_update (eds, NULL, "a=2015550101 b=2015550102 b=2015550103 c=2015550104 d=2015550105 e=2015550106");
+  assert_splice (&info, 0, 0, 6);
+
+  /* Remove b, change d and add f in one batch */
+  eds_update (eds, "b d", "d=2015550107 f=2015550108");
+  assert_splice (&info, 1, 4, 3);
+  assert_uids (eds, "a c d f e");
+  assert_number_uid (eds, "2015550102", NULL);
+  assert_number_uid (eds, "2015550105", NULL);
+  assert_number_uid (eds, "2015550107", "d");
+  assert_number_uid (eds, "2015550108", "f");
+  assert_number_uid (eds, "2015550106", "e");
+
+  /* Removing the first and the last one replaces everything */
+  eds_update (eds, "a e", "g=2015550109");
+  assert_splice (&info, 0, 5, 4);
+  assert_uids (eds, "c d f g");
+
+  /* Removing unknown uids is the same as adding */
+  eds_update (eds, "x y", "h=2015550110");
+  assert_splice (&info, 4, 0, 1);
+  assert_uids (eds, "c d f g h");
+
+  g_object_unref (eds);
+}
+
+static void
+test_contact_provider_update_duplicate (void)
+{
+  SpliceInfo info = {0};
+  ChattyEds *eds;
+
+  eds = chatty_eds_new (CHATTY_PROTOCOL_MMS_SMS);
+  g_signal_connect (eds->contacts_list, "items-changed",
+                    G_CALLBACK (contacts_items_changed_cb), &info);
+
+  eds_update (eds, NULL, "a=2015550101 b=2015550102");
+  assert_splice (&info, 0, 0, 2);
+
+  /* A uid added again replaces the old contacts */
+  eds_update (eds, NULL, "a=2015550103");
+  assert_splice (&info, 0, 1, 1);
+  assert_uids (eds, "a b");
+  assert_number_uid (eds, "2015550101", NULL);
+  assert_number_uid (eds, "2015550103", "a");
+
+  /* The contacts of a uid are kept together in a batch too */
+  eds_update (eds, NULL, "c=2015550104 b=2015550105 c=2015550106");
+  assert_splice (&info, 1, 1, 3);
+  assert_uids (eds, "a c c b");
+  assert_number_uid (eds, "2015550102", NULL);
+  assert_number_uid (eds, "2015550105", "b");
+
+  eds_update (eds, "a c", NULL);
+  assert_splice (&info, 0, 3, 0);
+  assert_uids (eds, "b");
+  assert_number_uid (eds, "2015550103", NULL);
+  assert_number_uid (eds, "2015550106", NULL);
+
+  eds_update (eds, "b", NULL);
+  assert_splice (&info, 0, 1, 0);
+  assert_uids (eds, "");
+  g_assert_cmpint (g_hash_table_size (eds->number_index), ==, 0);
+
+  g_object_unref (eds);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+  chatty_settings_set_country_iso_code (chatty_settings_get_default (), "US");
+
+  g_test_add_func ("/contact-provider/number/add", test_contact_provider_number_add);
+  g_test_add_func ("/contact-provider/number/change", test_contact_provider_number_change);
+  g_test_add_func ("/contact-provider/number/shared", test_contact_provider_number_shared);
+  g_test_add_func ("/contact-provider/number/national", test_contact_provider_number_national);
+  g_test_add_func ("/contact-provider/update/add", test_contact_provider_update_add);
+  g_test_add_func ("/contact-provider/update/remove", test_contact_provider_update_remove);
+  g_test_add_func ("/contact-provider/update/change", test_contact_provider_update_change);
+  g_test_add_func ("/contact-provider/update/mixed", test_contact_provider_update_mixed);
+  g_test_add_func ("/contact-provider/update/duplicate", test_contact_provider_update_duplicate);
+
+  return g_test_run ();
+}
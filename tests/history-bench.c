@@ -0,0 +1,529 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* history-bench.c
+ *
+ * Copyright 2026 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Benchmark of ChattyHistory on a synthetic database.  Run with
+ * 'meson test --benchmark' or directly, see --help for the size of
+ * the generated database.  The results are written as JSON so that
+ * they can be compared between builds.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+#include "chatty-contact.h"
+#include "chatty-file.h"
+#include "chatty-message.h"
+#include "chatty-mm-account.h"
+#include "chatty-mm-buddy.h"
+#include "chatty-mm-chat.h"
+#include "chatty-history.h"
+
+#define DB_NAME "chatty-history-bench.db"
+
+static int      n_threads = 200;
+static int      n_messages = 100;
+static double   attachment_ratio = 0.1;
+static int      page_size = 50;
+static int      n_samples = 20;
+static char    *output;
+static char    *db_dir;
+
+typedef struct {
+  const char *name;
+  guint       count;
+  double      total;
+  double      max;
+} BenchResult;
+
+enum {
+  BENCH_BULK_ADD,
+  BENCH_MARK_READ,
+  BENCH_OPEN,
+  BENCH_GET_CHATS,
+  BENCH_GET_MESSAGES,
+  BENCH_ADD_MESSAGE,
+  BENCH_DELETE_CHAT,
+  BENCH_EXPORT,
+  BENCH_IMPORT,
+  BENCH_CLOSE,
+  N_BENCH
+};
+
+static BenchResult results[N_BENCH] = {
+  [BENCH_BULK_ADD]     = { "add_messages" },
+  [BENCH_MARK_READ]    = { "set_last_read_msg" },
+  [BENCH_OPEN]         = { "open" },
+  [BENCH_GET_CHATS]    = { "get_chats" },
+  [BENCH_GET_MESSAGES] = { "get_messages_page" },
+  [BENCH_ADD_MESSAGE]  = { "add_message" },
+  [BENCH_DELETE_CHAT]  = { "delete_chat" },
+  [BENCH_EXPORT]       = { "export" },
+  [BENCH_IMPORT]       = { "import" },
+  [BENCH_CLOSE]        = { "close" },
+};
+
+static void
+bench_record (guint  bench,
+              gint64 start)
+{
+  double elapsed;
+
+  elapsed = (g_get_monotonic_time () - start) / (double)G_TIME_SPAN_MILLISECOND;
+  results[bench].count++;
+  results[bench].total += elapsed;
+  results[bench].max = MAX (results[bench].max, elapsed);
+}
+
+static void
+bench_reset (guint bench)
+{
+  results[bench].count = 0;
+  results[bench].total = 0;
+  results[bench].max = 0;
+}
+
+static void
+finish_cb (GObject      *object,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  GAsyncResult **out = user_data;
+
+  *out = g_object_ref (result);
+}
+
+static void
+wait_for_result (GAsyncResult **result)
+{
+  while (!*result)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+history_open_sync (ChattyHistory *history)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  chatty_history_open_async (history, g_strdup (db_dir), DB_NAME, finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_OPEN, start);
+
+  g_assert_true (chatty_history_open_finish (history, result, &error));
+  g_assert_no_error (error);
+}
+
+static void
+history_close_sync (ChattyHistory *history)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  chatty_history_close_async (history, finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_CLOSE, start);
+
+  g_assert_true (chatty_history_close_finish (history, result, &error));
+  g_assert_no_error (error);
+}
+
+static ChattyChat *
+bench_chat_new (guint index)
+{
+  g_autoptr(GPtrArray) members = NULL;
+  g_autofree char *number = NULL;
+  ChattyChat *chat;
+
+  number = g_strdup_printf ("+1555%07u", index);
+  chat = (ChattyChat *)chatty_mm_chat_new (number, NULL, CHATTY_PROTOCOL_MMS_SMS, TRUE,
+                                           CHATTY_ITEM_VISIBLE);
+  members = g_ptr_array_new_full (1, g_object_unref);
+  g_ptr_array_add (members, chatty_mm_buddy_new (number, NULL));
+  chatty_mm_chat_add_users (CHATTY_MM_CHAT (chat), members);
+
+  return chat;
+}
+
+static ChattyMessage *
+bench_message_new (ChattyChat *chat,
+                   GRand      *rand,
+                   guint       index,
+                   int         when)
+{
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autofree char *uuid = NULL;
+  g_autofree char *text = NULL;
+  ChattyMessage *message;
+  const char *number;
+
+  number = chatty_chat_get_chat_name (chat);
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, number);
+  chatty_contact_set_value (contact, number);
+
+  uuid = g_uuid_string_random ();
+  text = g_strdup_printf ("Message %u from %s", index, number);
+  message = chatty_message_new (CHATTY_ITEM (contact), text, uuid, when,
+                                CHATTY_MESSAGE_TEXT,
+                                g_rand_boolean (rand) ? CHATTY_DIRECTION_OUT : CHATTY_DIRECTION_IN,
+                                0);
+
+  if (g_rand_double (rand) < attachment_ratio) {
+    g_autofree char *url = NULL;
+
+    url = g_strdup_printf ("https://example.com/%s.png", uuid);
+    chatty_message_set_files (message,
+                              g_list_append (NULL,
+                                             chatty_file_new_full ("image.png", url, NULL, "image/png",
+                                                                   g_rand_int_range (rand, 1000, 1000000),
+                                                                   640, 480, 0)));
+  }
+
+  return message;
+}
+
+static void
+bench_populate (ChattyHistory *history,
+                GPtrArray     *chats,
+                GRand         *rand)
+{
+  int when;
+
+  when = time (NULL) - n_messages;
+
+  for (guint i = 0; i < (guint)n_threads; i++) {
+    g_autoptr(GPtrArray) messages = NULL;
+    ChattyChat *chat;
+    gint64 start;
+
+    chat = bench_chat_new (i);
+    g_ptr_array_add (chats, chat);
+    messages = g_ptr_array_new_full (n_messages, g_object_unref);
+
+    /* Some messages share a timestamp, as they do in busy chats */
+    for (guint j = 0; j < (guint)n_messages; j++)
+      g_ptr_array_add (messages, bench_message_new (chat, rand, j, when + j - j % 3));
+
+    {
+      g_autoptr(GAsyncResult) result = NULL;
+
+      start = g_get_monotonic_time ();
+      chatty_history_add_messages_async (history, chat, messages, finish_cb, &result);
+      wait_for_result (&result);
+      bench_record (BENCH_BULK_ADD, start);
+      g_assert_true (chatty_history_add_messages_finish (history, result, NULL));
+    }
+
+    /* Leave a few messages of every thread unread */
+    if (messages->len > 5) {
+      g_autoptr(GAsyncResult) result = NULL;
+
+      start = g_get_monotonic_time ();
+      chatty_history_set_last_read_msg_async (history, chat,
+                                              messages->pdata[messages->len - 5],
+                                              finish_cb, &result);
+      wait_for_result (&result);
+      bench_record (BENCH_MARK_READ, start);
+      g_assert_true (chatty_history_set_last_read_msg_finish (history, result, NULL));
+    }
+  }
+}
+
+static void
+bench_get_chats (ChattyHistory *history)
+{
+  g_autoptr(ChattyMmAccount) account = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  gint64 start;
+
+  account = chatty_mm_account_new ();
+
+  start = g_get_monotonic_time ();
+  chatty_history_get_chats_async (history, CHATTY_ACCOUNT (account), finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_GET_CHATS, start);
+
+  chats = chatty_history_get_chats_finish (history, result, NULL);
+  g_assert_nonnull (chats);
+  g_assert_cmpint (chats->len, ==, n_threads);
+}
+
+/* Load every message of @chat a page at a time, from the latest */
+static void
+bench_get_messages (ChattyHistory *history,
+                    ChattyChat    *chat)
+{
+  g_autoptr(ChattyMessage) start_message = NULL;
+  guint loaded = 0;
+
+  do {
+    g_autoptr(GAsyncResult) result = NULL;
+    g_autoptr(GPtrArray) messages = NULL;
+    gint64 start;
+
+    start = g_get_monotonic_time ();
+    chatty_history_get_messages_async (history, chat, start_message, page_size,
+                                       finish_cb, &result);
+    wait_for_result (&result);
+    bench_record (BENCH_GET_MESSAGES, start);
+
+    messages = chatty_history_get_messages_finish (history, result, NULL);
+
+    if (!messages || !messages->len)
+      break;
+
+    loaded += messages->len;
+    g_set_object (&start_message, messages->pdata[0]);
+  } while (TRUE);
+
+  g_assert_cmpint (loaded, ==, n_messages);
+}
+
+static void
+bench_add_message (ChattyHistory *history,
+                   ChattyChat    *chat,
+                   GRand         *rand)
+{
+  for (guint i = 0; i < (guint)n_samples; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autoptr(GAsyncResult) result = NULL;
+    gint64 start;
+
+    message = bench_message_new (chat, rand, n_messages + i, time (NULL));
+
+    start = g_get_monotonic_time ();
+    chatty_history_add_message_async (history, chat, message, finish_cb, &result);
+    wait_for_result (&result);
+    bench_record (BENCH_ADD_MESSAGE, start);
+
+    g_assert_true (chatty_history_add_message_finish (history, result, NULL));
+  }
+}
+
+static void
+bench_delete_chat (ChattyHistory *history,
+                   ChattyChat    *chat)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  chatty_history_delete_chat_async (history, chat, finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_DELETE_CHAT, start);
+
+  g_assert_true (chatty_history_delete_chat_finish (history, result, NULL));
+}
+
+static void
+bench_export (ChattyHistory *history,
+              GFile         *file)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  chatty_history_export_async (history, file, TRUE, finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_EXPORT, start);
+
+  g_assert_true (chatty_history_export_finish (history, result, NULL));
+}
+
+/* Import to a new database, so that every message is added */
+static void
+bench_import (GFile *file)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  gint64 start;
+
+  history = chatty_history_new ();
+  chatty_history_open_async (history, g_strdup (db_dir), "import.db", finish_cb, &result);
+  wait_for_result (&result);
+  g_assert_true (chatty_history_open_finish (history, result, NULL));
+  g_clear_object (&result);
+
+  start = g_get_monotonic_time ();
+  chatty_history_import_async (history, file, finish_cb, &result);
+  wait_for_result (&result);
+  bench_record (BENCH_IMPORT, start);
+
+  g_assert_true (chatty_history_import_finish (history, result, NULL));
+  g_clear_object (&result);
+
+  chatty_history_close_async (history, finish_cb, &result);
+  wait_for_result (&result);
+  g_assert_true (chatty_history_close_finish (history, result, NULL));
+}
+
+static void
+json_append_double (GString    *str,
+                    const char *name,
+                    double      value,
+                    gboolean    last)
+{
+  char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+  /* JSON needs '.' as the decimal separator whatever the locale */
+  g_string_append_printf (str, "\"%s\": %s%s", name,
+                          g_ascii_formatd (buffer, sizeof buffer, "%.3f", value),
+                          last ? "" : ", ");
+}
+
+static char *
+bench_to_json (void)
+{
+  GString *str;
+
+  str = g_string_new ("{\n");
+  g_string_append_printf (str, "  \"sqlite_version\": \"%s\",\n", sqlite3_libversion ());
+  g_string_append_printf (str, "  \"config\": {\"threads\": %d, \"messages_per_thread\": %d, ",
+                          n_threads, n_messages);
+  json_append_double (str, "attachment_ratio", attachment_ratio, FALSE);
+  g_string_append_printf (str, "\"page_size\": %d, \"samples\": %d},\n", page_size, n_samples);
+  g_string_append (str, "  \"results\": {\n");
+
+  for (guint i = 0; i < N_BENCH; i++) {
+    BenchResult *result = &results[i];
+
+    g_string_append_printf (str, "    \"%s\": {\"count\": %u, ", result->name, result->count);
+    json_append_double (str, "total_ms", result->total, FALSE);
+    json_append_double (str, "mean_ms", result->count ? result->total / result->count : 0, FALSE);
+    json_append_double (str, "max_ms", result->max, TRUE);
+    g_string_append_printf (str, "}%s\n", i + 1 < N_BENCH ? "," : "");
+  }
+
+  g_string_append (str, "  }\n}\n");
+
+  return g_string_free (str, FALSE);
+}
+
+static void
+remove_db_dir (void)
+{
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  dir = g_dir_open (db_dir, 0, NULL);
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *path = NULL;
+
+    path = g_build_filename (db_dir, name, NULL);
+    g_remove (path);
+  }
+
+  g_rmdir (db_dir);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  g_autoptr(GFile) export = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *json = NULL;
+  g_autoptr(GRand) rand = NULL;
+  guint n_sampled;
+  GOptionEntry entries[] = {
+    { "threads", 't', 0, G_OPTION_ARG_INT, &n_threads, "Number of threads", "N" },
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &n_messages, "Number of messages per thread", "N" },
+    { "attachments", 'a', 0, G_OPTION_ARG_DOUBLE, &attachment_ratio,
+      "Ratio of messages with an attachment", "RATIO" },
+    { "page-size", 'p', 0, G_OPTION_ARG_INT, &page_size, "Number of messages per page", "N" },
+    { "samples", 's', 0, G_OPTION_ARG_INT, &n_samples,
+      "Number of threads to page through, messages to add and threads to delete", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write JSON results to FILE", "FILE" },
+    { NULL }
+  };
+
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+  context = g_option_context_new ("- benchmark chat history storage");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (n_threads < 1 || n_messages < 1 || page_size < 1 || n_samples < 1 ||
+      attachment_ratio < 0 || attachment_ratio > 1) {
+    g_printerr ("Invalid benchmark size\n");
+    return EXIT_FAILURE;
+  }
+
+  db_dir = g_dir_make_tmp ("chatty-bench-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Same seed for every run, so that runs are comparable */
+  rand = g_rand_new_with_seed (42);
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  n_sampled = MIN (n_samples, n_threads);
+
+  history = chatty_history_new ();
+  history_open_sync (history);
+  bench_populate (history, chats, rand);
+  history_close_sync (history);
+  g_clear_object (&history);
+
+  /* Only time the open of an existing database */
+  bench_reset (BENCH_OPEN);
+  bench_reset (BENCH_CLOSE);
+
+  history = chatty_history_new ();
+  history_open_sync (history);
+  bench_get_chats (history);
+
+  for (guint i = 0; i < n_sampled; i++)
+    bench_get_messages (history, chats->pdata[i * chats->len / n_sampled]);
+
+  export = g_file_new_build_filename (db_dir, "export.gz", NULL);
+  bench_export (history, export);
+
+  bench_add_message (history, chats->pdata[0], rand);
+
+  for (guint i = 0; i < n_sampled; i++)
+    bench_delete_chat (history, chats->pdata[i * chats->len / n_sampled]);
+
+  history_close_sync (history);
+  bench_import (export);
+  remove_db_dir ();
+
+  json = bench_to_json ();
+
+  if (output) {
+    if (!g_file_set_contents (output, json, -1, &error)) {
+      g_printerr ("Failed to write results: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  } else {
+    g_print ("%s", json);
+  }
+
+  g_free (db_dir);
+  g_free (output);
+
+  return EXIT_SUCCESS;
+}
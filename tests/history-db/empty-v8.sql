@@ -0,0 +1,133 @@
+BEGIN TRANSACTION;
+PRAGMA auto_vacuum = INCREMENTAL;
+PRAGMA user_version = 8;
+PRAGMA foreign_keys = ON;
+CREATE TABLE mime_type (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT NOT NULL UNIQUE
+);
+CREATE TABLE files (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT,
+  url TEXT NOT NULL UNIQUE,
+  path TEXT,
+  mime_type_id INTEGER REFERENCES mime_type(id),
+  status INT,
+  size INTEGER
+);
+CREATE TABLE file_metadata (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  file_id INTEGER NOT NULL UNIQUE REFERENCES files(id) ON DELETE CASCADE,
+  width INTEGER,
+  height INTEGER,
+  duration INTEGER,
+  FOREIGN KEY(file_id) REFERENCES files(id)
+);
+CREATE TABLE users (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  username TEXT NOT NULL,
+  alias TEXT,
+  avatar_id INTEGER REFERENCES files(id),
+  type INTEGER NOT NULL,
+  UNIQUE (username, type)
+);
+INSERT INTO users VALUES(1,'invalid-0000000000000000',NULL,NULL,1);
+CREATE TABLE accounts (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  user_id INTEGER NOT NULL REFERENCES users(id),
+  password TEXT,
+  enabled INTEGER DEFAULT 0,
+  protocol INTEGER NOT NULL,
+  UNIQUE (user_id, protocol)
+);
+INSERT INTO accounts VALUES(1,1,NULL,0,1);
+CREATE TABLE threads (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT NOT NULL,
+  alias TEXT,
+  avatar_id INTEGER REFERENCES files(id),
+  account_id INTEGER NOT NULL REFERENCES accounts(id) ON DELETE CASCADE,
+  type INTEGER NOT NULL,
+  encrypted INTEGER DEFAULT 0,
+  UNIQUE (name, account_id, type)
+);
+CREATE TABLE thread_members (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  thread_id INTEGER NOT NULL REFERENCES threads(id) ON DELETE CASCADE,
+  user_id INTEGER NOT NULL REFERENCES users(id),
+  UNIQUE (thread_id, user_id)
+);
+CREATE TABLE messages (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  uid TEXT NOT NULL,
+  thread_id INTEGER NOT NULL REFERENCES threads(id) ON DELETE CASCADE,
+  sender_id INTEGER REFERENCES users(id),
+  user_alias TEXT,
+  body TEXT NOT NULL,
+  body_type INTEGER NOT NULL,
+  direction INTEGER NOT NULL,
+  time INTEGER NOT NULL,
+  status INTEGER,
+  encrypted INTEGER DEFAULT 0,
+  preview_id INTEGER REFERENCES files(id),
+  subject TEXT,
+  UNIQUE (uid, thread_id, body, time)
+);
+CREATE TABLE mm_messages (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  message_id INTEGER NOT NULL UNIQUE REFERENCES messages(id) ON DELETE CASCADE,
+  account_id INTEGER NOT NULL REFERENCES accounts(id),
+  protocol INTEGER NOT NULL,
+  smsc TEXT,
+  time_sent INTEGER,
+  validity INTEGER,
+  reference_number INTEGER
+);
+CREATE TABLE message_files (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  message_id INTEGER NOT NULL REFERENCES messages(id) ON DELETE CASCADE,
+  file_id INTEGER NOT NULL REFERENCES files(id),
+  preview_id INTEGER REFERENCES files(id),
+  UNIQUE (message_id, file_id)
+);
+ALTER TABLE threads ADD COLUMN last_read_id INTEGER REFERENCES messages(id);
+ALTER TABLE threads ADD COLUMN visibility INT NOT NULL DEFAULT 0;
+ALTER TABLE threads ADD COLUMN notification INTEGER NOT NULL DEFAULT 1;
+
+CREATE INDEX messages_uid_idx ON messages(uid);
+CREATE INDEX messages_thread_time_idx ON messages(thread_id,time);
+
+CREATE VIRTUAL TABLE messages_fts USING fts5(body, subject, content='messages', content_rowid='id', tokenize='unicode61 remove_diacritics 2');
+CREATE TRIGGER messages_fts_insert AFTER INSERT ON messages BEGIN
+  INSERT INTO messages_fts(rowid,body,subject) VALUES(new.id,new.body,new.subject);
+END;
+CREATE TRIGGER messages_fts_delete AFTER DELETE ON messages BEGIN
+  INSERT INTO messages_fts(messages_fts,rowid,body,subject) VALUES('delete',old.id,old.body,old.subject);
+END;
+CREATE TRIGGER messages_fts_update AFTER UPDATE OF body,subject ON messages BEGIN
+  INSERT INTO messages_fts(messages_fts,rowid,body,subject) VALUES('delete',old.id,old.body,old.subject);
+  INSERT INTO messages_fts(rowid,body,subject) VALUES(new.id,new.body,new.subject);
+END;
+INSERT INTO messages_fts(messages_fts) VALUES('rebuild');
+
+CREATE TABLE thread_summary (thread_id INTEGER NOT NULL PRIMARY KEY REFERENCES threads(id) ON DELETE CASCADE, last_message_id INTEGER REFERENCES messages(id), last_message_time INTEGER, unread_count INTEGER NOT NULL DEFAULT 0);
+CREATE TRIGGER thread_summary_thread_insert AFTER INSERT ON threads BEGIN
+  INSERT OR IGNORE INTO thread_summary(thread_id) VALUES(new.id);
+END;
+CREATE TRIGGER thread_summary_thread_delete AFTER DELETE ON threads BEGIN
+  DELETE FROM thread_summary WHERE thread_id=old.id;
+END;
+CREATE TRIGGER thread_summary_thread_read AFTER UPDATE OF last_read_id ON threads BEGIN
+  UPDATE thread_summary SET unread_count=(SELECT COUNT(*) FROM messages WHERE messages.thread_id=new.id AND messages.id >= new.last_read_id) WHERE thread_id=new.id;
+END;
+CREATE TRIGGER thread_summary_message_insert AFTER INSERT ON messages BEGIN
+  UPDATE thread_summary SET unread_count=unread_count + 1 WHERE thread_id=new.thread_id AND new.id >= (SELECT last_read_id FROM threads WHERE threads.id=new.thread_id);
+  UPDATE thread_summary SET last_message_id=new.id, last_message_time=new.time WHERE thread_id=new.thread_id AND (new.status !=1 OR new.status IS NULL) AND (last_message_id IS NULL OR new.time > last_message_time OR (new.time = last_message_time AND new.id > last_message_id));
+END;
+CREATE INDEX message_files_file_idx ON message_files(file_id);
+CREATE INDEX message_files_preview_idx ON message_files(preview_id) WHERE preview_id IS NOT NULL;
+CREATE INDEX messages_preview_idx ON messages(preview_id) WHERE preview_id IS NOT NULL;
+CREATE INDEX users_avatar_idx ON users(avatar_id) WHERE avatar_id IS NOT NULL;
+CREATE INDEX threads_avatar_idx ON threads(avatar_id) WHERE avatar_id IS NOT NULL;
+
+COMMIT;
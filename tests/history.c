@@ -90,6 +90,153 @@ finish_bool_cb (GObject      *object,
   g_task_return_boolean (task, status);
 }
 
+static void
+finish_int_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  int value;
+
+  g_assert_true (G_IS_TASK (task));
+
+  value = g_task_propagate_int (G_TASK (result), &error);
+  g_assert_no_error (error);
+
+  g_task_return_int (task, value);
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+history_open_sync (ChattyHistory *history,
+                   const char    *dir,
+                   const char    *file_name)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_open_async (history, g_strdup (dir), file_name, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+history_close_sync (ChattyHistory *history)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (chatty_history_is_closed (history))
+    return;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_close_async (history, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static gboolean
+history_add_message_sync (ChattyHistory *history,
+                          ChattyChat    *chat,
+                          ChattyMessage *message)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_message_async (history, chat, message, finish_bool_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_boolean (task, NULL);
+}
+
+static void
+history_delete_chat_sync (ChattyHistory *history,
+                          ChattyChat    *chat)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_delete_chat_async (history, chat, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static gboolean
+history_im_exists_sync (ChattyHistory *history,
+                        const char    *account,
+                        const char    *who)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_im_exists_async (history, account, who, finish_bool_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_boolean (task, NULL);
+}
+
+static gboolean
+history_chat_exists_sync (ChattyHistory *history,
+                          const char    *account,
+                          const char    *room)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_chat_exists_async (history, account, room, finish_bool_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_boolean (task, NULL);
+}
+
+static int
+history_get_chat_timestamp_sync (ChattyHistory *history,
+                                 const char    *uuid,
+                                 const char    *room)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_chat_timestamp_async (history, uuid, room, finish_int_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_int (task, NULL);
+}
+
+static int
+history_get_im_timestamp_sync (ChattyHistory *history,
+                               const char    *uuid,
+                               const char    *account)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_im_timestamp_async (history, uuid, account, finish_int_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_int (task, NULL);
+}
+
+static int
+history_get_last_message_time_sync (ChattyHistory *history,
+                                    const char    *account,
+                                    const char    *room)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_last_message_time_async (history, account, room, finish_int_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_int (task, NULL);
+}
+
 static int
 history_db_get_int (sqlite3    *db,
                     const char *statement)
@@ -148,7 +295,7 @@ compare_table (sqlite3    *db,
 static void
 compare_db_new_columns (sqlite3 *db)
 {
-  g_assert (HISTORY_VERSION == 4);
+  g_assert (HISTORY_VERSION == 8);
 
   /* TO REMOVE */
   compare_table (db,
@@ -189,6 +336,19 @@ compare_db_new_columns (sqlite3 *db)
                  ");",
                  history_db_get_int (db, "SELECT COUNT(*) FROM main.message_files;"),
                  history_db_get_int (db, "SELECT COUNT(*) FROM test.message_files;"));
+
+  compare_table (db,
+                 "SELECT COUNT (*) FROM ("
+                 "SELECT threads.name,threads.type,m.uid,last_message_time,unread_count FROM main.thread_summary "
+                 "INNER JOIN main.threads ON threads.id=thread_summary.thread_id "
+                 "LEFT JOIN main.messages AS m ON m.id=thread_summary.last_message_id "
+                 "UNION "
+                 "SELECT threads.name,threads.type,m.uid,last_message_time,unread_count FROM test.thread_summary "
+                 "INNER JOIN test.threads ON threads.id=thread_summary.thread_id "
+                 "LEFT JOIN test.messages AS m ON m.id=thread_summary.last_message_id "
+                 ");",
+                 history_db_get_int (db, "SELECT COUNT(*) FROM main.thread_summary;"),
+                 history_db_get_int (db, "SELECT COUNT(*) FROM test.thread_summary;"));
 }
 
 static void
@@ -508,11 +668,11 @@ test_history_new (void)
   g_assert_false (g_file_test (file_name, G_FILE_TEST_EXISTS));
 
   history = chatty_history_new ();
-  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
   g_assert_true (g_file_test (file_name, G_FILE_TEST_IS_REGULAR));
   g_assert_false (chatty_history_is_closed (history));
 
-  chatty_history_close (history);
+  history_close_sync (history);
   g_assert_true (chatty_history_is_closed (history));
   g_assert_finalize_object (history);
 }
@@ -545,7 +705,7 @@ add_message (ChattyHistory      *history,
     uid = g_strdup (uuid);
 
   msg = new_message (account, who, message, uid, direction, when, type, room);
-  success = chatty_history_add_message (history, msg->chat, msg->message);
+  success = history_add_message_sync (history, msg->chat, msg->message);
   g_assert_true (success);
   g_assert_nonnull (uid);
   g_ptr_array_add (test_msg_array, msg);
@@ -563,17 +723,17 @@ add_message (ChattyHistory      *history,
   g_assert_cmpint (test_msg_array->len, ==, msg_array->len);
 
   if (!chatty_chat_is_im (msg->chat)) {
-    g_assert_true (chatty_history_chat_exists (history, account, room));
+    g_assert_true (history_chat_exists_sync (history, account, room));
 
-    time_stamp = chatty_history_get_chat_timestamp (history, uid, room);
+    time_stamp = history_get_chat_timestamp_sync (history, uid, room);
     g_assert_cmpint (when, ==, time_stamp);
 
-    time_stamp = chatty_history_get_last_message_time (history, account, room);
+    time_stamp = history_get_last_message_time_sync (history, account, room);
     g_assert_cmpint (when, ==, time_stamp);
   } else {
-    g_assert_true (chatty_history_im_exists (history, account, who));
+    g_assert_true (history_im_exists_sync (history, account, who));
 
-    time_stamp = chatty_history_get_im_timestamp (history, uid, account);
+    time_stamp = history_get_im_timestamp_sync (history, uid, account);
     g_assert_cmpint (when, ==, time_stamp);
   }
 
@@ -592,18 +752,18 @@ delete_existing_chat (ChattyHistory *history,
   gboolean status;
 
   if (is_im)
-    status = chatty_history_im_exists (history, account, chat_name);
+    status = history_im_exists_sync (history, account, chat_name);
   else
-    status = chatty_history_chat_exists (history, account, chat_name);
+    status = history_chat_exists_sync (history, account, chat_name);
   g_assert_true (status);
 
   chat = chatty_chat_new (account, chat_name, is_im);
-  chatty_history_delete_chat (history, chat);
+  history_delete_chat_sync (history, chat);
 
   if (is_im)
-    status = chatty_history_im_exists (history, account, chat_name);
+    status = history_im_exists_sync (history, account, chat_name);
   else
-    status = chatty_history_chat_exists (history, account, chat_name);
+    status = history_chat_exists_sync (history, account, chat_name);
   g_assert_false (status);
 }
 
@@ -699,7 +859,7 @@ add_chatty_message (ChattyHistory      *history,
     g_autofree char *draft = NULL;
 
     task = g_task_new (NULL, NULL, NULL, NULL);
-    chatty_history_get_draft_async (history, chat, finish_pointer_cb, task);
+    chatty_history_get_draft_async (history, chat, NULL, finish_pointer_cb, task);
 
     while (!g_task_get_completed (task))
       g_main_context_iteration (NULL, TRUE);
@@ -717,12 +877,13 @@ test_history_message (void)
   ChattyChat *chat;
   GPtrArray *msg_array;
   const char *account, *who;
+  guint hits, misses;
   int when;
 
   g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
 
   history = chatty_history_new ();
-  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
   g_assert_false (chatty_history_is_closed (history));
 
   msg_array = g_ptr_array_new ();
@@ -768,7 +929,12 @@ test_history_message (void)
   add_chatty_message (history, chat, msg_array, "yet another draft", when + 2,
                       CHATTY_MESSAGE_HTML_ESCAPED, CHATTY_DIRECTION_OUT, CHATTY_STATUS_DRAFT);
 
-  chatty_history_close (history);
+  /* Statements should be compiled once and reused afterwards */
+  chatty_history_get_statement_stats (history, &hits, &misses);
+  g_assert_cmpuint (misses, >, 0);
+  g_assert_cmpuint (hits, >, misses);
+
+  history_close_sync (history);
 
   while (!chatty_history_is_closed (history));
 
@@ -788,7 +954,7 @@ test_history_raw_message (void)
   g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
 
   history = chatty_history_new ();
-  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
 
   /* Test chat message */
   msg_array = g_ptr_array_new ();
@@ -797,8 +963,8 @@ test_history_raw_message (void)
   account = "account@test";
   who = "buddy@test";
   room = "chatroom@test";
-  g_assert_false (chatty_history_im_exists (history, account, who));
-  g_assert_false (chatty_history_chat_exists (history, account, room));
+  g_assert_false (history_im_exists_sync (history, account, who));
+  g_assert_false (history_chat_exists_sync (history, account, room));
 
   uuid = g_uuid_string_random ();
   when = time (NULL);
@@ -827,12 +993,12 @@ test_history_raw_message (void)
   room = NULL;
   uuid = NULL;
 
-  chatty_history_close (history);
+  history_close_sync (history);
   g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
   g_object_unref (history);
 
   history = chatty_history_new ();
-  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
   /* history = chatty_history_get_default (); */
 
   msg_array = g_ptr_array_new ();
@@ -926,7 +1092,7 @@ test_history_raw_message (void)
   delete_existing_chat (history, account, "room@test", FALSE);
   delete_existing_chat (history, account, "another@test", FALSE);
 
-  chatty_history_close (history);
+  history_close_sync (history);
   g_object_unref (history);
 }
 
@@ -971,7 +1137,7 @@ test_value (ChattyHistory *history,
     chatty_contact_set_value (contact, who);
     chat_message = chatty_message_new (CHATTY_ITEM (contact), message, uuid, time_stamp,
                                        CHATTY_MESSAGE_TEXT, chat_direction, 0);
-    success = chatty_history_add_message (history, chat, chat_message);
+    success = history_add_message_sync (history, chat, chat_message);
     g_assert_true (success);
   }
 
@@ -1005,8 +1171,9 @@ static void
 test_history_db (void)
 {
   g_autoptr(ChattyHistory) history = NULL;
-  const char *file_name, *account, *who, *message, *room;
+  const char *file_name, *archive_name, *account, *who, *message, *room;
   const char *statement;
+  sqlite3_stmt *stmt;
   sqlite3 *db;
   int status;
 
@@ -1015,12 +1182,30 @@ test_history_db (void)
   g_assert_false (g_file_test (file_name, G_FILE_TEST_IS_REGULAR));
 
   history = chatty_history_new ();
-  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
   g_assert_true (g_file_test (file_name, G_FILE_TEST_IS_REGULAR));
 
   status = sqlite3_open (file_name, &db);
   g_assert_cmpint (status, ==, SQLITE_OK);
 
+  /* The default durability profile uses write-ahead logging */
+  sqlite3_prepare_v2 (db, "PRAGMA journal_mode;", -1, &stmt, NULL);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpstr ((const char *)sqlite3_column_text (stmt, 0), ==, "wal");
+  sqlite3_finalize (stmt);
+
+  /* And so does the archive */
+  archive_name = g_test_get_filename (G_TEST_BUILT, "test-history-archive.db", NULL);
+  sqlite3_prepare_v2 (db, "ATTACH DATABASE ? AS archive;", -1, &stmt, NULL);
+  sqlite3_bind_text (stmt, 1, archive_name, -1, SQLITE_STATIC);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_DONE);
+  sqlite3_finalize (stmt);
+  sqlite3_prepare_v2 (db, "PRAGMA archive.journal_mode;", -1, &stmt, NULL);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpstr ((const char *)sqlite3_column_text (stmt, 0), ==, "wal");
+  sqlite3_finalize (stmt);
+  sqlite3_exec (db, "DETACH DATABASE archive;", NULL, NULL, NULL);
+
   account = "account@test";
   who = "buddy@test";
   message = "Random messsage";
@@ -1043,7 +1228,1631 @@ test_history_db (void)
   test_value (history, db, statement, SQLITE_ROW, 4, 1, account, who, message, room);
 
   sqlite3_close (db);
-  chatty_history_close (history);
+  history_close_sync (history);
+}
+
+static void
+add_chatty_messages (ChattyHistory *history,
+                     ChattyChat    *chat,
+                     GPtrArray     *messages)
+{
+  GTask *task;
+  gboolean success;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chat, messages, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  success = g_task_propagate_boolean (task, NULL);
+  g_assert_true (success);
+  g_assert_finalize_object (task);
+}
+
+static void
+test_history_messages_batch (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  const char *senders[] = {"alice@example.org", "bob@example.org", "carol@example.org"};
+  const char *account, *room;
+  GTask *task;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  account = "test-account@example.com";
+  room = "room@conference.example.org";
+  chat = chatty_chat_new (account, room, FALSE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  /* An empty batch is a no-op */
+  msg_array = g_ptr_array_new_full (300, g_object_unref);
+  add_chatty_messages (history, chat, msg_array);
+
+  when = time (NULL);
+  for (guint i = 0; i < 300; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+    ChattyMsgDirection direction;
+    const char *who;
+
+    direction = i % 4 ? CHATTY_DIRECTION_IN : CHATTY_DIRECTION_OUT;
+    who = direction == CHATTY_DIRECTION_IN ? senders[i % G_N_ELEMENTS (senders)] : account;
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, who);
+    chatty_contact_set_value (contact, who);
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Message %u", i);
+    g_ptr_array_add (msg_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when + i / 3,
+                                         CHATTY_MESSAGE_TEXT, direction, 0));
+  }
+
+  add_chatty_messages (history, chat, msg_array);
+  /* Adding the same messages again shouldn't duplicate them */
+  add_chatty_messages (history, chat, msg_array);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, NULL, msg_array->len + 10,
+                                     finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  messages = g_task_propagate_pointer (task, NULL);
+  g_assert_finalize_object (task);
+
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, msg_array->len);
+
+  for (guint i = 0; i < msg_array->len; i++)
+    compare_chat_message (msg_array->pdata[i], messages->pdata[i]);
+
+  g_clear_pointer (&messages, g_ptr_array_unref);
+  history_close_sync (history);
+}
+
+static void
+test_history_same_time (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyContact) contact = NULL;
+  ChattyMessage *start = NULL;
+  const char *account, *who;
+  guint loaded = 0, n_pages = 0;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  account = "test-account@example.com";
+  who = "alice@example.org";
+  chat = chatty_chat_new (account, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, who);
+  chatty_contact_set_value (contact, who);
+
+  /* A few older messages, then thousands sharing one timestamp */
+  msg_array = g_ptr_array_new_full (3010, g_object_unref);
+  when = time (NULL);
+
+  for (guint i = 0; i < 3010; i++) {
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Message %u", i);
+    g_ptr_array_add (msg_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid,
+                                         i < 10 ? when - 10 + i : when,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  add_chatty_messages (history, chat, msg_array);
+
+  /* Page back from the latest message, as the chat view does */
+  do {
+    g_autoptr(GPtrArray) messages = NULL;
+    g_autoptr(GTask) task = NULL;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    chatty_history_get_messages_async (history, chat, start, 100,
+                                       finish_pointer_cb, task);
+    wait_for_task (task);
+    messages = g_task_propagate_pointer (task, NULL);
+
+    if (!messages)
+      break;
+
+    /* Every page but the last one is full */
+    n_pages++;
+    g_assert_cmpint (messages->len, <=, 100);
+    g_assert_true (messages->len == 100 || loaded + messages->len == msg_array->len);
+
+    for (guint i = 0; i < messages->len; i++)
+      compare_chat_message (msg_array->pdata[msg_array->len - loaded - messages->len + i],
+                            messages->pdata[i]);
+
+    loaded += messages->len;
+    start = msg_array->pdata[msg_array->len - loaded];
+  } while (loaded < msg_array->len);
+
+  g_assert_cmpint (loaded, ==, msg_array->len);
+  g_assert_cmpint (n_pages, ==, 31);
+
+  /* Nothing is before the first message */
+  {
+    g_autoptr(GTask) task = NULL;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    chatty_history_get_messages_async (history, chat, msg_array->pdata[0], 100,
+                                       finish_pointer_cb, task);
+    wait_for_task (task);
+    g_assert_null (g_task_propagate_pointer (task, NULL));
+  }
+
+  history_close_sync (history);
+}
+
+static void
+history_set_last_read_msg_sync (ChattyHistory *history,
+                                ChattyChat    *chat,
+                                ChattyMessage *message)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_set_last_read_msg_async (history, chat, message, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+/*
+ * Loading the chat list is on the startup path, so this also
+ * works as a benchmark: run with '-m perf' to time it against
+ * a few thousand threads.
+ */
+static void
+test_history_chats (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyMmAccount) account = NULL;
+  g_autoptr(GPtrArray) threads = NULL;
+  g_autoptr(GHashTable) expected = NULL;
+  GTask *task;
+  guint n_threads, n_messages;
+  int when;
+
+  n_threads = g_test_perf () ? 2000 : 20;
+  n_messages = g_test_perf () ? 50 : 6;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history-chats.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history-chats.db");
+  account = chatty_mm_account_new ();
+  expected = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+
+  when = time (NULL) - n_messages;
+  for (guint i = 0; i < n_threads; i++) {
+    g_autoptr(GPtrArray) msg_array = NULL;
+    g_autoptr(GPtrArray) members = NULL;
+    g_autofree char *number = NULL;
+    ChattyChat *chat;
+    ChattyMessage *last;
+
+    number = g_strdup_printf ("+1555%07u", i);
+    chat = (ChattyChat *)chatty_mm_chat_new (number, NULL, CHATTY_PROTOCOL_MMS_SMS, TRUE,
+                                             CHATTY_ITEM_VISIBLE);
+    members = g_ptr_array_new_full (1, g_object_unref);
+    g_ptr_array_add (members, chatty_mm_buddy_new (number, NULL));
+    chatty_mm_chat_add_users (CHATTY_MM_CHAT (chat), members);
+    g_hash_table_insert (expected, (gpointer)chatty_chat_get_chat_name (chat), chat);
+
+    msg_array = g_ptr_array_new_full (n_messages, g_object_unref);
+    for (guint j = 0; j < n_messages; j++) {
+      g_autoptr(ChattyContact) contact = NULL;
+      g_autofree char *uuid = NULL;
+      g_autofree char *text = NULL;
+      ChattyMessage *message;
+
+      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+      chatty_contact_set_name (contact, number);
+      chatty_contact_set_value (contact, number);
+
+      uuid = g_uuid_string_random ();
+      text = g_strdup_printf ("Message %u", j);
+      /* The last two messages share the same timestamp */
+      message = chatty_message_new (CHATTY_ITEM (contact), text, uuid,
+                                    when + MIN (j, n_messages - 2),
+                                    CHATTY_MESSAGE_TEXT,
+                                    j % 2 ? CHATTY_DIRECTION_OUT : CHATTY_DIRECTION_IN, 0);
+
+      /* Attach files to the last message of every other thread */
+      if (i % 2 && j == n_messages - 1) {
+        GList *files = NULL;
+
+        files = g_list_append (files, chatty_file_new_full ("a.png", "https://example.com/a.png", NULL,
+                                                            "image/png", 100, 640, 480, 0));
+        files = g_list_append (files, chatty_file_new_full ("b.ogg", "https://example.com/b.ogg", NULL,
+                                                            "audio/ogg", 2000, 0, 0, 30));
+        chatty_message_set_files (message, files);
+      }
+
+      g_ptr_array_add (msg_array, message);
+    }
+
+    add_chatty_messages (history, chat, msg_array);
+
+    /* Only the last message of every third thread is unread */
+    last = msg_array->pdata[i % 3 ? 0 : n_messages - 1];
+    history_set_last_read_msg_sync (history, chat, last);
+    g_object_set_data_full (G_OBJECT (chat), "last", g_object_ref (msg_array->pdata[n_messages - 1]),
+                            g_object_unref);
+    g_object_set_data (G_OBJECT (chat), "unread", GUINT_TO_POINTER (i % 3 ? n_messages : 1));
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_test_timer_start ();
+  chatty_history_get_chats_async (history, CHATTY_ACCOUNT (account), finish_pointer_cb, task);
+  wait_for_task (task);
+  g_test_minimized_result (g_test_timer_elapsed (), "Loaded %u chats in %f seconds",
+                           n_threads, g_test_timer_last ());
+
+  threads = g_task_propagate_pointer (task, NULL);
+  g_assert_finalize_object (task);
+
+  g_assert_nonnull (threads);
+  g_assert_cmpint (threads->len, ==, n_threads);
+
+  for (guint i = 0; i < threads->len; i++) {
+    ChattyChat *chat, *old_chat;
+    ChattyMessage *message, *last;
+    GListModel *model;
+    GList *files, *old_files;
+
+    chat = threads->pdata[i];
+    g_assert_true (CHATTY_IS_MM_CHAT (chat));
+    old_chat = g_hash_table_lookup (expected, chatty_chat_get_chat_name (chat));
+    g_assert_nonnull (old_chat);
+
+    g_assert_cmpint (chatty_chat_get_unread_count (chat), ==,
+                     GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (old_chat), "unread")));
+
+    model = chatty_chat_get_messages (chat);
+    g_assert_cmpint (g_list_model_get_n_items (model), ==, 1);
+    message = g_list_model_get_item (model, 0);
+    last = g_object_get_data (G_OBJECT (old_chat), "last");
+    compare_chat_message (last, message);
+
+    files = chatty_message_get_files (message);
+    old_files = chatty_message_get_files (last);
+    g_assert_cmpint (g_list_length (files), ==, g_list_length (old_files));
+    for (; files; files = files->next, old_files = old_files->next)
+      compare_file (files->data, old_files->data);
+    g_object_unref (message);
+
+    model = chatty_chat_get_users (chat);
+    g_assert_cmpint (g_list_model_get_n_items (model), ==, 1);
+    {
+      g_autoptr(ChattyMmBuddy) buddy = NULL;
+
+      buddy = g_list_model_get_item (model, 0);
+      g_assert_cmpstr (chatty_mm_buddy_get_number (buddy), ==, chatty_chat_get_chat_name (chat));
+    }
+  }
+
+  history_close_sync (history);
+}
+
+static void
+test_history_ids (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GTask) task = NULL;
+  const char *account, *who;
+  guint cached;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_cmpint (history->ids_lru.length, ==, 0);
+
+  msg_array = g_ptr_array_new_full (10, g_object_unref);
+  account = "test-account@example.com";
+  who = "buddy@example.org";
+  chat = chatty_chat_new (account, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  when = time (NULL);
+  add_chatty_message (history, chat, msg_array, "Hello", when,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0);
+  cached = history->ids_lru.length;
+  g_assert_cmpint (cached, >, 0);
+
+  /* The same chat and sender resolve to the cached ids */
+  add_chatty_message (history, chat, msg_array, "Hi", when + 1,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  add_chatty_message (history, chat, msg_array, "How are you?", when + 2,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0);
+  g_assert_cmpint (history->ids_lru.length, <=, cached + 1);
+
+  /* The thread id shouldn't be used once the chat is deleted */
+  history_delete_chat_sync (history, chat);
+  g_assert_cmpint (history->ids_lru.length, ==, 0);
+
+  g_ptr_array_set_size (msg_array, 0);
+  add_chatty_message (history, chat, msg_array, "Hello again", when + 3,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, NULL, 10, finish_pointer_cb, task);
+  wait_for_task (task);
+  messages = g_task_propagate_pointer (task, NULL);
+
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 1);
+  compare_chat_message (msg_array->pdata[0], messages->pdata[0]);
+
+  history_close_sync (history);
+  g_assert_cmpint (history->ids_lru.length, ==, 0);
+}
+
+static void
+history_run_maintenance (ChattyHistory *self,
+                         GTask         *task)
+{
+  while (history_maintain (self))
+    ;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+history_maintain_sync (ChattyHistory *history)
+{
+  g_autoptr(GTask) task = NULL;
+  GTask *worker_task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  worker_task = g_task_new (history, NULL, finish_bool_cb, task);
+  g_task_set_task_data (worker_task, history_run_maintenance, NULL);
+  history_push (history, worker_task, HISTORY_PRIORITY_IDLE);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+test_history_maintenance (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *body = NULL;
+  char *local_files[2];
+  ChattyChat *chats[2];
+  sqlite3 *db;
+  int when;
+
+  path = g_test_build_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (path);
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  /* Large enough for the messages of a chat to fill several pages */
+  body = g_strnfill (1000, 'a');
+  when = time (NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (chats); i++) {
+    g_autoptr(GPtrArray) msg_array = NULL;
+    g_autoptr(GPtrArray) members = NULL;
+    g_autofree char *number = NULL;
+
+    number = g_strdup_printf ("+1555%07u", i);
+    chats[i] = (ChattyChat *)chatty_mm_chat_new (number, NULL, CHATTY_PROTOCOL_MMS_SMS, TRUE,
+                                                 CHATTY_ITEM_VISIBLE);
+    members = g_ptr_array_new_full (1, g_object_unref);
+    g_ptr_array_add (members, chatty_mm_buddy_new (number, NULL));
+    chatty_mm_chat_add_users (CHATTY_MM_CHAT (chats[i]), members);
+
+    msg_array = g_ptr_array_new_full (100, g_object_unref);
+
+    for (guint j = 0; j < 100; j++) {
+      g_autoptr(ChattyContact) contact = NULL;
+      g_autofree char *uuid = NULL;
+      g_autofree char *url = NULL;
+      ChattyMessage *message;
+      GList *files = NULL;
+
+      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+      chatty_contact_set_name (contact, number);
+      chatty_contact_set_value (contact, number);
+
+      uuid = g_uuid_string_random ();
+      message = chatty_message_new (CHATTY_ITEM (contact), body, uuid, when + j,
+                                    CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+
+      /* The first file of each chat is the same */
+      if (j == 0)
+        url = g_strdup ("https://example.com/shared.png");
+      else
+        url = g_strdup_printf ("https://example.com/%s.png", uuid);
+
+      /* The second file of each chat has a local copy */
+      if (j == 1) {
+        g_autofree char *local_path = NULL;
+        g_autofree char *local_dir = NULL;
+
+        local_path = g_strdup_printf ("mms/test-%u/a.png", i);
+        local_files[i] = g_build_filename (g_get_user_data_dir (), "chatty", local_path, NULL);
+        local_dir = g_path_get_dirname (local_files[i]);
+        g_assert_cmpint (g_mkdir_with_parents (local_dir, S_IRWXU), ==, 0);
+        g_assert_true (g_file_set_contents (local_files[i], "png", -1, NULL));
+        files = g_list_append (files, chatty_file_new_full ("a.png", url, local_path,
+                                                            "image/png", 100, 640, 480, 0));
+      } else {
+        files = g_list_append (files, chatty_file_new_full ("a.png", url, NULL,
+                                                            "image/png", 100, 640, 480, 0));
+      }
+
+      chatty_message_set_files (message, files);
+      g_ptr_array_add (msg_array, message);
+    }
+
+    add_chatty_messages (history, chats[i], msg_array);
+  }
+
+  history_delete_chat_sync (history, chats[0]);
+  history_maintain_sync (history);
+
+  g_assert_cmpint (history->maintenance, ==, HISTORY_MAINTENANCE_NONE);
+  /* The local copy of files no longer referred to are deleted too */
+  g_assert_false (g_file_test (local_files[0], G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (local_files[1], G_FILE_TEST_EXISTS));
+
+  history_close_sync (history);
+
+  g_assert_cmpint (sqlite3_open (path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, SQLITE_AUTOVACUUM_INCREMENTAL);
+  g_assert_cmpint (history_db_get_int (db, "PRAGMA freelist_count;"), ==, 0);
+  /* Only the files of the chat left, including the shared one */
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM files;"), ==, 100);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM file_metadata;"), ==, 100);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM files "
+                                           "WHERE url='https://example.com/shared.png';"), ==, 1);
+  sqlite3_close (db);
+
+  for (guint i = 0; i < G_N_ELEMENTS (chats); i++) {
+    g_object_unref (chats[i]);
+    g_free (local_files[i]);
+  }
+}
+
+static GPtrArray *
+history_get_messages_sync (ChattyHistory *history,
+                           ChattyChat    *chat,
+                           ChattyMessage *start,
+                           guint          limit)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, start, limit, finish_pointer_cb, task);
+  wait_for_task (task);
+
+  return g_task_propagate_pointer (task, NULL);
+}
+
+static GPtrArray *
+search_messages (ChattyHistory *history,
+                 const char    *query,
+                 ChattyAccount *account,
+                 guint          limit,
+                 guint          offset)
+{
+  GPtrArray *messages;
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_search_async (history, query, account, limit, offset, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  messages = g_task_propagate_pointer (task, NULL);
+  g_assert_finalize_object (task);
+
+  return messages;
+}
+
+static void
+test_history_archive (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) unread_array = NULL;
+  g_autoptr(GPtrArray) matches = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) unread_chat = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *archive_path = NULL;
+  ChattyMessage *start = NULL;
+  sqlite3 *db;
+  guint n_messages;
+  int when;
+
+  path = g_test_build_filename (G_TEST_BUILT, "test-history.db", NULL);
+  archive_path = g_test_build_filename (G_TEST_BUILT, "test-history-archive.db", NULL);
+  g_remove (path);
+  g_remove (archive_path);
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_cmpstr (history->archive_path, ==, archive_path);
+  history->hot_messages = 10;
+
+  chat = chatty_chat_new ("test-account@example.com", "bob@example.org", TRUE);
+  msg_array = g_ptr_array_new_full (50, g_object_unref);
+  when = time (NULL) - 50;
+
+  for (guint i = 0; i < 50; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "bob@example.org");
+    chatty_contact_set_value (contact, "bob@example.org");
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Message %u", i);
+    /* Pairs of messages share the same timestamp */
+    g_ptr_array_add (msg_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when + i / 2,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  add_chatty_messages (history, chat, msg_array);
+  history_set_last_read_msg_sync (history, chat, msg_array->pdata[49]);
+
+  /* A chat never marked read is archived too */
+  unread_chat = chatty_chat_new ("test-account@example.com", "carol@example.org", TRUE);
+  unread_array = g_ptr_array_new_full (30, g_object_unref);
+
+  for (guint i = 0; i < 30; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "carol@example.org");
+    chatty_contact_set_value (contact, "carol@example.org");
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Unread message %u", i);
+    g_ptr_array_add (unread_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when + i,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  add_chatty_messages (history, unread_chat, unread_array);
+  g_assert_cmpint (history->archive_max_time, ==, 0);
+
+  history_maintain_sync (history);
+  g_assert_cmpint (history->archive_max_time, >=, when + 19);
+
+  /* Archived messages can still be searched */
+  matches = search_messages (history, "message 0", NULL, 10, 0);
+  g_assert_nonnull (matches);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_clear_pointer (&matches, g_ptr_array_unref);
+  matches = search_messages (history, "message 49", NULL, 10, 0);
+  g_assert_nonnull (matches);
+  g_assert_cmpint (matches->len, ==, 1);
+  compare_chat_message (msg_array->pdata[49], matches->pdata[0]);
+  g_clear_pointer (&matches, g_ptr_array_unref);
+
+  /* Storing an archived message again updates it in the archive */
+  chatty_message_set_status (msg_array->pdata[0], CHATTY_STATUS_DELIVERED, 0);
+  g_assert_true (history_add_message_sync (history, chat, msg_array->pdata[0]));
+
+  /* Pages span both databases */
+  n_messages = msg_array->len;
+  while (TRUE) {
+    g_autoptr(GPtrArray) messages = NULL;
+
+    messages = history_get_messages_sync (history, chat, start, 15);
+
+    if (!messages)
+      break;
+
+    g_assert_cmpint (messages->len, <=, 15);
+    g_assert_cmpint (messages->len, <=, n_messages);
+
+    for (guint i = 0; i < messages->len; i++) {
+      ChattyMessage *expected = msg_array->pdata[n_messages - messages->len + i];
+
+      compare_chat_message (expected, messages->pdata[i]);
+    }
+
+    n_messages -= messages->len;
+    start = msg_array->pdata[n_messages];
+  }
+  g_assert_cmpint (n_messages, ==, 0);
+
+  history_close_sync (history);
+
+  g_assert_cmpint (sqlite3_open (path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 20);
+  sqlite3_close (db);
+
+  g_assert_cmpint (sqlite3_open (archive_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 60);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages "
+                                           "WHERE status IS NOT NULL;"), ==, 1);
+  sqlite3_close (db);
+
+  /* Deleting the chat deletes its archived messages too */
+  g_clear_object (&history);
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_cmpint (history->archive_max_time, >=, when + 19);
+
+  /* If the thread can't be deleted, its archived messages are kept */
+  g_assert_cmpint (sqlite3_open (path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db,
+                                 "CREATE TRIGGER test_fail_delete BEFORE DELETE ON threads "
+                                 "BEGIN SELECT RAISE(ABORT,'test'); END;",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_delete_chat_async (history, chat, finish_error_cb, task);
+  wait_for_task (task);
+  g_assert_false (g_task_propagate_boolean (task, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&error);
+  g_clear_object (&task);
+  g_assert_cmpint (sqlite3_exec (db, "DROP TRIGGER test_fail_delete;",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+
+  g_assert_cmpint (sqlite3_open (archive_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 60);
+  sqlite3_close (db);
+
+  history_delete_chat_sync (history, chat);
+
+  /* Including from the full text index */
+  matches = search_messages (history, "message 0", NULL, 10, 0);
+  g_assert_nonnull (matches);
+  g_assert_cmpint (matches->len, ==, 1);
+  compare_chat_message (unread_array->pdata[0], matches->pdata[0]);
+  g_clear_pointer (&matches, g_ptr_array_unref);
+
+  history_close_sync (history);
+
+  g_assert_cmpint (sqlite3_open (archive_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 20);
+  sqlite3_close (db);
+}
+
+static void
+history_export_sync (ChattyHistory *history,
+                     GFile         *file,
+                     gboolean       compress)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_export_async (history, file, compress, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+history_import_sync (ChattyHistory *history,
+                     GFile         *file)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_import_async (history, file, finish_bool_cb, task);
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+test_history_export (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GFile) compressed = NULL;
+  g_autoptr(GFile) plain = NULL;
+  g_autoptr(GFile) malformed = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *import_path = NULL;
+  g_autofree char *content = NULL;
+  const char *texts[] = {"Hello\tworld", "Line 1\nLine 2\r\n", "C:\\path\\N", "\\N", "Plain"};
+  sqlite3 *db;
+  gsize length;
+  int when;
+
+  path = g_test_build_filename (G_TEST_BUILT, "test-history.db", NULL);
+  import_path = g_test_build_filename (G_TEST_BUILT, "test-history-import.db", NULL);
+  g_remove (path);
+  g_remove (import_path);
+  compressed = g_file_new_build_filename (g_test_get_dir (G_TEST_BUILT), "test-history-export.gz", NULL);
+  plain = g_file_new_build_filename (g_test_get_dir (G_TEST_BUILT), "test-history-export.txt", NULL);
+  malformed = g_file_new_build_filename (g_test_get_dir (G_TEST_BUILT), "test-history-malformed.txt", NULL);
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  chat = chatty_chat_new ("test-account@example.com", "bob@example.org", TRUE);
+  msg_array = g_ptr_array_new_full (20, g_object_unref);
+  when = time (NULL) - 20;
+
+  for (guint i = 0; i < 20; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    ChattyMessage *message;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "bob@example.org");
+    chatty_contact_set_value (contact, "bob@example.org");
+
+    uuid = g_uuid_string_random ();
+    /* Text that has to be escaped */
+    message = chatty_message_new (CHATTY_ITEM (contact), texts[i % G_N_ELEMENTS (texts)], uuid,
+                                  when + i, CHATTY_MESSAGE_TEXT,
+                                  i % 2 ? CHATTY_DIRECTION_OUT : CHATTY_DIRECTION_IN, 0);
+
+    if (i % 4 == 0) {
+      g_autofree char *url = NULL;
+      GList *files = NULL;
+
+      url = g_strdup_printf ("https://example.com/%u.png", i);
+      files = g_list_append (files, chatty_file_new_full ("a.png", url, NULL,
+                                                          "image/png", 100, 640, 480, 0));
+      files = g_list_append (files, chatty_file_new_full ("b.ogg", "https://example.com/b.ogg", NULL,
+                                                          "audio/ogg", 2000, 0, 0, 30));
+      chatty_message_set_files (message, files);
+    }
+
+    g_ptr_array_add (msg_array, message);
+  }
+
+  add_chatty_messages (history, chat, msg_array);
+  history_set_last_read_msg_sync (history, chat, msg_array->pdata[15]);
+
+  history_export_sync (history, compressed, TRUE);
+  history_export_sync (history, plain, FALSE);
+  history_close_sync (history);
+  g_clear_object (&history);
+
+  g_assert_true (g_file_load_contents (plain, NULL, &content, &length, NULL, NULL));
+  g_assert_true (g_str_has_prefix (content, "chatty-history\t1\n"));
+  g_clear_pointer (&content, g_free);
+
+  g_assert_true (g_file_load_contents (compressed, NULL, &content, &length, NULL, NULL));
+  g_assert_cmpint (length, >, 2);
+  g_assert_cmpint ((guchar)content[0], ==, 0x1f);
+  g_assert_cmpint ((guchar)content[1], ==, 0x8b);
+  g_clear_pointer (&content, g_free);
+
+  /* A message with a field too many */
+  g_assert_true (g_file_load_contents (plain, NULL, &content, &length, NULL, NULL));
+  lines = g_strsplit (content, "\n", -1);
+  g_clear_pointer (&content, g_free);
+
+  for (guint i = 0; lines[i]; i++) {
+    if (g_str_has_prefix (lines[i], "M\t")) {
+      char *line = lines[i];
+
+      lines[i] = g_strconcat (line, "\textra", NULL);
+      g_free (line);
+      break;
+    }
+  }
+
+  content = g_strjoinv ("\n", lines);
+  g_assert_true (g_file_replace_contents (malformed, content, strlen (content), NULL, FALSE,
+                                          G_FILE_CREATE_NONE, NULL, NULL, NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history-import.db");
+
+  /* Malformed records are rejected, not truncated */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_import_async (history, malformed, finish_error_cb, task);
+  wait_for_task (task);
+  g_assert_false (g_task_propagate_boolean (task, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+
+  history_import_sync (history, compressed);
+  /* Importing again adds nothing */
+  history_import_sync (history, plain);
+
+  messages = history_get_messages_sync (history, chat, NULL, 100);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, msg_array->len);
+
+  for (guint i = 0; i < messages->len; i++) {
+    compare_chat_message (msg_array->pdata[i], messages->pdata[i]);
+    g_assert_cmpint (g_list_length (chatty_message_get_files (messages->pdata[i])), ==,
+                     g_list_length (chatty_message_get_files (msg_array->pdata[i])));
+  }
+
+  history_close_sync (history);
+
+  g_assert_cmpint (sqlite3_open (import_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 20);
+  /* The shared file is imported once */
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM files;"), ==, 6);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM message_files;"), ==, 10);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM file_metadata;"), ==, 6);
+  /* The indexes, triggers and summary are back */
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM sqlite_master "
+                                           "WHERE name='messages_thread_time_idx' "
+                                           "OR name='messages_fts_insert';"), ==, 2);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages_fts "
+                                           "WHERE messages_fts MATCH 'world';"), ==, 4);
+  g_assert_cmpint (history_db_get_int (db, "SELECT unread_count FROM thread_summary;"), ==, 5);
+  sqlite3_close (db);
+
+  g_file_delete (compressed, NULL, NULL);
+  g_file_delete (plain, NULL, NULL);
+  g_file_delete (malformed, NULL, NULL);
+}
+
+static GTask *
+queue_task_new (GCancellable *cancellable,
+                guint         id)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, cancellable, NULL, NULL);
+  g_object_set_data (G_OBJECT (task), "id", GUINT_TO_POINTER (id));
+
+  return task;
+}
+
+static guint
+queue_pop_id (HistoryQueue *queue)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = history_queue_pop (queue, 0);
+
+  if (!task)
+    return 0;
+
+  return GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "id"));
+}
+
+static void
+test_history_queue (void)
+{
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GTask) cancelled = NULL;
+  HistoryQueue *queue;
+  guint seq;
+
+  queue = history_queue_new ();
+  cancellable = g_cancellable_new ();
+  cancelled = queue_task_new (cancellable, 5);
+
+  g_assert_null (history_queue_pop (queue, 0));
+
+  history_queue_push (queue, queue_task_new (NULL, 1), HISTORY_PRIORITY_IDLE);
+  history_queue_push (queue, queue_task_new (NULL, 2), HISTORY_PRIORITY_WRITE);
+  seq = history_queue_push (queue, queue_task_new (NULL, 3), HISTORY_PRIORITY_WRITE);
+  history_queue_push (queue, queue_task_new (NULL, 4), HISTORY_PRIORITY_UI);
+  history_queue_push (queue, g_object_ref (cancelled), HISTORY_PRIORITY_WRITE);
+  history_queue_push (queue, queue_task_new (NULL, 6), HISTORY_PRIORITY_UI);
+  history_queue_push (queue, queue_task_new (NULL, 7), HISTORY_PRIORITY_OPEN);
+  g_assert_cmpint (history_queue_get_last_seq (queue), ==, 7);
+
+  g_cancellable_cancel (cancellable);
+
+  /* Opening goes before everything queued before */
+  g_assert_cmpint (queue_pop_id (queue), ==, 7);
+  history_queue_task_done (queue);
+
+  /* Then UI tasks, in the order queued */
+  g_assert_cmpint (queue_pop_id (queue), ==, 4);
+  g_assert_true (history_queue_has_pending (queue, seq, HISTORY_PRIORITY_WRITE));
+  g_assert_false (history_queue_has_pending (queue, seq, HISTORY_PRIORITY_UI));
+  history_queue_task_done (queue);
+
+  g_assert_cmpint (queue_pop_id (queue), ==, 6);
+  history_queue_task_done (queue);
+  g_assert_cmpint (queue_pop_id (queue), ==, 2);
+  history_queue_task_done (queue);
+
+  /* The running task is still pending */
+  g_assert_cmpint (queue_pop_id (queue), ==, 3);
+  g_assert_true (history_queue_has_pending (queue, seq, HISTORY_PRIORITY_WRITE));
+  history_queue_task_done (queue);
+  g_assert_false (history_queue_has_pending (queue, seq, HISTORY_PRIORITY_WRITE));
+  history_queue_wait (queue, seq, HISTORY_PRIORITY_WRITE);
+
+  /* Cancelled tasks are never run, but complete with an error */
+  g_assert_cmpint (queue_pop_id (queue), ==, 1);
+  history_queue_task_done (queue);
+  g_assert_null (history_queue_pop (queue, 0));
+  g_assert_cmpint (queue->dropped, ==, 1);
+
+  wait_for_task (cancelled);
+  g_assert_true (g_task_had_error (cancelled));
+  g_assert_false (g_task_propagate_boolean (cancelled, NULL));
+
+  /* Don't wait for tasks that will never run once closed */
+  history_queue_push (queue, queue_task_new (NULL, 8), HISTORY_PRIORITY_WRITE);
+  history_queue_close (queue);
+  history_queue_wait (queue, history_queue_get_last_seq (queue), HISTORY_PRIORITY_WRITE);
+
+  history_queue_log_stats (queue, "test");
+  g_assert_cmpint (queue->done, ==, 0);
+  g_assert_cmpint (queue->max_depth[HISTORY_PRIORITY_WRITE], ==, 1);
+
+  history_queue_free (queue);
+}
+
+static void
+test_history_readers (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GTask) task = NULL;
+  GPtrArray *tasks;
+  const char *account, *room;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  /* Readers are used only with write-ahead logging */
+  if (!history->wal_enabled) {
+    g_test_skip ("Write-ahead logging not supported");
+    history_close_sync (history);
+    return;
+  }
+
+  g_assert_cmpint (history->readers->len, ==, HISTORY_READERS);
+
+  account = "test-account@example.com";
+  room = "room@conference.example.org";
+  chat = chatty_chat_new (account, room, FALSE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  msg_array = g_ptr_array_new_full (100, g_object_unref);
+  tasks = g_ptr_array_new_full (100, g_object_unref);
+  when = time (NULL);
+
+  /* Queue the writes without waiting for them */
+  for (guint i = 0; i < 100; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+    ChattyMessage *message;
+    GTask *add_task;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "alice@example.org");
+    chatty_contact_set_value (contact, "alice@example.org");
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Message %u", i);
+    message = chatty_message_new (CHATTY_ITEM (contact), text, uuid, when + i,
+                                  CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+    g_ptr_array_add (msg_array, message);
+
+    add_task = g_task_new (NULL, NULL, NULL, NULL);
+    chatty_history_add_message_async (history, chat, message, finish_bool_cb, add_task);
+    g_ptr_array_add (tasks, add_task);
+  }
+
+  /* A read queued after the writes should see all of them */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, NULL, msg_array->len + 10,
+                                     finish_pointer_cb, task);
+  wait_for_task (task);
+  messages = g_task_propagate_pointer (task, NULL);
+  g_clear_object (&task);
+
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, msg_array->len);
+
+  for (guint i = 0; i < msg_array->len; i++)
+    compare_chat_message (msg_array->pdata[i], messages->pdata[i]);
+
+  for (guint i = 0; i < tasks->len; i++) {
+    wait_for_task (tasks->pdata[i]);
+    g_assert_true (g_task_propagate_boolean (tasks->pdata[i], NULL));
+  }
+
+  g_ptr_array_unref (tasks);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* Load older messages */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, msg_array->pdata[50], 20,
+                                     finish_pointer_cb, task);
+  wait_for_task (task);
+  messages = g_task_propagate_pointer (task, NULL);
+
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 20);
+
+  for (guint i = 0; i < messages->len; i++)
+    compare_chat_message (msg_array->pdata[30 + i], messages->pdata[i]);
+
+  history_close_sync (history);
+  g_assert_cmpint (history->readers->len, ==, 0);
+}
+
+static GMutex blocker_lock;
+static GCond blocker_cond;
+static gboolean blocker_released;
+
+static void
+history_block_worker (ChattyHistory *self,
+                      GTask         *task)
+{
+  g_mutex_lock (&blocker_lock);
+  while (!blocker_released)
+    g_cond_wait (&blocker_cond, &blocker_lock);
+  g_mutex_unlock (&blocker_lock);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+finish_order_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GPtrArray *order = user_data;
+
+  g_ptr_array_add (order, g_object_ref (result));
+}
+
+static void
+test_history_bulk_priority (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) bulk_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(GPtrArray) order = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) bulk_chat = NULL;
+  g_autoptr(GTask) task = NULL;
+  GTask *blocker;
+  const char *account, *who;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  account = "test-account@example.com";
+  who = "buddy@example.org";
+  chat = chatty_chat_new (account, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  bulk_chat = chatty_chat_new (account, "room@conference.example.org", FALSE);
+  g_object_set (G_OBJECT (bulk_chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  msg_array = g_ptr_array_new_full (10, g_object_unref);
+  when = time (NULL);
+  add_chatty_message (history, chat, msg_array, "Hello", when,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0);
+
+  bulk_array = g_ptr_array_new_full (5000, g_object_unref);
+
+  for (guint i = 0; i < 5000; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "alice@example.org");
+    chatty_contact_set_value (contact, "alice@example.org");
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Synced message %u", i);
+    g_ptr_array_add (bulk_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when - 5000 + i,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  /* Hold the worker so that everything below is queued before it runs */
+  blocker_released = FALSE;
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  blocker = g_task_new (history, NULL, finish_bool_cb, task);
+  g_task_set_task_data (blocker, history_block_worker, NULL);
+  history_push (history, blocker, HISTORY_PRIORITY_WRITE);
+
+  order = g_ptr_array_new_with_free_func (g_object_unref);
+  chatty_history_add_messages_async (history, bulk_chat, bulk_array, finish_order_cb, order);
+  chatty_history_get_messages_async (history, chat, NULL, 10, finish_order_cb, order);
+
+  g_mutex_lock (&blocker_lock);
+  blocker_released = TRUE;
+  g_cond_broadcast (&blocker_cond);
+  g_mutex_unlock (&blocker_lock);
+
+  while (order->len < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+
+  /* Opening the chat doesn't wait for the bulk write queued before */
+  g_assert_true (g_async_result_is_tagged (order->pdata[0], chatty_history_get_messages_async));
+  messages = chatty_history_get_messages_finish (history, order->pdata[0], NULL);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 1);
+  compare_chat_message (msg_array->pdata[0], messages->pdata[0]);
+
+  g_assert_true (g_async_result_is_tagged (order->pdata[1], chatty_history_add_messages_async));
+  g_assert_true (chatty_history_add_messages_finish (history, order->pdata[1], NULL));
+
+  history_close_sync (history);
+}
+
+static void
+test_history_open_queued (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) order = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *account, *who, *uid;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+
+  account = "test-account@example.com";
+  who = "buddy@example.org";
+  chat = chatty_chat_new (account, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  msg_array = g_ptr_array_new_full (3, g_object_unref);
+  when = time (NULL);
+
+  for (guint i = 0; i < 3; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, who);
+    chatty_contact_set_value (contact, who);
+
+    uuid = g_uuid_string_random ();
+    text = g_strdup_printf ("Archived message %u", i);
+    g_ptr_array_add (msg_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  uid = chatty_message_get_uid (msg_array->pdata[0]);
+
+  /* Like an account syncing its archive while the history is being opened */
+  order = g_ptr_array_new_with_free_func (g_object_unref);
+  chatty_history_get_im_timestamp_async (history, uid, account, finish_order_cb, order);
+  chatty_history_add_messages_async (history, chat, msg_array, finish_order_cb, order);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_open_async (history, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                             "test-history.db", finish_bool_cb, task);
+
+  while (order->len < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  wait_for_task (task);
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+
+  /* The database was opened before running the tasks queued before */
+  g_assert_true (g_async_result_is_tagged (order->pdata[0], chatty_history_get_im_timestamp_async));
+  g_assert_cmpint (chatty_history_get_im_timestamp_finish (history, order->pdata[0], &error), ==, 0);
+  g_assert_no_error (error);
+
+  g_assert_true (g_async_result_is_tagged (order->pdata[1], chatty_history_add_messages_async));
+  g_assert_true (chatty_history_add_messages_finish (history, order->pdata[1], &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpint (history_get_im_timestamp_sync (history, uid, account), ==, when);
+
+  history_close_sync (history);
+}
+
+static void
+finish_error_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GError *error = NULL;
+  GTask *task = user_data;
+
+  g_assert_true (G_IS_TASK (task));
+
+  if (g_task_propagate_boolean (G_TASK (result), &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+test_history_messages_batch_failure (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  const char *account, *who;
+  GTask *task;
+  sqlite3 *db;
+  int when;
+
+  path = g_test_build_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (path);
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  /* Fail the insert of a message in the middle of the batch */
+  g_assert_cmpint (sqlite3_open (path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db,
+                                 "CREATE TRIGGER test_fail "
+                                 "BEFORE INSERT ON messages WHEN NEW.body='Fail' "
+                                 "BEGIN SELECT RAISE(ABORT, 'Forced failure'); END;",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+
+  account = "test-account@example.com";
+  who = "buddy@example.org";
+  chat = chatty_chat_new (account, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  msg_array = g_ptr_array_new_full (10, g_object_unref);
+  when = time (NULL);
+
+  for (guint i = 0; i < 10; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uuid = NULL;
+    g_autofree char *text = NULL;
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, who);
+    chatty_contact_set_value (contact, who);
+
+    uuid = g_uuid_string_random ();
+    text = i == 5 ? g_strdup ("Fail") : g_strdup_printf ("Message %u", i);
+    g_ptr_array_add (msg_array,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uuid, when + i,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chat, msg_array, finish_error_cb, task);
+  wait_for_task (task);
+  g_assert_false (g_task_propagate_boolean (task, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_finalize_object (task);
+  g_clear_error (&error);
+
+  /* Nothing of the batch should have been stored, not even the chat */
+  g_assert_cmpint (sqlite3_open (path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM messages;"), ==, 0);
+  g_assert_cmpint (history_db_get_int (db, "SELECT COUNT(*) FROM threads;"), ==, 0);
+  g_assert_cmpint (sqlite3_exec (db, "DROP TRIGGER test_fail;", NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+
+  /* The same batch can be stored once the failure is gone */
+  add_chatty_messages (history, chat, msg_array);
+
+  messages = history_get_messages_sync (history, chat, NULL, 20);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, msg_array->len);
+
+  for (guint i = 0; i < msg_array->len; i++)
+    compare_chat_message (msg_array->pdata[i], messages->pdata[i]);
+
+  history_close_sync (history);
+}
+
+static void
+test_history_search (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GPtrArray) msg_array = NULL;
+  g_autoptr(GPtrArray) sms_array = NULL;
+  g_autoptr(GPtrArray) xmpp_array = NULL;
+  g_autoptr(GPtrArray) members = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyMmAccount) account = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) sms_chat = NULL;
+  g_autoptr(ChattyChat) xmpp_chat = NULL;
+  const char *username, *who;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  msg_array = g_ptr_array_new_full (10, g_object_unref);
+  username = "test-account@example.com";
+  who = "buddy@example.org";
+  chat = chatty_chat_new (username, who, TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  when = time (NULL);
+  add_chatty_message (history, chat, msg_array, "Are we meeting at the café?", when,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0);
+  add_chatty_message (history, chat, msg_array, "Yes, the cafe near the station", when + 1,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  add_chatty_message (history, chat, msg_array, "Station is closed today", when + 2,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  add_chatty_message (history, chat, msg_array, "a draft about the cafe", when + 3,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, CHATTY_STATUS_DRAFT);
+
+  /* Diacritics are ignored, drafts are not matched */
+  messages = search_messages (history, "cafe", NULL, 10, 0);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 2);
+  for (guint i = 0; i < messages->len; i++) {
+    g_assert_cmpstr (g_object_get_data (messages->pdata[i], "chat-name"), ==, who);
+    g_assert_nonnull (g_object_get_data (messages->pdata[i], "snippet"));
+  }
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* Prefix match, and case insensitive */
+  messages = search_messages (history, "STAT", NULL, 10, 0);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 2);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* All words should match */
+  messages = search_messages (history, "cafe station", NULL, 10, 0);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 1);
+  compare_chat_message (msg_array->pdata[1], messages->pdata[0]);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* Paging */
+  messages = search_messages (history, "station", NULL, 1, 1);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 1);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* FTS syntax in query should be matched literally */
+  messages = search_messages (history, "\"station OR NEAR(", NULL, 10, 0);
+  g_assert_null (messages);
+  messages = search_messages (history, "  ", NULL, 10, 0);
+  g_assert_null (messages);
+
+  /* Only the account with the same username and protocol is searched */
+  account = chatty_mm_account_new ();
+  sms_chat = (ChattyChat *)chatty_mm_chat_new ("+15555550100", NULL, CHATTY_PROTOCOL_MMS_SMS, TRUE,
+                                               CHATTY_ITEM_VISIBLE);
+  members = g_ptr_array_new_full (1, g_object_unref);
+  g_ptr_array_add (members, chatty_mm_buddy_new ("+15555550100", NULL));
+  chatty_mm_chat_add_users (CHATTY_MM_CHAT (sms_chat), members);
+  sms_array = g_ptr_array_new_full (1, g_object_unref);
+  add_chatty_message (history, sms_chat, sms_array, "cafe by sms", when + 4,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  xmpp_chat = chatty_chat_new (chatty_item_get_username (CHATTY_ITEM (account)), who, TRUE);
+  g_object_set (G_OBJECT (xmpp_chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  xmpp_array = g_ptr_array_new_full (1, g_object_unref);
+  add_chatty_message (history, xmpp_chat, xmpp_array, "cafe by xmpp", when + 5,
+                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+
+  messages = search_messages (history, "cafe", CHATTY_ACCOUNT (account), 10, 0);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 1);
+  compare_chat_message (sms_array->pdata[0], messages->pdata[0]);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  messages = search_messages (history, "cafe", NULL, 10, 0);
+  g_assert_nonnull (messages);
+  g_assert_cmpint (messages->len, ==, 4);
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  /* Deleted messages should no longer match */
+  history_delete_chat_sync (history, chat);
+  history_delete_chat_sync (history, sms_chat);
+  history_delete_chat_sync (history, xmpp_chat);
+  messages = search_messages (history, "cafe", NULL, 10, 0);
+  g_assert_null (messages);
+
+  history_close_sync (history);
+}
+
+static void
+assert_query_uses_index (sqlite3    *db,
+                         const char *table,
+                         const char *sql)
+{
+  g_autofree char *query = NULL;
+  g_autofree char *search = NULL;
+  g_autofree char *scan = NULL;
+  sqlite3_stmt *stmt;
+  gboolean found = FALSE;
+  int status;
+
+  query = g_strconcat ("EXPLAIN QUERY PLAN ", sql, NULL);
+  search = g_strdup_printf ("SEARCH %s USING ", table);
+  scan = g_strdup_printf ("SCAN %s", table);
+
+  status = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+  if (status != SQLITE_OK)
+    g_warning ("sql: %s, error: %s", sql, sqlite3_errmsg (db));
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW) {
+    const char *detail;
+
+    /* The 4th column is the human readable plan of each step */
+    detail = (const char *)sqlite3_column_text (stmt, 3);
+    g_debug ("%s: %s", table, detail);
+
+    if (g_str_has_prefix (detail, scan) &&
+        (detail[strlen (scan)] == '\0' || detail[strlen (scan)] == ' '))
+      g_error ("Table '%s' is scanned in '%s': %s", table, sql, detail);
+
+    if (g_str_has_prefix (detail, search))
+      found = TRUE;
+  }
+
+  g_assert_cmpint (status, ==, SQLITE_DONE);
+  sqlite3_finalize (stmt);
+
+  if (!found)
+    g_error ("No index used for '%s' in '%s'", table, sql);
+}
+
+static void
+test_history_indexes (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autofree char *attach = NULL;
+  const char *file_name;
+  sqlite3 *db;
+  int status;
+
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (file_name);
+
+  history = chatty_history_new ();
+  history_open_sync (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  history_close_sync (history);
+
+  status = sqlite3_open (file_name, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  /* message id lookup after each insert */
+  assert_query_uses_index (db, "messages",
+                           "SELECT messages.id FROM messages "
+                           "WHERE messages.uid=?;");
+
+  /* get_message_cursor() */
+  assert_query_uses_index (db, "messages",
+                           "SELECT time,id FROM messages "
+                           "WHERE uid=? AND thread_id=? LIMIT 1;");
+
+  /* get_messages_before(), both sides of the cursor */
+  assert_query_uses_index (db, "messages",
+                           "SELECT id,time FROM messages "
+                           "WHERE thread_id=?1 AND time=?2 AND id<?3 "
+                           "AND body NOT NULL "
+                           "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status is null) "
+                           "ORDER BY id DESC LIMIT ?4;");
+  assert_query_uses_index (db, "messages",
+                           "SELECT id,time FROM messages "
+                           "WHERE thread_id=?1 AND time<?2 "
+                           "AND body NOT NULL "
+                           "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status is null) "
+                           "ORDER BY time DESC, id DESC LIMIT ?4;");
+
+  /* history_exists() */
+  assert_query_uses_index (db, "threads",
+                           "SELECT time FROM messages "
+                           "INNER JOIN threads "
+                           "ON threads.name=? "
+                           "INNER JOIN accounts "
+                           "ON threads.account_id=accounts.id "
+                           "INNER JOIN users "
+                           "ON users.id=accounts.user_id AND users.username=? "
+                           "WHERE messages.thread_id=threads.id LIMIT 1;");
+  assert_query_uses_index (db, "messages",
+                           "SELECT time FROM messages "
+                           "INNER JOIN threads "
+                           "ON threads.name=? "
+                           "INNER JOIN accounts "
+                           "ON threads.account_id=accounts.id "
+                           "INNER JOIN users "
+                           "ON users.id=accounts.user_id AND users.username=? "
+                           "WHERE messages.thread_id=threads.id LIMIT 1;");
+
+  /* get_messages_before(), attachments of the page */
+  assert_query_uses_index (db, "message_files",
+                           "SELECT message_files.file_id,files.url,mime_type.name FROM messages "
+                           "LEFT JOIN message_files ON message_files.message_id=messages.id "
+                           "LEFT JOIN files ON files.id=message_files.file_id "
+                           "LEFT JOIN mime_type ON mime_type.id=files.mime_type_id "
+                           "WHERE messages.id=?;");
+
+  /* get_chat_draft_id() */
+  assert_query_uses_index (db, "messages",
+                           "SELECT messages.id FROM messages "
+                           "WHERE thread_id=? AND status=" STRING(MESSAGE_STATUS_DRAFT));
+
+  attach = g_strdup_printf ("ATTACH '%s' AS archive;",
+                            g_test_get_filename (G_TEST_BUILT, "test-history-archive.db", NULL));
+  status = sqlite3_exec (db, attach, NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  /* get_message_cursor() of archived messages */
+  assert_query_uses_index (db, "archive.messages",
+                           "SELECT time,id FROM archive.messages "
+                           "WHERE uid=? AND thread_id=? LIMIT 1;");
+
+  /* history_archive_has_page() */
+  assert_query_uses_index (db, "archive.messages",
+                           "SELECT 1 FROM archive.messages "
+                           "WHERE thread_id=?1 AND time>=?2 LIMIT 1;");
+
+  /* get_messages_before() of archived messages */
+  assert_query_uses_index (db, "archive.messages",
+                           "SELECT id,time FROM archive.messages "
+                           "WHERE thread_id=?1 AND time<?2 "
+                           "AND body NOT NULL "
+                           "AND (status !=" STRING(MESSAGE_STATUS_DRAFT) " OR status is null) "
+                           "ORDER BY time DESC, id DESC LIMIT ?4;");
+
+  sqlite3_close (db);
 }
 
 static void
@@ -1119,15 +2928,19 @@ test_history_migration_db (void)
     sqlite3_close (db);
 
     /* Export migrated version sql file */
-    expected_file = g_strdelimit (g_strdup (name), "0123", '4');
+    expected_file = g_strdelimit (g_strdup (name), "01234567", '8');
     export_sql_file (path, expected_file, &db);
 
     /* Open history with old db, which will result in db migration */
     input_file = g_strdup (name);
     strcpy (input_file + strlen (input_file) - strlen ("sql"), "db");
     history = chatty_history_new ();
-    chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), input_file);
-    chatty_history_close (history);
+    history_open_sync (history, g_test_get_dir (G_TEST_BUILT), input_file);
+    /* auto_vacuum is enabled by the first maintenance after migration */
+    g_assert_true (history->auto_vacuum_pending);
+    history_maintain_sync (history);
+    g_assert_false (history->auto_vacuum_pending);
+    history_close_sync (history);
     g_free (input_file);
 
     /* Attach old (now migrated) db with expected migrated db */
@@ -1139,6 +2952,8 @@ test_history_migration_db (void)
 
     compare_history_db (db);
     compare_db_new_columns (db);
+    g_assert_cmpint (history_db_get_int (db, "PRAGMA test.auto_vacuum;"), ==,
+                     SQLITE_AUTOVACUUM_INCREMENTAL);
     sqlite3_close (db);
   }
 }
@@ -1147,13 +2962,27 @@ int
 main (int   argc,
       char *argv[])
 {
-  g_test_init (&argc, &argv, NULL);
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
   g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
 
   g_test_add_func ("/history/new", test_history_new);
   g_test_add_func ("/history/message", test_history_message);
   g_test_add_func ("/history/raw_message", test_history_raw_message);
   g_test_add_func ("/history/db", test_history_db);
+  g_test_add_func ("/history/messages_batch", test_history_messages_batch);
+  g_test_add_func ("/history/messages_batch_failure", test_history_messages_batch_failure);
+  g_test_add_func ("/history/same_time", test_history_same_time);
+  g_test_add_func ("/history/chats", test_history_chats);
+  g_test_add_func ("/history/ids", test_history_ids);
+  g_test_add_func ("/history/maintenance", test_history_maintenance);
+  g_test_add_func ("/history/archive", test_history_archive);
+  g_test_add_func ("/history/export", test_history_export);
+  g_test_add_func ("/history/queue", test_history_queue);
+  g_test_add_func ("/history/readers", test_history_readers);
+  g_test_add_func ("/history/bulk_priority", test_history_bulk_priority);
+  g_test_add_func ("/history/open_queued", test_history_open_queued);
+  g_test_add_func ("/history/indexes", test_history_indexes);
+  g_test_add_func ("/history/search", test_history_search);
   g_test_add_func ("/history/db_migration", test_history_migration_db);
 
   return g_test_run ();
@@ -17,6 +17,156 @@
 
 #include "chatty-message-row.c"
 
+/*
+ * The linkify and quote code before the single pass tokenizer,
+ * to check that the output is still the same.
+ */
+static char *
+reference_linkify (const char *message,
+                   gboolean    strip_tracking_ids)
+{
+  g_autoptr(GString) link_str = NULL;
+  GString *str = NULL;
+  char *start, *end, *url;
+
+  if (!message || !*message)
+    return NULL;
+
+  str = g_string_sized_new (256);
+  link_str = g_string_sized_new (256);
+  start = end = (char *)message;
+
+  while ((url = chatty_utils_find_url (start, &end))) {
+    g_autofree char *link = NULL;
+    g_autofree char *escaped_link = NULL;
+    g_autofree char *utm_stripped_link = NULL;
+    char *escaped = NULL;
+
+    escaped = g_markup_escape_text (start, url - start);
+    g_string_append (str, escaped);
+    g_free (escaped);
+
+    link = g_strndup (url, end - url);
+    if (strip_tracking_ids)
+      utm_stripped_link = chatty_utils_strip_utm_from_url (link);
+    else
+      utm_stripped_link = g_strdup (link);
+
+    escaped_link = g_markup_escape_text (utm_stripped_link, -1);
+    g_string_set_size (link_str, 0);
+    g_string_append_uri_escaped (link_str, utm_stripped_link, ":/?#[]@!$&'()*+,;=", TRUE);
+    escaped = g_markup_escape_text (link_str->str, link_str->len);
+    g_string_append_printf (str, "<a href=\"%s\">%s</a>", escaped, escaped_link);
+    g_free (escaped);
+
+    start = end;
+  }
+
+  if (str->len && start && *start) {
+    g_autofree char *escaped = NULL;
+
+    escaped = g_markup_escape_text (start, -1);
+    g_string_append (str, escaped);
+  }
+
+  return g_string_free (str, FALSE);
+}
+
+static PangoAttrList *
+reference_quotes (const char *text)
+{
+  PangoAttrList *list;
+  const char *end;
+  char *quote;
+
+  list = pango_attr_list_new ();
+  end = text;
+
+  if (!text || !*text)
+    return list;
+
+  do {
+    quote = strchr (end, '>');
+
+    if (quote &&
+        (quote == text ||
+         *(quote - 1) == '\n')) {
+      PangoAttribute *attribute;
+
+      end = strchr (quote, '\n');
+
+      if (!end)
+        end = quote + strlen (quote);
+
+      attribute = pango_attr_foreground_new (30000, 30000, 30000);
+      attribute->start_index = quote - text;
+      attribute->end_index = end - text + 1;
+      pango_attr_list_insert (list, attribute);
+    } else if (quote && *quote) {
+      end = end + 1;
+    }
+  } while (quote && *quote);
+
+  return list;
+}
+
+static void
+check_linkify (const char *text,
+               gboolean    strip_tracking_ids)
+{
+  g_autoptr(PangoAttrList) expected_quotes = NULL;
+  g_autoptr(PangoAttrList) quotes = NULL;
+  g_autofree char *expected = NULL;
+  g_autofree char *content = NULL;
+  g_autofree char *expected_str = NULL;
+  g_autofree char *quotes_str = NULL;
+  GtkLabel *label;
+
+  expected = reference_linkify (text, strip_tracking_ids);
+  content = text_item_linkify (text, TRUE, strip_tracking_ids, &quotes);
+
+  if (expected && !*expected)
+    g_clear_pointer (&expected, g_free);
+
+  g_assert_cmpstr (content, ==, expected);
+
+  label = GTK_LABEL (g_object_ref_sink (gtk_label_new ("")));
+
+  if (expected)
+    gtk_label_set_markup (label, expected);
+  else
+    gtk_label_set_text (label, text);
+
+  expected_quotes = reference_quotes (gtk_label_get_text (label));
+  expected_str = pango_attr_list_to_string (expected_quotes);
+  quotes_str = pango_attr_list_to_string (quotes);
+  g_assert_cmpstr (quotes_str, ==, expected_str);
+
+  g_object_unref (label);
+}
+
+static const char *fuzz_tokens[] = {
+  "http://", "https://", "file://", "www.", "HTTP://", "wWw.", "ttp", "ww",
+  ":", ".", " ", "\n", "\t", "\r", "(", ")", "[", "]", ",", "/", "-", "_",
+  ">", "> ", "&", "<", "'", "\"", "a", "x", "0", "é", "മ", "\u2066",
+  "example.com", "?utm_source=x", "&fbclid=1", "?a=b", "=",
+};
+
+static char *
+fuzz_text_new (void)
+{
+  GString *str;
+  guint n_tokens;
+
+  str = g_string_new (NULL);
+  n_tokens = g_test_rand_int_range (0, 32);
+
+  for (guint i = 0; i < n_tokens; i++)
+    g_string_append (str, fuzz_tokens[g_test_rand_int_range (0, G_N_ELEMENTS (fuzz_tokens))]);
+
+  return g_string_free (str, FALSE);
+}
+
 static void
 test_message_text_markup (void)
 {
@@ -104,9 +254,9 @@ test_message_text_markup (void)
     const char *str;
 
     label = GTK_LABEL (gtk_label_new (""));
-    content = text_item_linkify (array[i].text);
+    content = text_item_linkify (array[i].text, TRUE, FALSE, NULL);
 
-    if (content && *content)
+    if (content)
       gtk_label_set_markup (label, content);
     else
       gtk_label_set_text (label, array[i].text);
@@ -116,9 +266,126 @@ test_message_text_markup (void)
 
     str = gtk_label_get_label (label);
     g_assert_cmpstr (str, ==, array[i].markup);
+
+    check_linkify (array[i].text, FALSE);
+    check_linkify (array[i].text, TRUE);
+  }
+}
+
+static void
+test_message_text_quotes (void)
+{
+  const char *array[] = {
+    "",
+    ">",
+    "> quote",
+    "a > b",
+    "> quote\nreply",
+    "reply\n> quote\n>> nested\nreply > not",
+    "> see https://example.com/?utm_source=x&a=b\n> www.example.com\nok",
+    "https://example.com/?utm_source=x\n> after a stripped link",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (array); i++) {
+    check_linkify (array[i], FALSE);
+    check_linkify (array[i], TRUE);
   }
 }
 
+static void
+test_message_text_fuzz (void)
+{
+  guint n_runs;
+
+  n_runs = g_test_perf () ? 200000 : 2000;
+
+  for (guint i = 0; i < n_runs; i++) {
+    g_autofree char *text = NULL;
+
+    text = fuzz_text_new ();
+    check_linkify (text, g_test_rand_bit ());
+  }
+}
+
+static void
+test_message_text_bench (void)
+{
+  g_autoptr(GString) str = NULL;
+  guint n_runs;
+  double reference, elapsed;
+
+  str = g_string_new (NULL);
+  for (guint i = 0; i < 200; i++)
+    g_string_append (str, "> Check (eg: https://example.com/path_(a)/b?utm_source=x&q=1), "
+                     "www.gnu.org and some more text\n");
+
+  n_runs = g_test_perf () ? 1000 : 10;
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_runs; i++) {
+    g_autoptr(PangoAttrList) quotes = NULL;
+    g_autoptr(GtkLabel) label = NULL;
+    g_autofree char *content = NULL;
+
+    /* The old code needed the label text to find quotes */
+    content = reference_linkify (str->str, TRUE);
+    label = GTK_LABEL (g_object_ref_sink (gtk_label_new (NULL)));
+    gtk_label_set_markup (label, content);
+    quotes = reference_quotes (gtk_label_get_text (label));
+  }
+  reference = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_runs; i++) {
+    g_autoptr(PangoAttrList) quotes = NULL;
+    g_autoptr(GtkLabel) label = NULL;
+    g_autofree char *content = NULL;
+
+    content = text_item_linkify (str->str, TRUE, TRUE, &quotes);
+    label = GTK_LABEL (g_object_ref_sink (gtk_label_new (NULL)));
+    gtk_label_set_markup (label, content);
+  }
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_minimized_result (elapsed, "Rendered %u messages in %f seconds, was %f seconds",
+                           n_runs, elapsed, reference);
+}
+
+static void
+test_message_markup_cache (void)
+{
+  g_autoptr(ChattyMessage) message = NULL;
+  g_autoptr(PangoAttrList) list = NULL;
+  g_autofree char *content = NULL;
+  g_autofree char *huge = NULL;
+  PangoAttrList *quotes;
+  const char *markup, *text;
+
+  text = "> https://example.com/?utm_source=x&a=b";
+  message = chatty_message_new (NULL, text, NULL, 0, CHATTY_MESSAGE_TEXT,
+                                CHATTY_DIRECTION_IN, CHATTY_STATUS_RECEIVED);
+  g_assert_false (chatty_message_get_markup_cache (message, FALSE, &markup, &quotes));
+
+  content = text_item_linkify (text, TRUE, FALSE, &list);
+  chatty_message_set_markup_cache (message, FALSE, content, list);
+  g_assert_false (chatty_message_get_markup_cache (message, TRUE, &markup, &quotes));
+  g_assert_true (chatty_message_get_markup_cache (message, FALSE, &markup, &quotes));
+  g_assert_cmpstr (markup, ==, content);
+  g_assert_true (quotes == list);
+
+  /* Plain text is cached without markup */
+  chatty_message_set_markup_cache (message, TRUE, NULL, list);
+  g_assert_false (chatty_message_get_markup_cache (message, FALSE, &markup, &quotes));
+  g_assert_true (chatty_message_get_markup_cache (message, TRUE, &markup, &quotes));
+  g_assert_null (markup);
+  g_assert_true (quotes == list);
+
+  /* Too large markups are not cached */
+  huge = g_strnfill (128 * 1024, 'a');
+  chatty_message_set_markup_cache (message, TRUE, huge, list);
+  g_assert_false (chatty_message_get_markup_cache (message, TRUE, &markup, &quotes));
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -126,6 +393,10 @@ main (int   argc,
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/message-text/markup", test_message_text_markup);
+  g_test_add_func ("/message-text/quotes", test_message_text_quotes);
+  g_test_add_func ("/message-text/fuzz", test_message_text_fuzz);
+  g_test_add_func ("/message-text/bench", test_message_text_bench);
+  g_test_add_func ("/message-text/markup-cache", test_message_markup_cache);
 
   return g_test_run ();
 }
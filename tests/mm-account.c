@@ -102,6 +102,33 @@ test_mm_account_find_chat (void)
   g_assert_cmpint (g_list_model_get_n_items (users), ==, 4);
   g_object_unref (chat);
 
+  chat = chatty_mm_account_find_chat (account, "456,123");
+  g_assert_true (CHATTY_IS_MM_CHAT (chat));
+  g_assert_cmpstr (chatty_chat_get_chat_name (chat), ==, "123,456");
+  g_assert_true (chatty_mm_account_find_chat (account, "9633111222") ==
+                 chatty_mm_account_find_chat (account, "9633-111-222"));
+
+  /* A deleted chat should no more be found */
+  chatty_mm_account_delete_chat (account, chat);
+  g_assert_cmpint (g_list_model_get_n_items (chat_list), ==, 7);
+  g_assert_null (chatty_mm_account_find_chat (account, "123,456"));
+
+  chatty_mm_account_start_chat (account, "123,456");
+  g_assert_cmpint (g_list_model_get_n_items (chat_list), ==, 8);
+  g_assert_nonnull (chatty_mm_account_find_chat (account, "456,123"));
+
+  /* Another chat of the same name is found once the first is deleted */
+  chat = (ChattyChat *)chatty_mm_chat_new ("123,456", NULL, CHATTY_PROTOCOL_MMS, FALSE,
+                                           CHATTY_ITEM_VISIBLE);
+  g_list_store_append (G_LIST_STORE (chat_list), chat);
+  g_object_unref (chat);
+  g_assert_cmpint (g_list_model_get_n_items (chat_list), ==, 9);
+  g_assert_true (chatty_mm_account_find_chat (account, "123,456") != chat);
+
+  chatty_mm_account_delete_chat (account, chatty_mm_account_find_chat (account, "123,456"));
+  g_assert_cmpint (g_list_model_get_n_items (chat_list), ==, 8);
+  g_assert_true (chatty_mm_account_find_chat (account, "123,456") == chat);
+
   g_list_store_remove_all (G_LIST_STORE (chat_list));
   g_assert_finalize_object (account);
   g_assert_finalize_object (history);
@@ -87,14 +87,89 @@ test_phone_utils_valid (void)
     g_assert_false (chatty_phone_utils_is_valid (invalid[i][0], invalid[i][1]));
 }
 
+static void
+test_phone_utils_key (void)
+{
+  ChattyPhoneKey a, b;
+  char *str;
+
+  g_assert_false (chatty_phone_utils_get_key ("", "IN", &a));
+  g_assert_false (chatty_phone_utils_get_key ("GNU", "IN", &a));
+
+  g_assert_true (chatty_phone_utils_get_key ("+91 9633 123 456", "US", &a));
+  g_assert_true (chatty_phone_utils_get_key ("09633123456", "IN", &b));
+  g_assert_cmpint (a.country_code, ==, 91);
+  g_assert_cmpuint (a.national_number, ==, G_GUINT64_CONSTANT (9633123456));
+  g_assert_true (chatty_phone_utils_key_is_valid (&a));
+  g_assert_true (chatty_phone_utils_key_match (&a, &b));
+  g_assert_true (chatty_phone_utils_key_equal (&a, &b));
+  g_assert_cmpuint (chatty_phone_utils_key_hash (&a), ==, chatty_phone_utils_key_hash (&b));
+
+  str = chatty_phone_utils_key_to_string (&a, FALSE);
+  g_assert_cmpstr (str, ==, "+919633123456");
+  g_free (str);
+
+  /* Same national number without a country code, a national match */
+  g_assert_true (chatty_phone_utils_get_key ("9633123456", "US", &b));
+  g_assert_true (chatty_phone_utils_key_match (&a, &b));
+  g_assert_false (chatty_phone_utils_key_equal (&a, &b));
+
+  /* Same national number in a different country */
+  g_assert_true (chatty_phone_utils_get_key ("+1 9633123456", "US", &b));
+  g_assert_false (chatty_phone_utils_key_match (&a, &b));
+  g_assert_false (chatty_phone_utils_key_equal (&a, &b));
+
+  /* Italian leading zero is part of the number */
+  g_assert_true (chatty_phone_utils_get_key ("+39 06 1234 5678", NULL, &a));
+  g_assert_true (chatty_phone_utils_get_key ("+39 6 1234 5678", NULL, &b));
+  g_assert_false (chatty_phone_utils_key_match (&a, &b));
+  str = chatty_phone_utils_key_to_string (&a, FALSE);
+  g_assert_cmpstr (str, ==, "+390612345678");
+  g_free (str);
+
+  g_assert_true (chatty_phone_utils_get_key ("112", "DE", &a));
+  g_assert_false (chatty_phone_utils_key_is_valid (&a));
+  str = chatty_phone_utils_key_to_string (&a, TRUE);
+  g_assert_cmpstr (str, ==, "112");
+  g_free (str);
+}
+
 static void
 test_phone_utils_check_phone (void)
 {
+  ChattySettings *settings;
+
+  chatty_utils_clear_phonenumber_cache ();
+
+  /* The second run should be from the cache, and the third after a reset */
+  for (guint run = 0; run < 3; run++) {
+    if (run == 2)
+      chatty_utils_clear_phonenumber_cache ();
+
+    for (guint i = 0; i < G_N_ELEMENTS (phone); i++) {
+      g_autofree char *expected = NULL;
+
+      expected = chatty_utils_check_phonenumber (phone[i][0], phone[i][1]);
+      g_assert_cmpstr (expected, ==, phone[i][2]);
+    }
+  }
+
+  /* Changing the region clears the cache, the results should follow it */
+  settings = chatty_settings_get_default ();
+
   for (guint i = 0; i < G_N_ELEMENTS (phone); i++) {
     g_autofree char *expected = NULL;
+    g_autofree char *national = NULL;
 
-    expected = chatty_utils_check_phonenumber (phone[i][0], phone[i][1]);
+    chatty_settings_set_country_iso_code (settings, phone[i][1]);
+    expected = chatty_utils_check_phonenumber (phone[i][0],
+                                               chatty_settings_get_country_iso_code (settings));
     g_assert_cmpstr (expected, ==, phone[i][2]);
+
+    chatty_settings_set_country_iso_code (settings, "US");
+    national = chatty_utils_check_phonenumber ("9633123456",
+                                               chatty_settings_get_country_iso_code (settings));
+    g_assert_cmpstr (national, ==, "(963) 312-3456");
   }
 }
 
@@ -272,6 +347,32 @@ test_message_strip_utm_from_url (void)
   }
 }
 
+static void
+test_message_strip_utm_bench (void)
+{
+  const char *urls[] = {
+    "https://www.example.com/",
+    "https://www.example.com/?t=ftsa&q=hello&ia=definition",
+    "http://www.example.com/user's-image.png?utm_source=1234qwer&fbclid=1234564&",
+    "https://example.com/a?utm_source=news&utm_medium=email&utm_campaign=x&id=42&page=2",
+  };
+  guint n_runs;
+
+  n_runs = g_test_perf () ? 100000 : 100;
+
+  g_test_timer_start ();
+
+  for (guint i = 0; i < n_runs; i++) {
+    g_autofree char *stripped = NULL;
+
+    stripped = chatty_utils_strip_utm_from_url (urls[i % G_N_ELEMENTS (urls)]);
+    g_assert_nonnull (stripped);
+  }
+
+  g_test_minimized_result (g_test_timer_elapsed (), "Stripped %u urls in %f seconds",
+                           n_runs, g_test_timer_last ());
+}
+
 static void
 test_message_strip_utm_from_message (void)
 {
@@ -343,13 +444,17 @@ main (int   argc,
 {
   g_test_init (&argc, &argv, NULL);
 
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
   g_test_add_func ("/phone-utils/valid", test_phone_utils_valid);
+  g_test_add_func ("/phone-utils/key", test_phone_utils_key);
   g_test_add_func ("/utils/check-phone", test_phone_utils_check_phone);
   g_test_add_func ("/utils/username_valid", test_utils_username_valid);
   g_test_add_func ("/utils/groupname_valid", test_utils_groupname_valid);
   g_test_add_func ("/utils/jabber_id_strip", test_utils_jabber_id_strip);
   g_test_add_func ("/message-text/strip_utmstrip_utm_from_url", test_message_strip_utm_from_url);
   g_test_add_func ("/message-text/strip_utmstrip_utm_from_message", test_message_strip_utm_from_message);
+  g_test_add_func ("/message-text/strip_utm_bench", test_message_strip_utm_bench);
 
   return g_test_run ();
 }